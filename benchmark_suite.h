@@ -0,0 +1,291 @@
+#ifndef BENCHMARK_SUITE_H
+#define BENCHMARK_SUITE_H
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <algorithm>
+#include <utility>
+#include <cstdlib>
+#include <cmath>
+
+#include "headless_simulation.h"
+#include "gpu_profiler.h"
+
+
+
+/**
+ * BenchmarkScenario
+ *  - A named scene of the benchmark suite. The particle cube is given relative to the size of the domain, so that the scenario looks the same at every grid size
+ *  - Each scenario is run with the cube resolution multiplied by each of benchmark_particle_scales, see 'Benchmark suite' in simulation_constants.h
+ */
+struct BenchmarkScenario{
+    string name;
+    glm::vec3 relative_offset;
+    glm::vec3 relative_size;
+    //particles in each dimension of the cube at the largest particle count
+    Size3 resolution;
+    bool fountain;
+};
+
+const vector<BenchmarkScenario> benchmark_scenarios{
+    //the default particle cube of a 20^3 grid collapsing, without the fountain
+    {"dam_break", {0.25f, 0.1f, 0.075f}, {0.5f, 0.5f, 0.1f}, {100, 100, 100}, false},
+    //a shallow pool covering the floor, pushed up by the fountain in its' middle
+    {"fountain", {0.05f, 0.8f, 0.05f}, {0.9f, 0.1f, 0.9f}, {100, 20, 100}, true},
+    //the lower half of the tank filled, except for a quarter next to one wall - the water keeps running into the empty wall and back
+    {"sloshing_tank", {0.05f, 0.5f, 0.05f}, {0.65f, 0.45f, 0.9f}, {100, 70, 100}, false},
+    //single particles spread evenly over the upper half of the domain, raining down. Mostly empty bricks, and the surface of many small droplets
+    {"sparse_droplets", {0.05f, 0.05f, 0.05f}, {0.9f, 0.45f, 0.9f}, {24, 12, 24}, false}
+};
+//each scenario runs with its' cube resolution multiplied by each of these, in each dimension
+const vector<float> benchmark_particle_scales{1.f, 0.5f, 0.25f};
+//stages are listed as slower than the baseline only if they take at least this long, shorter ones are mostly noise
+constexpr double benchmark_stage_min_ms = 0.05;
+
+
+//scene of the given scenario at the current grid size. Cubes that don't fit into the particle buffer are scaled down further, so runs at the largest scale can have the same particles as smaller ones
+inline SimulationScene benchmarkScene(const BenchmarkScenario& scenario, float particle_scale){
+    glm::vec3 domain(fluid_width, fluid_height, fluid_depth);
+    float volume = (float) scenario.resolution.volume() * particle_scale * particle_scale * particle_scale;
+    if (volume > particle_space_size) particle_scale *= std::cbrt(particle_space_size / volume);
+    auto scaled = [particle_scale](uint32_t resolution){ return std::max(1u, static_cast<uint32_t>(resolution * particle_scale)); };
+    Size3 resolution{scaled(scenario.resolution.x), scaled(scenario.resolution.y), scaled(scenario.resolution.z)};
+    return SimulationScene{resolution, scenario.relative_offset * domain, scenario.relative_size * domain, scenario.fountain ? fountain_force : 0.f};
+}
+
+
+
+/**
+ * BenchmarkResult
+ *  - Result of one scenario at one grid size, surface resolution and particle count. Its' name identifies it when comparing with a baseline, it includes everything the run depends on
+ */
+struct BenchmarkResult{
+    string name;
+    string scenario;
+    uint32_t grid_size = 0;
+    uint32_t surface_resolution = 0;
+    uint32_t particles = 0;
+    double steps_per_second = 0;
+    double step_ms = 0;
+    VkDeviceSize peak_memory_bytes = 0;
+    //GPU time of each stage per step, in the order stages were first run
+    vector<std::pair<string, double>> stage_ms;
+};
+
+
+/**
+ * BenchmarkStartup
+ *  - Time it takes to create the default simulation for the first time in the process, and once more after it. The second one can use pipelines the driver cached while creating the first one
+ *  - The first one is only cold if the driver doesn't keep its' own cache on disk between launches, see 'Startup time' in simulation_constants.h
+ *  - Total times include allocating images and buffers, section times are only the time taken by creating the shader context and sections, see HeadlessSimulation::getStartupMs()
+ */
+struct BenchmarkStartup{
+    double first_ms = 0;
+    double repeated_ms = 0;
+    double first_sections_ms = 0;
+    double repeated_sections_ms = 0;
+};
+
+//create the default simulation twice, one after another
+inline BenchmarkStartup measureBenchmarkStartup(HeadlessDevice& headless, const RunSettings& settings, const WorkgroupSizes& workgroup_sizes){
+    BenchmarkStartup startup;
+    auto create = [&](double& total_ms, double& sections_ms){
+        auto start = HeadlessClock::now();
+        HeadlessSimulation simulation(headless, settings, workgroup_sizes);
+        total_ms = elapsedMs(start, HeadlessClock::now());
+        sections_ms = simulation.getStartupMs();
+    };
+    create(startup.first_ms, startup.first_sections_ms);
+    create(startup.repeated_ms, startup.repeated_sections_ms);
+    return startup;
+}
+
+
+//run one scenario at one particle count with the current simulation sizes - initialize, warm up, time settings.benchmark_steps steps, then profile benchmark_profiled_steps more
+inline BenchmarkResult runBenchmarkScenario(HeadlessDevice& headless, const RunSettings& settings, const WorkgroupSizes& workgroup_sizes, const BenchmarkScenario& scenario, float particle_scale){
+    SimulationScene scene = benchmarkScene(scenario, particle_scale);
+    BenchmarkResult result;
+    result.scenario = scenario.name;
+    result.grid_size = fluid_width;
+    result.surface_resolution = surface_render_resolution;
+    result.particles = scene.spawn_cube_resolution.volume();
+    result.name = scenario.name + "/grid" + std::to_string(fluid_width) + "/surface" + std::to_string(surface_render_resolution) + "/particles" + std::to_string(result.particles);
+
+    HeadlessSimulation simulation(headless, settings, workgroup_sizes, false, scene);
+    simulation.initialize();
+    uint32_t substeps = std::max(settings.substeps, 1u);
+    for (uint32_t step = 0; step < benchmark_warmup_steps; step += substeps) simulation.step(std::min(substeps, benchmark_warmup_steps - step));
+
+    auto start = HeadlessClock::now();
+    for (uint32_t step = 0; step < settings.benchmark_steps; step += substeps) simulation.step(std::min(substeps, settings.benchmark_steps - step));
+    double time_ms = elapsedMs(start, HeadlessClock::now());
+    result.step_ms = time_ms / settings.benchmark_steps;
+    result.steps_per_second = 1000.0 * settings.benchmark_steps / time_ms;
+    result.peak_memory_bytes = simulation.getDescriptors().getDeviceMemoryBytes();
+
+    //timestamps between sections slow the step down a little, so stages are timed separately from the whole step
+    GpuProfiler profiler(headless.getProperties().limits.timestampPeriod, 1);
+    simulation.setProfiler(&profiler);
+    for (uint32_t step = 0; step < benchmark_profiled_steps; step += substeps) simulation.step(std::min(substeps, benchmark_profiled_steps - step));
+    simulation.waitIdle();
+    profiler.finish();
+    for (const auto& stage : profiler.sectionTotals()) result.stage_ms.emplace_back(stage.first, stage.second / benchmark_profiled_steps);
+    return result;
+}
+
+
+//write results as JSON, each run on its' own line. Returns false if the file couldn't be written
+inline bool writeBenchmarkResults(const string& path, const string& device_name, const RunSettings& settings, const BenchmarkStartup& startup, const vector<BenchmarkResult>& results){
+    std::ofstream file(path, std::ios::trunc);
+    file << std::fixed << std::setprecision(6)
+        << "{\n\"device\": \"" << device_name << "\",\n\"particle_space\": " << particle_space_size
+        << ",\n\"steps\": " << settings.benchmark_steps << ",\n\"profiled_steps\": " << benchmark_profiled_steps
+        << ",\n\"startup\": {\"grid_size\": " << settings.grid_size << ", \"surface_resolution\": " << settings.surface_resolution << ", \"first_ms\": " << startup.first_ms << ", \"repeated_ms\": " << startup.repeated_ms
+        << ", \"first_sections_ms\": " << startup.first_sections_ms << ", \"repeated_sections_ms\": " << startup.repeated_sections_ms << "},\n\"runs\": [\n";
+    for (size_t i = 0; i < results.size(); i++){
+        const BenchmarkResult& r = results[i];
+        file << "{\"name\": \"" << r.name << "\", \"scenario\": \"" << r.scenario << "\", \"grid_size\": " << r.grid_size << ", \"surface_resolution\": " << r.surface_resolution << ", \"particles\": " << r.particles << ", \"steps_per_second\": " << r.steps_per_second
+            << ", \"step_ms\": " << r.step_ms << ", \"peak_memory_bytes\": " << r.peak_memory_bytes << ", \"stage_ms\": {";
+        for (size_t s = 0; s < r.stage_ms.size(); s++){
+            file << (s == 0 ? "" : ", ") << "\"" << r.stage_ms[s].first << "\": " << r.stage_ms[s].second;
+        }
+        file << "}}" << (i + 1 < results.size() ? ",\n" : "\n");
+    }
+    file << "]\n}\n";
+    return static_cast<bool>(file);
+}
+
+
+//value of a string field in one line of results written above, empty if the line doesn't have it
+inline string benchmarkStringField(const string& line, const string& field){
+    string key = "\"" + field + "\": \"";
+    size_t start = line.find(key);
+    if (start == string::npos) return "";
+    start += key.size();
+    size_t end = line.find('"', start);
+    return end == string::npos ? "" : line.substr(start, end - start);
+}
+//value of a number field in one line of results, returns false if the line doesn't have it
+inline bool benchmarkNumberField(const string& line, const string& field, double& value){
+    string key = "\"" + field + "\": ";
+    size_t start = line.find(key);
+    if (start == string::npos) return false;
+    value = std::strtod(line.c_str() + start + key.size(), nullptr);
+    return true;
+}
+//read runs of a results file written by writeBenchmarkResults(), only the fields compared with are read. Returns false if the file couldn't be opened
+inline bool readBenchmarkResults(const string& path, vector<BenchmarkResult>& results){
+    std::ifstream file(path);
+    if (!file) return false;
+    string line;
+    while (std::getline(file, line)){
+        BenchmarkResult r;
+        r.name = benchmarkStringField(line, "name");
+        if (r.name.empty() || !benchmarkNumberField(line, "steps_per_second", r.steps_per_second)) continue;
+        //stages are "name": value pairs between the braces following stage_ms
+        size_t stages = line.find("\"stage_ms\": {");
+        size_t stages_end = stages == string::npos ? string::npos : line.find('}', stages);
+        size_t pos = stages == string::npos ? string::npos : line.find('{', stages) + 1;
+        while (pos != string::npos && pos < stages_end){
+            size_t name_start = line.find('"', pos);
+            if (name_start == string::npos || name_start > stages_end) break;
+            size_t name_end = line.find('"', name_start + 1);
+            size_t value_start = line.find(':', name_end) + 1;
+            r.stage_ms.emplace_back(line.substr(name_start + 1, name_end - name_start - 1), std::strtod(line.c_str() + value_start, nullptr));
+            pos = line.find(',', value_start);
+        }
+        results.push_back(r);
+    }
+    return true;
+}
+
+
+//print how each run changed compared with the baseline, return the number of runs whose steps per second dropped by more than benchmark_regression_threshold
+inline uint32_t compareBenchmarkResults(const vector<BenchmarkResult>& baseline, const vector<BenchmarkResult>& results){
+    uint32_t regressions = 0;
+    std::cout << "Comparison with baseline, runs slower by more than " << std::setprecision(0) << benchmark_regression_threshold * 100 << "% are regressions\n";
+    for (const BenchmarkResult& r : results){
+        auto base = std::find_if(baseline.begin(), baseline.end(), [&r](const BenchmarkResult& b){ return b.name == r.name; });
+        if (base == baseline.end()){
+            std::cout << "  " << r.name << ": not in baseline\n";
+            continue;
+        }
+        double change = r.steps_per_second / base->steps_per_second - 1;
+        bool regression = change < -benchmark_regression_threshold;
+        if (regression) regressions++;
+        std::cout << "  " << r.name << ": " << std::setprecision(2) << base->steps_per_second << " -> " << r.steps_per_second << " steps/s (" << std::showpos << change * 100 << std::noshowpos << "%)"
+            << (regression ? " REGRESSION" : "") << "\n";
+        //stages that got slower, even if the whole step didn't, point at what to look at
+        for (const auto& stage : r.stage_ms){
+            auto base_stage = std::find_if(base->stage_ms.begin(), base->stage_ms.end(), [&stage](const std::pair<string, double>& s){ return s.first == stage.first; });
+            if (base_stage == base->stage_ms.end() || stage.second < benchmark_stage_min_ms) continue;
+            if (stage.second > base_stage->second * (1 + benchmark_regression_threshold)){
+                std::cout << "      " << stage.first << " slower: " << std::setprecision(3) << base_stage->second << " -> " << stage.second << " ms\n";
+            }
+        }
+    }
+    return regressions;
+}
+
+
+
+/**
+ * runBenchmarkSuite
+ *  - Runs each scenario at each grid size, surface resolution and particle count headless, prints a summary and writes results as JSON to settings.benchmark_output_path. Described in simulation_constants.h, look for 'Benchmark suite'
+ *  - Startup times are measured first, at the sizes chosen at startup, see BenchmarkStartup
+ *  - Sizes are changed by setSimulationSizes() between runs, no simulation exists at that time. Workgroup sizes saved for the device are used where they fit the grid
+ *  - Other settings, such as the pressure solver or storage precision, apply to all runs the same way as in headless mode
+ *  - With a baseline, returns a non-zero exit code if any run is a regression
+ */
+inline int runBenchmarkSuite(VulkanLibrary& library, const string& app_name, const RunSettings& settings){
+    HeadlessDevice headless(library, app_name);
+    string device_name = headless.getDeviceName();
+
+    BenchmarkStartup startup = measureBenchmarkStartup(headless, settings, loadWorkgroupSizes(device_name));
+    std::cout << "Benchmark on " << device_name << ", particle space " << particle_space_size << ", " << settings.benchmark_steps << " steps per run\n"
+        << std::fixed << std::setprecision(3) << "Startup at grid " << settings.grid_size << ", surface resolution " << settings.surface_resolution << " - first " << startup.first_ms
+        << " ms (sections " << startup.first_sections_ms << " ms), repeated " << startup.repeated_ms << " ms (sections " << startup.repeated_sections_ms << " ms)\n"
+        << std::setw(18) << "scenario" << std::setw(8) << "grid" << std::setw(10) << "surface" << std::setw(12) << "particles" << std::setw(12) << "steps/s" << std::setw(12) << "ms/step"
+        << std::setw(14) << "memory MB" << "\n";
+    vector<BenchmarkResult> results;
+    for (uint32_t grid_size : settings.benchmark_grid_sizes){
+        for (uint32_t resolution : settings.benchmark_surface_resolutions){
+            setSimulationSizes(grid_size, resolution, settings.particle_space);
+            //saved sizes are validated against the grid when loading, default ones are used if they don't fit
+            WorkgroupSizes workgroup_sizes = loadWorkgroupSizes(device_name);
+            for (const BenchmarkScenario& scenario : benchmark_scenarios){
+                if (!settings.benchmark_scenario.empty() && scenario.name != settings.benchmark_scenario) continue;
+                for (float scale : benchmark_particle_scales){
+                    results.push_back(runBenchmarkScenario(headless, settings, workgroup_sizes, scenario, scale));
+                    const BenchmarkResult& r = results.back();
+                    std::cout << std::fixed << std::setprecision(3) << std::setw(18) << r.scenario << std::setw(8) << r.grid_size << std::setw(10) << r.surface_resolution << std::setw(12) << r.particles
+                        << std::setw(12) << r.steps_per_second << std::setw(12) << r.step_ms << std::setw(14) << r.peak_memory_bytes / (1024.0 * 1024.0) << "\n";
+                }
+            }
+        }
+    }
+    setSimulationSizes(settings.grid_size, settings.surface_resolution, settings.particle_space);
+    if (results.empty()){
+        std::cerr << "Unknown benchmark scenario '" << settings.benchmark_scenario << "'\n";
+        return 1;
+    }
+    if (!writeBenchmarkResults(settings.benchmark_output_path, device_name, settings, startup, results)){
+        std::cerr << "Could not write benchmark results to " << settings.benchmark_output_path << "\n";
+        return 1;
+    }
+    std::cout << "Results written to " << settings.benchmark_output_path << "\n";
+
+    if (settings.benchmark_baseline_path.empty()) return 0;
+    vector<BenchmarkResult> baseline;
+    if (!readBenchmarkResults(settings.benchmark_baseline_path, baseline)){
+        std::cerr << "Could not read benchmark baseline " << settings.benchmark_baseline_path << "\n";
+        return 1;
+    }
+    uint32_t regressions = compareBenchmarkResults(baseline, results);
+    if (regressions != 0) std::cout << regressions << " regressions\n";
+    return regressions == 0 ? 0 : 1;
+}
+
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef BINNING_BENCHMARK_H
+#define BINNING_BENCHMARK_H
+
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+#include "headless_simulation.h"
+
+
+
+//side lengths of the initial particle cube in cells. The same number of particles is spawned in each scene, smaller cubes mean more particles per cell
+const vector<float> binning_benchmark_cube_sides{16.f, 8.f, 4.f, 2.f};
+//how many times a section is recorded into one command buffer, longer command buffers hide the cost of submitting and waiting
+constexpr uint32_t binning_benchmark_repeats = 20;
+//how many command buffers are timed for each section, the median is reported
+constexpr uint32_t binning_benchmark_runs = 7;
+
+
+
+/**
+ * BinningBenchmarkSections
+ *  - Atomic and shared variants of 01_update_densities and 15_update_detailed_densities, each preceded by clearing the image it writes into
+ */
+class BinningBenchmarkSections{
+    FlowClearColorSection m_clear_densities;
+    FlowClearColorSection m_clear_detailed_densities;
+    //indexed by ParticleBinning
+    vector<std::unique_ptr<IndirectComputeSection<>>> m_update_densities;
+    vector<std::unique_ptr<IndirectComputeSection<>>> m_update_detailed_densities;
+public:
+    BinningBenchmarkSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, VkBuffer particle_commands_buffer) :
+        m_clear_densities(flow_context, PARTICLE_DENSITIES_IMG, ClearValue((uint32_t) 0)),
+        m_clear_detailed_densities(flow_context, DETAILED_DENSITIES_IMG, ClearValue((uint32_t) 0))
+    {
+        for (ParticleBinning binning : {ParticleBinning::PARTICLE_BINNING_ATOMIC, ParticleBinning::PARTICLE_BINNING_SHARED}){
+            m_update_densities.push_back(createSection(fluid_context, flow_context, particle_commands_buffer, updateDensitiesShader(binning), PARTICLE_DENSITIES_IMG));
+            m_update_detailed_densities.push_back(createSection(fluid_context, flow_context, particle_commands_buffer, updateDetailedDensitiesShader(binning), DETAILED_DENSITIES_IMG));
+        }
+    }
+    void complete(){
+        m_clear_densities.complete();
+        m_clear_detailed_densities.complete();
+        for (auto& s : m_update_densities) s->complete();
+        for (auto& s : m_update_detailed_densities) s->complete();
+    }
+    void recordDensities(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context, ParticleBinning binning){
+        m_clear_densities.run(command_buffer, flow_context);
+        m_update_densities[(uint32_t) binning]->run(command_buffer, flow_context);
+    }
+    void recordDetailedDensities(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context, ParticleBinning binning){
+        m_clear_detailed_densities.run(command_buffer, flow_context);
+        m_update_detailed_densities[(uint32_t) binning]->run(command_buffer, flow_context);
+    }
+private:
+    //both variants of both sections use the same descriptors, only the image they write into differs
+    static std::unique_ptr<IndirectComputeSection<>> createSection(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, VkBuffer particle_commands_buffer,
+        const string& shader_dir, uint32_t densities_image)
+    {
+        return std::make_unique<IndirectComputeSection<>>(
+            particle_commands_buffer, particle_dispatch_command_offset,
+            fluid_context, shader_dir,
+            FlowPipelineSectionDescriptors{
+                flow_context,
+                vector<FlowPipelineSectionDescriptorUsage>{
+                    simulation_parameters_buffer_compute_usage,
+                    FlowStorageBuffer{"particles", PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_R}},
+                    active_particles_compute_usage,
+                    particle_commands_compute_usage,
+                    FlowStorageImage{"particle_densities", densities_image, usage_compute, ImageState{IMAGE_STORAGE_RW}}
+                }
+            }
+        );
+    }
+};
+
+
+
+//record the given commands binning_benchmark_repeats times into one command buffer, submit it and wait, return the median time of one repeat in milliseconds
+inline double timeRepeated(HeadlessDevice& headless, const std::function<void(CommandBuffer&)>& record){
+    vector<double> times;
+    for (uint32_t run = 0; run < binning_benchmark_runs; run++){
+        auto start = HeadlessClock::now();
+        CommandBuffer& command_buffer = headless.startRecord();
+        for (uint32_t i = 0; i < binning_benchmark_repeats; i++) record(command_buffer);
+        headless.submitAndWait();
+        times.push_back(elapsedMs(start, HeadlessClock::now()) / binning_benchmark_repeats);
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+
+/**
+ * runBinningBenchmark
+ *  - Compares atomic and shared particle binning. For each particle cube size, a scene is initialized, then both variants of 01 and 15 are timed
+ *  - Times include clearing the image, they are measured on the CPU around whole submissions
+ */
+inline int runBinningBenchmark(VulkanLibrary& library, const string& app_name, const RunSettings& settings){
+    HeadlessDevice headless(library, app_name);
+    WorkgroupSizes workgroup_sizes = loadWorkgroupSizes(headless.getDeviceName());
+    const ParticleBinning methods[2]{ParticleBinning::PARTICLE_BINNING_ATOMIC, ParticleBinning::PARTICLE_BINNING_SHARED};
+    uint32_t particle_count = particle_init_cube_resolution.volume();
+
+    std::cout << "Particle binning benchmark - " << particle_count << " particles, times in ms per dispatch\n"
+        << std::setw(10) << "cube side" << std::setw(16) << "particles/cell" << std::setw(12) << "01 atomic" << std::setw(12) << "01 shared" << std::setw(12) << "15 atomic" << std::setw(12) << "15 shared" << "\n";
+    for (float side : binning_benchmark_cube_sides){
+        //the cube is placed in the middle of the domain, it has to stay inside the solid border
+        if (side + 2 > fluid_width || side + 2 > fluid_height || side + 2 > fluid_depth) continue;
+        glm::vec3 offset = glm::vec3(fluid_width, fluid_height, fluid_depth) * 0.5f - glm::vec3(side * 0.5f);
+
+        SimulationParametersBufferData params(offset, glm::vec3(side));
+        DirectoryPipelinesContext fluid_context(shaderDirectory(settings.shaders_from_disk, workgroup_sizes));
+        SimulationDescriptors flow_context{params, headless.getLocalObjectCreator(), workgroup_sizes};
+        SimulationInitializationSections init_sections{fluid_context, flow_context, workgroup_sizes};
+        BinningBenchmarkSections sections{fluid_context, flow_context, flow_context.getParticleCommandsBuffer()};
+        fluid_context.createDescriptorPool();
+        init_sections.complete();
+        sections.complete();
+
+        init_sections.run(headless.startRecord(), flow_context);
+        headless.submitAndWait();
+
+        double times[4];
+        for (uint32_t m = 0; m < 2; m++){
+            times[m]     = timeRepeated(headless, [&](CommandBuffer& cb){ sections.recordDensities(cb, flow_context, methods[m]); });
+            times[2 + m] = timeRepeated(headless, [&](CommandBuffer& cb){ sections.recordDetailedDensities(cb, flow_context, methods[m]); });
+        }
+        std::cout << std::fixed << std::setprecision(3) << std::setw(10) << side << std::setw(16) << std::setprecision(1) << particle_count / (side * side * side) << std::setprecision(3);
+        for (double t : times) std::cout << std::setw(12) << t;
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+
+#endif
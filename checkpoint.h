@@ -0,0 +1,147 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "fluid_flow_sections.h"
+#include "gpu_readback.h"
+#include "mapped_file.h"
+
+
+using std::vector;
+using std::string;
+
+
+
+/**
+ * Checkpoint file
+ *  - Complete simulation state after some step - all images that are kept between steps and the particle buffer, as saved in the readback buffer, see simulationReadbackRegions()
+ *  - Layout - CheckpointHeader, one CheckpointRegion for each saved image or buffer, then the contents of the readback buffer
+ *  - Regions are compared with the current ones when restoring, so a checkpoint can only be restored with the same grid sizes and particle space. All values are saved as 32 bit words, so storage precision can differ
+ *  - Pressure solver images, brick lists and the surface mesh aren't saved, they are computed again by the first step after restoring, which processes all bricks and extracts the whole mesh
+ *  - A checkpoint is written into a temporary file first, which then replaces the previous one, so a crash while saving leaves the previous checkpoint intact
+ */
+constexpr uint32_t checkpoint_magic = 0x4b434c46;   //"FLCK"
+constexpr uint32_t checkpoint_version = 1;
+
+struct CheckpointHeader{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t step;                  //number of steps simulated before saving
+    uint32_t region_count;
+    uint32_t storage_precision;     //StoragePrecision of the saving run, values are saved as 32 bit regardless
+    uint32_t reserved;
+    uint64_t data_bytes;            //size of the readback buffer contents following the regions
+};
+struct CheckpointRegion{
+    uint32_t index;                 //ImageAttachments value for images, BufferAttachments value for buffers
+    uint32_t is_image;
+    uint32_t components;
+    uint32_t size[3];
+    uint32_t word_offset;
+    uint32_t word_count;
+};
+static_assert(sizeof(CheckpointHeader) == 32 && sizeof(CheckpointRegion) == 32, "Checkpoint structures are written as is");
+
+
+
+/**
+ * SimulationCheckpoints
+ *  - Sections that copy simulation state into the readback buffer and back, and saving and loading of its' contents to a checkpoint file
+ *  - Saving - record recordSave(), wait for it to finish, then call save()
+ *  - Restoring - call load(), which maps the file and copies it into the readback buffer in one go, then record recordRestore() in place of initialization sections
+ *  - The readback buffer must have simulationReadbackBufferSize() bytes
+ */
+class SimulationCheckpoints{
+    SimulationReadbackSections m_readback;
+    SimulationRestoreSections m_restore;
+public:
+    SimulationCheckpoints(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes) :
+        m_readback(fluid_context, flow_context, workgroup_sizes),
+        m_restore(fluid_context, flow_context, workgroup_sizes)
+    {}
+    void complete(){
+        m_readback.complete();
+        m_restore.complete();
+    }
+    void recordSave(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        m_readback.run(command_buffer, flow_context);
+    }
+    void recordRestore(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        m_restore.run(command_buffer, flow_context);
+    }
+    //write state copied by recordSave() into a checkpoint file. Returns false if the file couldn't be written
+    static bool save(const string& path, SimulationDescriptors& flow_context, uint32_t step, StoragePrecision storage_precision){
+        vector<ReadbackRegion> regions = simulationReadbackRegions();
+        vector<uint32_t> words(simulationReadbackBufferSize() / sizeof(uint32_t));
+        flow_context.readReadbackBuffer(words.data(), words.size() * sizeof(uint32_t));
+
+        CheckpointHeader header{checkpoint_magic, checkpoint_version, step, (uint32_t) regions.size(), (uint32_t) storage_precision, 0, words.size() * sizeof(uint32_t)};
+        string temporary_path = path + ".tmp";
+        {
+            std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            for (const ReadbackRegion& r : regions){
+                CheckpointRegion region{r.index, r.is_image, r.components, {r.size.x, r.size.y, r.size.z}, r.word_offset, r.wordCount()};
+                file.write(reinterpret_cast<const char*>(&region), sizeof(region));
+            }
+            file.write(reinterpret_cast<const char*>(words.data()), header.data_bytes);
+            if (!file){
+                std::cerr << "Could not write checkpoint " << temporary_path << "\n";
+                return false;
+            }
+        }
+        std::error_code error;
+        std::filesystem::rename(temporary_path, path, error);
+        if (error){
+            std::cerr << "Could not replace checkpoint " << path << ": " << error.message() << "\n";
+            return false;
+        }
+        return true;
+    }
+    //map a checkpoint file and copy its' data into the readback buffer, step is set to the number of steps simulated before saving. Returns false if the file is missing or was saved with different sizes
+    static bool load(const string& path, SimulationDescriptors& flow_context, uint32_t& step){
+        MappedFile file;
+        if (!file.open(path) || file.size() < sizeof(CheckpointHeader)){
+            std::cerr << "Could not open checkpoint " << path << "\n";
+            return false;
+        }
+        CheckpointHeader header;
+        std::memcpy(&header, file.data(), sizeof(header));
+        if (header.magic != checkpoint_magic || header.version != checkpoint_version){
+            std::cerr << path << " isn't a checkpoint of this version\n";
+            return false;
+        }
+        vector<ReadbackRegion> regions = simulationReadbackRegions();
+        size_t data_offset = sizeof(header) + header.region_count * sizeof(CheckpointRegion);
+        if (header.region_count != regions.size() || header.data_bytes != simulationReadbackBufferSize() || file.size() < data_offset + header.data_bytes){
+            std::cerr << "Checkpoint " << path << " was saved with different simulation sizes\n";
+            return false;
+        }
+        for (uint32_t i = 0; i < header.region_count; i++){
+            CheckpointRegion saved;
+            std::memcpy(&saved, file.data() + sizeof(header) + i * sizeof(CheckpointRegion), sizeof(saved));
+            const ReadbackRegion& r = regions[i];
+            if (saved.index != r.index || saved.is_image != (uint32_t) r.is_image || saved.components != r.components || saved.word_offset != r.word_offset || saved.word_count != r.wordCount()
+                || saved.size[0] != r.size.x || saved.size[1] != r.size.y || saved.size[2] != r.size.z)
+            {
+                std::cerr << "Region '" << r.name << "' of checkpoint " << path << " doesn't match the simulation\n";
+                return false;
+            }
+        }
+        //the whole state is copied from the mapped file into the host visible readback buffer at once, and distributed into images by recordRestore()
+        flow_context.writeReadbackBuffer(file.data() + data_offset, header.data_bytes);
+        step = header.step;
+        return true;
+    }
+};
+
+
+#endif
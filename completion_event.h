@@ -0,0 +1,42 @@
+#ifndef COMPLETION_EVENT_H
+#define COMPLETION_EVENT_H
+
+#include <stdexcept>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+
+
+
+/**
+ * CompletionEvent
+ *  - Tells whether a submitted command buffer finished executing, so that a wait for its' fence that ran out of time isn't mistaken for a finished submission
+ *  - Call reset() before submitting, record() as the last command of the buffer, and finished() after waiting for the submission
+ *  - The event is set once all commands recorded before it finished, results of a command buffer that isn't finished mustn't be read
+ */
+class CompletionEvent{
+    VkEvent m_event;
+public:
+    CompletionEvent(){
+        VkEventCreateInfo info{VK_STRUCTURE_TYPE_EVENT_CREATE_INFO, nullptr, 0};
+        if (vkCreateEvent(g_device, &info, nullptr, &m_event) != VK_SUCCESS) throw std::runtime_error("Could not create a completion event");
+    }
+    CompletionEvent(const CompletionEvent&) = delete;
+    CompletionEvent& operator=(const CompletionEvent&) = delete;
+    ~CompletionEvent(){
+        vkDestroyEvent(g_device, m_event, nullptr);
+    }
+    //the command buffer recorded into mustn't be executing
+    void reset(){
+        vkResetEvent(g_device, m_event);
+    }
+    void record(VkCommandBuffer command_buffer){
+        vkCmdSetEvent(command_buffer, m_event, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+    }
+    bool finished() const{
+        return vkGetEventStatus(g_device, m_event) == VK_EVENT_SET;
+    }
+};
+
+
+
+#endif
@@ -0,0 +1,670 @@
+#ifndef CPU_SIMULATION_H
+#define CPU_SIMULATION_H
+
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <algorithm>
+#include <cstring>
+#include <string>
+#include <stdexcept>
+
+#include "simulation_constants.h"
+#include "thread_pool.h"
+#include "slab_transport.h"
+
+
+using std::vector;
+
+
+
+/**
+ * CpuGridIndexer
+ *  - Converts 3D grid coordinates to indices into flat arrays. x is the fastest changing coordinate, same as in GPU images.
+ *  - All loads outside of the grid return zero, which is what imageLoad returns on the GPU for out of bounds coordinates
+ *  - A slab of a decomposed grid only stores some layers along z, see 'CPU slab decomposition' in simulation_constants.h. z coordinates are then local to the slab,
+ *    layer 0 is the first ghost layer, and loads past the end of the whole grid still return zero
+ */
+struct CpuGridIndexer{
+    int w, h, d;
+    //global z of the first stored layer, and depth of the whole grid
+    int z_origin = 0, domain_d;
+    //stored layers owned by this grid, the ones around them are ghost layers of neighbouring slabs
+    int owned_begin = 0, owned_end;
+
+    CpuGridIndexer(const Size3& size) : w((int) size.x), h((int) size.y), d((int) size.z), domain_d(d), owned_end(d)
+    {}
+    //slab owning global layers [z_begin, z_end) of a grid of the given size, with ghost layers on both sides
+    CpuGridIndexer(const Size3& size, uint32_t z_begin, uint32_t z_end, uint32_t ghost_layers) :
+        w((int) size.x), h((int) size.y), d((int) (z_end - z_begin + 2 * ghost_layers)), z_origin((int) z_begin - (int) ghost_layers), domain_d((int) size.z),
+        owned_begin((int) ghost_layers), owned_end((int) (z_end - z_begin + ghost_layers))
+    {}
+    int globalZ(int z) const{
+        return z + z_origin;
+    }
+    int localZ(int global_z) const{
+        return global_z - z_origin;
+    }
+    int ghostLayers() const{
+        return owned_begin;
+    }
+    size_t volume() const{
+        return (size_t) w * h * d;
+    }
+    size_t index(int x, int y, int z) const{
+        return (size_t) x + (size_t) w * ((size_t) y + (size_t) h * z);
+    }
+    bool inside(int x, int y, int z) const{
+        return x >= 0 && y >= 0 && z >= 0 && x < w && y < h && z < d && globalZ(z) >= 0 && globalZ(z) < domain_d;
+    }
+    template<typename T>
+    T load(const vector<T>& grid, int x, int y, int z) const{
+        return inside(x, y, z) ? grid[index(x, y, z)] : T(0);
+    }
+    //emulates sampling a texture with linear filtering and clamp to edge addressing. u, v, t are coordinates in texel space of the whole grid, texel centers lie at integer coordinates
+    float sampleLinear(const vector<float>& grid, float u, float v, float t) const{
+        float fu = std::floor(u), fv = std::floor(v), ft = std::floor(t);
+        float au = u - fu, av = v - fv, at = t - ft;
+        int x0 = clampCoord((int) fu, 0, w - 1), x1 = clampCoord((int) fu + 1, 0, w - 1);
+        int y0 = clampCoord((int) fv, 0, h - 1), y1 = clampCoord((int) fv + 1, 0, h - 1);
+        //clamped to the edge of the whole grid, then converted to stored layers. A slab only stores ghost layers around its' owned ones,
+        //a sample reaching past them would need layers it doesn't have, that is an error instead of silently clamping to the last stored layer
+        int z0 = localZ(clampCoord((int) ft, 0, domain_d - 1)), z1 = localZ(clampCoord((int) ft + 1, 0, domain_d - 1));
+        if (z0 < 0 || z1 >= d) throw std::runtime_error("Linear sample at z " + std::to_string(t) + " is outside of the layers stored by the slab");
+        auto lerp = [](float a, float b, float k){ return a + (b - a) * k; };
+        float c00 = lerp(grid[index(x0, y0, z0)], grid[index(x1, y0, z0)], au);
+        float c10 = lerp(grid[index(x0, y1, z0)], grid[index(x1, y1, z0)], au);
+        float c01 = lerp(grid[index(x0, y0, z1)], grid[index(x1, y0, z1)], au);
+        float c11 = lerp(grid[index(x0, y1, z1)], grid[index(x1, y1, z1)], au);
+        return lerp(lerp(c00, c10, av), lerp(c01, c11, av), at);
+    }
+private:
+    static int clampCoord(int c, int min, int max){
+        return std::min(std::max(c, min), max);
+    }
+};
+
+
+
+/**
+ * CpuVelocityGrid
+ *  - Velocity field stored as a structure of arrays - one array per component, so that loops over one component are contiguous and easy to vectorize
+ */
+struct CpuVelocityGrid{
+    vector<float> c[3];
+
+    void resize(size_t volume){
+        for (int i = 0; i < 3; i++) c[i].assign(volume, 0.f);
+    }
+};
+
+/**
+ * CpuParticles
+ *  - Particle positions stored as a structure of arrays, w is equal to active_particle_w for active particles, same as in the particle buffer on the GPU
+ */
+struct CpuParticles{
+    vector<float> x, y, z, w;
+
+    void resize(size_t count){
+        x.assign(count, 0.f); y.assign(count, 0.f); z.assign(count, 0.f); w.assign(count, 0.f);
+    }
+    size_t size() const{
+        return x.size();
+    }
+};
+
+
+
+//first fluid layer owned by the slab of the given rank, slabs own nearly the same number of layers
+inline uint32_t cpuSlabBegin(uint32_t rank, uint32_t slab_count){
+    return (uint32_t) ((uint64_t) fluid_depth * rank / slab_count);
+}
+//the most slabs the fluid grid can be split into, each one has to own at least as many layers as its' neighbours store as ghost layers
+inline uint32_t maxCpuSlabs(){
+    return std::max(1u, fluid_depth / slab_ghost_layers);
+}
+
+
+
+/**
+ * CpuSimulation
+ *  - A multithreaded CPU implementation of all simulation sections, from 00_init_particles to 18_diffuse_float_densities
+ *  - Each method mirrors one shader in shaders_fluid and uses the same constants that are written into SimulationParametersBufferData, results should match the GPU up to floating point precision
+ *  - Grids are split into z-slabs that are processed in parallel by a work stealing thread pool, particles are split into equally sized ranges
+ *  - Arrays have the same names as images in ImageAttachments, where one image is used as both source and target on the GPU, the CPU reads from a copy instead to avoid races
+ *  - Created with a SlabTransport, it only simulates one slab of the grid and the particles inside it. Ghost layers are exchanged with neighbouring slabs
+ *    after each section that changes values the next ones read from neighbours, and particles that moved into another slab are sent to it after 14_particles
+ */
+class CpuSimulation{
+    WorkStealingThreadPool& m_pool;
+    CpuGridIndexer m_fluid;
+    CpuGridIndexer m_detailed;
+    //connection to neighbouring slabs, null when simulating the whole grid
+    SlabTransport* m_transport = nullptr;
+    vector<uint8_t> m_to_lower, m_to_upper, m_from_lower, m_from_upper;
+public:
+    CpuVelocityGrid velocities_1, velocities_2;
+    vector<uint8_t> cell_types, new_cell_types;
+    vector<float> pressures_1, pressures_2, divergences;
+    vector<uint32_t> particle_densities;
+    vector<uint32_t> detailed_densities, detailed_densities_inertia;
+    vector<float> particle_densities_float_1, particle_densities_float_2;
+    CpuParticles particles;
+
+    CpuSimulation(WorkStealingThreadPool& pool) : CpuSimulation(pool, CpuGridIndexer(fluid_size), CpuGridIndexer(surface_render_size))
+    {}
+    //simulation of the slab of transport.rank()
+    CpuSimulation(WorkStealingThreadPool& pool, SlabTransport& transport) :
+        CpuSimulation(pool,
+            CpuGridIndexer(fluid_size, cpuSlabBegin(transport.rank(), transport.size()), cpuSlabBegin(transport.rank() + 1, transport.size()), slab_ghost_layers),
+            CpuGridIndexer(surface_render_size, cpuSlabBegin(transport.rank(), transport.size()) * surface_render_resolution,
+                cpuSlabBegin(transport.rank() + 1, transport.size()) * surface_render_resolution, slab_detailed_ghost_layers))
+    {
+        m_transport = &transport;
+    }
+    CpuSimulation(WorkStealingThreadPool& pool, const CpuGridIndexer& fluid, const CpuGridIndexer& detailed) : m_pool(pool), m_fluid(fluid), m_detailed(detailed){
+        velocities_1.resize(m_fluid.volume());
+        velocities_2.resize(m_fluid.volume());
+        cell_types.assign(m_fluid.volume(), 0);
+        new_cell_types.assign(m_fluid.volume(), 0);
+        pressures_1.assign(m_fluid.volume(), 0.f);
+        pressures_2.assign(m_fluid.volume(), 0.f);
+        divergences.assign(m_fluid.volume(), 0.f);
+        particle_densities.assign(m_fluid.volume(), 0);
+        detailed_densities.assign(m_detailed.volume(), 0);
+        detailed_densities_inertia.assign(m_detailed.volume(), 0);
+        particle_densities_float_1.assign(m_detailed.volume(), 0.f);
+        particle_densities_float_2.assign(m_detailed.volume(), 0.f);
+        particles.resize(particle_space_size);
+    }
+
+    const CpuGridIndexer& fluidGrid() const{
+        return m_fluid;
+    }
+    const CpuGridIndexer& detailedGrid() const{
+        return m_detailed;
+    }
+
+    //equivalent of SimulationInitializationSections
+    void initialize(){
+        velocities_1.resize(m_fluid.volume());
+        std::fill(cell_types.begin(), cell_types.end(), (uint8_t) CellType::CELL_INACTIVE);
+        std::fill(detailed_densities_inertia.begin(), detailed_densities_inertia.end(), 0u);
+        std::fill(pressures_2.begin(), pressures_2.end(), simulation_air_pressure);
+        initParticles();
+        if (m_transport) keepOwnedParticles();
+    }
+    //equivalent of SimulationStepSections using the Jacobi pressure solver. A slab exchanges ghost layers of what the next section reads from neighbours, cell types of ghost layers
+    //are copied by updateCellTypes. Like on the GPU, detailed densities are computed first, from particles and cell types at the start of the step
+    void step(){
+        std::fill(detailed_densities.begin(), detailed_densities.end(), 0u);
+        updateDetailedDensities();
+        exchangeHalos(m_detailed, detailed_densities);
+        computeDensitiesInertia();
+        computeFloatDensities();
+        exchangeHalos(m_detailed, particle_densities_float_1);
+        for (uint32_t i = 0; i < float_density_diffuse_steps; i++){
+            diffuseFloatDensities(i % 2 == 0);
+            exchangeHalos(m_detailed, i % 2 == 0 ? particle_densities_float_2 : particle_densities_float_1);
+        }
+        std::fill(particle_densities.begin(), particle_densities.end(), 0u);
+        updateDensities();
+        updateWater();
+        exchangeHalos(m_fluid, new_cell_types);
+        updateAir();
+        exchangeHalos(m_fluid, new_cell_types);
+        computeExtrapolatedVelocities();
+        setExtrapolatedVelocities();
+        exchangeHalos(m_fluid, velocities_1.c[0], velocities_1.c[1], velocities_1.c[2]);
+        updateCellTypes();
+        advect();
+        forces();
+        exchangeHalos(m_fluid, velocities_2.c[0], velocities_2.c[1], velocities_2.c[2]);
+        diffuse();
+        solids();
+        exchangeHalos(m_fluid, velocities_1.c[0], velocities_1.c[1], velocities_1.c[2]);
+        computeDivergence();
+        initPressures();
+        exchangeHalos(m_fluid, pressures_1, pressures_2);
+        for (uint32_t i = 0; i < divergence_solve_iterations; i++){
+            solvePressure(i % 2 == 0);
+            exchangeHalos(m_fluid, i % 2 == 0 ? pressures_2 : pressures_1);
+        }
+        fixDivergence();
+        exchangeHalos(m_fluid, velocities_1.c[0], velocities_1.c[1], velocities_1.c[2]);
+        moveParticles();
+        migrateParticles();
+    }
+
+
+    // * 00_init_particles *
+    void initParticles(){
+        uint32_t cube_volume = particle_init_cube_resolution.volume();
+        forEachParticleRange([&](uint32_t begin, uint32_t end){
+            for (uint32_t i = begin; i < end; i++){
+                if (i < cube_volume){
+                    uint32_t j = i;
+                    float px = (float) (j % particle_init_cube_resolution.x); j /= particle_init_cube_resolution.x;
+                    float py = (float) (j % particle_init_cube_resolution.y); j /= particle_init_cube_resolution.y;
+                    float pz = (float) (j % particle_init_cube_resolution.z);
+                    particles.x[i] = particle_init_cube_offset.x + px / particle_init_cube_resolution.x * particle_init_cube_size.x;
+                    particles.y[i] = particle_init_cube_offset.y + py / particle_init_cube_resolution.y * particle_init_cube_size.y;
+                    particles.z[i] = particle_init_cube_offset.z + pz / particle_init_cube_resolution.z * particle_init_cube_size.z;
+                    particles.w[i] = active_particle_w;
+                }else{
+                    particles.x[i] = particles.y[i] = particles.z[i] = particles.w[i] = 0.f;
+                }
+            }
+        });
+    }
+    // * 01_update_densities *
+    void updateDensities(){
+        countParticles(m_fluid, 1.f, particle_densities);
+    }
+    // * 02_update_water *
+    void updateWater(){
+        forEachFluidRow([&](size_t row, int, int){
+            for (int x = 0; x < m_fluid.w; x++){
+                new_cell_types[row + x] = (uint8_t) (particle_densities[row + x] > 0 ? CellType::CELL_WATER : CellType::CELL_INACTIVE);
+            }
+        });
+    }
+    // * 03_update_air *
+    void updateAir(){
+        //the shader reads and writes the same image, reading from a copy makes the result independent of execution order
+        vector<uint8_t> types = new_cell_types;
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                int global_z = m_fluid.globalZ(z);
+                if (x == 0 || y == 0 || global_z == 0 || x == m_fluid.w - 1 || y == m_fluid.h - 1 || global_z == m_fluid.domain_d - 1){
+                    new_cell_types[row + x] = (uint8_t) CellType::CELL_SOLID;
+                }else if (!isWater(types[row + x])){
+                    bool water_around = isWater(m_fluid.load(types, x + 1, y, z)) || isWater(m_fluid.load(types, x, y + 1, z)) || isWater(m_fluid.load(types, x, y, z + 1))
+                                     || isWater(m_fluid.load(types, x - 1, y, z)) || isWater(m_fluid.load(types, x, y - 1, z)) || isWater(m_fluid.load(types, x, y, z - 1));
+                    if (water_around) new_cell_types[row + x] = (uint8_t) CellType::CELL_AIR;
+                }
+            }
+        });
+    }
+    // * 04_compute_extrapolated_velocities *
+    void computeExtrapolatedVelocities(){
+        const int moves[6][3] = {{-1, 0, 0}, {0, -1, 0}, {0, 0, -1}, {1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                int count = 0;
+                float v[3] = {0, 0, 0};
+                for (const int* m : moves){
+                    int nx = x + m[0], ny = y + m[1], nz = z + m[2];
+                    if (m_fluid.inside(nx, ny, nz) && isWater(cell_types[m_fluid.index(nx, ny, nz)])){
+                        for (int c = 0; c < 3; c++) v[c] += velocities_1.c[c][m_fluid.index(nx, ny, nz)];
+                        count++;
+                    }
+                }
+                for (int c = 0; c < 3; c++) velocities_2.c[c][row + x] = (count != 0) ? v[c] / count : 0.f;
+            }
+        });
+    }
+    // * 05_set_extrapolated_velocities *
+    void setExtrapolatedVelocities(){
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                bool was_active = isActive(cell_types[row + x]);
+                bool is_active  = isActive(new_cell_types[row + x]);
+                int pos[3] = {x, y, z};
+                for (int c = 0; c < 3; c++){
+                    int across[3] = {pos[0], pos[1], pos[2]};
+                    across[c] -= 1;
+                    bool vel_was_active = was_active || isActive(m_fluid.load(cell_types, across[0], across[1], across[2]));
+                    bool vel_is_active  = is_active  || isActive(m_fluid.load(new_cell_types, across[0], across[1], across[2]));
+                    if (vel_was_active && !vel_is_active){
+                        velocities_1.c[c][row + x] = 0.f;
+                    }else if (!vel_was_active && vel_is_active){
+                        velocities_1.c[c][row + x] = velocities_2.c[c][row + x];
+                    }
+                }
+            }
+        });
+    }
+    // * 06_update_cell_types *
+    void updateCellTypes(){
+        cell_types = new_cell_types;
+    }
+    // * 07_advect *
+    void advect(){
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                int pos[3] = {x, y, m_fluid.globalZ(z)};
+                bool cur_active = isWater(cell_types[row + x]);
+                for (int c = 0; c < 3; c++){
+                    int next[3] = {x, y, z};
+                    next[c] += 1;
+                    float result = velocities_1.c[c][row + x];
+                    if (pos[c] != 0 && (cur_active || isWater(m_fluid.load(cell_types, next[0], next[1], next[2])))){
+                        float p[3] = {x + 0.5f, y + 0.5f, pos[2] + 0.5f};
+                        p[c] = (float) pos[c];
+                        float v[3];
+                        for (int k = 0; k < 3; k++) v[k] = sampleVelocity(p, k);
+                        float back[3] = {p[0] - v[0] * simulation_time_step, p[1] - v[1] * simulation_time_step, p[2] - v[2] * simulation_time_step};
+                        result = sampleVelocity(back, c);
+                    }
+                    velocities_2.c[c][row + x] = result;
+                }
+            }
+        });
+    }
+    // * 08_forces *
+    void forces(){
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                float force = 0;
+                bool water_across_y = isWater(cell_types[row + x]) || isWater(m_fluid.load(cell_types, x, y - 1, z));
+                if (y != 0 && water_across_y) force += simulation_gravity;
+                if (x == (int) fountain_position.x && y == (int) fountain_position.y && m_fluid.globalZ(z) == (int) fountain_position.z && water_across_y) force += fountain_force;
+                velocities_2.c[1][row + x] += simulation_time_step * force;
+            }
+        });
+    }
+    // * 09_diffuse - velocities of water cells are averaged with the ones of all 6 neighbouring cells, the others are copied *
+    void diffuse(){
+        const float a = simulation_diffusion_coefficient * simulation_time_step;
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int c = 0; c < 3; c++){
+                const vector<float>& src = velocities_2.c[c];
+                for (int x = 0; x < m_fluid.w; x++){
+                    float v = src[row + x];
+                    if (isWater(cell_types[row + x])){
+                        v = (1.f - 6 * a) * v + a * (m_fluid.load(src, x + 1, y, z) + m_fluid.load(src, x - 1, y, z) + m_fluid.load(src, x, y + 1, z)
+                                                   + m_fluid.load(src, x, y - 1, z) + m_fluid.load(src, x, y, z + 1) + m_fluid.load(src, x, y, z - 1));
+                    }
+                    velocities_1.c[c][row + x] = v;
+                }
+            }
+        });
+    }
+    // * 10_solids *
+    void solids(){
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                int pos[3] = {x, y, z};
+                bool solid = isSolid(cell_types[row + x]);
+                for (int c = 0; c < 3; c++){
+                    float& v = velocities_1.c[c][row + x];
+                    if (solid && v > -solid_repel_velocity) v = -solid_repel_velocity;
+                    int across[3] = {pos[0], pos[1], pos[2]};
+                    across[c] -= 1;
+                    if (isSolid(m_fluid.load(cell_types, across[0], across[1], across[2])) && v < solid_repel_velocity) v = solid_repel_velocity;
+                }
+            }
+        });
+    }
+    // * 11_compute_divergence *
+    void computeDivergence(){
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                divergences[row + x] = m_fluid.load(velocities_1.c[0], x + 1, y, z) - velocities_1.c[0][row + x]
+                                     + m_fluid.load(velocities_1.c[1], x, y + 1, z) - velocities_1.c[1][row + x]
+                                     + m_fluid.load(velocities_1.c[2], x, y, z + 1) - velocities_1.c[2][row + x];
+            }
+        });
+    }
+    // * 12a_pressure_init - water cells keep pressures from the previous step, all others are set to air pressure *
+    void initPressures(){
+        forEachFluidRow([&](size_t row, int, int){
+            for (int x = 0; x < m_fluid.w; x++){
+                if (!isWater(cell_types[row + x])) pressures_2[row + x] = simulation_air_pressure;
+                pressures_1[row + x] = pressures_2[row + x];
+            }
+        });
+    }
+    // * 12_solve_pressure - one Jacobi iteration, even iterations read pressures_1 and write pressures_2 *
+    void solvePressure(bool is_even_iteration){
+        const vector<float>& src = is_even_iteration ? pressures_1 : pressures_2;
+        vector<float>& dst = is_even_iteration ? pressures_2 : pressures_1;
+        const float b_scale = simulation_fluid_density * simulation_cell_width / simulation_time_step;
+        const int moves[6][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}, {-1, 0, 0}, {0, -1, 0}, {0, 0, -1}};
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                if (!isWater(cell_types[row + x])) continue;
+                int aii = 0;
+                float s = divergences[row + x] * b_scale;
+                for (const int* m : moves){
+                    int nx = x + m[0], ny = y + m[1], nz = z + m[2];
+                    uint8_t t = m_fluid.load(cell_types, nx, ny, nz);
+                    if (isSolid(t)) continue;
+                    s -= isWater(t) ? src[m_fluid.index(nx, ny, nz)] : simulation_air_pressure;
+                    aii++;
+                }
+                dst[row + x] = -s / aii;
+            }
+        });
+    }
+    // * 13_fix_divergence - reads pressures_2, same as the GPU section *
+    void fixDivergence(){
+        const float k = simulation_time_step / simulation_fluid_density / simulation_cell_width;
+        forEachFluidRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_fluid.w; x++){
+                uint8_t local_type = cell_types[row + x];
+                float local_pressure = pressures_2[row + x];
+                int pos[3] = {x, y, z};
+                for (int c = 0; c < 3; c++){
+                    int across[3] = {pos[0], pos[1], pos[2]};
+                    across[c] -= 1;
+                    uint8_t across_type = m_fluid.load(cell_types, across[0], across[1], across[2]);
+                    float dv = 0;
+                    bool first_layer = (c == 2 ? m_fluid.globalZ(pos[c]) : pos[c]) == 0;
+                    if (!first_layer && (isWater(local_type) || isWater(across_type)) && !isSolid(local_type) && !isSolid(across_type)){
+                        dv = local_pressure - pressures_2[m_fluid.index(across[0], across[1], across[2])];
+                    }
+                    velocities_1.c[c][row + x] -= k * dv;
+                }
+            }
+        });
+    }
+    // * 14_particles *
+    void moveParticles(){
+        forEachParticleRange([&](uint32_t begin, uint32_t end){
+            for (uint32_t i = begin; i < end; i++){
+                if (particles.w[i] != active_particle_w) continue;
+                float p[3] = {particles.x[i], particles.y[i], particles.z[i]};
+                float v[3] = {sampleVelocity(p, 0), sampleVelocity(p, 1), sampleVelocity(p, 2)};
+                particles.x[i] += v[0] * simulation_time_step;
+                particles.y[i] += v[1] * simulation_time_step;
+                particles.z[i] += v[2] * simulation_time_step;
+            }
+        });
+    }
+    //send particles that left the owned layers of a slab to the neighbour in the direction they moved, and add the ones neighbours sent. Particles leaving the whole grid stay in the first
+    //or the last slab. Nothing is done when simulating the whole grid
+    void migrateParticles(){
+        if (!m_transport) return;
+        vector<float> leaving[2];
+        size_t kept = 0;
+        for (size_t i = 0; i < particles.size(); i++){
+            int direction = ownerDirection(particles.z[i]);
+            if (direction == 0){
+                particles.x[kept] = particles.x[i]; particles.y[kept] = particles.y[i]; particles.z[kept] = particles.z[i]; particles.w[kept] = particles.w[i];
+                kept++;
+                continue;
+            }
+            vector<float>& target = leaving[direction > 0];
+            target.insert(target.end(), {particles.x[i], particles.y[i], particles.z[i], particles.w[i]});
+        }
+        for (vector<float>* c : {&particles.x, &particles.y, &particles.z, &particles.w}) c->resize(kept);
+
+        toBytes(leaving[0], m_to_lower);
+        toBytes(leaving[1], m_to_upper);
+        m_transport->exchange(m_to_lower, m_to_upper, m_from_lower, m_from_upper);
+        for (const vector<uint8_t>* message : {&m_from_lower, &m_from_upper}){
+            const float* arrived = reinterpret_cast<const float*>(message->data());
+            for (size_t i = 0; i < message->size() / (4 * sizeof(float)); i++){
+                particles.x.push_back(arrived[4 * i]); particles.y.push_back(arrived[4 * i + 1]); particles.z.push_back(arrived[4 * i + 2]); particles.w.push_back(arrived[4 * i + 3]);
+            }
+        }
+    }
+    // * 15_update_detailed_densities *
+    void updateDetailedDensities(){
+        countParticles(m_detailed, (float) surface_render_resolution, detailed_densities);
+    }
+    // * 16_compute_detailed_densities_inertia *
+    void computeDensitiesInertia(){
+        forEachDetailedRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_detailed.w; x++){
+                uint32_t inertia = detailed_densities_inertia[row + x];
+                uint32_t old_inertia = inertia;
+                if (detailed_densities[row + x] > 0) inertia += simulation_inertia_increase_filled;
+                int hit_count = (m_detailed.load(detailed_densities, x + 1, y, z) > 0) + (m_detailed.load(detailed_densities, x, y + 1, z) > 0) + (m_detailed.load(detailed_densities, x, y, z + 1) > 0)
+                              + (m_detailed.load(detailed_densities, x - 1, y, z) > 0) + (m_detailed.load(detailed_densities, x, y - 1, z) > 0) + (m_detailed.load(detailed_densities, x, y, z - 1) > 0);
+                if (hit_count >= simulation_inertia_required_neighbour_hits) inertia += hit_count * simulation_inertia_increase_neighbour;
+                if (inertia == old_inertia){
+                    inertia = (inertia > (uint32_t) simulation_inertia_decrease) ? inertia - simulation_inertia_decrease : 0;
+                }
+                detailed_densities_inertia[row + x] = std::min((uint32_t) simulation_densities_max_inertia, inertia);
+            }
+        });
+    }
+    // * 17_compute_float_densities *
+    void computeFloatDensities(){
+        forEachDetailedRow([&](size_t row, int, int){
+            for (int x = 0; x < m_detailed.w; x++){
+                uint32_t dens = detailed_densities_inertia[row + x];
+                particle_densities_float_1[row + x] = (dens == 0) ? -1.f : dens / simulation_float_density_division_coefficient;
+            }
+        });
+    }
+    // * 18_diffuse_float_densities - even iterations read float densities 1 and write float densities 2 *
+    void diffuseFloatDensities(bool is_even_iteration){
+        const vector<float>& src = is_even_iteration ? particle_densities_float_1 : particle_densities_float_2;
+        vector<float>& dst = is_even_iteration ? particle_densities_float_2 : particle_densities_float_1;
+        const float a = simulation_float_density_diffuse_coefficient;
+        forEachDetailedRow([&](size_t row, int y, int z){
+            for (int x = 0; x < m_detailed.w; x++){
+                int fluid_z = m_fluid.localZ(m_detailed.globalZ(z) / (int) surface_render_resolution);
+                if (isSolid(cell_types[m_fluid.index(x / surface_render_resolution, y / surface_render_resolution, fluid_z)])) continue;
+                dst[row + x] = (1.f - 6 * a) * src[row + x] + a *
+                    (m_detailed.load(src, x + 1, y, z) + m_detailed.load(src, x - 1, y, z) +
+                     m_detailed.load(src, x, y + 1, z) + m_detailed.load(src, x, y - 1, z) +
+                     m_detailed.load(src, x, y, z + 1) + m_detailed.load(src, x, y, z - 1));
+            }
+        });
+    }
+
+private:
+    static bool isWater(uint8_t t){
+        return t == (uint8_t) CellType::CELL_WATER;
+    }
+    static bool isSolid(uint8_t t){
+        return t == (uint8_t) CellType::CELL_SOLID;
+    }
+    static bool isActive(uint8_t t){
+        return t == (uint8_t) CellType::CELL_WATER || t == (uint8_t) CellType::CELL_AIR;
+    }
+    //sample one velocity component at a position in world space, same as getVelocityCompAt in 07_advect and 14_particles
+    float sampleVelocity(const float* pos, int comp) const{
+        //texture coordinates (pos + 0.5 in the component dimension) / fluid_size, converted to texel space by multiplying by size and subtracting 0.5
+        float u = pos[0] - 0.5f + (comp == 0 ? 0.5f : 0.f);
+        float v = pos[1] - 0.5f + (comp == 1 ? 0.5f : 0.f);
+        float t = pos[2] - 0.5f + (comp == 2 ? 0.5f : 0.f);
+        return m_fluid.sampleLinear(velocities_1.c[comp], u, v, t);
+    }
+    //-1 if a particle at global z belongs to the slab below, 1 if to the one above, 0 if to this one
+    int ownerDirection(float z) const{
+        int cell_z = m_fluid.localZ((int) z);
+        if (cell_z < m_fluid.owned_begin && m_transport->hasLower()) return -1;
+        if (cell_z >= m_fluid.owned_end && m_transport->hasUpper()) return 1;
+        return 0;
+    }
+    //after initParticles, remove inactive particles and ones owned by other slabs, the others keep the same order
+    void keepOwnedParticles(){
+        size_t kept = 0;
+        for (size_t i = 0; i < particles.size(); i++){
+            if (particles.w[i] != active_particle_w || ownerDirection(particles.z[i]) != 0) continue;
+            particles.x[kept] = particles.x[i]; particles.y[kept] = particles.y[i]; particles.z[kept] = particles.z[i]; particles.w[kept] = particles.w[i];
+            kept++;
+        }
+        for (vector<float>* c : {&particles.x, &particles.y, &particles.z, &particles.w}) c->resize(kept);
+    }
+    //send owned layers next to each neighbour into its' ghost layers and receive its' layers into ours, for each of the given arrays of the grid. Nothing is done when simulating the whole grid
+    template<typename... T>
+    void exchangeHalos(const CpuGridIndexer& grid, vector<T>&... arrays){
+        if (!m_transport) return;
+        int ghost = grid.ghostLayers();
+        m_to_lower.clear();
+        m_to_upper.clear();
+        (appendLayers(grid, arrays, grid.owned_begin, ghost, m_to_lower), ...);
+        (appendLayers(grid, arrays, grid.owned_end - ghost, ghost, m_to_upper), ...);
+        m_transport->exchange(m_to_lower, m_to_upper, m_from_lower, m_from_upper);
+        size_t offset = 0;
+        if (!m_from_lower.empty()) (readLayers(grid, arrays, 0, ghost, m_from_lower, offset), ...);
+        offset = 0;
+        if (!m_from_upper.empty()) (readLayers(grid, arrays, grid.owned_end, ghost, m_from_upper, offset), ...);
+    }
+    template<typename T>
+    static void appendLayers(const CpuGridIndexer& grid, const vector<T>& array, int z, int count, vector<uint8_t>& message){
+        const uint8_t* begin = reinterpret_cast<const uint8_t*>(array.data() + grid.index(0, 0, z));
+        message.insert(message.end(), begin, begin + grid.index(0, 0, count) * sizeof(T));
+    }
+    template<typename T>
+    static void readLayers(const CpuGridIndexer& grid, vector<T>& array, int z, int count, const vector<uint8_t>& message, size_t& offset){
+        size_t bytes = grid.index(0, 0, count) * sizeof(T);
+        std::memcpy(array.data() + grid.index(0, 0, z), message.data() + offset, bytes);
+        offset += bytes;
+    }
+    static void toBytes(const vector<float>& values, vector<uint8_t>& message){
+        const uint8_t* begin = reinterpret_cast<const uint8_t*>(values.data());
+        message.assign(begin, begin + values.size() * sizeof(float));
+    }
+    //count active particles in each cell of the given grid, positions are multiplied by scale first. Each thread counts into its own histogram, histograms are then summed slab by slab
+    void countParticles(const CpuGridIndexer& grid, float scale, vector<uint32_t>& counts){
+        //at most 16 histograms are used, so that detailed grid histograms don't take too much memory on machines with many cores
+        uint32_t particle_count = (uint32_t) particles.size();
+        if (particle_count == 0) return;
+        uint32_t chunk_count = std::min(m_pool.threadCount(), 16u);
+        uint32_t chunk_size = (particle_count + chunk_count - 1) / chunk_count;
+        vector<vector<uint32_t>> histograms(chunk_count);
+        m_pool.parallelFor(0, particle_count, chunk_size, [&](uint32_t begin, uint32_t end){
+            vector<uint32_t>& histogram = histograms[begin / chunk_size];
+            histogram.assign(grid.volume(), 0);
+            for (uint32_t i = begin; i < end; i++){
+                if (particles.w[i] != active_particle_w) continue;
+                int x = (int) (particles.x[i] * scale), y = (int) (particles.y[i] * scale), z = grid.localZ((int) (particles.z[i] * scale));
+                if (grid.inside(x, y, z)) histogram[grid.index(x, y, z)]++;
+            }
+        });
+        m_pool.forEachSlab(grid.d, [&](uint32_t z_begin, uint32_t z_end){
+            size_t begin = grid.index(0, 0, z_begin), end = grid.index(0, 0, z_end);
+            for (const vector<uint32_t>& histogram : histograms){
+                if (histogram.empty()) continue;
+                for (size_t i = begin; i < end; i++) counts[i] += histogram[i];
+            }
+        });
+    }
+    template<typename F>
+    void forEachParticleRange(F f){
+        uint32_t particle_count = (uint32_t) particles.size();
+        if (particle_count == 0) return;
+        uint32_t grain = (particle_count + 4 * m_pool.threadCount() - 1) / (4 * m_pool.threadCount());
+        m_pool.parallelFor(0, particle_count, grain, f);
+    }
+    //call f(row_start_index, y, z) for each row of owned layers of the grid, rows of one z-slab are processed by the same thread
+    template<typename F>
+    void forEachRow(const CpuGridIndexer& grid, F f){
+        m_pool.forEachSlab(grid.owned_end - grid.owned_begin, [&](uint32_t z_begin, uint32_t z_end){
+            for (int z = grid.owned_begin + (int) z_begin; z < grid.owned_begin + (int) z_end; z++){
+                for (int y = 0; y < grid.h; y++){
+                    f(grid.index(0, y, z), y, z);
+                }
+            }
+        });
+    }
+    template<typename F>
+    void forEachFluidRow(F f){
+        forEachRow(m_fluid, f);
+    }
+    template<typename F>
+    void forEachDetailedRow(F f){
+        forEachRow(m_detailed, f);
+    }
+};
+
+
+#endif
@@ -0,0 +1,184 @@
+#ifndef CPU_VERIFICATION_H
+#define CPU_VERIFICATION_H
+
+#include <iostream>
+#include <iomanip>
+#include <cmath>
+#include <functional>
+
+#include "cpu_simulation.h"
+#include "headless_simulation.h"
+#include "run_settings.h"
+
+
+
+//floating point values are equal when they differ by less than abs_tolerance + rel_tolerance * |value|. Velocities are sampled using hardware linear filtering on the GPU, which has limited precision
+constexpr float cpu_verification_abs_tolerance = 1e-3f;
+constexpr float cpu_verification_rel_tolerance = 1e-2f;
+//an image is considered to match when at most this fraction of its values differ (particles close to cell borders can end up in different cells)
+constexpr double cpu_verification_max_mismatch_fraction = 0.001;
+
+
+
+/**
+ * StageComparison
+ *  - Result of comparing one image written by a section on the GPU with the CPU equivalent
+ */
+struct StageComparison{
+    string stage;
+    string image;
+    size_t compared = 0;
+    size_t mismatched = 0;
+    double max_abs_difference = 0;
+    double mean_abs_difference = 0;
+
+    bool passed() const{
+        return mismatched <= cpu_verification_max_mismatch_fraction * compared;
+    }
+    void print() const{
+        std::cout << std::left << std::setw(40) << stage << std::setw(30) << image << std::right
+            << std::setw(10) << mismatched << " / " << std::setw(10) << compared
+            << std::scientific << std::setprecision(3) << "   max " << max_abs_difference << "   mean " << mean_abs_difference << std::defaultfloat
+            << (passed() ? "   OK" : "   MISMATCH") << "\n";
+    }
+};
+
+
+//compare float values, mask can be used to skip values that aren't defined on the GPU
+inline StageComparison compareFloats(const string& stage, const string& image, const vector<float>& gpu, const vector<float>& cpu, const std::function<bool(size_t)>& mask = nullptr){
+    StageComparison result{stage, image};
+    double sum = 0;
+    for (size_t i = 0; i < gpu.size(); i++){
+        if (mask && !mask(i)) continue;
+        double diff = std::abs((double) gpu[i] - cpu[i]);
+        if (!(diff <= cpu_verification_abs_tolerance + cpu_verification_rel_tolerance * std::abs(cpu[i]))) result.mismatched++;
+        result.max_abs_difference = std::max(result.max_abs_difference, diff);
+        sum += diff;
+        result.compared++;
+    }
+    result.mean_abs_difference = result.compared ? sum / result.compared : 0;
+    return result;
+}
+
+//compare unsigned integer values, they have to be exactly the same
+template<typename T>
+StageComparison compareUints(const string& stage, const string& image, const vector<uint32_t>& gpu, const vector<T>& cpu){
+    StageComparison result{stage, image};
+    double sum = 0;
+    for (size_t i = 0; i < gpu.size(); i++){
+        double diff = std::abs((double) gpu[i] - (double) cpu[i]);
+        if (diff != 0) result.mismatched++;
+        result.max_abs_difference = std::max(result.max_abs_difference, diff);
+        sum += diff;
+    }
+    result.compared = gpu.size();
+    result.mean_abs_difference = result.compared ? sum / result.compared : 0;
+    return result;
+}
+
+
+
+/**
+ * compareWithCpu
+ *  - Compares the output of each simulation section, as it is saved in GPU images after a step, with the state of the CPU simulation
+ */
+inline vector<StageComparison> compareWithCpu(const SimulationReadbackData& gpu, const CpuSimulation& cpu){
+    vector<StageComparison> results;
+    auto floats = [&](uint32_t index, uint32_t component){ return gpu.floatComponent(gpu.region(index, true), component); };
+    auto uints  = [&](uint32_t index){ return gpu.uintComponent(gpu.region(index, true), 0); };
+    const char* axis[3] = {"x", "y", "z"};
+
+    //float densities in solid cells are never written, the GPU images contain undefined values there
+    const CpuGridIndexer& fluid = cpu.fluidGrid();
+    const CpuGridIndexer& detailed = cpu.detailedGrid();
+    auto not_solid = [&](size_t i){
+        int x = (int) (i % detailed.w), y = (int) (i / detailed.w % detailed.h), z = (int) (i / detailed.w / detailed.h);
+        return cpu.cell_types[fluid.index(x / surface_render_resolution, y / surface_render_resolution, z / surface_render_resolution)] != (uint8_t) CellType::CELL_SOLID;
+    };
+
+    results.push_back(compareUints("01_update_densities", "Particle densities", uints(PARTICLE_DENSITIES_IMG), cpu.particle_densities));
+    results.push_back(compareUints("02_update_water, 03_update_air", "New cell types", uints(NEW_CELL_TYPES), cpu.new_cell_types));
+    results.push_back(compareUints("06_update_cell_types", "Cell types", uints(CELL_TYPES), cpu.cell_types));
+    for (uint32_t c = 0; c < 3; c++){
+        results.push_back(compareFloats("07_advect ... 09_diffuse", string("Velocities 2 ") + axis[c], floats(VELOCITIES_2, c), cpu.velocities_2.c[c]));
+    }
+    results.push_back(compareFloats("11_compute_divergence", "Divergences", floats(DIVERGENCES, 0), cpu.divergences));
+    results.push_back(compareFloats("12_solve_pressure", "Pressures 1", floats(PRESSURES_1, 0), cpu.pressures_1));
+    results.push_back(compareFloats("12_solve_pressure", "Pressures 2", floats(PRESSURES_2, 0), cpu.pressures_2));
+    for (uint32_t c = 0; c < 3; c++){
+        results.push_back(compareFloats("13_fix_divergence", string("Velocities 1 ") + axis[c], floats(VELOCITIES_1, c), cpu.velocities_1.c[c]));
+    }
+    const ReadbackRegion& particles = gpu.region(PARTICLES_BUF, false);
+    const vector<float>* cpu_particles[4] = {&cpu.particles.x, &cpu.particles.y, &cpu.particles.z, &cpu.particles.w};
+    for (uint32_t c = 0; c < 4; c++){
+        results.push_back(compareFloats("14_particles", string("Particles ") + "xyzw"[c], gpu.floatComponent(particles, c), *cpu_particles[c]));
+    }
+    results.push_back(compareUints("15_update_detailed_densities", "Detailed particle densities", uints(DETAILED_DENSITIES_IMG), cpu.detailed_densities));
+    results.push_back(compareUints("16_compute_detailed_densities_inertia", "Detailed densities inertias", uints(DETAILED_DENSITIES_INERTIA_IMG), cpu.detailed_densities_inertia));
+    results.push_back(compareFloats("17, 18_diffuse_float_densities", "Particle densities float 1", floats(PARTICLE_DENSITIES_FLOAT_1, 0), cpu.particle_densities_float_1, not_solid));
+    results.push_back(compareFloats("18_diffuse_float_densities", "Particle densities float 2", floats(PARTICLE_DENSITIES_FLOAT_2, 0), cpu.particle_densities_float_2, not_solid));
+    return results;
+}
+
+
+
+/**
+ * runCpuSimulation
+ *  - Runs the simulation on the CPU backend for settings.headless_steps steps and prints a timing summary. No vulkan device is required.
+ */
+inline int runCpuSimulation(const RunSettings& settings){
+    auto run_start = HeadlessClock::now();
+    WorkStealingThreadPool pool(settings.cpu_threads);
+    CpuSimulation simulation(pool);
+    simulation.initialize();
+    auto init_end = HeadlessClock::now();
+
+    std::cout << "Running on the CPU backend using " << pool.threadCount() << " threads\n";
+    HeadlessTimings timings;
+    for (uint32_t step = 0; step < settings.headless_steps; step++){
+        auto step_start = HeadlessClock::now();
+        simulation.step();
+        timings.add(elapsedMs(step_start, HeadlessClock::now()), 0);
+    }
+    timings.print(elapsedMs(run_start, init_end), elapsedMs(run_start, HeadlessClock::now()));
+    return 0;
+}
+
+
+/**
+ * runCpuVerification
+ *  - Runs settings.verify_steps steps of the simulation both on the GPU and on the CPU backend from the same initial state, then compares outputs of all sections
+ *  - The GPU always uses the Jacobi pressure solver here, since it is the one the CPU backend implements, and particles aren't sorted, so that they can be compared one by one
+ *  - Images are stored with full precision, reduced precisions are compared with full precision by runPrecisionReport
+ *  - Returns 0 if all images match, 1 otherwise
+ */
+inline int runCpuVerification(VulkanLibrary& library, const string& app_name, const RunSettings& settings){
+    RunSettings gpu_settings = settings;
+    gpu_settings.pressure_solver = PressureSolver::PRESSURE_SOLVER_JACOBI;
+    gpu_settings.particle_sort_interval = 0;
+    gpu_settings.storage_precision = StoragePrecision::STORAGE_PRECISION_FULL;
+    HeadlessDevice headless(library, app_name);
+    HeadlessSimulation gpu(headless, gpu_settings, loadWorkgroupSizes(headless.getDeviceName()), true);
+    WorkStealingThreadPool pool(settings.cpu_threads);
+    CpuSimulation cpu(pool);
+
+    gpu.initialize();
+    cpu.initialize();
+    for (uint32_t step = 0; step < settings.verify_steps; step++){
+        gpu.step();
+        cpu.step();
+    }
+    vector<StageComparison> results = compareWithCpu(gpu.readback(), cpu);
+
+    std::cout << "Comparison of GPU and CPU results after " << settings.verify_steps << " step(s):\n";
+    bool all_passed = true;
+    for (const StageComparison& r : results){
+        r.print();
+        all_passed = all_passed && r.passed();
+    }
+    std::cout << (all_passed ? "All sections match.\n" : "Some sections differ.\n");
+    return all_passed ? 0 : 1;
+}
+
+
+#endif
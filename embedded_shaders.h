@@ -0,0 +1,180 @@
+#ifndef EMBEDDED_SHADERS_H
+#define EMBEDDED_SHADERS_H
+
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <stdexcept>
+#include <algorithm>
+#include <iterator>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "mapped_file.h"
+#include "workgroup_sizes.h"
+
+
+using std::vector;
+using std::string;
+
+
+
+/**
+ * Embedded shaders
+ *  - `make shaders` compiles all shaders, then shaders_fluid/embed_shaders.py writes the SPIR-V of each one into shaders_fluid/embedded_shader_data.h as a constexpr array, which is compiled into the executable
+ *  - Shader files aren't needed next to the executable, and the executable can't be run with shaders of another version
+ *  - --shaders-from-disk loads the compiled files from shaders_fluid instead, so that shaders can be changed without rebuilding the application. It is also used when the application was built without embedded shaders
+ *  - The library only loads shaders from a directory, it can't be given code in memory, and creates pipelines without specialization info. Chosen workgroup sizes are written into the code of either kind
+ *    of shaders, which is then written into a directory named by the hash of the written code, and the context is created with it, see shaderDirectory()
+ *  - The directory is in a directory only the user can access, see privateShaderRoot(). Each file is compared with the code before it is used, only files that differ are written
+ */
+struct EmbeddedShaderFile{
+    //path of the compiled file relative to the shader directory, e.g. "07_advect/comp.spv"
+    const char* path;
+    const uint32_t* code;
+    size_t words;
+};
+
+#if __has_include("shaders_fluid/embedded_shader_data.h")
+#include "shaders_fluid/embedded_shader_data.h"
+#define FLUID_EMBEDDED_SHADERS
+#endif
+
+//all shaders compiled into the executable, empty if it was built without them
+inline vector<EmbeddedShaderFile> embeddedShaders(){
+#ifdef FLUID_EMBEDDED_SHADERS
+    return vector<EmbeddedShaderFile>(std::begin(embedded_shader_files), std::end(embedded_shader_files));
+#else
+    return {};
+#endif
+}
+
+//whether pipelines are created from embedded shaders
+inline bool usesEmbeddedShaders(bool shaders_from_disk){
+    return !shaders_from_disk && !embeddedShaders().empty();
+}
+
+
+/**
+ * ShaderFile
+ *  - Code of one compiled shader, copied from the executable or read from shaders_fluid
+ */
+struct ShaderFile{
+    //path of the compiled file relative to the shader directory, e.g. "07_advect/comp.spv"
+    string path;
+    vector<uint32_t> code;
+
+    //name of the shader directory, which sections are created with
+    string shader() const{
+        return path.substr(0, path.find('/'));
+    }
+};
+
+//all shaders pipelines are created from - embedded ones, or SPIR-V files in subdirectories of shaders_fluid, in order of their paths
+inline vector<ShaderFile> loadShaderFiles(bool shaders_from_disk){
+    vector<ShaderFile> shaders;
+    if (usesEmbeddedShaders(shaders_from_disk)){
+        for (const EmbeddedShaderFile& file : embeddedShaders()) shaders.push_back(ShaderFile{file.path, vector<uint32_t>(file.code, file.code + file.words)});
+        return shaders;
+    }
+
+    const string directory = "shaders_fluid";
+    vector<string> files;
+    std::error_code error;
+    for (const auto& entry : std::filesystem::recursive_directory_iterator(directory, error)){
+        if (entry.is_regular_file() && entry.path().extension() == ".spv") files.push_back(entry.path().lexically_relative(directory).generic_string());
+    }
+    std::sort(files.begin(), files.end());
+    for (const string& file : files){
+        MappedFile mapped;
+        if (!mapped.open(directory + "/" + file) || mapped.size() % sizeof(uint32_t) != 0) throw std::runtime_error("Could not read shader " + directory + "/" + file);
+        ShaderFile shader{file, vector<uint32_t>(mapped.size() / sizeof(uint32_t))};
+        if (mapped.size() != 0) std::memcpy(shader.code.data(), mapped.data(), mapped.size());
+        shaders.push_back(std::move(shader));
+    }
+    return shaders;
+}
+
+//FNV-1a hash of paths and code of shaders
+inline uint64_t hashShaders(const vector<ShaderFile>& shaders){
+    uint64_t hash = 14695981039346656037ull;
+    auto add = [&hash](const uint8_t* data, size_t size){
+        for (size_t i = 0; i < size; i++) hash = (hash ^ data[i]) * 1099511628211ull;
+    };
+    for (const ShaderFile& shader : shaders){
+        add(reinterpret_cast<const uint8_t*>(shader.path.c_str()), shader.path.size() + 1);
+        add(reinterpret_cast<const uint8_t*>(shader.code.data()), shader.code.size() * sizeof(uint32_t));
+    }
+    return hash;
+}
+
+
+//directory shader directories are written into, which only the user can access - XDG_RUNTIME_DIR if it is set, otherwise fluid_simulation_<user id> in the temporary directory of the system,
+//created if it doesn't exist. Throws if it isn't a directory of the user that only they can access, since other users could replace shaders in it. On Windows, the temporary directory is in the user's profile
+inline std::filesystem::path privateShaderRoot(){
+#ifdef _WIN32
+    return std::filesystem::temp_directory_path();
+#else
+    const char* runtime_directory = std::getenv("XDG_RUNTIME_DIR");
+    std::filesystem::path root = (runtime_directory && runtime_directory[0] == '/') ? std::filesystem::path(runtime_directory) :
+        std::filesystem::temp_directory_path() / ("fluid_simulation_" + std::to_string(geteuid()));
+    if (mkdir(root.c_str(), 0700) != 0 && errno != EEXIST) throw std::runtime_error("Could not create shader directory " + root.string());
+    struct stat info;
+    if (lstat(root.c_str(), &info) != 0 || !S_ISDIR(info.st_mode) || info.st_uid != geteuid() || (info.st_mode & 077) != 0){
+        throw std::runtime_error("Shader directory " + root.string() + " has to be a directory of the current user that only they can access");
+    }
+    return root;
+#endif
+}
+
+//whether a file contains exactly the code
+inline bool fileContains(const std::filesystem::path& path, const uint32_t* code, size_t words){
+    MappedFile mapped;
+    if (!mapped.open(path.string()) || mapped.size() != words * sizeof(uint32_t)) return false;
+    return words == 0 || std::memcmp(mapped.data(), code, mapped.size()) == 0;
+}
+
+//write code into a file, unless it already contains the code - it was written by an earlier run, since the directory is named by the hash of the code. Files that differ, e.g. after an interrupted run, are written again.
+//It is written into a temporary file first, which then replaces the previous one, so that a run interrupted while writing doesn't leave a partial shader behind
+inline void writeShaderFile(const std::filesystem::path& path, const uint32_t* code, size_t words){
+    std::error_code error;
+    if (fileContains(path, code, words)) return;
+    std::filesystem::create_directories(path.parent_path(), error);
+    std::filesystem::path temporary_path = path;
+    temporary_path += ".tmp";
+    {
+        std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+        file.write(reinterpret_cast<const char*>(code), words * sizeof(uint32_t));
+        if (!file) throw std::runtime_error("Could not write shader " + temporary_path.string());
+    }
+    std::filesystem::rename(temporary_path, path, error);
+    if (error) throw std::runtime_error("Could not replace shader " + path.string() + ": " + error.message());
+}
+
+//directory the fluid context is created with. Shaders, embedded or loaded from shaders_fluid, are written into fluid_simulation_shaders_<hash> in privateShaderRoot(), with workgroup sizes written into them.
+//Shaders loaded from shaders_fluid have to be copied as well, since the library can only load them from a directory
+inline string shaderDirectory(bool shaders_from_disk, const WorkgroupSizes& sizes){
+    vector<ShaderFile> shaders = loadShaderFiles(shaders_from_disk);
+    if (shaders.empty()) throw std::runtime_error("No compiled shaders were found in shaders_fluid, run make shaders first");
+    for (ShaderFile& shader : shaders) specializeWorkgroupSizes(shader.shader(), shader.code, sizes);
+
+    std::ostringstream name;
+    name << "fluid_simulation_shaders_" << std::hex << std::setw(16) << std::setfill('0') << hashShaders(shaders);
+    std::filesystem::path directory = privateShaderRoot() / name.str();
+    for (const ShaderFile& shader : shaders) writeShaderFile(directory / shader.path, shader.code.data(), shader.code.size());
+    return directory.string();
+}
+
+
+#endif
@@ -0,0 +1,193 @@
+#ifndef ENSEMBLE_H
+#define ENSEMBLE_H
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cmath>
+#include <algorithm>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "headless_simulation.h"
+#include "workgroup_sizes.h"
+#include "run_settings.h"
+
+
+using std::vector;
+using std::string;
+
+
+
+//parameters of each member, the default ones with each swept parameter interpolated between its' first and last value
+inline vector<EnsembleMemberParameters> ensembleMemberParameters(const vector<EnsembleSweep>& sweeps, uint32_t member_count){
+    vector<EnsembleMemberParameters> members(member_count);
+    for (uint32_t i = 0; i < member_count; i++){
+        float t = member_count > 1 ? (float) i / (member_count - 1) : 0.f;
+        for (const EnsembleSweep& sweep : sweeps){
+            float value = sweep.first + (sweep.last - sweep.first) * t;
+            switch (sweep.parameter){
+                case EnsembleParameter::ENSEMBLE_FOUNTAIN:  members[i].fountain_strength = value; break;
+                case EnsembleParameter::ENSEMBLE_GRAVITY:   members[i].gravity = value; break;
+                case EnsembleParameter::ENSEMBLE_DIFFUSION: members[i].diffusion_coefficient = value; break;
+            }
+        }
+    }
+    return members;
+}
+
+
+//member a cell of the atlas belongs to, returns false for padding and for tiles past the last member, which stay empty
+inline bool ensembleMemberOfCell(uint32_t x, uint32_t y, uint32_t z, uint32_t& member){
+    const Size3& stride = ensemble_member_stride;
+    if (x % stride.x >= ensemble_member_size.x || y % stride.y >= ensemble_member_size.y || z % stride.z >= ensemble_member_size.z) return false;
+    member = x / stride.x + ensemble_member_tiles.x * (y / stride.y + ensemble_member_tiles.y * (z / stride.z));
+    return member < ensemble_member_count;
+}
+
+
+
+/**
+ * EnsembleStatistics
+ *  - Summary of the state of one member after the last step, computed from the readback data of the whole atlas
+ */
+struct EnsembleStatistics{
+    uint32_t water_cells = 0;
+    uint32_t active_particles = 0;
+    //relative to the bottom of the member
+    double mean_particle_height = 0;
+    //largest length of a velocity in a cell, made of the three components stored at its' faces
+    double max_speed = 0;
+};
+
+inline vector<EnsembleStatistics> ensembleStatistics(const SimulationReadbackData& data){
+    vector<EnsembleStatistics> statistics(ensemble_member_count);
+    vector<uint32_t> cell_types = data.uintComponent(data.region(CELL_TYPES, true), 0);
+    vector<float> velocities[3];
+    for (uint32_t c = 0; c < 3; c++) velocities[c] = data.floatComponent(data.region(VELOCITIES_1, true), c);
+    uint32_t i = 0;
+    for (uint32_t z = 0; z < fluid_depth; z++){
+        for (uint32_t y = 0; y < fluid_height; y++){
+            for (uint32_t x = 0; x < fluid_width; x++, i++){
+                uint32_t member;
+                if (!ensembleMemberOfCell(x, y, z, member)) continue;
+                EnsembleStatistics& s = statistics[member];
+                s.water_cells += (cell_types[i] == (uint32_t) CellType::CELL_WATER);
+                double speed = std::sqrt((double) velocities[0][i] * velocities[0][i] + (double) velocities[1][i] * velocities[1][i] + (double) velocities[2][i] * velocities[2][i]);
+                s.max_speed = std::max(s.max_speed, speed);
+            }
+        }
+    }
+
+    //particles are kept inside their member, so the cell they are in tells which one it is
+    const ReadbackRegion& particles = data.region(PARTICLES_BUF, false);
+    vector<float> position[3], w = data.floatComponent(particles, 3);
+    for (uint32_t c = 0; c < 3; c++) position[c] = data.floatComponent(particles, c);
+    vector<double> height_sums(ensemble_member_count, 0);
+    for (size_t p = 0; p < w.size(); p++){
+        if (w[p] != active_particle_w) continue;
+        uint32_t member, y = (uint32_t) position[1][p];
+        if (!ensembleMemberOfCell((uint32_t) position[0][p], y, (uint32_t) position[2][p], member)) continue;
+        height_sums[member] += position[1][p] - (float) (y / ensemble_member_stride.y * ensemble_member_stride.y);
+        statistics[member].active_particles++;
+    }
+    for (uint32_t m = 0; m < ensemble_member_count; m++){
+        EnsembleStatistics& s = statistics[m];
+        s.mean_particle_height = s.active_particles ? height_sums[m] / s.active_particles : 0;
+    }
+    return statistics;
+}
+
+
+//write the parameters and statistics of each member as CSV, returns false if the file couldn't be written
+inline bool writeEnsembleStatistics(const string& path, const vector<EnsembleMemberParameters>& members, const vector<EnsembleStatistics>& statistics){
+    std::ofstream file(path, std::ios::trunc);
+    file << "member,fountain_force,gravity,diffusion_coefficient,water_cells,active_particles,mean_particle_height,max_speed\n" << std::fixed << std::setprecision(6);
+    for (size_t i = 0; i < members.size(); i++){
+        const EnsembleMemberParameters& m = members[i];
+        const EnsembleStatistics& s = statistics[i];
+        file << i << "," << m.fountain_strength << "," << m.gravity << "," << m.diffusion_coefficient << ","
+            << s.water_cells << "," << s.active_particles << "," << s.mean_particle_height << "," << s.max_speed << "\n";
+    }
+    return static_cast<bool>(file);
+}
+
+
+//run settings.headless_steps steps, settings.substeps in each submission, returns how long it took in milliseconds
+inline double runEnsembleSteps(HeadlessSimulation& simulation, const RunSettings& settings){
+    uint32_t substeps = std::max(settings.substeps, 1u);
+    auto start = HeadlessClock::now();
+    for (uint32_t step = 0; step < settings.headless_steps; step += substeps){
+        simulation.step(std::min(substeps, settings.headless_steps - step));
+    }
+    return elapsedMs(start, HeadlessClock::now());
+}
+
+
+
+/**
+ * runEnsemble
+ *  - Runs settings.ensemble_members simulations as one, tiled in an atlas, for settings.headless_steps steps, described in simulation_constants.h, look for 'Ensembles'
+ *  - The first member is run alone first, at the size of one member and with the same particle cube. Throughput of the ensemble in member steps per second is then compared with it -
+ *    scaling efficiency is the ensemble's throughput divided by the number of members and the throughput of a single member, it stays close to 1 until the device is saturated
+ *  - Statistics of each member are written to settings.ensemble_output_path. Simulation sizes chosen at startup are restored at the end
+ */
+inline int runEnsemble(VulkanLibrary& library, const string& app_name, const RunSettings& settings){
+    uint32_t member_count = settings.ensemble_members;
+    HeadlessDevice headless(library, app_name);
+    vector<EnsembleMemberParameters> members = ensembleMemberParameters(settings.ensemble_sweeps, member_count);
+
+    //the atlas decides how many particles each member's cube has
+    setSimulationSizes(settings.grid_size, settings.surface_resolution, settings.particle_space, member_count);
+    SimulationScene scene;
+    scene.members = members;
+    std::cout << "Running an ensemble of " << member_count << " simulations of " << settings.grid_size << "^3 cells on " << headless.getDeviceName() << ", atlas of "
+        << ensemble_member_tiles.x << "x" << ensemble_member_tiles.y << "x" << ensemble_member_tiles.z << " members, " << fluid_width << "x" << fluid_height << "x" << fluid_depth << " cells, "
+        << settings.headless_steps << " steps\n";
+
+    //one member alone, with the same particle cube
+    double single_ms;
+    {
+        setSimulationSizes(settings.grid_size, settings.surface_resolution, settings.particle_space);
+        SimulationScene single_scene = scene;
+        single_scene.members = {members[0]};
+        HeadlessSimulation single(headless, settings, loadWorkgroupSizes(headless.getDeviceName()), false, single_scene);
+        single.initialize();
+        single_ms = runEnsembleSteps(single, settings);
+        single.waitIdle();
+    }
+
+    setSimulationSizes(settings.grid_size, settings.surface_resolution, settings.particle_space, member_count);
+    auto init_start = HeadlessClock::now();
+    HeadlessSimulation ensemble(headless, settings, loadWorkgroupSizes(headless.getDeviceName()), true, scene);
+    ensemble.initialize();
+    double init_ms = elapsedMs(init_start, HeadlessClock::now());
+    double ensemble_ms = runEnsembleSteps(ensemble, settings);
+    ensemble.waitIdle();
+    vector<EnsembleStatistics> statistics = ensembleStatistics(ensemble.readback());
+    uint32_t surface_overflows = ensemble.getSurfaceOverflowCount();
+
+    double single_throughput = single_ms > 0 ? 1000.0 * settings.headless_steps / single_ms : 0;
+    double throughput = ensemble_ms > 0 ? 1000.0 * settings.headless_steps * member_count / ensemble_ms : 0;
+    std::cout << std::fixed << std::setprecision(3)
+        << "Ensemble run finished\n"
+        << "  members:               " << member_count << "\n"
+        << "  initialization:        " << init_ms << " ms\n"
+        << "  total time:            " << ensemble_ms << " ms\n"
+        << "  single member:         " << single_throughput << " steps/s\n"
+        << "  throughput:            " << throughput << " member steps/s, " << (settings.headless_steps ? throughput / settings.headless_steps : 0.0) << " simulations/s\n"
+        << "  scaling efficiency:    " << (single_throughput > 0 ? throughput / (member_count * single_throughput) : 0.0) << "\n";
+    if (surface_overflows != 0) std::cerr << "Surface mesh buffers were full after " << surface_overflows << " submissions\n";
+    setSimulationSizes(settings.grid_size, settings.surface_resolution, settings.particle_space);
+
+    if (!writeEnsembleStatistics(settings.ensemble_output_path, members, statistics)){
+        std::cerr << "Could not write ensemble statistics to " << settings.ensemble_output_path << "\n";
+        return 1;
+    }
+    std::cout << "Statistics of each member written to " << settings.ensemble_output_path << "\n";
+    return 0;
+}
+
+
+#endif
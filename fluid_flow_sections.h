@@ -1,6 +1,19 @@
+#ifndef FLUID_FLOW_SECTIONS_H
+#define FLUID_FLOW_SECTIONS_H
+
+#include <memory>
+#include <map>
+#include <set>
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+
 #include "just-a-vulkan-library/vulkan_include_all.h"
 #include "marching_cubes.h"
 #include "simulation_constants.h"
+#include "indirect_sections.h"
+#include "section_graph.h"
+#include "workgroup_sizes.h"
 
 
 
@@ -8,55 +21,147 @@
 
 //Enum of all images that are used during the simulation
 enum ImageAttachments{
-    VELOCITIES_1, VELOCITIES_2, CELL_TYPES, NEW_CELL_TYPES, PRESSURES_1, PRESSURES_2, DIVERGENCES, PARTICLE_DENSITIES_IMG, DETAILED_DENSITIES_IMG, DETAILED_DENSITIES_INERTIA_IMG, PARTICLE_DENSITIES_FLOAT_1, PARTICLE_DENSITIES_FLOAT_2, IMAGE_COUNT
+    VELOCITIES_1, VELOCITIES_2, CELL_TYPES, NEW_CELL_TYPES, PRESSURES_1, PRESSURES_2, DIVERGENCES, PARTICLE_DENSITIES_IMG, DETAILED_DENSITIES_IMG, DETAILED_DENSITIES_INERTIA_IMG, PARTICLE_DENSITIES_FLOAT_1, PARTICLE_DENSITIES_FLOAT_2,
+    PRESSURE_RHS, PRESSURE_RESIDUAL, PRESSURE_CORRECTION, PRESSURE_SEARCH, PRESSURE_PRODUCT, SURFACE_MESH_DENSITIES, IMAGE_COUNT
 };
+//images of coarser multigrid levels are placed after IMAGE_COUNT, each level has one image of each type listed here
+enum MultigridLevelImage{
+    MULTIGRID_CELL_TYPES, MULTIGRID_RHS, MULTIGRID_SOLUTION, MULTIGRID_IMAGE_COUNT
+};
+//index of a multigrid image in the descriptor context. Level 0 is the full resolution grid, it uses cell types, residuals and corrections of the pressure solver
+inline uint32_t multigridImage(uint32_t level, MultigridLevelImage image){
+    if (level == 0){
+        const uint32_t full_resolution_images[MULTIGRID_IMAGE_COUNT]{CELL_TYPES, PRESSURE_RESIDUAL, PRESSURE_CORRECTION};
+        return full_resolution_images[image];
+    }
+    return IMAGE_COUNT + (level - 1) * MULTIGRID_IMAGE_COUNT + image;
+}
 //enum of all buffers that are used during the simulation
 enum BufferAttachments{
-    PARTICLES_BUF, MARCHING_CUBES_COUNTS_BUF, MARCHING_CUBES_EDGES_BUF, SIMULATION_PARAMS_BUF, BUFFER_COUNT
+    PARTICLES_BUF, MARCHING_CUBES_COUNTS_BUF, MARCHING_CUBES_EDGES_BUF, SIMULATION_PARAMS_BUF, PRESSURE_PARTIAL_SUMS_BUF, PRESSURE_SOLVER_STATE_BUF, ACTIVE_PARTICLES_BUF, PARTICLE_COMMANDS_BUF,
+    SORTED_PARTICLES_BUF, PARTICLE_SORT_RANKS_BUF, CELL_PARTICLE_COUNTS_BUF, CELL_PARTICLE_STARTS_BUF, BRICK_COMMANDS_BUF, FLUID_BRICK_FLAGS_BUF, FLUID_BRICKS_BUF, SURFACE_BRICK_FLAGS_BUF, SURFACE_BRICKS_BUF,
+    SURFACE_BRICK_MESHES_BUF, SURFACE_MESH_COMMANDS_BUF, SURFACE_VERTICES_BUF, SURFACE_INDICES_BUF, SURFACE_REMESH_BRICKS_BUF, READBACK_BUF, BUFFER_COUNT
 };
+//particle buffers written by the step for each frame in flight are placed after BUFFER_COUNT, each frame has one buffer of each type listed here. Described in simulation_constants.h, look for 'Frames in flight'
+enum RenderFrameBuffer{
+    RENDER_PARTICLES, RENDER_PARTICLE_COMMANDS, RENDER_FRAME_BUFFER_COUNT
+};
+//frame passed to steps whose particles aren't drawn by any frame in flight
+constexpr uint32_t no_render_frame = UINT32_MAX;
+//index of a buffer of a frame in flight in the descriptor context
+inline uint32_t renderFrameBuffer(uint32_t frame, RenderFrameBuffer buffer){
+    return BUFFER_COUNT + frame * RENDER_FRAME_BUFFER_COUNT + buffer;
+}
+
 
+//features required by all simulation shaders - velocities and surface images are declared without a format, see StoragePrecision
+inline PhysicalDeviceFeatures simulationDeviceFeatures(){
+    return PhysicalDeviceFeatures().enableShaderStorageImageReadWithoutFormat().enableShaderStorageImageWriteWithoutFormat();
+}
 
 
 
+//mesh status at the end of the surface mesh commands buffer, see 'Surface mesh' in simulation_constants.h
+struct SurfaceMeshStatus{
+    uint32_t dropped_bricks;
+    uint32_t required_vertices;
+    uint32_t required_indices;
+    uint32_t unused;
+};
+static_assert(sizeof(SurfaceMeshStatus) == surface_mesh_status_size, "Surface mesh status doesn't match its' layout in shaders");
+
 
 class SimulationDescriptors{
     FlowDescriptorContext m_context;
     VkSampler m_velocities_sampler;
+    //particles and the surface mesh can be copied out of these by the frame exporter
+    Buffer m_particles_buffer;
+    Buffer m_surface_vertices_buffer;
+    //indirect dispatch and draw commands of particle sections
+    Buffer m_particle_commands_buffer;
+    //indirect dispatch commands of sections that go over active bricks
+    Buffer m_brick_commands_buffer;
+    //indexed draw command, dispatch command of surface mesh sections and index buffer of the surface mesh
+    Buffer m_surface_mesh_commands_buffer;
+    Buffer m_surface_indices_buffer;
+    Buffer m_active_particles_buffer;
+    //host visible memory of the readback buffer
+    std::unique_ptr<BufferMemoryObject> m_readback_memory;
+    //host visible copies of the surface mesh status, one for each frame in flight, or one when nothing is rendered
+    Buffer m_surface_status_buffer;
+    std::unique_ptr<BufferMemoryObject> m_surface_status_memory;
+    //particles drawn by each frame in flight, in the order given by renderFrameBuffer()
+    vector<Buffer> m_render_frame_buffers;
+    //sizes of buffers with one value per workgroup or per brick depend on them
+    WorkgroupSizes m_workgroup_sizes;
+    //device local memory taken by all images and buffers, it is all allocated here, so this is also the most the simulation ever uses
+    VkDeviceSize m_device_memory_bytes = 0;
 public:
-    SimulationDescriptors(const UniformBufferRawDataSTD140& fluid_params_uniform_buffer, LocalObjectCreator& device_local_object_creator){
+    //readback_buffer_size is the size of a host visible buffer that is used for copying simulation data to and from the CPU, it is only needed when verifying results or using checkpoints
+    //storage_precision chooses formats of velocities, float densities and densities inertia, see StoragePrecision
+    //render_frame_count is the number of frames in flight that buffers drawn by RenderSections are created for, zero when nothing is rendered
+    SimulationDescriptors(const UniformBufferRawDataSTD140& fluid_params_uniform_buffer, LocalObjectCreator& device_local_object_creator, const WorkgroupSizes& workgroup_sizes, StoragePrecision storage_precision = default_storage_precision, uint32_t readback_buffer_size = 4,
+        uint32_t render_frame_count = 0) :
+        m_workgroup_sizes(workgroup_sizes)
+    {
         /**
          * Allocating buffers and images on the GPU
          *  - All textures and buffers that will be used for computation are created here
          *  - When creating a texture, several parameters must be given
          *    - Size - width, height and depth in pixels
          *    - Format - what format does each pixel have, and how many values are stored per pixel. Used values - RGBA32F - 4 floating point values, R32F - 1 float, R8U - 8byte unsigned int
+         *      Velocities, float densities and densities inertia can use 16 or 8 bit formats instead, depending on storage precision
          *    - Usage - how the texture will be used. Used values - transfer_dst(for filling the image with a value), storage(reading/writing texture in shaders), sampled(can be sampled with linear interpolation)
+         *  - All simulation images are sampled by readback shaders when verifying results on the CPU, that is why they have the sampled usage. Pressure solver images are temporary and aren't read back
          */
-        //velocities image info - RGBA32F(A dimension not used, RGB format not supported)
-        ImageInfo velocity_image_info = ImageInfo(fluid_size, VK_FORMAT_R32G32B32A32_SFLOAT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+        StorageFormats formats = storageFormats(storage_precision);
+        //velocities image info - RGBA32F or RGBA16F(A dimension not used, RGB format not supported)
+        ImageInfo velocity_image_info = ImageInfo(fluid_size, formats.velocities, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
         ExtImage velocities_1_img = velocity_image_info.create();
         ExtImage velocities_2_img = velocity_image_info.create();
 
-        ImageInfo cell_type_image_info = ImageInfo(fluid_size, VK_FORMAT_R8_UINT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+        ImageInfo cell_type_image_info = ImageInfo(fluid_size, VK_FORMAT_R8_UINT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
         ExtImage cell_types_img = cell_type_image_info.create();
         ExtImage cell_types_new_img = cell_type_image_info.create();
 
-        ImageInfo pressures_image_info = ImageInfo(fluid_size, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+        ImageInfo pressures_image_info = ImageInfo(fluid_size, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
         ExtImage pressures_1_img = pressures_image_info.create();
         ExtImage pressures_2_img = pressures_image_info.create();
         ExtImage divergence_img = pressures_image_info.create(); //settings for divergence are the same as for pressure
 
-        ExtImage densities_image = ImageInfo(fluid_size, VK_FORMAT_R32_UINT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT).create();
+        ExtImage densities_image = ImageInfo(fluid_size, VK_FORMAT_R32_UINT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT).create();
 
-        ImageInfo detailed_densities_info(surface_render_size, VK_FORMAT_R32_UINT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
-        ExtImage detailed_densities_image = detailed_densities_info.create();
-        ExtImage detailed_densities_inertia_image = detailed_densities_info.create();
+        //detailed densities are counted with atomics, so they stay 32 bit, inertia never exceeds simulation_densities_max_inertia
+        ExtImage detailed_densities_image = ImageInfo(surface_render_size, VK_FORMAT_R32_UINT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT).create();
+        ExtImage detailed_densities_inertia_image = ImageInfo(surface_render_size, formats.densities_inertia, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT).create();
 
-        ExtImage float_densities_1_img = ImageInfo(surface_render_size, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT).create();
-        ExtImage float_densities_2_img = ImageInfo(surface_render_size, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_STORAGE_BIT).create();
+        ImageInfo float_densities_info(surface_render_size, formats.float_densities, VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT);
+        ExtImage float_densities_1_img = float_densities_info.create();
+        ExtImage float_densities_2_img = float_densities_info.create();
+        //float densities of each surface brick the last time its' mesh was extracted, it is cleared so that the first step is compared with empty space
+        ExtImage surface_mesh_densities_img = ImageInfo(surface_render_size, formats.float_densities, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT).create();
+
+        //images used by multigrid and conjugate gradient pressure solvers
+        ImageInfo solver_image_info = ImageInfo(fluid_size, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT);
+        ExtImage pressure_rhs_img = solver_image_info.create();
+        ExtImage pressure_residual_img = solver_image_info.create();
+        ExtImage pressure_correction_img = solver_image_info.create();
+        ExtImage pressure_search_img = solver_image_info.create();
+        ExtImage pressure_product_img = solver_image_info.create();
+
+        vector<ExtImage> images{velocities_1_img, velocities_2_img, cell_types_img, cell_types_new_img, pressures_1_img, pressures_2_img, divergence_img, densities_image, detailed_densities_image, detailed_densities_inertia_image,  float_densities_1_img, float_densities_2_img,
+            pressure_rhs_img, pressure_residual_img, pressure_correction_img, pressure_search_img, pressure_product_img, surface_mesh_densities_img};
+        //cell types, right hand sides and solutions of coarser multigrid levels, in the order given by multigridImage()
+        for (uint32_t level = 1; level < multigrid_level_count; level++){
+            Size3 level_size = multigridLevelSize(level);
+            images.push_back(ImageInfo(level_size, VK_FORMAT_R8_UINT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT).create());
+            images.push_back(ImageInfo(level_size, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT).create());
+            images.push_back(ImageInfo(level_size, VK_FORMAT_R32_SFLOAT, VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_STORAGE_BIT).create());
+        }
 
         //Allocate memory for all created images on the GPU
-        ImageMemoryObject memory({velocities_1_img, velocities_2_img, cell_types_img, cell_types_new_img, pressures_1_img, pressures_2_img, divergence_img, densities_image, detailed_densities_image, detailed_densities_inertia_image,  float_densities_1_img, float_densities_2_img}, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        ImageMemoryObject memory(images, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        for (const ExtImage& image : images) m_device_memory_bytes += imageMemoryBytes(image);
 
 
 
@@ -69,7 +174,7 @@ public:
          */
 
         //buffer for all particles (3 values position, 1 for determining whether particle is active or not)
-        Buffer particles_buffer = BufferInfo(particle_space_size * 4 * sizeof(float), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        m_particles_buffer = BufferInfo(particle_space_size * 4 * sizeof(float), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT).create();
 
         //buffers for marching cubes method
         MarchingCubesBuffers marching_cubes;
@@ -77,19 +182,80 @@ public:
         //create the buffer that will hold all simulation parameters
         Buffer simulation_parameters_buffer = BufferInfo(fluid_params_uniform_buffer, VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT).create();
 
+        //pressure solver reductions - two partial sums per workgroup of the fluid grid, and the solver state (residuals, conjugate gradient coefficients, whether the solve has converged)
+        Buffer pressure_partial_sums_buffer = BufferInfo(workgroup_sizes.fluidDispatchSize().volume() * 2 * sizeof(float), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        Buffer pressure_solver_state_buffer = BufferInfo(8 * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+
+        //indices of all active particles, and indirect commands for going over them
+        m_active_particles_buffer = BufferInfo(particle_space_size * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT).create();
+        m_particle_commands_buffer = BufferInfo(particle_commands_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT).create();
+
+        //buffers for sorting particles by cell - sorted copy of particles, rank of each particle within its' cell, and particle count and start of each cell
+        Buffer sorted_particles_buffer = BufferInfo(particle_space_size * 4 * sizeof(float), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        Buffer particle_sort_ranks_buffer = BufferInfo(particle_space_size * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        Buffer cell_particle_counts_buffer = BufferInfo(particle_sort_cell_count * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        Buffer cell_particle_starts_buffer = BufferInfo(particle_sort_cell_count * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+
+        //brick maps - indirect commands of fluid and surface sections, whether each brick is occupied, and the list of active bricks of both grids
+        m_brick_commands_buffer = BufferInfo(brick_commands_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT).create();
+        Size3 fluid_brick_grid_size = workgroup_sizes.fluidDispatchSize();
+        Size3 surface_brick_grid_size = workgroup_sizes.surfaceDispatchSize();
+        Buffer fluid_brick_flags_buffer = BufferInfo(fluid_brick_grid_size.volume() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        Buffer fluid_bricks_buffer = BufferInfo(fluid_brick_grid_size.volume() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        Buffer surface_brick_flags_buffer = BufferInfo(surface_brick_grid_size.volume() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        Buffer surface_bricks_buffer = BufferInfo(surface_brick_grid_size.volume() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+
+        //surface mesh - mesh record of each surface brick, draw command and mesh state, the mesh itself, and the list of bricks extracted in the current step. Layout is described in simulation_constants.h, look for 'Surface mesh'
+        Buffer surface_brick_meshes_buffer = BufferInfo(surface_brick_grid_size.volume() * surface_brick_mesh_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+        m_surface_mesh_commands_buffer = BufferInfo(surface_mesh_commands_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT).create();
+        m_surface_vertices_buffer = BufferInfo(surface_mesh_max_vertices * surface_mesh_vertex_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT).create();
+        m_surface_indices_buffer = BufferInfo(surface_mesh_max_indices * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT).create();
+        Buffer surface_remesh_bricks_buffer = BufferInfo(surface_brick_grid_size.volume() * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+
+        //buffer that simulation data is copied into when it needs to be read on the CPU
+        Buffer readback_buffer = BufferInfo(readback_buffer_size, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create();
+
         //allocate GPU memory for all buffers
-        BufferMemoryObject buffer_memory({particles_buffer, marching_cubes.triangle_count_buffer, marching_cubes.vertex_edge_indices_buffer, simulation_parameters_buffer}, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        BufferMemoryObject buffer_memory({m_particles_buffer, marching_cubes.triangle_count_buffer, marching_cubes.vertex_edge_indices_buffer, simulation_parameters_buffer, pressure_partial_sums_buffer, pressure_solver_state_buffer, m_active_particles_buffer, m_particle_commands_buffer,
+            sorted_particles_buffer, particle_sort_ranks_buffer, cell_particle_counts_buffer, cell_particle_starts_buffer, m_brick_commands_buffer, fluid_brick_flags_buffer, fluid_bricks_buffer, surface_brick_flags_buffer, surface_bricks_buffer,
+            surface_brick_meshes_buffer, m_surface_mesh_commands_buffer, m_surface_vertices_buffer, m_surface_indices_buffer, surface_remesh_bricks_buffer},
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        for (const Buffer& buffer : {m_particles_buffer, marching_cubes.triangle_count_buffer, marching_cubes.vertex_edge_indices_buffer, simulation_parameters_buffer, pressure_partial_sums_buffer, pressure_solver_state_buffer, m_active_particles_buffer, m_particle_commands_buffer,
+            sorted_particles_buffer, particle_sort_ranks_buffer, cell_particle_counts_buffer, cell_particle_starts_buffer, m_brick_commands_buffer, fluid_brick_flags_buffer, fluid_bricks_buffer, surface_brick_flags_buffer, surface_bricks_buffer,
+            surface_brick_meshes_buffer, m_surface_mesh_commands_buffer, m_surface_vertices_buffer, m_surface_indices_buffer, surface_remesh_bricks_buffer}){
+            m_device_memory_bytes += bufferMemoryBytes(buffer);
+        }
+        //readback buffer has to be visible from the CPU
+        m_readback_memory = std::make_unique<BufferMemoryObject>(vector<Buffer>{readback_buffer}, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        //so does the surface mesh status, it is only written by copies and isn't tracked by the descriptor context
+        m_surface_status_buffer = BufferInfo(std::max(render_frame_count, 1u) * surface_mesh_status_size, VK_BUFFER_USAGE_TRANSFER_DST_BIT).create();
+        m_surface_status_memory = std::make_unique<BufferMemoryObject>(vector<Buffer>{m_surface_status_buffer}, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+        std::memset(m_surface_status_memory->map(), 0, std::max(render_frame_count, 1u) * surface_mesh_status_size);
+        m_surface_status_memory->unmap();
+
+        //the last substep of each frame writes positions of active particles and their draw command into buffers of its' frame in flight, the next step writes the ones of another frame while this one is rendered
+        //draw commands are cleared at initialization, so that frames drawn before any step draw nothing
+        for (uint32_t frame = 0; frame < render_frame_count; frame++){
+            m_render_frame_buffers.push_back(BufferInfo(particle_space_size * 4 * sizeof(float), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT).create());
+            m_render_frame_buffers.push_back(BufferInfo(4 * sizeof(uint32_t), VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT).create());
+        }
+        if (render_frame_count != 0){
+            BufferMemoryObject render_frame_memory(m_render_frame_buffers, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        }
+        for (const Buffer& buffer : m_render_frame_buffers) m_device_memory_bytes += bufferMemoryBytes(buffer);
 
         //load marching cubes buffer data from files and copy them to the GPU
         marching_cubes.loadData(device_local_object_creator);
         //copy fluid parameters buffer to the GPU
         device_local_object_creator.copyToLocal(fluid_params_uniform_buffer, simulation_parameters_buffer);
 
+        //all buffers in the order given by BufferAttachments, followed by the ones of each frame in flight
+        vector<Buffer> buffers{m_particles_buffer, marching_cubes.triangle_count_buffer, marching_cubes.vertex_edge_indices_buffer, simulation_parameters_buffer, pressure_partial_sums_buffer, pressure_solver_state_buffer, m_active_particles_buffer, m_particle_commands_buffer,
+            sorted_particles_buffer, particle_sort_ranks_buffer, cell_particle_counts_buffer, cell_particle_starts_buffer, m_brick_commands_buffer, fluid_brick_flags_buffer, fluid_bricks_buffer, surface_brick_flags_buffer, surface_bricks_buffer,
+            surface_brick_meshes_buffer, m_surface_mesh_commands_buffer, m_surface_vertices_buffer, m_surface_indices_buffer, surface_remesh_bricks_buffer, readback_buffer};
+        buffers.insert(buffers.end(), m_render_frame_buffers.begin(), m_render_frame_buffers.end());
         //Holds all images and buffers, and the states they are currently in
-        m_context = FlowDescriptorContext{
-            {velocities_1_img, velocities_2_img, cell_types_img, cell_types_new_img, pressures_1_img, pressures_2_img, divergence_img, densities_image, detailed_densities_image, detailed_densities_inertia_image,  float_densities_1_img, float_densities_2_img},
-            {particles_buffer, marching_cubes.triangle_count_buffer, marching_cubes.vertex_edge_indices_buffer, simulation_parameters_buffer},
-        };
+        m_context = FlowDescriptorContext{images, buffers};
 
         //sampler used for getting velocity texture values. Includes linear interpolation, coordinates from 0 to texture size, and clamping values to edge
         m_velocities_sampler = SamplerInfo().setFilters(VK_FILTER_LINEAR, VK_FILTER_LINEAR).setWrapMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE).create();
@@ -100,6 +266,76 @@ public:
     VkSampler getVelocitiesSampler(){
         return m_velocities_sampler;
     }
+    VkBuffer getParticleCommandsBuffer(){
+        return m_particle_commands_buffer;
+    }
+    VkBuffer getBrickCommandsBuffer(){
+        return m_brick_commands_buffer;
+    }
+    VkBuffer getSurfaceMeshCommandsBuffer(){
+        return m_surface_mesh_commands_buffer;
+    }
+    VkBuffer getSurfaceIndicesBuffer(){
+        return m_surface_indices_buffer;
+    }
+    VkBuffer getParticlesBuffer(){
+        return m_particles_buffer;
+    }
+    VkBuffer getSurfaceVerticesBuffer(){
+        return m_surface_vertices_buffer;
+    }
+    VkBuffer getActiveParticlesBuffer(){
+        return m_active_particles_buffer;
+    }
+    VkBuffer getSurfaceStatusBuffer(){
+        return m_surface_status_buffer;
+    }
+    //surface mesh status last copied into the given slot by recordSurfaceStatusCopy(). The copy must be finished
+    SurfaceMeshStatus readSurfaceStatus(uint32_t slot){
+        SurfaceMeshStatus status;
+        const char* data = (const char*) m_surface_status_memory->map();
+        std::memcpy(&status, data + slot * surface_mesh_status_size, sizeof(status));
+        m_surface_status_memory->unmap();
+        return status;
+    }
+    //one buffer drawn by a frame in flight, see renderFrameBuffer()
+    VkBuffer getRenderFrameBuffer(uint32_t frame, RenderFrameBuffer buffer){
+        return m_render_frame_buffers[frame * RENDER_FRAME_BUFFER_COUNT + buffer];
+    }
+    //number of frames in flight that buffers were created for, zero when nothing is rendered
+    uint32_t getRenderFrameCount() const{
+        return static_cast<uint32_t>(m_render_frame_buffers.size()) / RENDER_FRAME_BUFFER_COUNT;
+    }
+    const WorkgroupSizes& getWorkgroupSizes(){
+        return m_workgroup_sizes;
+    }
+    //bytes of device local memory taken by all simulation images and buffers, without alignment between them and without the host visible readback buffer
+    VkDeviceSize getDeviceMemoryBytes() const{
+        return m_device_memory_bytes;
+    }
+    //copy contents of the readback buffer to CPU memory. All GPU work writing into it must be finished before calling this
+    void readReadbackBuffer(void* target, size_t size_bytes){
+        void* data = m_readback_memory->map();
+        std::memcpy(target, data, size_bytes);
+        m_readback_memory->unmap();
+    }
+    //copy data from CPU memory into the readback buffer, so that shaders can read it. GPU work using the buffer must be finished before calling this
+    void writeReadbackBuffer(const void* source, size_t size_bytes){
+        void* data = m_readback_memory->map();
+        std::memcpy(data, source, size_bytes);
+        m_readback_memory->unmap();
+    }
+private:
+    static VkDeviceSize imageMemoryBytes(VkImage image){
+        VkMemoryRequirements requirements;
+        vkGetImageMemoryRequirements(g_device, image, &requirements);
+        return requirements.size;
+    }
+    static VkDeviceSize bufferMemoryBytes(VkBuffer buffer){
+        VkMemoryRequirements requirements;
+        vkGetBufferMemoryRequirements(g_device, buffer, &requirements);
+        return requirements.size;
+    }
 };
 
 
@@ -117,6 +353,9 @@ public:
  *    - FlowComputeSection - Runs a single compute shader. Parameters - shader context, shader directory name, DESCRIPTORS_USED, global dispatch size
  *    - FlowGraphicsSection - Runs a single graphics pipeline, possibly with multiple shaders. Parameters - shader context, shader dir name, DESCRIPTORS_USED, vertex count, graphics pipeline info, render_pass
  *    - FlowComputePushConstantSection & FlowGraphicsPushConstantSection - These are normal Compute/Graphics sections with added support for push constants in shaders
+ *    - IndirectComputeSection, IndirectLoopComputeSection & IndirectGraphicsSection - Sections that read their dispatch / draw size from a buffer on the GPU, described in indirect_sections.h. Parameters - commands buffer, offset in it, then the same as for the wrapped section, without the size
+ *  - Groups of sections whose order doesn't matter everywhere are run by a FlowSectionGraph, described in section_graph.h. Its' sections are GraphComputeSections and GraphClearSections,
+ *    compute sections list descriptors as SectionUsages - storageImage() and storageBuffer() create both the descriptor usage and the access the graph orders sections by
  * - DESCRIPTORS_USED
  *    - This parameter describes all descriptors used by the section. This includes descriptor context and list of images/buffers:
  *       - Each descriptor contains: name in shaders, index in descriptor context, usage(in which shader stages the descriptor is used), and state, in which the image/buffer should be during this section
@@ -129,309 +368,1430 @@ public:
 //descriptors created with this stage will be used only during compute shader
 const VkPipelineStageFlags usage_compute(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
 //simulation params buffer is used many times with the same parameters, create a variable for it
-const FlowUniformBuffer simulation_parameters_buffer_compute_usage{"simulation_params_buffer", SIMULATION_PARAMS_BUF, usage_compute, BufferState{BUFFER_UNIFORM}};
+const SectionUsage simulation_parameters_buffer_compute_usage = uniformBuffer("simulation_params_buffer", SIMULATION_PARAMS_BUF);
+
+
+//particle sections go over the list of active particles, the number of active particles is read from the commands buffer
+const SectionUsage active_particles_compute_usage = storageBuffer("active_particles", ACTIVE_PARTICLES_BUF, BUFFER_STORAGE_R);
+const SectionUsage particle_commands_compute_usage = storageBuffer("particle_commands", PARTICLE_COMMANDS_BUF, BUFFER_STORAGE_R);
+//fluid and surface sections go over the list of active bricks of their grid, the number of active bricks is read from the brick commands buffer
+const SectionUsage fluid_bricks_compute_usage = storageBuffer("active_bricks", FLUID_BRICKS_BUF, BUFFER_STORAGE_R);
+const SectionUsage surface_bricks_compute_usage = storageBuffer("active_bricks", SURFACE_BRICKS_BUF, BUFFER_STORAGE_R);
 
 
 /**** DESCRIPTIONS OF ALL SECTIONS AND THEIR PURPOSE IN THE SIMULATION IS DESCRIBED IN README.md ****/
-class SimulationInitializationSections : public FlowSectionList{
+/**
+ * SimulationInitializationSections
+ *  - Creates the initial particle cube and clears images, then compacts indices of active particles and writes indirect commands used by particle sections
+ *  - Clears and the first two sections are independent, they are run as one level of a FlowSectionGraph, only compaction waits for them
+ */
+class SimulationInitializationSections{
+    GraphClearSection m_clear_velocities;
+    GraphClearSection m_clear_velocities_2;
+    GraphClearSection m_clear_cell_types;
+    GraphClearSection m_clear_new_cell_types;
+    GraphClearSection m_clear_densities_inertia;
+    GraphClearSection m_clear_pressures;
+    GraphClearSection m_clear_surface_mesh_densities;
+    GraphComputeSection<FlowComputeSection> m_init_particles;
+    GraphComputeSection<FlowComputeSection> m_reset_active_particles;
+    GraphComputeSection<FlowComputeSection> m_compact_particles;
+    FlowSectionGraph m_graph;
 public:
-    SimulationInitializationSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context) :
-        FlowSectionList{flow_context,
-            new FlowClearColorSection(flow_context, VELOCITIES_1, ClearValue(0.f, 0.f, 0.f, 0.f)),
-            new FlowClearColorSection(flow_context,   CELL_TYPES, ClearValue((uint32_t) CellType::CELL_INACTIVE)),
-            new FlowClearColorSection(flow_context,  DETAILED_DENSITIES_INERTIA_IMG, ClearValue(0)),
-            new FlowComputeSection(
-                fluid_context, "00_init_particles",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageBuffer{"particles", PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_W}},
-                    }
-                },
-                particle_dispatch_size
-            )
-        }
+    SimulationInitializationSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes) :
+        m_clear_velocities(flow_context, VELOCITIES_1, ClearValue(0.f, 0.f, 0.f, 0.f)),
+        //padding between ensemble members is never written, images that are read there start cleared too, see 'Ensembles'
+        m_clear_velocities_2(flow_context, VELOCITIES_2, ClearValue(0.f, 0.f, 0.f, 0.f)),
+        m_clear_cell_types(flow_context,   CELL_TYPES, ClearValue((uint32_t) CellType::CELL_INACTIVE)),
+        m_clear_new_cell_types(flow_context, NEW_CELL_TYPES, ClearValue((uint32_t) CellType::CELL_INACTIVE)),
+        m_clear_densities_inertia(flow_context,  DETAILED_DENSITIES_INERTIA_IMG, ClearValue(0)),
+        //pressures are kept between steps and used as the initial guess, start with air pressure everywhere
+        m_clear_pressures(flow_context, PRESSURES_2, ClearValue(simulation_air_pressure)),
+        //surface meshes are extracted when densities differ from these, start with empty space everywhere
+        m_clear_surface_mesh_densities(flow_context, SURFACE_MESH_DENSITIES, ClearValue(-1.f)),
+        m_init_particles(
+            fluid_context, "00_init_particles", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_W),
+            },
+            workgroup_sizes.particleDispatchSize()
+        ),
+        m_reset_active_particles(
+            fluid_context, "00a_reset_active_particles", flow_context,
+            SectionUsages{
+                storageBuffer("particle_commands", PARTICLE_COMMANDS_BUF, BUFFER_STORAGE_W)
+            },
+            Size3{1, 1, 1}
+        ),
+        m_compact_particles(
+            fluid_context, "00b_compact_particles", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_R),
+                storageBuffer("active_particles", ACTIVE_PARTICLES_BUF, BUFFER_STORAGE_W),
+                storageBuffer("particle_commands", PARTICLE_COMMANDS_BUF, BUFFER_STORAGE_RW)
+            },
+            workgroup_sizes.particleDispatchSize()
+        ),
+        m_graph("initialization")
+    {
+        m_graph.add("clear_velocities", m_clear_velocities);
+        m_graph.add("clear_velocities_2", m_clear_velocities_2);
+        m_graph.add("clear_cell_types", m_clear_cell_types);
+        m_graph.add("clear_new_cell_types", m_clear_new_cell_types);
+        m_graph.add("clear_densities_inertia", m_clear_densities_inertia);
+        m_graph.add("clear_pressures", m_clear_pressures);
+        m_graph.add("clear_surface_mesh_densities", m_clear_surface_mesh_densities);
+        m_graph.add("00_init_particles", m_init_particles);
+        m_graph.add("00a_reset_active_particles", m_reset_active_particles);
+        m_graph.add("00b_compact_particles", m_compact_particles);
+    }
+    void complete(){
+        m_clear_velocities.complete();
+        m_clear_velocities_2.complete();
+        m_clear_cell_types.complete();
+        m_clear_new_cell_types.complete();
+        m_clear_densities_inertia.complete();
+        m_clear_pressures.complete();
+        m_clear_surface_mesh_densities.complete();
+        m_init_particles.complete();
+        m_reset_active_particles.complete();
+        m_compact_particles.complete();
+    }
+    //particles never become active or inactive during a step, so compaction done here stays valid for the whole simulation. The barrier after the graph makes the commands visible to indirect dispatches
+    GraphBarriers run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        return m_graph.run(command_buffer, flow_context);
+    }
+    FlowSectionGraph& getGraph(){
+        return m_graph;
+    }
+};
+
+
+/**
+ * BrickMapSections
+ *  - Builds the list of active bricks of one grid, and the indirect command that dispatches sections of that grid over it. Described in simulation_constants.h, look for 'Sparse bricks'
+ *  - The mark section is different for each grid, it writes whether each brick is occupied and resets the command. 01d_build_brick_list then appends all active bricks to the list
+ */
+class BrickMapSections{
+    GraphComputeSection<FlowComputeSection> m_mark;
+    GraphComputeSection<FlowComputePushConstantSection> m_build;
+    //both sections are timed together under the name of the mark section
+    string m_name;
+public:
+    //mark_usages have to include the flags buffer and the brick commands buffer
+    BrickMapSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const string& mark_shader, const SectionUsages& mark_usages,
+        Size3 brick_grid_size, uint32_t flags_buffer, uint32_t bricks_buffer, uint32_t command_offset) :
+        m_mark(fluid_context, mark_shader, flow_context, mark_usages, brick_grid_size),
+        m_build(
+            fluid_context, "01d_build_brick_list", flow_context,
+            SectionUsages{
+                storageBuffer("brick_flags",    flags_buffer,       BUFFER_STORAGE_R),
+                storageBuffer("active_bricks",  bricks_buffer,      BUFFER_STORAGE_W),
+                storageBuffer("brick_commands", BRICK_COMMANDS_BUF, BUFFER_STORAGE_RW)
+            },
+            brickListDispatchSize(brick_grid_size)
+        ),
+        m_name(mark_shader)
+    {
+        uint32_t command_index = command_offset / sizeof(uint32_t);
+        m_build.getPushConstantData().write("grid_width", &brick_grid_size.x, 1);
+        m_build.getPushConstantData().write("grid_height", &brick_grid_size.y, 1);
+        m_build.getPushConstantData().write("grid_depth", &brick_grid_size.z, 1);
+        m_build.getPushConstantData().write("command_index", &command_index, 1);
+    }
+    void complete(){
+        m_mark.complete();
+        m_build.complete();
+    }
+    //if all_active is true, all bricks are added to the list, whether they are occupied or not
+    void run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context, bool all_active){
+        GpuProfileScope profile(command_buffer, m_name.c_str());
+        //the command is reset by the mark section, dispatches recorded during the previous step have to read it first
+        recordIndirectCommandsOverwriteBarrier(command_buffer);
+        m_mark.run(command_buffer, flow_context);
+        uint32_t all_active_value = all_active ? 1 : 0;
+        m_build.getPushConstantData().write("all_active", &all_active_value, 1);
+        m_build.run(command_buffer, flow_context);
+        recordIndirectCommandsBarrier(command_buffer);
+    }
+    //everything both sections use, for the node of a FlowSectionGraph that runs them
+    vector<SectionAccess> getAccesses() const{
+        vector<SectionAccess> accesses = m_mark.getAccesses();
+        appendAccesses(accesses, m_build.getAccesses());
+        return accesses;
+    }
+    const string& getName() const{
+        return m_name;
+    }
+};
+
+
+//shader directories of sections that count particles in each cell, for the given binning method
+inline string updateDensitiesShader(ParticleBinning binning){
+    return (binning == ParticleBinning::PARTICLE_BINNING_SHARED) ? "01b_update_densities_binned" : "01_update_densities";
+}
+inline string updateDetailedDensitiesShader(ParticleBinning binning){
+    return (binning == ParticleBinning::PARTICLE_BINNING_SHARED) ? "15b_update_detailed_densities_binned" : "15_update_detailed_densities";
+}
+
+
+/**
+ * ParticleSortSections
+ *  - Sorts active particles by the Morton code of their cell, described in simulation_constants.h. Passes that go over particles are dispatched indirectly
+ *  - After sorting, active particles occupy the start of the particle buffer in sorted order, and the active particle list is 0, 1, 2, ...
+ *  - Passes depend on each other, all of them are one opaque node of the step's graph
+ */
+class ParticleSortSections{
+    //everything the passes use, for the node that runs them
+    vector<SectionAccess> m_accesses;
+    FlowComputeSection m_clear_cells;
+    IndirectComputeSection<> m_count;
+    FlowComputeSection m_scan;
+    IndirectComputeSection<> m_scatter;
+    IndirectComputeSection<> m_copy;
+public:
+    ParticleSortSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, VkBuffer particle_commands_buffer) :
+        m_clear_cells(
+            fluid_context, "00c_sort_clear_cells",
+            trackedDescriptors(flow_context, SectionUsages{
+                storageBuffer("cell_particle_counts", CELL_PARTICLE_COUNTS_BUF, BUFFER_STORAGE_W)
+            }, m_accesses),
+            particle_sort_cells_dispatch_size
+        ),
+        m_count(
+            particle_commands_buffer, particle_dispatch_command_offset,
+            fluid_context, "00d_sort_count_particles",
+            trackedDescriptors(flow_context, SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_R),
+                active_particles_compute_usage,
+                particle_commands_compute_usage,
+                storageBuffer("cell_particle_counts", CELL_PARTICLE_COUNTS_BUF, BUFFER_STORAGE_RW),
+                storageBuffer("particle_sort_ranks", PARTICLE_SORT_RANKS_BUF, BUFFER_STORAGE_W)
+            }, m_accesses)
+        ),
+        m_scan(
+            fluid_context, "00e_sort_scan_cells",
+            trackedDescriptors(flow_context, SectionUsages{
+                storageBuffer("cell_particle_counts", CELL_PARTICLE_COUNTS_BUF, BUFFER_STORAGE_R),
+                storageBuffer("cell_particle_starts", CELL_PARTICLE_STARTS_BUF, BUFFER_STORAGE_W)
+            }, m_accesses),
+            Size3{1, 1, 1}
+        ),
+        m_scatter(
+            particle_commands_buffer, particle_dispatch_command_offset,
+            fluid_context, "00f_sort_scatter_particles",
+            trackedDescriptors(flow_context, SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_R),
+                active_particles_compute_usage,
+                particle_commands_compute_usage,
+                storageBuffer("cell_particle_starts", CELL_PARTICLE_STARTS_BUF, BUFFER_STORAGE_R),
+                storageBuffer("particle_sort_ranks", PARTICLE_SORT_RANKS_BUF, BUFFER_STORAGE_R),
+                storageBuffer("sorted_particles", SORTED_PARTICLES_BUF, BUFFER_STORAGE_W)
+            }, m_accesses)
+        ),
+        m_copy(
+            particle_commands_buffer, particle_dispatch_command_offset,
+            fluid_context, "00g_sort_copy_particles",
+            trackedDescriptors(flow_context, SectionUsages{
+                storageBuffer("sorted_particles", SORTED_PARTICLES_BUF, BUFFER_STORAGE_R),
+                storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_W),
+                storageBuffer("active_particles", ACTIVE_PARTICLES_BUF, BUFFER_STORAGE_RW),
+                particle_commands_compute_usage
+            }, m_accesses)
+        )
     {}
+    void complete(){
+        m_clear_cells.complete();
+        m_count.complete();
+        m_scan.complete();
+        m_scatter.complete();
+        m_copy.complete();
+    }
+    void run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        {
+            GpuProfileScope profile(command_buffer, "00c_sort_clear_cells");
+            m_clear_cells.run(command_buffer, flow_context);
+        }
+        m_count.run(command_buffer, flow_context);
+        {
+            GpuProfileScope profile(command_buffer, "00e_sort_scan_cells");
+            m_scan.run(command_buffer, flow_context);
+        }
+        m_scatter.run(command_buffer, flow_context);
+        m_copy.run(command_buffer, flow_context);
+    }
+    const vector<SectionAccess>& getAccesses() const{
+        return m_accesses;
+    }
 };
 
 
-class SimulationStepSections : public FlowSectionList{
+/**
+ * SimulationVelocitySections
+ *  - First part of the simulation step, 01 - 11. Updates cell types, moves velocities and computes their divergence
+ *  - 01_update_densities is dispatched indirectly over active particles. Binning selects whether 01_update_densities or 01b_update_densities_binned is used
+ *  - Then the brick map of the fluid grid is built, 02 - 11 are dispatched indirectly over active bricks
+ *  - Kernel fusion selects whether chains of 02 - 10 run as fused sections or one section per shader, described in simulation_constants.h
+ *  - Sections are nodes of the step's graph, added by addTo(). The brick map is an opaque node
+ */
+class SimulationVelocitySections{
+    using Section = GraphComputeSection<FlowComputeSection>;
+    Section m_update_densities;
+    string m_update_densities_name;
+    BrickMapSections m_fluid_bricks;
+    //02 - 11 with the shader directory of each
+    vector<std::pair<string, std::unique_ptr<Section>>> m_velocities;
+    bool m_all_bricks_active = true;
 public:
-    SimulationStepSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, VkSampler velocities_sampler) :
-        FlowSectionList{flow_context,
-            new FlowClearColorSection(flow_context, PARTICLE_DENSITIES_IMG, ClearValue((uint32_t) 0)),
-            new FlowComputeSection(
-                fluid_context, "01_update_densities",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageBuffer{"particles", PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_R}},
-                        FlowStorageImage{"particle_densities", PARTICLE_DENSITIES_IMG, usage_compute, ImageState{IMAGE_STORAGE_RW}}
-                    }
-                },
-                particle_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "02_update_water",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"particle_densities", PARTICLE_DENSITIES_IMG, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"cell_types", NEW_CELL_TYPES, usage_compute, ImageState{IMAGE_STORAGE_W}},
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "03_update_air",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types", NEW_CELL_TYPES, usage_compute, ImageState{IMAGE_STORAGE_RW}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "04_compute_extrapolated_velocities",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types", CELL_TYPES, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"velocities", VELOCITIES_1, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"extrapolated_velocities", VELOCITIES_2, usage_compute, ImageState{IMAGE_STORAGE_W}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "05_set_extrapolated_velocities",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"new_cell_types", NEW_CELL_TYPES, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"cell_types", CELL_TYPES, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"velocities", VELOCITIES_1, usage_compute, ImageState{IMAGE_STORAGE_W}},
-                        FlowStorageImage{"extrapolated_velocitites", VELOCITIES_2, usage_compute, ImageState{IMAGE_STORAGE_R}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "06_update_cell_types",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        FlowStorageImage{"new_cell_types", NEW_CELL_TYPES, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"cell_types", CELL_TYPES, usage_compute, ImageState{IMAGE_STORAGE_W}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "07_advect",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types",      CELL_TYPES,   usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowCombinedImage{"velocities_src", VELOCITIES_1, usage_compute, ImageState{IMAGE_SAMPLER}, velocities_sampler},
-                        FlowStorageImage{"velocities_dst",  VELOCITIES_2, usage_compute, ImageState{IMAGE_STORAGE_W}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "08_forces",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types", CELL_TYPES,   usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"velocities", VELOCITIES_2, usage_compute, ImageState{IMAGE_STORAGE_RW}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "09_diffuse",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types",     CELL_TYPES,   usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"velocities_src", VELOCITIES_2, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"velocities_dst", VELOCITIES_1, usage_compute, ImageState{IMAGE_STORAGE_W}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "10_solids",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types", CELL_TYPES,   usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"velocities", VELOCITIES_1, usage_compute, ImageState{IMAGE_STORAGE_R}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "11_compute_divergence",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        FlowStorageImage{"velocities", VELOCITIES_1, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"divergences",DIVERGENCES,  usage_compute, ImageState{IMAGE_STORAGE_W}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowClearColorSection(flow_context, PRESSURES_1, ClearValue(simulation_air_pressure)),
-            new FlowClearColorSection(flow_context, PRESSURES_2, ClearValue(simulation_air_pressure)),
-            new FlowLoopPushConstantSection<FlowComputePushConstantSection>(divergence_solve_iterations, flow_context,
-                fluid_context, "12_solve_pressure",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types", CELL_TYPES,  usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"divergences", DIVERGENCES, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"pressures_1", PRESSURES_1, usage_compute, ImageState{IMAGE_STORAGE_RW}},
-                        FlowStorageImage{"pressures_2", PRESSURES_2, usage_compute, ImageState{IMAGE_STORAGE_RW}}
-                    }
-                },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "13_fix_divergence",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types", CELL_TYPES,   usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"pressures", PRESSURES_2,  usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"velocities", VELOCITIES_1, usage_compute, ImageState{IMAGE_STORAGE_RW}}
-                    }
+    SimulationVelocitySections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes, VkSampler velocities_sampler, VkBuffer particle_commands_buffer, VkBuffer brick_commands_buffer,
+        ParticleBinning binning, KernelFusion kernel_fusion) :
+        m_update_densities(
+            particle_commands_buffer, particle_dispatch_command_offset,
+            fluid_context, updateDensitiesShader(binning), flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_R),
+                active_particles_compute_usage,
+                particle_commands_compute_usage,
+                storageImage("particle_densities", PARTICLE_DENSITIES_IMG, IMAGE_STORAGE_RW)
+            }
+        ),
+        m_update_densities_name(updateDensitiesShader(binning)),
+        m_fluid_bricks(
+            fluid_context, flow_context, "01c_mark_fluid_bricks",
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("particle_densities", PARTICLE_DENSITIES_IMG, IMAGE_STORAGE_R),
+                storageImage("cell_types",         CELL_TYPES,             IMAGE_STORAGE_R),
+                storageBuffer("brick_flags",       FLUID_BRICK_FLAGS_BUF,  BUFFER_STORAGE_W),
+                storageBuffer("brick_commands",    BRICK_COMMANDS_BUF,     BUFFER_STORAGE_W)
+            },
+            workgroup_sizes.fluidDispatchSize(), FLUID_BRICK_FLAGS_BUF, FLUID_BRICKS_BUF, fluid_brick_command_offset
+        )
+    {
+        auto add = [&](const string& shader_dir, const SectionUsages& usages){
+            m_velocities.emplace_back(shader_dir, std::make_unique<Section>(brick_commands_buffer, fluid_brick_command_offset, fluid_context, shader_dir, flow_context, usages));
+        };
+        //02 and 03, fused or separate
+        if (kernel_fusion == KernelFusion::KERNELS_FUSED){
+            add("02b_update_cell_types_fused", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("particle_densities", PARTICLE_DENSITIES_IMG, IMAGE_STORAGE_R),
+                storageImage("cell_types", NEW_CELL_TYPES, IMAGE_STORAGE_W),
+                fluid_bricks_compute_usage
+            });
+        }else{
+            add("02_update_water", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("particle_densities", PARTICLE_DENSITIES_IMG, IMAGE_STORAGE_R),
+                storageImage("cell_types", NEW_CELL_TYPES, IMAGE_STORAGE_W),
+                fluid_bricks_compute_usage
+            });
+            add("03_update_air", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types", NEW_CELL_TYPES, IMAGE_STORAGE_RW),
+                fluid_bricks_compute_usage
+            });
+        }
+        add("04_compute_extrapolated_velocities", SectionUsages{
+            simulation_parameters_buffer_compute_usage,
+            storageImage("cell_types", CELL_TYPES, IMAGE_STORAGE_R),
+            storageImage("velocities", VELOCITIES_1, IMAGE_STORAGE_R),
+            storageImage("extrapolated_velocities", VELOCITIES_2, IMAGE_STORAGE_W),
+            fluid_bricks_compute_usage
+        });
+        add("05_set_extrapolated_velocities", SectionUsages{
+            simulation_parameters_buffer_compute_usage,
+            storageImage("new_cell_types", NEW_CELL_TYPES, IMAGE_STORAGE_R),
+            storageImage("cell_types", CELL_TYPES, IMAGE_STORAGE_R),
+            storageImage("velocities", VELOCITIES_1, IMAGE_STORAGE_W),
+            storageImage("extrapolated_velocitites", VELOCITIES_2, IMAGE_STORAGE_R),
+            fluid_bricks_compute_usage
+        });
+        //06 to 10, fused or separate
+        if (kernel_fusion == KernelFusion::KERNELS_FUSED){
+            add("07b_advect_forces_fused", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("new_cell_types",  NEW_CELL_TYPES, IMAGE_STORAGE_R),
+                storageImage("cell_types",      CELL_TYPES,     IMAGE_STORAGE_W),
+                sampledImage("velocities_src",  VELOCITIES_1,   velocities_sampler),
+                storageImage("velocities_dst",  VELOCITIES_2,   IMAGE_STORAGE_W),
+                fluid_bricks_compute_usage
+            });
+            add("09b_diffuse_solids_fused", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types",     CELL_TYPES,   IMAGE_STORAGE_R),
+                storageImage("velocities_src", VELOCITIES_2, IMAGE_STORAGE_R),
+                storageImage("velocities_dst", VELOCITIES_1, IMAGE_STORAGE_W),
+                fluid_bricks_compute_usage
+            });
+        }else{
+            add("06_update_cell_types", SectionUsages{
+                storageImage("new_cell_types", NEW_CELL_TYPES, IMAGE_STORAGE_R),
+                storageImage("cell_types", CELL_TYPES, IMAGE_STORAGE_W),
+                fluid_bricks_compute_usage
+            });
+            add("07_advect", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types",      CELL_TYPES,   IMAGE_STORAGE_R),
+                sampledImage("velocities_src",  VELOCITIES_1, velocities_sampler),
+                storageImage("velocities_dst",  VELOCITIES_2, IMAGE_STORAGE_W),
+                fluid_bricks_compute_usage
+            });
+            add("08_forces", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types", CELL_TYPES,   IMAGE_STORAGE_R),
+                storageImage("velocities", VELOCITIES_2, IMAGE_STORAGE_RW),
+                fluid_bricks_compute_usage
+            });
+            add("09_diffuse", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types",     CELL_TYPES,   IMAGE_STORAGE_R),
+                storageImage("velocities_src", VELOCITIES_2, IMAGE_STORAGE_R),
+                storageImage("velocities_dst", VELOCITIES_1, IMAGE_STORAGE_W),
+                fluid_bricks_compute_usage
+            });
+            add("10_solids", SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types", CELL_TYPES,   IMAGE_STORAGE_R),
+                storageImage("velocities", VELOCITIES_1, IMAGE_STORAGE_RW),
+                fluid_bricks_compute_usage
+            });
+        }
+        add("11_compute_divergence", SectionUsages{
+            storageImage("velocities", VELOCITIES_1, IMAGE_STORAGE_R),
+            storageImage("divergences",DIVERGENCES,  IMAGE_STORAGE_W),
+            fluid_bricks_compute_usage
+        });
+    }
+    void complete(){
+        m_update_densities.complete();
+        m_fluid_bricks.complete();
+        for (auto& s : m_velocities) s.second->complete();
+    }
+    //if all_bricks_active is true, sections go over the whole grid. Set before the graph is run
+    void setAllBricksActive(bool all_bricks_active){
+        m_all_bricks_active = all_bricks_active;
+    }
+    //add all sections to the graph in the order they run. Particle densities have to be cleared by a node added before
+    void addTo(FlowSectionGraph& graph){
+        graph.add(m_update_densities_name, m_update_densities);
+        graph.addOpaque(m_fluid_bricks.getName(), m_fluid_bricks.getAccesses(), [this](GraphRecording& recording){
+            m_fluid_bricks.run(recording.getCommandBuffer(), recording.getFlowContext(), m_all_bricks_active);
+        });
+        for (auto& s : m_velocities) graph.add(s.first, *s.second);
+    }
+};
+
+
+
+//usages of pressure solver buffers, shared by most solver sections
+const SectionUsage pressure_partial_sums_write_usage = storageBuffer("partial_sums_buffer", PRESSURE_PARTIAL_SUMS_BUF, BUFFER_STORAGE_W);
+const SectionUsage pressure_solver_state_read_usage = storageBuffer("solver_state_buffer", PRESSURE_SOLVER_STATE_BUF, BUFFER_STORAGE_R);
+
+
+/**
+ * PressureSolverSections
+ *  - Solves for pressure using the method selected when created, pressures are saved in pressures 2, which is read by 13_fix_divergence
+ *  - 12a_pressure_init keeps water pressures from the previous step as the initial guess and sets air cells to air pressure. It goes over active bricks of the fluid grid, as do Jacobi and tiled Gauss-Seidel solvers
+ *  - Jacobi - loop over 12_solve_pressure, same as before
+ *  - Tiled Gauss-Seidel - loop over 12m_solve_pressure_tiled, each dispatch does sweeps_per_dispatch red-black sweeps in shared memory
+ *  - Multigrid - each iteration runs a V-cycle on the residual, adds the correction to pressures, then computes the new residual
+ *  - MGPCG - conjugate gradient, where one V-cycle is used as the preconditioner
+ *  - V-cycle - red-black Gauss-Seidel smoothing, restriction of the residual to the coarser level, recursion, prolongation of the correction and smoothing again
+ *    - Post-smoothing runs in the opposite color order to pre-smoothing, which keeps the V-cycle symmetric as conjugate gradient requires
+ *  - Dot products are summed per workgroup, then 12c_pressure_reduce sums them in a single workgroup and updates the solver state buffer
+ *  - All multigrid and MGPCG sections on the finest level are dispatched over active bricks, like 12a. Water cells are only in active bricks, and values outside them stay zero from the last step their brick was active
+ *    - Restriction is dispatched over the coarser level, and coarser levels over the whole level, they have 8 times fewer cells per level and no brick lists. Clears of solutions and the search direction clear whole images
+ *    - Once the residual is below tolerance, the solver state is marked as converged and all remaining recorded solver dispatches return immediately
+ *  - Sections are nodes of the step's graph, added by addTo(). Jacobi and tiled Gauss-Seidel loops are opaque nodes. Multigrid and MGPCG setup sections are nodes of the step's graph, so coarsening of cell types runs next to the initial residual,
+ *    and all iterations are one opaque node that runs the iteration's FlowSectionGraph in the step's recording, where solutions of all levels are cleared together at the start of each V-cycle
+ */
+class PressureSolverSections{
+    //modes of 12c_pressure_reduce
+    enum ReduceMode : uint32_t{
+        REDUCE_START, REDUCE_ALPHA, REDUCE_RESIDUAL, REDUCE_BETA
+    };
+
+    PressureSolver m_solver;
+    VkBuffer m_brick_commands_buffer;
+    GraphComputeSection<FlowComputeSection> m_init;
+    //jacobi or tiled Gauss-Seidel solver, and what it uses
+    std::unique_ptr<IndirectLoopComputeSection> m_relaxation;
+    vector<SectionAccess> m_relaxation_accesses;
+    //shared by multigrid and conjugate gradient solvers
+    std::unique_ptr<GraphComputeSection<FlowComputePushConstantSection>> m_residual;
+    std::unique_ptr<GraphComputeSection<FlowComputePushConstantSection>> m_reduce;
+    //multigrid sections, index is the level they run on. Coarsen, restrict and prolongate move data between level i and i + 1
+    vector<std::unique_ptr<GraphComputeSection<FlowComputeSection>>> m_coarsen;
+    vector<std::unique_ptr<GraphClearSection>> m_clear_solution;
+    vector<std::unique_ptr<GraphComputeSection<FlowComputePushConstantSection>>> m_smooth;
+    vector<std::unique_ptr<GraphComputeSection<FlowComputeSection>>> m_restrict;
+    vector<std::unique_ptr<GraphComputeSection<FlowComputePushConstantSection>>> m_prolongate;
+    std::unique_ptr<GraphComputeSection<FlowComputeSection>> m_correct;
+    //conjugate gradient sections
+    std::unique_ptr<GraphClearSection> m_clear_search;
+    std::unique_ptr<GraphComputeSection<FlowComputeSection>> m_apply_operator;
+    std::unique_ptr<GraphComputeSection<FlowComputeSection>> m_dot;
+    std::unique_ptr<GraphComputeSection<FlowComputeSection>> m_update_solution;
+    std::unique_ptr<GraphComputeSection<FlowComputeSection>> m_update_search;
+    //the iteration is run pressure_solve_max_iterations times, the setup is added to the step's graph
+    FlowSectionGraph m_iteration{"12_pressure_iteration"};
+public:
+    PressureSolverSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes, VkBuffer brick_commands_buffer, PressureSolver solver, uint32_t sweeps_per_dispatch) :
+        m_solver(solver),
+        m_brick_commands_buffer(brick_commands_buffer),
+        m_init(
+            brick_commands_buffer, fluid_brick_command_offset,
+            fluid_context, "12a_pressure_init", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types",   CELL_TYPES,   IMAGE_STORAGE_R),
+                storageImage("divergences",  DIVERGENCES,  IMAGE_STORAGE_R),
+                storageImage("pressures_1",  PRESSURES_1,  IMAGE_STORAGE_W),
+                storageImage("pressures_2",  PRESSURES_2,  IMAGE_STORAGE_RW),
+                storageImage("pressure_rhs", PRESSURE_RHS, IMAGE_STORAGE_W),
+                fluid_bricks_compute_usage
+            }
+        )
+    {
+        if (m_solver == PressureSolver::PRESSURE_SOLVER_JACOBI || m_solver == PressureSolver::PRESSURE_SOLVER_TILED_GAUSS_SEIDEL){
+            bool tiled = m_solver == PressureSolver::PRESSURE_SOLVER_TILED_GAUSS_SEIDEL;
+            //both solvers use the same images and ping-pong between pressures 1 and 2, only water cells are written, so they go over active bricks
+            m_relaxation = std::make_unique<IndirectLoopComputeSection>(tiled ? tiled_pressure_dispatches : divergence_solve_iterations,
+                brick_commands_buffer, fluid_brick_command_offset,
+                fluid_context, tiled ? "12m_solve_pressure_tiled" : "12_solve_pressure",
+                trackedDescriptors(flow_context, SectionUsages{
+                    simulation_parameters_buffer_compute_usage,
+                    storageImage("cell_types", CELL_TYPES,  IMAGE_STORAGE_R),
+                    storageImage("divergences", DIVERGENCES, IMAGE_STORAGE_R),
+                    storageImage("pressures_1", PRESSURES_1, IMAGE_STORAGE_RW),
+                    storageImage("pressures_2", PRESSURES_2, IMAGE_STORAGE_RW),
+                    fluid_bricks_compute_usage
+                }, m_relaxation_accesses)
+            );
+            if (tiled) m_relaxation->getPushConstantData().write("sweeps", &sweeps_per_dispatch, 1);
+            return;
+        }
+        createReductionSections(fluid_context, flow_context, workgroup_sizes);
+        createMultigridSections(fluid_context, flow_context, workgroup_sizes);
+        if (m_solver == PressureSolver::PRESSURE_SOLVER_MGPCG) createConjugateGradientSections(fluid_context, flow_context, workgroup_sizes);
+        createIteration();
+    }
+    void complete(){
+        m_init.complete();
+        if (m_relaxation) m_relaxation->complete();
+        if (m_residual) m_residual->complete();
+        if (m_reduce) m_reduce->complete();
+        for (auto& s : m_coarsen) s->complete();
+        for (auto& s : m_clear_solution) s->complete();
+        for (auto& s : m_smooth) s->complete();
+        for (auto& s : m_restrict) s->complete();
+        for (auto& s : m_prolongate) s->complete();
+        if (m_correct) m_correct->complete();
+        if (m_clear_search) m_clear_search->complete();
+        if (m_apply_operator) m_apply_operator->complete();
+        if (m_dot) m_dot->complete();
+        if (m_update_solution) m_update_solution->complete();
+        if (m_update_search) m_update_search->complete();
+    }
+    //add the whole pressure solve to the step's graph, all iterations are recorded, ones after convergence do nothing on the GPU. Each iteration is timed as one section by the GPU profiler
+    void addTo(FlowSectionGraph& graph){
+        graph.add("12a_pressure_init", m_init);
+        if (m_relaxation){
+            graph.addOpaque(m_relaxation->getName(), m_relaxation_accesses, [this](GraphRecording& recording){
+                m_relaxation->run(recording.getCommandBuffer(), recording.getFlowContext());
+            });
+            return;
+        }
+        //cell types of all coarser levels, and the residual of the initial guess, which also decides whether solving is needed at all
+        for (uint32_t level = 0; level + 1 < multigrid_level_count; level++){
+            graph.add("12d_multigrid_coarsen", *m_coarsen[level]);
+        }
+        addResidual(graph, false);
+        addReduce(graph, REDUCE_START);
+        if (m_solver == PressureSolver::PRESSURE_SOLVER_MGPCG) graph.add("12_pcg_clear_search", *m_clear_search);
+        const char* iteration_name = m_solver == PressureSolver::PRESSURE_SOLVER_MULTIGRID ? "12_multigrid_iteration" : "12_mgpcg_iteration";
+        graph.addOpaque(iteration_name, m_iteration.getAccesses(), [this, iteration_name](GraphRecording& recording){
+            for (uint32_t i = 0; i < pressure_solve_max_iterations; i++){
+                GpuProfileScope profile(recording.getCommandBuffer(), iteration_name);
+                m_iteration.run(recording);
+            }
+        });
+    }
+    //graph of one multigrid or MGPCG iteration, empty with other solvers
+    FlowSectionGraph& getIterationGraph(){
+        return m_iteration;
+    }
+    bool usesGraphs() const{
+        return !m_relaxation;
+    }
+private:
+    void createIteration(){
+        if (m_solver == PressureSolver::PRESSURE_SOLVER_MULTIGRID){
+            addVCycle(m_iteration, 0);
+            m_iteration.add("12h_multigrid_correct", *m_correct);
+            addResidual(m_iteration, true);
+            addReduce(m_iteration, REDUCE_RESIDUAL);
+            return;
+        }
+        //z = M^-1 r, beta = r.z / previous r.z, p = z + beta * p
+        addVCycle(m_iteration, 0);
+        m_iteration.add("12j_pcg_dot", *m_dot);
+        addReduce(m_iteration, REDUCE_BETA);
+        m_iteration.add("12l_pcg_update_search", *m_update_search);
+        //q = A p, alpha = r.z / p.q, x += alpha * p, r -= alpha * q
+        m_iteration.add("12i_pcg_apply_operator", *m_apply_operator);
+        addReduce(m_iteration, REDUCE_ALPHA);
+        m_iteration.add("12k_pcg_update_solution", *m_update_solution);
+        addReduce(m_iteration, REDUCE_RESIDUAL);
+    }
+    void addResidual(FlowSectionGraph& graph, bool skip_if_converged){
+        graph.add("12b_pressure_residual", *m_residual,
+            [this, skip_if_converged](){
+                uint32_t skip = skip_if_converged ? 1 : 0;
+                m_residual->getPushConstantData().write("skip_if_converged", &skip, 1);
+            });
+    }
+    void addReduce(FlowSectionGraph& graph, ReduceMode mode){
+        graph.add("12c_pressure_reduce", *m_reduce,
+            [this, mode](){
+                uint32_t mode_value = mode;
+                m_reduce->getPushConstantData().write("mode", &mode_value, 1);
+            });
+    }
+    void addSmooth(FlowSectionGraph& graph, uint32_t level, uint32_t parity){
+        graph.add("12e_multigrid_smooth", *m_smooth[level],
+            [this, level, parity](){
+                uint32_t parity_value = parity;
+                m_smooth[level]->getPushConstantData().write("parity", &parity_value, 1);
+            });
+    }
+    //solve A * solution = rhs approximately on the given level, starting from zero
+    void addVCycle(FlowSectionGraph& graph, uint32_t level){
+        graph.add("12_multigrid_clear_solution", *m_clear_solution[level]);
+        if (level + 1 == multigrid_level_count){
+            //coarsest level - first half of the sweeps is red-black, second half black-red, so that the result is symmetric
+            for (uint32_t i = 0; i < multigrid_coarse_sweeps; i++){
+                uint32_t first = (i < multigrid_coarse_sweeps / 2) ? 0 : 1;
+                addSmooth(graph, level, first);
+                addSmooth(graph, level, 1 - first);
+            }
+            return;
+        }
+        for (uint32_t i = 0; i < multigrid_smoothing_sweeps; i++){
+            addSmooth(graph, level, 0);
+            addSmooth(graph, level, 1);
+        }
+        graph.add("12f_multigrid_restrict", *m_restrict[level]);
+        addVCycle(graph, level + 1);
+        graph.add("12g_multigrid_prolongate", *m_prolongate[level]);
+        for (uint32_t i = 0; i < multigrid_smoothing_sweeps; i++){
+            addSmooth(graph, level, 1);
+            addSmooth(graph, level, 0);
+        }
+    }
+
+    //section of one multigrid level, the finest one is dispatched over active bricks and the others over the whole level. Push constant active_bricks_only tells the shader which one it is
+    template<typename Section>
+    std::unique_ptr<GraphComputeSection<Section>> levelSection(DirectoryPipelinesContext& fluid_context, const string& shader_dir, FlowDescriptorContext& flow_context, uint32_t level, Size3 dispatch_size, const SectionUsages& usages){
+        std::unique_ptr<GraphComputeSection<Section>> section;
+        if (level == 0){
+            section = std::make_unique<GraphComputeSection<Section>>(m_brick_commands_buffer, fluid_brick_command_offset, fluid_context, shader_dir, flow_context, usages);
+        }else{
+            section = std::make_unique<GraphComputeSection<Section>>(fluid_context, shader_dir, flow_context, usages, dispatch_size);
+        }
+        uint32_t active_bricks_only = (level == 0) ? 1 : 0;
+        section->getPushConstantData().write("active_bricks_only", &active_bricks_only, 1);
+        return section;
+    }
+    void createReductionSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes){
+        m_residual = std::make_unique<GraphComputeSection<FlowComputePushConstantSection>>(
+            m_brick_commands_buffer, fluid_brick_command_offset,
+            fluid_context, "12b_pressure_residual", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types",   CELL_TYPES,        IMAGE_STORAGE_R),
+                storageImage("pressure_rhs", PRESSURE_RHS,      IMAGE_STORAGE_R),
+                storageImage("pressures",    PRESSURES_2,       IMAGE_STORAGE_R),
+                storageImage("residuals",    PRESSURE_RESIDUAL, IMAGE_STORAGE_W),
+                pressure_partial_sums_write_usage,
+                pressure_solver_state_read_usage,
+                fluid_bricks_compute_usage
+            }
+        );
+        m_reduce = std::make_unique<GraphComputeSection<FlowComputePushConstantSection>>(
+            fluid_context, "12c_pressure_reduce", flow_context,
+            SectionUsages{
+                storageBuffer("partial_sums_buffer", PRESSURE_PARTIAL_SUMS_BUF, BUFFER_STORAGE_R),
+                storageBuffer("solver_state_buffer", PRESSURE_SOLVER_STATE_BUF, BUFFER_STORAGE_RW),
+                //the number of partial sums is the number of active bricks
+                storageBuffer("brick_commands",      BRICK_COMMANDS_BUF,        BUFFER_STORAGE_R)
+            },
+            Size3{1, 1, 1}
+        );
+        float tolerance_squared = pressure_solve_tolerance * pressure_solve_tolerance;
+        m_reduce->getPushConstantData().write("tolerance_squared", &tolerance_squared, 1);
+    }
+    void createMultigridSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes){
+        for (uint32_t level = 0; level < multigrid_level_count; level++){
+            Size3 dispatch_size = workgroup_sizes.multigridDispatchSize(level);
+            m_clear_solution.push_back(std::make_unique<GraphClearSection>(flow_context, multigridImage(level, MULTIGRID_SOLUTION), ClearValue(0.f)));
+            m_smooth.push_back(levelSection<FlowComputePushConstantSection>(fluid_context, "12e_multigrid_smooth", flow_context, level, dispatch_size,
+                SectionUsages{
+                    simulation_parameters_buffer_compute_usage,
+                    storageImage("cell_types", multigridImage(level, MULTIGRID_CELL_TYPES), IMAGE_STORAGE_R),
+                    storageImage("rhs",        multigridImage(level, MULTIGRID_RHS),        IMAGE_STORAGE_R),
+                    storageImage("solution",   multigridImage(level, MULTIGRID_SOLUTION),   IMAGE_STORAGE_RW),
+                    pressure_solver_state_read_usage,
+                    fluid_bricks_compute_usage
+                }
+            ));
+            if (level + 1 == multigrid_level_count) break;
+
+            //sections moving data between this level and the coarser one are dispatched over the coarser one, except for prolongation
+            Size3 coarse_dispatch_size = workgroup_sizes.multigridDispatchSize(level + 1);
+            m_coarsen.push_back(std::make_unique<GraphComputeSection<FlowComputeSection>>(
+                fluid_context, "12d_multigrid_coarsen", flow_context,
+                SectionUsages{
+                    simulation_parameters_buffer_compute_usage,
+                    storageImage("fine_cell_types",   multigridImage(level,     MULTIGRID_CELL_TYPES), IMAGE_STORAGE_R),
+                    storageImage("coarse_cell_types", multigridImage(level + 1, MULTIGRID_CELL_TYPES), IMAGE_STORAGE_W)
                 },
-                fluid_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "14_particles",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowCombinedImage{"velocities", VELOCITIES_1,   usage_compute, ImageState{IMAGE_SAMPLER}, velocities_sampler},
-                        FlowStorageBuffer{"particles", PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_RW}},
-                    }
+                coarse_dispatch_size
+            ));
+            m_restrict.push_back(std::make_unique<GraphComputeSection<FlowComputeSection>>(
+                fluid_context, "12f_multigrid_restrict", flow_context,
+                SectionUsages{
+                    simulation_parameters_buffer_compute_usage,
+                    storageImage("fine_cell_types", multigridImage(level,     MULTIGRID_CELL_TYPES), IMAGE_STORAGE_R),
+                    storageImage("fine_rhs",        multigridImage(level,     MULTIGRID_RHS),        IMAGE_STORAGE_R),
+                    storageImage("fine_solution",   multigridImage(level,     MULTIGRID_SOLUTION),   IMAGE_STORAGE_R),
+                    storageImage("coarse_rhs",      multigridImage(level + 1, MULTIGRID_RHS),        IMAGE_STORAGE_W),
+                    pressure_solver_state_read_usage
                 },
-                particle_dispatch_size
-            ),
-            new FlowClearColorSection(flow_context, DETAILED_DENSITIES_IMG, ClearValue(0u)),
-            new FlowComputeSection(
-                fluid_context, "15_update_detailed_densities",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageBuffer{"particles", PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_R}},
-                        FlowStorageImage{"particle_densities", DETAILED_DENSITIES_IMG, usage_compute, ImageState{IMAGE_STORAGE_RW}}
-                    }
-                }, 
-                particle_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "16_compute_detailed_densities_inertia",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"particle_densities", DETAILED_DENSITIES_IMG, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"densities_inertia", DETAILED_DENSITIES_INERTIA_IMG, usage_compute, ImageState{IMAGE_STORAGE_RW}}
-                    }
-                }, 
-                surface_render_dispatch_size
-            ),
-            new FlowComputeSection(
-                fluid_context, "17_compute_float_densities",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"densities_inertia", DETAILED_DENSITIES_INERTIA_IMG, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"float_densities", PARTICLE_DENSITIES_FLOAT_1, usage_compute, ImageState{IMAGE_STORAGE_W}},
-                    }
-                }, 
-                surface_render_dispatch_size
-            ),
-            new FlowLoopPushConstantSection<FlowComputePushConstantSection>(float_density_diffuse_steps, flow_context,
-                fluid_context, "18_diffuse_float_densities",
-                FlowPipelineSectionDescriptors{
-                    flow_context,
-                    vector<FlowPipelineSectionDescriptorUsage>{
-                        simulation_parameters_buffer_compute_usage,
-                        FlowStorageImage{"cell_types", CELL_TYPES,   usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"densities_1", PARTICLE_DENSITIES_FLOAT_1, usage_compute, ImageState{IMAGE_STORAGE_R}},
-                        FlowStorageImage{"densities_2", PARTICLE_DENSITIES_FLOAT_2, usage_compute, ImageState{IMAGE_STORAGE_W}},
-                    }
-                }, 
-                surface_render_dispatch_size
-            )
+                coarse_dispatch_size
+            ));
+            m_prolongate.push_back(levelSection<FlowComputePushConstantSection>(fluid_context, "12g_multigrid_prolongate", flow_context, level, dispatch_size,
+                SectionUsages{
+                    simulation_parameters_buffer_compute_usage,
+                    storageImage("fine_cell_types", multigridImage(level,     MULTIGRID_CELL_TYPES), IMAGE_STORAGE_R),
+                    storageImage("coarse_solution", multigridImage(level + 1, MULTIGRID_SOLUTION),   IMAGE_STORAGE_R),
+                    storageImage("fine_solution",   multigridImage(level,     MULTIGRID_SOLUTION),   IMAGE_STORAGE_RW),
+                    pressure_solver_state_read_usage,
+                    fluid_bricks_compute_usage
+                }
+            ));
         }
+        m_correct = std::make_unique<GraphComputeSection<FlowComputeSection>>(
+            m_brick_commands_buffer, fluid_brick_command_offset,
+            fluid_context, "12h_multigrid_correct", flow_context,
+            SectionUsages{
+                storageImage("correction", PRESSURE_CORRECTION, IMAGE_STORAGE_R),
+                storageImage("pressures",  PRESSURES_2,         IMAGE_STORAGE_RW),
+                pressure_solver_state_read_usage,
+                fluid_bricks_compute_usage
+            }
+        );
+    }
+    void createConjugateGradientSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes){
+        m_clear_search = std::make_unique<GraphClearSection>(flow_context, PRESSURE_SEARCH, ClearValue(0.f));
+        m_apply_operator = std::make_unique<GraphComputeSection<FlowComputeSection>>(
+            m_brick_commands_buffer, fluid_brick_command_offset,
+            fluid_context, "12i_pcg_apply_operator", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types", CELL_TYPES,       IMAGE_STORAGE_R),
+                storageImage("search",     PRESSURE_SEARCH,  IMAGE_STORAGE_R),
+                storageImage("product",    PRESSURE_PRODUCT, IMAGE_STORAGE_W),
+                pressure_partial_sums_write_usage,
+                pressure_solver_state_read_usage,
+                fluid_bricks_compute_usage
+            }
+        );
+        m_dot = std::make_unique<GraphComputeSection<FlowComputeSection>>(
+            m_brick_commands_buffer, fluid_brick_command_offset,
+            fluid_context, "12j_pcg_dot", flow_context,
+            SectionUsages{
+                storageImage("residuals",  PRESSURE_RESIDUAL,   IMAGE_STORAGE_R),
+                storageImage("correction", PRESSURE_CORRECTION, IMAGE_STORAGE_R),
+                pressure_partial_sums_write_usage,
+                pressure_solver_state_read_usage,
+                fluid_bricks_compute_usage
+            }
+        );
+        m_update_solution = std::make_unique<GraphComputeSection<FlowComputeSection>>(
+            m_brick_commands_buffer, fluid_brick_command_offset,
+            fluid_context, "12k_pcg_update_solution", flow_context,
+            SectionUsages{
+                storageImage("search",    PRESSURE_SEARCH,   IMAGE_STORAGE_R),
+                storageImage("product",   PRESSURE_PRODUCT,  IMAGE_STORAGE_R),
+                storageImage("pressures", PRESSURES_2,       IMAGE_STORAGE_RW),
+                storageImage("residuals", PRESSURE_RESIDUAL, IMAGE_STORAGE_RW),
+                pressure_partial_sums_write_usage,
+                pressure_solver_state_read_usage,
+                fluid_bricks_compute_usage
+            }
+        );
+        m_update_search = std::make_unique<GraphComputeSection<FlowComputeSection>>(
+            m_brick_commands_buffer, fluid_brick_command_offset,
+            fluid_context, "12l_pcg_update_search", flow_context,
+            SectionUsages{
+                storageImage("correction", PRESSURE_CORRECTION, IMAGE_STORAGE_R),
+                storageImage("search",     PRESSURE_SEARCH,     IMAGE_STORAGE_RW),
+                pressure_solver_state_read_usage,
+                fluid_bricks_compute_usage
+            }
+        );
+    }
+};
+
+
+
+/**
+ * SimulationParticleSections
+ *  - Last part of the simulation step, 13 and 14. Removes divergence from velocities and moves particles
+ *  - 13 goes over active bricks of the fluid grid, 14_particles is dispatched indirectly over active particles
+ *  - The last substep of a frame runs 14b_particles_render_output of its' frame in flight instead of 14, one section per frame in flight. See 'Frames in flight' in simulation_constants.h
+ *  - Sections are nodes of the step's graph, added by addTo(). Frames drawn while the simulation was paused may still read particles of a frame in flight, the barrier at the start of each recording waits for them
+ */
+class SimulationParticleSections{
+    using Section = GraphComputeSection<FlowComputeSection>;
+    Section m_fix_divergence;
+    Section m_move_particles;
+    //14b of each frame in flight, empty when nothing is rendered
+    vector<std::unique_ptr<Section>> m_move_particles_render_output;
+    //nodes of 14 and of 14b of each frame in the step's graph
+    uint32_t m_move_particles_node = 0;
+    vector<uint32_t> m_render_output_nodes;
+public:
+    SimulationParticleSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, VkSampler velocities_sampler, VkBuffer particle_commands_buffer, VkBuffer brick_commands_buffer,
+        uint32_t render_frame_count = 0) :
+        m_fix_divergence(
+            brick_commands_buffer, fluid_brick_command_offset,
+            fluid_context, "13_fix_divergence", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types", CELL_TYPES,   IMAGE_STORAGE_R),
+                storageImage("pressures", PRESSURES_2,  IMAGE_STORAGE_R),
+                storageImage("velocities", VELOCITIES_1, IMAGE_STORAGE_RW),
+                fluid_bricks_compute_usage
+            }
+        ),
+        m_move_particles(
+            particle_commands_buffer, particle_dispatch_command_offset,
+            fluid_context, "14_particles", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                sampledImage("velocities", VELOCITIES_1, velocities_sampler),
+                storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_RW),
+                active_particles_compute_usage,
+                particle_commands_compute_usage
+            }
+        )
+    {
+        for (uint32_t frame = 0; frame < render_frame_count; frame++){
+            m_move_particles_render_output.push_back(std::make_unique<Section>(
+                particle_commands_buffer, particle_dispatch_command_offset,
+                fluid_context, "14b_particles_render_output", flow_context,
+                SectionUsages{
+                    simulation_parameters_buffer_compute_usage,
+                    sampledImage("velocities", VELOCITIES_1, velocities_sampler),
+                    storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_RW),
+                    active_particles_compute_usage,
+                    particle_commands_compute_usage,
+                    storageBuffer("render_particles",         renderFrameBuffer(frame, RENDER_PARTICLES),         BUFFER_STORAGE_W),
+                    storageBuffer("render_particle_commands", renderFrameBuffer(frame, RENDER_PARTICLE_COMMANDS), BUFFER_STORAGE_W)
+                }
+            ));
+        }
+    }
+    void complete(){
+        m_fix_divergence.complete();
+        m_move_particles.complete();
+        for (auto& section : m_move_particles_render_output) section->complete();
+    }
+    void addTo(FlowSectionGraph& graph){
+        graph.add("13_fix_divergence", m_fix_divergence);
+        m_move_particles_node = graph.add("14_particles", m_move_particles);
+        m_render_output_nodes.clear();
+        for (auto& section : m_move_particles_render_output) m_render_output_nodes.push_back(graph.add("14b_particles_render_output", *section));
+    }
+    //particles are also written for render_frame, unless it is no_render_frame. Set before the graph is run
+    void setRenderFrame(FlowSectionGraph& graph, uint32_t render_frame){
+        graph.setEnabled(m_move_particles_node, render_frame == no_render_frame);
+        for (uint32_t frame = 0; frame < m_render_output_nodes.size(); frame++) graph.setEnabled(m_render_output_nodes[frame], frame == render_frame);
+    }
+};
+
+
+/**
+ * SurfaceDensitySections
+ *  - Computes densities used for rendering the surface, 15 - 18. 15_update_detailed_densities is dispatched indirectly over active particles, binning selects the variant of 15 that is used
+ *  - After 15, the brick map of the detailed grid is built, 16 - 18 go over its' active bricks
+ *  - 15 - 18 are only needed for the surface, substeps that aren't rendered skip them
+ *  - Sections are nodes of the step's graph, added by addTo() before the velocity sections. They count particles where they are at the start of the step, so they overlap with 01 - 05,
+ *    and the surface lags one step behind particles. See 'Section graphs' in README.md
+ */
+class SurfaceDensitySections{
+    GraphComputeSection<FlowComputeSection> m_update_detailed_densities;
+    string m_update_detailed_densities_name;
+    BrickMapSections m_surface_bricks;
+    GraphComputeSection<FlowComputeSection> m_densities_inertia;
+    GraphComputeSection<FlowComputeSection> m_float_densities;
+    //both images are read and written, depending on the iteration
+    GraphComputeSection<FlowComputePushConstantSection> m_diffuse_float_densities;
+    bool m_all_bricks_active = true;
+public:
+    SurfaceDensitySections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes, VkBuffer particle_commands_buffer, VkBuffer brick_commands_buffer,
+        ParticleBinning binning) :
+        m_update_detailed_densities(
+            particle_commands_buffer, particle_dispatch_command_offset,
+            fluid_context, updateDetailedDensitiesShader(binning), flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageBuffer("particles", PARTICLES_BUF, BUFFER_STORAGE_R),
+                active_particles_compute_usage,
+                particle_commands_compute_usage,
+                storageImage("particle_densities", DETAILED_DENSITIES_IMG, IMAGE_STORAGE_RW)
+            }
+        ),
+        m_update_detailed_densities_name(updateDetailedDensitiesShader(binning)),
+        m_surface_bricks(
+            fluid_context, flow_context, "15c_mark_surface_bricks",
+            SectionUsages{
+                storageImage("particle_densities", DETAILED_DENSITIES_IMG,         IMAGE_STORAGE_R),
+                storageImage("densities_inertia",  DETAILED_DENSITIES_INERTIA_IMG, IMAGE_STORAGE_R),
+                storageBuffer("brick_flags",       SURFACE_BRICK_FLAGS_BUF,        BUFFER_STORAGE_W),
+                storageBuffer("brick_commands",    BRICK_COMMANDS_BUF,             BUFFER_STORAGE_W)
+            },
+            workgroup_sizes.surfaceDispatchSize(), SURFACE_BRICK_FLAGS_BUF, SURFACE_BRICKS_BUF, surface_brick_command_offset
+        ),
+        m_densities_inertia(
+            brick_commands_buffer, surface_brick_command_offset,
+            fluid_context, "16_compute_detailed_densities_inertia", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("particle_densities", DETAILED_DENSITIES_IMG, IMAGE_STORAGE_R),
+                storageImage("densities_inertia", DETAILED_DENSITIES_INERTIA_IMG, IMAGE_STORAGE_RW),
+                surface_bricks_compute_usage
+            }
+        ),
+        m_float_densities(
+            brick_commands_buffer, surface_brick_command_offset,
+            fluid_context, "17_compute_float_densities", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("densities_inertia", DETAILED_DENSITIES_INERTIA_IMG, IMAGE_STORAGE_R),
+                storageImage("float_densities", PARTICLE_DENSITIES_FLOAT_1, IMAGE_STORAGE_W),
+                surface_bricks_compute_usage
+            }
+        ),
+        m_diffuse_float_densities(
+            brick_commands_buffer, surface_brick_command_offset,
+            fluid_context, "18_diffuse_float_densities", flow_context,
+            SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                storageImage("cell_types", CELL_TYPES,   IMAGE_STORAGE_R),
+                storageImage("densities_1", PARTICLE_DENSITIES_FLOAT_1, IMAGE_STORAGE_RW),
+                storageImage("densities_2", PARTICLE_DENSITIES_FLOAT_2, IMAGE_STORAGE_RW),
+                surface_bricks_compute_usage
+            }
+        )
     {}
+    void complete(){
+        m_update_detailed_densities.complete();
+        m_surface_bricks.complete();
+        m_densities_inertia.complete();
+        m_float_densities.complete();
+        m_diffuse_float_densities.complete();
+    }
+    //if all_bricks_active is true, sections go over the whole detailed grid. Set before the graph is run
+    void setAllBricksActive(bool all_bricks_active){
+        m_all_bricks_active = all_bricks_active;
+    }
+    //add all sections to the graph in the order they run, 18 once per iteration. Returns their nodes. Detailed densities have to be cleared by a node added before
+    vector<uint32_t> addTo(FlowSectionGraph& graph){
+        vector<uint32_t> nodes;
+        nodes.push_back(graph.add(m_update_detailed_densities_name, m_update_detailed_densities));
+        nodes.push_back(graph.addOpaque(m_surface_bricks.getName(), m_surface_bricks.getAccesses(), [this](GraphRecording& recording){
+            m_surface_bricks.run(recording.getCommandBuffer(), recording.getFlowContext(), m_all_bricks_active);
+        }));
+        nodes.push_back(graph.add("16_compute_detailed_densities_inertia", m_densities_inertia));
+        nodes.push_back(graph.add("17_compute_float_densities", m_float_densities));
+        for (uint32_t i = 0; i < float_density_diffuse_steps; i++){
+            nodes.push_back(graph.add("18_diffuse_float_densities", m_diffuse_float_densities, [this, i](){
+                uint32_t is_even_iteration = (i % 2 == 0) ? 1 : 0;
+                m_diffuse_float_densities.getPushConstantData().write("is_even_iteration", &is_even_iteration, 1);
+            }));
+        }
+        return nodes;
+    }
 };
 
 
+/**
+ * SurfaceMeshSections
+ *  - Extracts the fluid surface from float densities into an indexed triangle mesh at the end of each step, using the marching cubes method. Described in simulation_constants.h, look for 'Surface mesh'
+ *  - 19 finds active bricks of the detailed grid that changed, 19b counts vertices and indices of bricks next to them, 20 gives these bricks space in the mesh buffers and writes the draw command, 21 writes their meshes
+ *  - Bricks that aren't active have no surface and don't change, so the mesh is complete
+ *  - If incremental_remesh is false, all active bricks are treated as changed every step
+ *  - Sections depend on each other and record barriers for draws of the mesh, all of them are one opaque node of the step's graph
+ */
+class SurfaceMeshSections{
+    //everything the sections use, for the node that runs them
+    vector<SectionAccess> m_accesses;
+    IndirectComputeSection<FlowComputePushConstantSection> m_mark;
+    IndirectComputeSection<> m_count;
+    FlowComputePushConstantSection m_allocate;
+    IndirectComputeSection<> m_generate;
+    bool m_incremental_remesh;
+public:
+    SurfaceMeshSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, VkBuffer brick_commands_buffer, VkBuffer surface_mesh_commands_buffer, bool incremental_remesh = default_incremental_remesh) :
+        m_mark(
+            brick_commands_buffer, surface_brick_command_offset,
+            fluid_context, "19_surface_mark_changed_bricks",
+            trackedDescriptors(flow_context, SectionUsages{
+                storageImage("float_densities", PARTICLE_DENSITIES_FLOAT_2, IMAGE_STORAGE_R),
+                storageImage("surface_mesh_densities", SURFACE_MESH_DENSITIES, IMAGE_STORAGE_RW),
+                surface_bricks_compute_usage,
+                storageBuffer("surface_brick_meshes", SURFACE_BRICK_MESHES_BUF, BUFFER_STORAGE_RW),
+                storageBuffer("surface_mesh_commands", SURFACE_MESH_COMMANDS_BUF, BUFFER_STORAGE_R)
+            }, m_accesses)
+        ),
+        m_count(
+            brick_commands_buffer, surface_brick_command_offset,
+            fluid_context, "19b_surface_count_bricks",
+            trackedDescriptors(flow_context, SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                uniformBuffer("triangle_counts", MARCHING_CUBES_COUNTS_BUF),
+                storageImage("float_densities", PARTICLE_DENSITIES_FLOAT_2, IMAGE_STORAGE_R),
+                surface_bricks_compute_usage,
+                storageBuffer("surface_brick_meshes", SURFACE_BRICK_MESHES_BUF, BUFFER_STORAGE_RW),
+                storageBuffer("surface_mesh_commands", SURFACE_MESH_COMMANDS_BUF, BUFFER_STORAGE_R)
+            }, m_accesses)
+        ),
+        m_allocate(
+            fluid_context, "20_surface_allocate_bricks",
+            trackedDescriptors(flow_context, SectionUsages{
+                storageBuffer("surface_brick_meshes", SURFACE_BRICK_MESHES_BUF, BUFFER_STORAGE_RW),
+                storageBuffer("surface_mesh_commands", SURFACE_MESH_COMMANDS_BUF, BUFFER_STORAGE_RW),
+                storageBuffer("surface_remesh_bricks", SURFACE_REMESH_BRICKS_BUF, BUFFER_STORAGE_W)
+            }, m_accesses),
+            Size3{1, 1, 1}
+        ),
+        m_generate(
+            surface_mesh_commands_buffer, surface_mesh_remesh_command_offset,
+            fluid_context, "21_surface_generate_mesh",
+            trackedDescriptors(flow_context, SectionUsages{
+                simulation_parameters_buffer_compute_usage,
+                uniformBuffer("triangle_counts", MARCHING_CUBES_COUNTS_BUF),
+                uniformBuffer("triangle_vertices", MARCHING_CUBES_EDGES_BUF),
+                storageImage("float_densities", PARTICLE_DENSITIES_FLOAT_2, IMAGE_STORAGE_R),
+                storageBuffer("surface_remesh_bricks", SURFACE_REMESH_BRICKS_BUF, BUFFER_STORAGE_R),
+                storageBuffer("surface_brick_meshes", SURFACE_BRICK_MESHES_BUF, BUFFER_STORAGE_R),
+                storageBuffer("surface_vertices", SURFACE_VERTICES_BUF, BUFFER_STORAGE_W),
+                storageBuffer("surface_indices", SURFACE_INDICES_BUF, BUFFER_STORAGE_W)
+            }, m_accesses)
+        ),
+        m_incremental_remesh(incremental_remesh)
+    {
+        float threshold = surface_remesh_threshold;
+        m_mark.getPushConstantData().write("threshold", &threshold, 1);
+        uint32_t max_vertices = surface_mesh_max_vertices, max_indices = surface_mesh_max_indices;
+        uint32_t vertex_granularity = surface_mesh_vertex_granularity, index_granularity = surface_mesh_index_granularity;
+        m_allocate.getPushConstantData().write("max_vertices", &max_vertices, 1);
+        m_allocate.getPushConstantData().write("max_indices", &max_indices, 1);
+        m_allocate.getPushConstantData().write("vertex_granularity", &vertex_granularity, 1);
+        m_allocate.getPushConstantData().write("index_granularity", &index_granularity, 1);
+    }
+    void complete(){
+        m_mark.complete();
+        m_count.complete();
+        m_allocate.complete();
+        m_generate.complete();
+    }
+    //remesh_all makes all active bricks extract their meshes, packed from the start of the mesh buffers. Mesh state isn't initialized before the first step, so it has to be set then
+    void run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context, bool remesh_all){
+        uint32_t remesh_all_value = (remesh_all || !m_incremental_remesh) ? 1 : 0;
+        m_mark.getPushConstantData().write("remesh_all", &remesh_all_value, 1);
+        m_allocate.getPushConstantData().write("remesh_all", &remesh_all_value, 1);
+
+        m_mark.run(command_buffer, flow_context);
+        m_count.run(command_buffer, flow_context);
+        //the draw command and indices of the previous step have to be read before they are overwritten
+        recordIndirectCommandsOverwriteBarrier(command_buffer);
+        {
+            GpuProfileScope profile(command_buffer, "20_surface_allocate_bricks");
+            m_allocate.run(command_buffer, flow_context);
+        }
+        recordIndirectCommandsBarrier(command_buffer);
+        //frames in flight draw the mesh from these buffers, it is overwritten once the previously submitted frame read it
+        recordIndexBufferOverwriteBarrier(command_buffer);
+        recordVertexStorageOverwriteBarrier(command_buffer);
+        m_generate.run(command_buffer, flow_context);
+        recordIndexBufferBarrier(command_buffer);
+    }
+    const vector<SectionAccess>& getAccesses() const{
+        return m_accesses;
+    }
+};
+
+
+/**
+ * SimulationStepSections
+ *  - All sections that run each simulation step - velocity sections, pressure solve, particle sections, surface densities and extraction of the surface mesh
+ *  - If particle_sort_interval isn't 0, particles are sorted by cell at the start of every particle_sort_interval-th step, starting with the first one
+ *  - If sparse_bricks is true, fluid and surface sections only go over active bricks, except during the first step
+ *  - If incremental_remesh is true, only surface meshes of bricks that changed are extracted, except during the first step
+ *  - Several steps can be recorded at once as substeps, described in simulation_constants.h, look for 'Substeps'. Only the last one, and the first step of the simulation, compute the surface
+ *  - With render_frame_count frames in flight, the last substep also writes particles drawn by the given frame, see SimulationParticleSections
+ *  - The whole step is one FlowSectionGraph, which records one merged barrier per level. Variants of the step enable its' nodes, all substeps of one submission share a GraphRecording.
+ *    Surface sections are added first, they count particles at the start of the step and run next to 01 - 05. Images that 01 and 15 count particles into are cleared in the first level
+ */
+class SimulationStepSections{
+    GraphClearSection m_clear_densities;
+    GraphClearSection m_clear_detailed_densities;
+    std::unique_ptr<ParticleSortSections> m_sort;
+    SimulationVelocitySections m_velocities;
+    PressureSolverSections m_pressure;
+    SimulationParticleSections m_particles;
+    SurfaceDensitySections m_surface_densities;
+    SurfaceMeshSections m_surface_mesh;
+    FlowSectionGraph m_graph{"step", true};
+    uint32_t m_sort_node = 0;
+    //nodes that only run when the surface is updated, from the clear of detailed densities to the mesh
+    vector<uint32_t> m_surface_nodes;
+    bool m_remesh_all = true;
+    uint32_t m_particle_sort_interval;
+    bool m_sparse_bricks;
+    uint32_t m_render_frame_count;
+    //number of steps simulated so far, including steps done before a restored checkpoint
+    uint32_t m_step = 0;
+    //the first recorded step processes all bricks and extracts the whole surface mesh, since nothing is known about the state before it
+    bool m_first_step = true;
+    //where barriers of each recorded variant are printed, and variants printed so far
+    std::ostream* m_barrier_report = nullptr;
+    std::set<string> m_reported_variants;
+public:
+    SimulationStepSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes, VkSampler velocities_sampler, VkBuffer particle_commands_buffer, VkBuffer brick_commands_buffer,
+        VkBuffer surface_mesh_commands_buffer, PressureSolver pressure_solver = default_pressure_solver, uint32_t pressure_sweeps_per_dispatch = tiled_pressure_sweeps_per_dispatch, uint32_t particle_sort_interval = default_particle_sort_interval,
+        ParticleBinning particle_binning = default_particle_binning, bool sparse_bricks = default_sparse_bricks, KernelFusion kernel_fusion = default_kernel_fusion, bool incremental_remesh = default_incremental_remesh, uint32_t render_frame_count = 0) :
+        m_clear_densities(flow_context, PARTICLE_DENSITIES_IMG, ClearValue((uint32_t) 0)),
+        m_clear_detailed_densities(flow_context, DETAILED_DENSITIES_IMG, ClearValue(0u)),
+        m_velocities(fluid_context, flow_context, workgroup_sizes, velocities_sampler, particle_commands_buffer, brick_commands_buffer, particle_binning, kernel_fusion),
+        m_pressure  (fluid_context, flow_context, workgroup_sizes, brick_commands_buffer, pressure_solver, pressure_sweeps_per_dispatch),
+        m_particles (fluid_context, flow_context, velocities_sampler, particle_commands_buffer, brick_commands_buffer, render_frame_count),
+        m_surface_densities(fluid_context, flow_context, workgroup_sizes, particle_commands_buffer, brick_commands_buffer, particle_binning),
+        m_surface_mesh(fluid_context, flow_context, brick_commands_buffer, surface_mesh_commands_buffer, incremental_remesh),
+        m_particle_sort_interval(particle_sort_interval),
+        m_sparse_bricks(sparse_bricks),
+        m_render_frame_count(render_frame_count)
+    {
+        if (m_particle_sort_interval != 0) m_sort = std::make_unique<ParticleSortSections>(fluid_context, flow_context, particle_commands_buffer);
+        m_graph.add("01_clear_densities", m_clear_densities);
+        m_surface_nodes.push_back(m_graph.add("15_clear_detailed_densities", m_clear_detailed_densities));
+        if (m_sort){
+            m_sort_node = m_graph.addOpaque("00_sort_particles", m_sort->getAccesses(), [this](GraphRecording& recording){
+                m_sort->run(recording.getCommandBuffer(), recording.getFlowContext());
+            });
+        }
+        for (uint32_t node : m_surface_densities.addTo(m_graph)) m_surface_nodes.push_back(node);
+        m_surface_nodes.push_back(m_graph.addOpaque("19_surface_mesh", m_surface_mesh.getAccesses(), [this](GraphRecording& recording){
+            m_surface_mesh.run(recording.getCommandBuffer(), recording.getFlowContext(), m_remesh_all);
+        }));
+        m_velocities.addTo(m_graph);
+        m_pressure.addTo(m_graph);
+        m_particles.addTo(m_graph);
+    }
+    void complete(){
+        m_clear_densities.complete();
+        m_clear_detailed_densities.complete();
+        if (m_sort) m_sort->complete();
+        m_velocities.complete();
+        m_pressure.complete();
+        m_particles.complete();
+        m_surface_densities.complete();
+        m_surface_mesh.complete();
+    }
+    //record the next substeps steps in one GraphRecording and advance the step counter. The last one writes particles drawn by frame, if frames are rendered. Returns barriers of the recording
+    GraphBarriers run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context, uint32_t substeps = 1, uint32_t frame = 0){
+        GraphRecording recording(command_buffer, flow_context);
+        string variant = "recorded";
+        for (uint32_t i = 0; i < substeps; i++){
+            bool last = i == substeps - 1;
+            bool sort = sortsNextStep(), update_surface = m_first_step || last;
+            variant += variantName(sort, m_first_step, update_surface);
+            record(recording, sort, m_first_step, update_surface, last ? renderFrame(frame) : no_render_frame);
+            advance();
+        }
+        reportBarriers(variant, recording.end());
+        return recording.getBarriers();
+    }
+    //record a step with the given variant into the recording without advancing the step counter, used for pre-recording. first_step processes all bricks and extracts the whole mesh,
+    //update_surface computes densities of the detailed grid and the mesh. Particles are written for render_frame, unless it is no_render_frame
+    void record(GraphRecording& recording, bool sort, bool first_step, bool update_surface = true, uint32_t render_frame = no_render_frame){
+        setVariant(sort, first_step, update_surface, render_frame);
+        m_graph.run(recording);
+    }
+    //call after a step recorded by record() is submitted
+    void advance(){
+        m_first_step = false;
+        m_step++;
+    }
+    bool sortsNextStep() const{
+        return m_sort && m_step % m_particle_sort_interval == 0;
+    }
+    bool isFirstStep() const{
+        return m_first_step;
+    }
+    bool sortsParticles() const{
+        return m_sort != nullptr;
+    }
+    //frame whose particles the last substep of a frame writes, no_render_frame when nothing is rendered
+    uint32_t renderFrame(uint32_t frame) const{
+        return m_render_frame_count != 0 ? frame : no_render_frame;
+    }
+    //print levels of the step with all nodes that can run, and of one pressure solver iteration
+    void dumpSchedule(std::ostream& out){
+        setVariant(m_sort != nullptr, false, true, renderFrame(0));
+        m_graph.dump(out);
+        if (m_pressure.usesGraphs()) m_pressure.getIterationGraph().dump(out);
+    }
+    //print barriers recorded by each variant of substeps of one submission the first time it is recorded, nullptr to stop printing them
+    void setBarrierReport(std::ostream* out){
+        m_barrier_report = out;
+    }
+    //part of the name of a variant reported by reportBarriers() for one substep
+    static string variantName(bool sort, bool first_step, bool update_surface){
+        return string(" [step") + (sort ? ", sort" : "") + (first_step ? ", first" : "") + (update_surface ? ", surface" : "") + "]";
+    }
+    void reportBarriers(const string& variant, const GraphBarriers& barriers){
+        if (m_barrier_report && m_reported_variants.insert(variant).second) barriers.print(*m_barrier_report, variant);
+    }
+    //continue counting steps from a restored checkpoint, so that particles are sorted in the same steps as in the original run
+    void setStep(uint32_t step){
+        m_step = step;
+    }
+    uint32_t getStep() const{
+        return m_step;
+    }
+private:
+    void setVariant(bool sort, bool first_step, bool update_surface, uint32_t render_frame){
+        if (m_sort) m_graph.setEnabled(m_sort_node, sort);
+        for (uint32_t node : m_surface_nodes) m_graph.setEnabled(node, update_surface);
+        m_particles.setRenderFrame(m_graph, render_frame);
+        bool all_bricks_active = !m_sparse_bricks || first_step;
+        m_velocities.setAllBricksActive(all_bricks_active);
+        m_surface_densities.setAllBricksActive(all_bricks_active);
+        m_remesh_all = first_step;
+    }
+};
+
+
+/**
+ * RecordedSimulationStep
+ *  - Submits simulation steps from command buffers recorded once, instead of recording all sections each step. Described in simulation_constants.h, look for 'Pre-recorded steps'
+ *  - All substeps of one submission are recorded into one command buffer, a batch. Batches differ by the number of substeps and by which of them sort particles, each one is recorded the first time it is needed
+ *  - Only the last substep of a batch computes the surface, so every batch leaves images in the layouts of a whole step, and the next one can start from them. Each batch is one GraphRecording,
+ *    which starts with a barrier after everything submitted before it, so batches can follow each other in any order
+ *  - The first step is recorded into the command buffer given by the caller, batches are recorded after it, when the descriptor context holds the states at the end of a step
+ *  - Anything else that transitions descriptors used by the step, like readback or checkpoint sections, makes the recorded batches invalid. The next steps are then recorded by the caller again and batches are recorded again when used
+ */
+class RecordedSimulationStep{
+    struct Batch{
+        CommandBuffer buffer;
+        bool recorded = false;
+        //sections timed by the batch when it was recorded with a profiler
+        vector<uint32_t> profiled_sections;
+    };
+    SimulationStepSections& m_sections;
+    FlowDescriptorContext& m_flow_context;
+    CommandPool& m_command_pool;
+    //batches by the frame in flight they write particles and timestamps for, and whether each of their substeps sorts particles. Nodes of a map don't move, so pending batches stay valid
+    std::map<std::pair<uint32_t, vector<bool>>, Batch> m_batches;
+    //submissions of pre-recorded batches signal nothing, the submission after them does
+    SubmitSynchronization m_step_sync;
+    bool m_recorded = false;
+    //batch selected by the last record() call, nullptr if the steps were recorded by the caller
+    CommandBuffer* m_pending = nullptr;
+public:
+    //command_pool must allow resetting command buffers
+    RecordedSimulationStep(SimulationStepSections& sections, FlowDescriptorContext& flow_context, CommandPool& command_pool) :
+        m_sections(sections),
+        m_flow_context(flow_context),
+        m_command_pool(command_pool)
+    {}
+    //call before the recorded batches are used again after descriptors were transitioned outside of the step, or after a profiler was created or destroyed. They mustn't be executing
+    void invalidate(){
+        m_recorded = false;
+        for (auto& batch : m_batches) batch.second.recorded = false;
+    }
+    //select the batch of the next substeps steps, or record them into command_buffer if no recorded batches can be used. Call instead of SimulationStepSections::run()
+    //frame is the frame in flight the steps are drawn by, its' slot of the active profiler is started too. Batches write timestamps into the queries of that slot, so that profiling times the pre-recorded path
+    void record(CommandBuffer& command_buffer, uint32_t substeps = 1, uint32_t frame = 0){
+        m_pending = nullptr;
+        GpuProfiler* profiler = GpuProfiler::active();
+        if (substeps == 0 || !m_recorded || m_sections.isFirstStep()){
+            if (profiler) profiler->startFrame(command_buffer, frame);
+            if (substeps == 0) return;
+            m_sections.run(command_buffer, m_flow_context, substeps, frame);
+            m_recorded = true;
+            return;
+        }
+        vector<bool> sorts(substeps);
+        for (uint32_t i = 0; i < substeps; i++){
+            sorts[i] = m_sections.sortsNextStep();
+            m_sections.advance();
+        }
+        Batch& selected = batch(frame, sorts);
+        if (profiler) profiler->startFrame(frame, selected.profiled_sections);
+        m_pending = &selected.buffer;
+    }
+    //submit the batch selected by record(), if any, then command_buffer with synchronization. There are at most two submissions, however many substeps there are
+    void submit(Queue& queue, CommandBuffer& command_buffer, SubmitSynchronization& synchronization){
+        if (m_pending) queue.submit(*m_pending, m_step_sync);
+        m_pending = nullptr;
+        queue.submit(command_buffer, synchronization);
+    }
+    //number of batches recorded so far
+    uint32_t batchCount() const{
+        return (uint32_t) m_batches.size();
+    }
+private:
+    //starting to record resets the buffer implicitly. Frames in flight can execute the same batch several times at once
+    Batch& batch(uint32_t frame, const vector<bool>& sorts){
+        auto key = std::make_pair(frame, sorts);
+        auto it = m_batches.find(key);
+        if (it == m_batches.end()) it = m_batches.emplace(key, Batch{m_command_pool.allocateBuffer()}).first;
+        Batch& batch = it->second;
+        if (!batch.recorded){
+            GpuProfiler* profiler = GpuProfiler::active();
+            batch.buffer.startRecordPrimary(VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT);
+            if (profiler) profiler->startReusable(batch.buffer, frame);
+            {
+                GraphRecording recording(batch.buffer, m_flow_context);
+                string variant = "pre-recorded";
+                for (size_t i = 0; i < sorts.size(); i++){
+                    bool last = i == sorts.size() - 1;
+                    variant += SimulationStepSections::variantName(sorts[i], false, last);
+                    m_sections.record(recording, sorts[i], false, last, last ? m_sections.renderFrame(frame) : no_render_frame);
+                }
+                m_sections.reportBarriers(variant, recording.end());
+            }
+            batch.profiled_sections = profiler ? profiler->endReusable() : vector<uint32_t>{};
+            batch.buffer.endRecord();
+            batch.recorded = true;
+        }
+        return batch;
+    }
+};
+
+
+//copy the surface mesh status written by the last step into a slot of the host visible status buffer. Surrounded by its' own barriers, after compute writes and before the host reads it
+inline void recordSurfaceStatusCopy(CommandBuffer& command_buffer, SimulationDescriptors& flow_context, uint32_t slot){
+    VkMemoryBarrier before{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT};
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &before, 0, nullptr, 0, nullptr);
+    VkBufferCopy region{surface_mesh_status_offset, slot * surface_mesh_status_size, surface_mesh_status_size};
+    vkCmdCopyBuffer(command_buffer, flow_context.getSurfaceMeshCommandsBuffer(), flow_context.getSurfaceStatusBuffer(), 1, &region);
+    VkMemoryBarrier after{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT};
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &after, 0, nullptr, 0, nullptr);
+}
+
+
+/**
+ * SurfaceMeshOverflowReport
+ *  - Reports when bricks are left without a surface because the mesh buffers are full, see 'Surface mesh' in simulation_constants.h
+ *  - Each status is only reported when the space needed grows beyond the last reported one, so a full buffer doesn't print every frame
+ */
+class SurfaceMeshOverflowReport{
+    uint32_t m_reported_vertices = 0;
+    uint32_t m_reported_indices = 0;
+    uint32_t m_overflows = 0;
+public:
+    void check(const SurfaceMeshStatus& status){
+        if (status.dropped_bricks == 0) return;
+        m_overflows++;
+        if (status.required_vertices <= m_reported_vertices && status.required_indices <= m_reported_indices) return;
+        m_reported_vertices = std::max(m_reported_vertices, status.required_vertices);
+        m_reported_indices = std::max(m_reported_indices, status.required_indices);
+        std::cerr << "Surface mesh buffers are full, " << status.dropped_bricks << " bricks have no surface. The mesh needs " << status.required_vertices << " vertices and " << status.required_indices
+            << " indices, buffers hold " << surface_mesh_max_vertices << " and " << surface_mesh_max_indices << ", see surface_mesh_max_vertices and surface_mesh_max_indices\n";
+    }
+    //number of checked statuses with dropped bricks
+    uint32_t getOverflowCount() const{
+        return m_overflows;
+    }
+};
+
+
+//make particles written for a frame in flight and the surface mesh visible to the frame drawing them, and copy the surface mesh status into the frame's slot, see recordSurfaceStatusCopy()
+//nothing is copied for drawing, the next step writes particles of another frame and overwrites the mesh only after this frame read it. Described in simulation_constants.h, look for 'Frames in flight'
+inline void recordRenderFrameOutputs(CommandBuffer& command_buffer, SimulationDescriptors& flow_context, uint32_t frame){
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_INDEX_READ_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT};
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+    recordSurfaceStatusCopy(command_buffer, flow_context, frame);
+}
+
+
+//clear draw commands of particles of all frames in flight, so that frames drawn before the first step draw nothing
+inline void recordRenderFramesClear(CommandBuffer& command_buffer, SimulationDescriptors& flow_context){
+    for (uint32_t frame = 0; frame < flow_context.getRenderFrameCount(); frame++){
+        vkCmdFillBuffer(command_buffer, flow_context.getRenderFrameBuffer(frame, RENDER_PARTICLE_COMMANDS), 0, VK_WHOLE_SIZE, 0);
+    }
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT};
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+
 /**
  * RenderParticlesSection
- *  - This section renders all particles in the simulation 
+ *  - This section renders all active particles in the simulation, it is drawn indirectly with one vertex per active particle
+ *  - Positions and the draw command are the ones written by the last step for the given frame in flight, positions are in the order of the active particle list
  */
-class RenderParticlesSection : public FlowGraphicsPushConstantSection{
+class RenderParticlesSection : public IndirectGraphicsSection<>{
 public:
-    RenderParticlesSection(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const PipelineInfo& render_pipeline_info, VkRenderPass render_pass) :
-        FlowGraphicsPushConstantSection(
+    RenderParticlesSection(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, uint32_t frame, VkBuffer render_particle_commands_buffer, const PipelineInfo& render_pipeline_info, VkRenderPass render_pass) :
+        IndirectGraphicsSection<>(
+            render_particle_commands_buffer, 0,
             fluid_context, "30_render_particles",
             FlowPipelineSectionDescriptors{
                 flow_context,
                 vector<FlowPipelineSectionDescriptorUsage>{
                     FlowUniformBuffer("simulation_params_buffer", SIMULATION_PARAMS_BUF, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, BufferState{BUFFER_UNIFORM}),
-                    FlowStorageBuffer{"particles", PARTICLES_BUF, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, BufferState{BUFFER_STORAGE_R}}
+                    FlowStorageBuffer{"particles", renderFrameBuffer(frame, RENDER_PARTICLES), VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, BufferState{BUFFER_STORAGE_R}}
                 }
             },
-            particle_space_size, render_pipeline_info, render_pass
+            render_pipeline_info, render_pass
         )
     {}
 };
 
 
 /**
- * RenderParticlesSection
- *  - This section renders the fluid surface
+ * RenderSurfaceSection
+ *  - This section renders the fluid surface mesh written by SurfaceMeshSections, it is drawn with one indexed indirect draw
+ *  - The mesh is drawn from the buffers the simulation writes, the next step overwrites them only after the frame read them. See 'Frames in flight' in simulation_constants.h
  */
-class RenderSurfaceSection : public FlowGraphicsPushConstantSection{
+class RenderSurfaceSection : public IndirectIndexedGraphicsSection<>{
 public:
-    RenderSurfaceSection(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const PipelineInfo& render_pipeline_info, VkRenderPass render_pass) :
-        FlowGraphicsPushConstantSection(
+    RenderSurfaceSection(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, VkBuffer surface_mesh_commands_buffer, VkBuffer surface_indices_buffer, const PipelineInfo& render_pipeline_info, VkRenderPass render_pass) :
+        IndirectIndexedGraphicsSection<>(
+            surface_mesh_commands_buffer, surface_mesh_draw_command_offset, surface_indices_buffer,
             fluid_context, "31_render_surface",
             FlowPipelineSectionDescriptors{
                 flow_context,
                 vector<FlowPipelineSectionDescriptorUsage>{
-                    FlowUniformBuffer("simulation_params_buffer", SIMULATION_PARAMS_BUF, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, BufferState{BUFFER_UNIFORM}),
-                    FlowUniformBuffer{"triangle_counts", MARCHING_CUBES_COUNTS_BUF, VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT, BufferState{BUFFER_UNIFORM}},
-                    FlowUniformBuffer{"triangle_vertices", MARCHING_CUBES_EDGES_BUF, VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT, BufferState{BUFFER_UNIFORM}},
-                    FlowStorageImage{"float_densities", PARTICLE_DENSITIES_FLOAT_2, VK_PIPELINE_STAGE_GEOMETRY_SHADER_BIT, ImageState{IMAGE_STORAGE_R}}
+                    FlowUniformBuffer("simulation_params_buffer", SIMULATION_PARAMS_BUF, VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT, BufferState{BUFFER_UNIFORM}),
+                    FlowStorageBuffer{"surface_vertices", SURFACE_VERTICES_BUF, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, BufferState{BUFFER_STORAGE_R}}
                 }
             },
-            fluid_surface_render_size.volume(), render_pipeline_info, render_pass
+            render_pipeline_info, render_pass
         )
     {}
 };
@@ -463,6 +1823,7 @@ public:
 /**
  * RenderSections
  *  - Contains three subsections, one for rendering particles, other for surface, third for data. They can be toggled on / off in real time using flags particles_on, surface_on and data_on
+ *  - Particles are drawn from the buffers of one frame in flight, there is one RenderSections object per frame
  */
 class RenderSections{
     RenderParticlesSection m_particles;
@@ -473,9 +1834,10 @@ public:
     bool surface_on = true;
     bool data_on = false;
 
-    RenderSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const PipelineInfo& render_pipeline_info, VkRenderPass render_pass) :
-        m_particles (fluid_context, flow_context, render_pipeline_info, render_pass),
-        m_surface   (fluid_context, flow_context, render_pipeline_info, render_pass),
+    //particles and data are drawn as points using render_pipeline_info, the surface is drawn as triangles using surface_pipeline_info
+    RenderSections(DirectoryPipelinesContext& fluid_context, SimulationDescriptors& flow_context, uint32_t frame, const PipelineInfo& render_pipeline_info, const PipelineInfo& surface_pipeline_info, VkRenderPass render_pass) :
+        m_particles (fluid_context, flow_context, frame, flow_context.getRenderFrameBuffer(frame, RENDER_PARTICLE_COMMANDS), render_pipeline_info, render_pass),
+        m_surface   (fluid_context, flow_context, flow_context.getSurfaceMeshCommandsBuffer(), flow_context.getSurfaceIndicesBuffer(), surface_pipeline_info, render_pass),
         m_data      (fluid_context, flow_context, render_pipeline_info, render_pass)
     {}
     void complete(){
@@ -492,16 +1854,22 @@ public:
     void execute(CommandBuffer& command_buffer, const glm::mat4& MVP){
         //for each section - if enabled, write MVP matrix, then render using it
         if (particles_on){
+            GpuProfileScope profile(command_buffer, "30_render_particles");
             m_particles.getPushConstantData().write("MVP", glm::value_ptr(MVP), 16);
             m_particles.execute(command_buffer);
         }
         if (surface_on){
+            GpuProfileScope profile(command_buffer, "31_render_surface");
             m_surface.getPushConstantData().write("MVP", glm::value_ptr(MVP), 16);
             m_surface.execute(command_buffer);
         }
         if (data_on){
+            GpuProfileScope profile(command_buffer, "32_debug_display_data");
             m_data.getPushConstantData().write("MVP", glm::value_ptr(MVP), 16);
             m_data.execute(command_buffer);
         }
     }
 };
+
+
+#endif
\ No newline at end of file
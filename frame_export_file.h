@@ -0,0 +1,456 @@
+#ifndef FRAME_EXPORT_FILE_H
+#define FRAME_EXPORT_FILE_H
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+
+#include "simulation_constants.h"
+#include "mapped_file.h"
+
+
+using std::vector;
+using std::string;
+
+
+
+/**
+ * Export file format
+ *  - Exported frames are appended to one binary file, little endian, each structure below is written as is
+ *    - File header, then frames one after another, each one is a frame header followed by particle data and surface data
+ *    - When the file is closed, an index with the offset of each frame is appended, followed by a trailer pointing at the index
+ *    - If the exporting process ends before the file is closed, the index is missing, readers find frames by walking frame headers from the start instead
+ *  - Particles - only active particles are saved, their positions are in the same space as in the particles buffer
+ *    - EXPORT_FLOAT - 3 floats per particle
+ *    - EXPORT_QUANTIZED - 3 16 bit unsigned integers per particle, positions are scaled so that the domain bounds from the file header map to 0 - 65535
+ *    - EXPORT_DELTA - keyframes are quantized, other frames save the difference of each quantized component from the previous frame, zigzag and varint encoded (1 byte for moves up to 63 units)
+ *      A frame is a keyframe every export_keyframe_interval frames, and whenever the number of particles changes. Decoding a frame starts at its' keyframe
+ *  - Surface - triangles of the surface mesh without degenerate ones, and the vertices they use
+ *    - EXPORT_FLOAT - position and normal, 6 floats per vertex
+ *    - Other encodings - quantized position (3x 16 bit) and normal (3x 8 bit signed), 9 bytes per vertex
+ *    - Indices are 32 bit, 3 per triangle, relative to the first vertex of the frame
+ */
+constexpr uint32_t export_file_magic = 0x46584c46;     //"FLXF"
+constexpr uint32_t export_frame_magic = 0x4d415246;    //"FRAM"
+constexpr uint32_t export_index_magic = 0x49584c46;    //"FLXI"
+constexpr uint32_t export_file_version = 1;
+
+//frame flags
+constexpr uint32_t export_frame_keyframe = 1;
+constexpr uint32_t export_frame_has_surface = 2;
+//the surface mesh didn't fit into the staging buffer, only its' first part was saved
+constexpr uint32_t export_frame_surface_truncated = 4;
+
+struct ExportFileHeader{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t encoding;              //ExportEncoding
+    uint32_t keyframe_interval;
+    float bounds_min[3];            //domain that quantized positions are scaled to
+    float bounds_max[3];
+    uint32_t reserved[2];
+};
+struct ExportFrameHeader{
+    uint32_t magic;
+    uint32_t frame;                 //number of the frame in the file
+    uint32_t step;                  //simulation step the frame was captured after
+    uint32_t flags;
+    uint32_t particle_count;
+    uint32_t vertex_count;
+    uint32_t index_count;
+    uint32_t keyframe;              //frame that decoding of this one starts at
+    uint64_t particle_bytes;
+    uint64_t surface_bytes;
+};
+struct ExportIndexEntry{
+    uint64_t offset;                //offset of the frame header from the start of the file
+    uint64_t size;                  //frame header and data, in bytes
+};
+struct ExportFileTrailer{
+    uint64_t index_offset;
+    uint32_t frame_count;
+    uint32_t magic;
+};
+static_assert(sizeof(ExportFileHeader) == 48 && sizeof(ExportFrameHeader) == 48 && sizeof(ExportIndexEntry) == 16 && sizeof(ExportFileTrailer) == 16, "Export structures are written as is");
+
+
+
+//quantization of positions within the domain, and zigzag varints used by delta frames
+inline uint16_t quantizeCoordinate(float value, float min, float max){
+    float t = std::clamp((value - min) / (max - min), 0.f, 1.f);
+    return (uint16_t) std::lround(t * 65535.f);
+}
+inline float dequantizeCoordinate(uint16_t value, float min, float max){
+    return min + (max - min) * (value / 65535.f);
+}
+inline void writeVarint(vector<uint8_t>& out, int32_t value){
+    uint32_t zigzag = ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+    while (zigzag >= 0x80){
+        out.push_back((uint8_t) (zigzag | 0x80));
+        zigzag >>= 7;
+    }
+    out.push_back((uint8_t) zigzag);
+}
+//returns false if data ends in the middle of the value
+inline bool readVarint(const uint8_t*& data, const uint8_t* end, int32_t& value){
+    uint32_t zigzag = 0;
+    for (uint32_t shift = 0; shift < 35; shift += 7){
+        if (data == end) return false;
+        uint8_t byte = *data++;
+        zigzag |= (uint32_t) (byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0){
+            value = (int32_t) (zigzag >> 1) ^ -(int32_t) (zigzag & 1);
+            return true;
+        }
+    }
+    return false;
+}
+template<typename T>
+void appendBytes(vector<uint8_t>& out, const T* data, size_t count){
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(data);
+    out.insert(out.end(), bytes, bytes + count * sizeof(T));
+}
+
+
+
+/**
+ * ExportFrameEncoder
+ *  - Turns active particles and the surface mesh of one step into the data of one frame, keeps the previous frame for delta encoding
+ *  - Vertices and indices are given the way they are in the surface mesh buffers - unreferenced vertices and degenerate triangles are left out here
+ */
+class ExportFrameEncoder{
+    ExportEncoding m_encoding;
+    uint32_t m_keyframe_interval;
+    glm::vec3 m_bounds_min, m_bounds_max;
+    //quantized particles of the previous frame and the keyframe it depends on
+    vector<uint16_t> m_previous;
+    uint32_t m_last_keyframe = 0;
+    //index of each surface vertex in the frame, reused between frames
+    vector<uint32_t> m_vertex_map;
+public:
+    ExportFrameEncoder(ExportEncoding encoding, uint32_t keyframe_interval, glm::vec3 bounds_min, glm::vec3 bounds_max) :
+        m_encoding(encoding), m_keyframe_interval(std::max(1u, keyframe_interval)), m_bounds_min(bounds_min), m_bounds_max(bounds_max)
+    {}
+    ExportFileHeader fileHeader() const{
+        return ExportFileHeader{export_file_magic, export_file_version, (uint32_t) m_encoding, m_keyframe_interval,
+            {m_bounds_min.x, m_bounds_min.y, m_bounds_min.z}, {m_bounds_max.x, m_bounds_max.y, m_bounds_max.z}, {0, 0}};
+    }
+    //particles are vec4 positions, w is active_particle_w for active ones. Writes the frame header and all data into out
+    void encode(uint32_t frame, uint32_t step, const glm::vec4* particles, uint32_t particle_space, vector<uint8_t>& out){
+        encode(frame, step, particles, particle_space, nullptr, 0, nullptr, 0, false, out);
+    }
+    //surface vertices are position and normal, 2x vec4 each, as in the surface vertices buffer
+    void encode(uint32_t frame, uint32_t step, const glm::vec4* particles, uint32_t particle_space, const glm::vec4* vertices, uint32_t vertex_count, const uint32_t* indices, uint32_t index_count,
+        bool surface_truncated, vector<uint8_t>& out)
+    {
+        out.clear();
+        out.resize(sizeof(ExportFrameHeader));
+        ExportFrameHeader header{export_frame_magic, frame, step, 0, 0, 0, 0, frame, 0, 0};
+
+        //particles
+        size_t particles_start = out.size();
+        vector<uint16_t> quantized;
+        for (uint32_t i = 0; i < particle_space; i++){
+            if (particles[i].w != active_particle_w) continue;
+            header.particle_count++;
+            if (m_encoding == ExportEncoding::EXPORT_FLOAT){
+                appendBytes(out, &particles[i].x, 3);
+            }else{
+                for (int c = 0; c < 3; c++) quantized.push_back(quantizeCoordinate(particles[i][c], m_bounds_min[c], m_bounds_max[c]));
+            }
+        }
+        bool keyframe = m_encoding != ExportEncoding::EXPORT_DELTA || frame == 0 || frame - m_last_keyframe >= m_keyframe_interval || quantized.size() != m_previous.size();
+        if (m_encoding == ExportEncoding::EXPORT_QUANTIZED || (m_encoding == ExportEncoding::EXPORT_DELTA && keyframe)){
+            appendBytes(out, quantized.data(), quantized.size());
+        }else if (m_encoding == ExportEncoding::EXPORT_DELTA){
+            for (size_t k = 0; k < quantized.size(); k++) writeVarint(out, (int32_t) quantized[k] - (int32_t) m_previous[k]);
+        }
+        if (keyframe) m_last_keyframe = frame;
+        header.keyframe = m_last_keyframe;
+        if (keyframe) header.flags |= export_frame_keyframe;
+        if (m_encoding == ExportEncoding::EXPORT_DELTA) m_previous.swap(quantized);
+        header.particle_bytes = out.size() - particles_start;
+
+        //surface
+        if (vertices){
+            size_t surface_start = out.size();
+            header.flags |= export_frame_has_surface;
+            if (surface_truncated) header.flags |= export_frame_surface_truncated;
+            m_vertex_map.assign(vertex_count, UINT32_MAX);
+            vector<uint32_t> frame_indices;
+            vector<uint32_t> used_vertices;
+            for (uint32_t t = 0; t + 2 < index_count; t += 3){
+                const uint32_t* triangle = indices + t;
+                //unused parts of brick ranges are filled with degenerate triangles
+                if (triangle[0] == triangle[1] && triangle[1] == triangle[2]) continue;
+                if (triangle[0] >= vertex_count || triangle[1] >= vertex_count || triangle[2] >= vertex_count) continue;
+                for (int k = 0; k < 3; k++){
+                    uint32_t& mapped = m_vertex_map[triangle[k]];
+                    if (mapped == UINT32_MAX){
+                        mapped = (uint32_t) used_vertices.size();
+                        used_vertices.push_back(triangle[k]);
+                    }
+                    frame_indices.push_back(mapped);
+                }
+            }
+            for (uint32_t v : used_vertices){
+                glm::vec3 position(vertices[2 * v]), normal(vertices[2 * v + 1]);
+                if (m_encoding == ExportEncoding::EXPORT_FLOAT){
+                    appendBytes(out, &position.x, 3);
+                    appendBytes(out, &normal.x, 3);
+                }else{
+                    uint16_t p[3];
+                    int8_t n[3];
+                    for (int c = 0; c < 3; c++){
+                        p[c] = quantizeCoordinate(position[c], m_bounds_min[c], m_bounds_max[c]);
+                        n[c] = (int8_t) std::lround(std::clamp(normal[c], -1.f, 1.f) * 127.f);
+                    }
+                    appendBytes(out, p, 3);
+                    appendBytes(out, n, 3);
+                }
+            }
+            appendBytes(out, frame_indices.data(), frame_indices.size());
+            header.vertex_count = (uint32_t) used_vertices.size();
+            header.index_count = (uint32_t) frame_indices.size();
+            header.surface_bytes = out.size() - surface_start;
+        }
+        std::memcpy(out.data(), &header, sizeof(header));
+    }
+};
+
+
+
+/**
+ * ExportFileWriter
+ *  - Appends encoded frames to the export file and remembers where each one starts, the index and trailer are written by close()
+ */
+class ExportFileWriter{
+    std::ofstream m_file;
+    vector<ExportIndexEntry> m_index;
+    uint64_t m_offset = 0;
+public:
+    //returns false if the file can't be created
+    bool open(const string& path, const ExportFileHeader& header){
+        m_file.open(path, std::ios::binary | std::ios::trunc);
+        if (!m_file) return false;
+        m_file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        m_offset = sizeof(header);
+        return bool(m_file);
+    }
+    //frame is the output of ExportFrameEncoder::encode
+    bool append(const vector<uint8_t>& frame){
+        m_file.write(reinterpret_cast<const char*>(frame.data()), frame.size());
+        m_index.push_back({m_offset, frame.size()});
+        m_offset += frame.size();
+        return bool(m_file);
+    }
+    bool close(){
+        if (!m_file.is_open()) return true;
+        ExportFileTrailer trailer{m_offset, (uint32_t) m_index.size(), export_index_magic};
+        m_file.write(reinterpret_cast<const char*>(m_index.data()), m_index.size() * sizeof(ExportIndexEntry));
+        m_file.write(reinterpret_cast<const char*>(&trailer), sizeof(trailer));
+        bool ok = bool(m_file);
+        m_file.close();
+        return ok;
+    }
+    uint64_t bytesWritten() const{
+        return m_offset;
+    }
+};
+
+
+
+/**
+ * ExportFileReader
+ *  - Memory maps an export file, any frame can be decoded without reading the ones before it, except for frames of the same keyframe with delta encoding
+ *  - Uses the index at the end of the file, or walks frame headers if the file wasn't closed
+ */
+class ExportFileReader{
+    MappedFile m_file;
+    ExportFileHeader m_header;
+    vector<ExportIndexEntry> m_index;
+    bool m_has_index = false;
+public:
+    //returns false if the file can't be mapped or isn't an export file
+    bool open(const string& path){
+        m_index.clear();
+        if (!m_file.open(path) || m_file.size() < sizeof(ExportFileHeader)) return false;
+        std::memcpy(&m_header, m_file.data(), sizeof(m_header));
+        if (m_header.magic != export_file_magic || m_header.version != export_file_version) return false;
+
+        //index written by ExportFileWriter::close()
+        if (m_file.size() >= sizeof(ExportFileHeader) + sizeof(ExportFileTrailer)){
+            ExportFileTrailer trailer;
+            std::memcpy(&trailer, m_file.data() + m_file.size() - sizeof(trailer), sizeof(trailer));
+            uint64_t index_bytes = (uint64_t) trailer.frame_count * sizeof(ExportIndexEntry);
+            if (trailer.magic == export_index_magic && trailer.index_offset + index_bytes + sizeof(trailer) == m_file.size()){
+                m_index.resize(trailer.frame_count);
+                std::memcpy(m_index.data(), m_file.data() + trailer.index_offset, index_bytes);
+                m_has_index = true;
+                return true;
+            }
+        }
+        //no index, find all complete frames
+        m_has_index = false;
+        uint64_t offset = sizeof(ExportFileHeader);
+        while (offset + sizeof(ExportFrameHeader) <= m_file.size()){
+            ExportFrameHeader frame;
+            std::memcpy(&frame, m_file.data() + offset, sizeof(frame));
+            uint64_t size = sizeof(frame) + frame.particle_bytes + frame.surface_bytes;
+            if (frame.magic != export_frame_magic || offset + size > m_file.size()) break;
+            m_index.push_back({offset, size});
+            offset += size;
+        }
+        return true;
+    }
+    const ExportFileHeader& fileHeader() const{
+        return m_header;
+    }
+    bool hasIndex() const{
+        return m_has_index;
+    }
+    uint32_t frameCount() const{
+        return (uint32_t) m_index.size();
+    }
+    uint64_t fileSize() const{
+        return m_file.size();
+    }
+    ExportFrameHeader frameHeader(uint32_t frame) const{
+        ExportFrameHeader header;
+        std::memcpy(&header, m_file.data() + m_index[frame].offset, sizeof(header));
+        return header;
+    }
+    //positions of all saved particles of a frame, returns false if the data is damaged
+    bool readParticles(uint32_t frame, vector<glm::vec3>& positions) const{
+        ExportFrameHeader header = frameHeader(frame);
+        positions.clear();
+        if (m_header.encoding == (uint32_t) ExportEncoding::EXPORT_FLOAT){
+            positions.resize(header.particle_count);
+            if (header.particle_bytes != positions.size() * sizeof(glm::vec3)) return false;
+            std::memcpy(positions.data(), particleData(frame), header.particle_bytes);
+            return true;
+        }
+        //quantized components, delta frames are applied one after another starting with the keyframe
+        vector<uint16_t> quantized;
+        uint32_t first = (m_header.encoding == (uint32_t) ExportEncoding::EXPORT_DELTA) ? header.keyframe : frame;
+        for (uint32_t f = first; f <= frame; f++){
+            ExportFrameHeader h = frameHeader(f);
+            const uint8_t* data = particleData(f);
+            if (f == first){
+                quantized.resize(3 * (size_t) h.particle_count);
+                if (h.particle_bytes != quantized.size() * sizeof(uint16_t)) return false;
+                std::memcpy(quantized.data(), data, h.particle_bytes);
+            }else{
+                if (h.particle_count * 3 != quantized.size()) return false;
+                const uint8_t* end = data + h.particle_bytes;
+                for (uint16_t& q : quantized){
+                    int32_t delta;
+                    if (!readVarint(data, end, delta)) return false;
+                    q = (uint16_t) (q + delta);
+                }
+            }
+        }
+        positions.resize(header.particle_count);
+        for (size_t i = 0; i < positions.size(); i++){
+            for (int c = 0; c < 3; c++) positions[i][c] = dequantizeCoordinate(quantized[3 * i + c], m_header.bounds_min[c], m_header.bounds_max[c]);
+        }
+        return true;
+    }
+    //surface mesh of a frame, empty if the frame has none
+    bool readSurface(uint32_t frame, vector<glm::vec3>& positions, vector<glm::vec3>& normals, vector<uint32_t>& indices) const{
+        ExportFrameHeader header = frameHeader(frame);
+        positions.resize(header.vertex_count);
+        normals.resize(header.vertex_count);
+        indices.resize(header.index_count);
+        const uint8_t* data = particleData(frame) + header.particle_bytes;
+        bool is_float = m_header.encoding == (uint32_t) ExportEncoding::EXPORT_FLOAT;
+        size_t vertex_bytes = is_float ? 6 * sizeof(float) : 3 * sizeof(uint16_t) + 3;
+        if (header.surface_bytes != header.vertex_count * vertex_bytes + header.index_count * sizeof(uint32_t)) return false;
+        for (uint32_t v = 0; v < header.vertex_count; v++, data += vertex_bytes){
+            if (is_float){
+                std::memcpy(&positions[v], data, sizeof(glm::vec3));
+                std::memcpy(&normals[v], data + sizeof(glm::vec3), sizeof(glm::vec3));
+            }else{
+                uint16_t p[3];
+                int8_t n[3];
+                std::memcpy(p, data, sizeof(p));
+                std::memcpy(n, data + sizeof(p), sizeof(n));
+                for (int c = 0; c < 3; c++){
+                    positions[v][c] = dequantizeCoordinate(p[c], m_header.bounds_min[c], m_header.bounds_max[c]);
+                    normals[v][c] = n[c] / 127.f;
+                }
+            }
+        }
+        std::memcpy(indices.data(), data, header.index_count * sizeof(uint32_t));
+        return true;
+    }
+private:
+    const uint8_t* particleData(uint32_t frame) const{
+        return m_file.data() + m_index[frame].offset + sizeof(ExportFrameHeader);
+    }
+};
+
+
+
+/**
+ * runExportInfo
+ *  - Maps an export file, prints its' header and a summary of all frames, then decodes the first, middle and last frame to check that random access works
+ */
+inline int runExportInfo(const string& path){
+    ExportFileReader reader;
+    if (!reader.open(path)){
+        std::cerr << "Could not read export file " << path << "\n";
+        return 1;
+    }
+    const ExportFileHeader& header = reader.fileHeader();
+    const char* encodings[] = {"float", "quantized", "delta"};
+    uint64_t particle_bytes = 0, surface_bytes = 0, particles = 0, keyframes = 0;
+    for (uint32_t f = 0; f < reader.frameCount(); f++){
+        ExportFrameHeader h = reader.frameHeader(f);
+        particle_bytes += h.particle_bytes;
+        surface_bytes += h.surface_bytes;
+        particles += h.particle_count;
+        if (h.flags & export_frame_keyframe) keyframes++;
+    }
+    std::cout << std::fixed << std::setprecision(3)
+        << "Export file " << path << "\n"
+        << "  encoding:              " << encodings[std::min(header.encoding, 2u)] << "\n"
+        << "  index:                 " << (reader.hasIndex() ? "present" : "missing, frames were found by walking the file") << "\n"
+        << "  frames:                " << reader.frameCount() << " (" << keyframes << " keyframes)\n"
+        << "  file size:             " << reader.fileSize() / (1024.0 * 1024.0) << " MB\n"
+        << "  particle data:         " << particle_bytes / (1024.0 * 1024.0) << " MB, " << (particles ? 1.0 * particle_bytes / particles : 0.0) << " bytes per particle\n"
+        << "  surface data:          " << surface_bytes / (1024.0 * 1024.0) << " MB\n";
+
+    if (reader.frameCount() == 0) return 0;
+    uint32_t checked[] = {0, reader.frameCount() / 2, reader.frameCount() - 1};
+    vector<glm::vec3> positions, vertices, normals;
+    vector<uint32_t> indices;
+    for (uint32_t f : checked){
+        ExportFrameHeader h = reader.frameHeader(f);
+        if (!reader.readParticles(f, positions) || !reader.readSurface(f, vertices, normals, indices)){
+            std::cerr << "Frame " << f << " is damaged\n";
+            return 1;
+        }
+        glm::vec3 low(INFINITY), high(-INFINITY);
+        for (const glm::vec3& p : positions){
+            low = glm::min(low, p);
+            high = glm::max(high, p);
+        }
+        std::cout << "  frame " << f << " (step " << h.step << "): " << h.particle_count << " particles";
+        if (!positions.empty()) std::cout << " in (" << low.x << ", " << low.y << ", " << low.z << ") - (" << high.x << ", " << high.y << ", " << high.z << ")";
+        if (h.flags & export_frame_has_surface) std::cout << ", " << h.index_count / 3 << " triangles" << ((h.flags & export_frame_surface_truncated) ? " (truncated)" : "");
+        std::cout << "\n";
+    }
+    return 0;
+}
+
+
+#endif
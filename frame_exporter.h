@@ -0,0 +1,246 @@
+#ifndef FRAME_EXPORTER_H
+#define FRAME_EXPORTER_H
+
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <iomanip>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "fluid_flow_sections.h"
+#include "frame_export_file.h"
+#include "run_settings.h"
+
+
+
+//how long the writer thread waits for one copy into a staging buffer
+const uint64_t export_copy_timeout = 60 * SYNC_SECOND;
+
+//make shader writes of the simulation step visible to copies into staging buffers
+inline void recordExportCopyBarrier(CommandBuffer& command_buffer){
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_TRANSFER_READ_BIT};
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+//make copied data visible to the host, and keep compute shaders of later steps from overwriting the copied buffers before the copies finish
+inline void recordExportReadbackBarrier(CommandBuffer& command_buffer){
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT};
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+
+
+/**
+ * FrameExporter
+ *  - Streams particles, and optionally the surface mesh, into an export file. Described in simulation_constants.h, look for 'Frame export'
+ *  - capture() is called after each simulation step is submitted, on the same queue. Every interval-th step, it records copies into the next staging buffer of the ring and submits them with its' own fence
+ *  - With substeps, only the state after the last substep of a submission can be captured, it is saved with the number of that step
+ *  - The writer thread waits for each fence in the order frames were captured, encodes the frame from the mapped staging buffer, releases it, and appends the frame to the file
+ *  - Staging buffers are only waited for by capture() when the writer falls behind by the whole ring, the number of such waits is reported
+ */
+class FrameExporter{
+    struct StagingSlot{
+        Buffer buffer;
+        std::unique_ptr<BufferMemoryObject> memory;
+        CommandBuffer command_buffer;
+        SubmitSynchronization sync;
+        //whether the slot holds a frame that the writer thread hasn't encoded yet
+        bool busy = false;
+
+        StagingSlot(CommandPool& command_pool, VkDeviceSize size) :
+            buffer(BufferInfo(size, VK_BUFFER_USAGE_TRANSFER_DST_BIT).create()),
+            command_buffer(command_pool.allocateBuffer())
+        {
+            memory = std::make_unique<BufferMemoryObject>(vector<Buffer>{buffer}, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+            sync.setEndFence(Fence());
+        }
+    };
+    struct FrameJob{
+        uint32_t slot;
+        uint32_t frame;
+        uint32_t step;
+    };
+
+    string m_path;
+    bool m_export_surface;
+    uint32_t m_interval;
+    VkBuffer m_particles_buffer;
+    VkBuffer m_surface_mesh_commands_buffer;
+    VkBuffer m_surface_vertices_buffer;
+    VkBuffer m_surface_indices_buffer;
+    //layout of each staging buffer - particles, then surface mesh commands, vertices and indices if the surface is exported
+    VkDeviceSize m_commands_offset, m_vertices_offset, m_indices_offset, m_slot_size;
+    vector<std::unique_ptr<StagingSlot>> m_slots;
+    uint32_t m_next_slot = 0;
+    uint32_t m_step = 0;
+    uint32_t m_frame = 0;
+
+    ExportFrameEncoder m_encoder;
+    ExportFileWriter m_writer;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_jobs_changed;
+    std::condition_variable m_slot_freed;
+    std::deque<FrameJob> m_jobs;
+    bool m_stop = false;
+    bool m_failed = false;
+    bool m_finished = false;
+    //statistics
+    uint32_t m_frames_written = 0;
+    uint32_t m_stalls = 0;
+public:
+    FrameExporter(SimulationDescriptors& flow_context, CommandPool& command_pool, const RunSettings& settings) :
+        m_path(settings.export_path),
+        m_export_surface(settings.export_surface),
+        m_interval(settings.export_interval),
+        m_particles_buffer(flow_context.getParticlesBuffer()),
+        m_surface_mesh_commands_buffer(flow_context.getSurfaceMeshCommandsBuffer()),
+        m_surface_vertices_buffer(flow_context.getSurfaceVerticesBuffer()),
+        m_surface_indices_buffer(flow_context.getSurfaceIndicesBuffer()),
+        m_encoder(settings.export_encoding, export_keyframe_interval, glm::vec3(0.f), glm::vec3(fluid_size.x, fluid_size.y, fluid_size.z))
+    {
+        m_commands_offset = particle_space_size * sizeof(glm::vec4);
+        m_vertices_offset = m_commands_offset + surface_mesh_commands_size;
+        m_indices_offset = m_vertices_offset + surfaceVertexCapacity() * surface_mesh_vertex_size;
+        m_slot_size = m_export_surface ? m_indices_offset + surfaceIndexCapacity() * sizeof(uint32_t) : m_commands_offset;
+        for (uint32_t i = 0; i < export_ring_size; i++) m_slots.push_back(std::make_unique<StagingSlot>(command_pool, m_slot_size));
+
+        if (!m_writer.open(m_path, m_encoder.fileHeader())){
+            std::cerr << "Could not create export file " << m_path << "\n";
+            m_failed = true;
+        }
+        m_thread = std::thread([this](){ writeFrames(); });
+    }
+    FrameExporter(const FrameExporter&) = delete;
+    FrameExporter& operator=(const FrameExporter&) = delete;
+    ~FrameExporter(){
+        finish();
+    }
+    //call after submitting each simulation step to queue, or a submission of several substeps. The state after them is exported if any one of them is an interval-th step
+    void capture(Queue& queue, uint32_t steps = 1){
+        uint32_t first_step = m_step;
+        m_step += steps;
+        uint32_t step = m_step - 1;
+        if ((first_step + m_interval - 1) / m_interval * m_interval > step) return;
+        uint32_t slot_index = m_next_slot;
+        StagingSlot& slot = *m_slots[slot_index];
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (m_failed) return;
+            //the writer thread is still encoding the frame captured export_ring_size frames ago
+            if (slot.busy){
+                m_stalls++;
+                m_slot_freed.wait(lock, [&](){ return !slot.busy || m_failed; });
+                if (m_failed) return;
+            }
+            slot.busy = true;
+        }
+        m_next_slot = (m_next_slot + 1) % export_ring_size;
+
+        //the fence of this slot was waited for by the writer thread, so its' command buffer can be recorded again
+        slot.command_buffer.resetBuffer(false);
+        slot.command_buffer.startRecordPrimary(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        recordExportCopyBarrier(slot.command_buffer);
+        VkBufferCopy particles{0, 0, m_commands_offset};
+        vkCmdCopyBuffer(slot.command_buffer, m_particles_buffer, slot.buffer, 1, &particles);
+        if (m_export_surface){
+            VkBufferCopy commands{0, m_commands_offset, surface_mesh_commands_size};
+            VkBufferCopy vertices{0, m_vertices_offset, surfaceVertexCapacity() * surface_mesh_vertex_size};
+            VkBufferCopy indices{0, m_indices_offset, surfaceIndexCapacity() * sizeof(uint32_t)};
+            vkCmdCopyBuffer(slot.command_buffer, m_surface_mesh_commands_buffer, slot.buffer, 1, &commands);
+            vkCmdCopyBuffer(slot.command_buffer, m_surface_vertices_buffer, slot.buffer, 1, &vertices);
+            vkCmdCopyBuffer(slot.command_buffer, m_surface_indices_buffer, slot.buffer, 1, &indices);
+        }
+        recordExportReadbackBarrier(slot.command_buffer);
+        slot.command_buffer.endRecord();
+        queue.submit(slot.command_buffer, slot.sync);
+
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_jobs.push_back({slot_index, m_frame++, step});
+        }
+        m_jobs_changed.notify_one();
+    }
+    //write all captured frames, then the index of the file. Returns false if writing failed
+    bool finish(){
+        if (m_finished) return !m_failed;
+        m_finished = true;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_jobs_changed.notify_one();
+        m_thread.join();
+        if (!m_writer.close()) m_failed = true;
+        return !m_failed;
+    }
+    void printSummary() const{
+        std::cout << std::fixed << std::setprecision(3)
+            << "Export to " << m_path << (m_failed ? " failed" : " finished") << "\n"
+            << "  frames:                " << m_frames_written << "\n"
+            << "  file size:             " << m_writer.bytesWritten() / (1024.0 * 1024.0) << " MB\n"
+            << "  staging buffer waits:  " << m_stalls << "\n";
+    }
+private:
+    static uint32_t surfaceVertexCapacity(){
+        return std::min(export_surface_max_vertices, surface_mesh_max_vertices);
+    }
+    static uint32_t surfaceIndexCapacity(){
+        return std::min(export_surface_max_indices, surface_mesh_max_indices);
+    }
+    //body of the writer thread
+    void writeFrames(){
+        vector<uint8_t> frame_data;
+        while (true){
+            FrameJob job;
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_jobs_changed.wait(lock, [&](){ return m_stop || !m_jobs.empty(); });
+                if (m_jobs.empty()) return;
+                job = m_jobs.front();
+                m_jobs.pop_front();
+            }
+            StagingSlot& slot = *m_slots[job.slot];
+            slot.sync.waitFor(export_copy_timeout);
+            encodeFrame(slot, job, frame_data);
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                slot.busy = false;
+            }
+            m_slot_freed.notify_one();
+
+            bool written = !m_failed && m_writer.append(frame_data);
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (written){
+                m_frames_written++;
+            }else if (!m_failed){
+                std::cerr << "Writing frame " << job.frame << " to " << m_path << " failed\n";
+                m_failed = true;
+                m_slot_freed.notify_one();
+            }
+        }
+    }
+    void encodeFrame(StagingSlot& slot, const FrameJob& job, vector<uint8_t>& frame_data){
+        const uint8_t* data = static_cast<const uint8_t*>(slot.memory->map());
+        const glm::vec4* particles = reinterpret_cast<const glm::vec4*>(data);
+        if (m_export_surface){
+            //index count of the draw command, and the number of vertices after it
+            const uint32_t* commands = reinterpret_cast<const uint32_t*>(data + m_commands_offset);
+            uint32_t index_count = commands[0];
+            uint32_t vertex_count = commands[surface_mesh_vertex_count_offset / sizeof(uint32_t)];
+            bool truncated = index_count > surfaceIndexCapacity() || vertex_count > surfaceVertexCapacity();
+            m_encoder.encode(job.frame, job.step, particles, particle_space_size,
+                reinterpret_cast<const glm::vec4*>(data + m_vertices_offset), std::min(vertex_count, surfaceVertexCapacity()),
+                reinterpret_cast<const uint32_t*>(data + m_indices_offset), std::min(index_count, surfaceIndexCapacity()), truncated, frame_data);
+        }else{
+            m_encoder.encode(job.frame, job.step, particles, particle_space_size, frame_data);
+        }
+        slot.memory->unmap();
+    }
+};
+
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef FRAME_PACING_H
+#define FRAME_PACING_H
+
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+#include "simulation_constants.h"
+#include "run_settings.h"
+
+
+
+/**
+ * FramePacer
+ *  - Decides how many substeps the windowed application simulates each frame, and limits its' frame rate. Described in simulation_constants.h, look for 'Substeps'
+ *  - With a fixed number of substeps, every frame simulates that many. Otherwise, real time elapsed since the last frame is accumulated and as many whole steps as fit into it are simulated, at most max_substeps
+ *  - Time that doesn't fit into max_substeps is dropped, so a slow frame doesn't make all following ones slow too. Time spent paused isn't simulated later
+ */
+class FramePacer{
+    using Clock = std::chrono::steady_clock;
+    uint32_t m_substeps;
+    uint32_t m_max_substeps;
+    Clock::duration m_min_frame_time;
+    Clock::time_point m_last_frame;
+    //real time not simulated yet, in seconds
+    double m_accumulator = 0;
+public:
+    FramePacer(const RunSettings& settings) :
+        m_substeps(settings.substeps),
+        m_max_substeps(settings.max_substeps),
+        m_min_frame_time(settings.max_fps == 0 ? Clock::duration::zero() : std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / settings.max_fps))),
+        m_last_frame(Clock::now())
+    {}
+    //wait until the frame rate limit allows the next frame, then return the number of substeps to simulate in it
+    uint32_t startFrame(bool paused){
+        if (m_min_frame_time != Clock::duration::zero()) std::this_thread::sleep_until(m_last_frame + m_min_frame_time);
+        Clock::time_point now = Clock::now();
+        double elapsed = std::chrono::duration<double>(now - m_last_frame).count();
+        m_last_frame = now;
+        if (paused){
+            m_accumulator = 0;
+            return 0;
+        }
+        if (m_substeps != 0) return m_substeps;
+
+        m_accumulator += elapsed;
+        uint32_t substeps = std::min(static_cast<uint32_t>(m_accumulator / simulation_time_step), m_max_substeps);
+        m_accumulator = std::min(m_accumulator - substeps * simulation_time_step, static_cast<double>(simulation_time_step));
+        return substeps;
+    }
+};
+
+
+#endif
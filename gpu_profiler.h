@@ -0,0 +1,275 @@
+#ifndef GPU_PROFILER_H
+#define GPU_PROFILER_H
+
+#include <vector>
+#include <string>
+#include <deque>
+#include <unordered_map>
+#include <utility>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "simulation_constants.h"
+
+
+using std::vector;
+using std::string;
+
+
+//query index returned when a section isn't timed
+constexpr uint32_t gpu_profiler_no_query = UINT32_MAX;
+
+
+
+/**
+ * GpuProfiler
+ *  - Times sections of the simulation and rendering using GPU timestamps. Described in simulation_constants.h, look for 'GPU profiler'
+ *  - Each frame slot owns 2 * profiler_max_sections_per_frame queries, a slot is reused once the frame recorded into it finished on the GPU. Its' timestamps are collected then, without waiting
+ *  - Sections are timed by GpuProfileScope, which does nothing unless a profiler exists. Only one profiler can exist at a time
+ *  - Timestamps are written at the bottom of the pipe, so the time of a section includes waiting for barriers before it, and times of all sections add up to the time of the frame
+ *  - Reusable command buffers submitted first in a frame are timed too. Each one is recorded for one slot, resets the slot's queries itself and takes its' first queries, the frame's other command buffers continue after them
+ */
+class GpuProfiler{
+    struct FrameSlot{
+        //section id of each timed scope, in the order of their queries
+        vector<uint32_t> sections;
+        uint32_t frame = 0;
+        bool pending = false;
+    };
+    struct SectionStatistics{
+        string name;
+        //the last profiler_statistics_window durations in milliseconds, as a ring
+        vector<double> samples;
+        uint32_t next_sample = 0;
+        uint64_t count = 0;
+        //sum of all durations, not only the ones in the window
+        double total_ms = 0;
+    };
+    struct TraceEvent{
+        uint32_t section;
+        uint32_t frame;
+        double start_us;
+        double duration_us;
+    };
+
+    VkQueryPool m_query_pool;
+    //nanoseconds per timestamp tick
+    double m_timestamp_period;
+    vector<FrameSlot> m_slots;
+    uint32_t m_slot = 0;
+    bool m_recording = false;
+    //sections of the reusable command buffer being recorded, and the slot it is recorded for
+    vector<uint32_t> m_reusable_sections;
+    uint32_t m_reusable_slot = 0;
+    bool m_recording_reusable = false;
+    uint32_t m_frame = 0;
+    std::unordered_map<string, uint32_t> m_section_ids;
+    vector<SectionStatistics> m_sections;
+    std::deque<TraceEvent> m_trace;
+    uint64_t m_first_timestamp = 0;
+    bool m_has_first_timestamp = false;
+    uint32_t m_dropped_frames = 0;
+    vector<uint64_t> m_results;
+
+    static inline GpuProfiler* s_active = nullptr;
+public:
+    //timestamp_period is VkPhysicalDeviceLimits::timestampPeriod of the device used, frame_slots the number of frames that can be recorded before the first one is collected
+    GpuProfiler(float timestamp_period, uint32_t frame_slots) :
+        m_timestamp_period(timestamp_period),
+        m_slots(frame_slots)
+    {
+        VkQueryPoolCreateInfo info{VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO, nullptr, 0, VK_QUERY_TYPE_TIMESTAMP, frame_slots * queriesPerSlot(), 0};
+        if (vkCreateQueryPool(g_device, &info, nullptr, &m_query_pool) != VK_SUCCESS){
+            std::cerr << "Could not create a timestamp query pool, sections won't be timed\n";
+            return;
+        }
+        s_active = this;
+    }
+    GpuProfiler(const GpuProfiler&) = delete;
+    GpuProfiler& operator=(const GpuProfiler&) = delete;
+    ~GpuProfiler(){
+        if (s_active == this){
+            vkDestroyQueryPool(g_device, m_query_pool, nullptr);
+            s_active = nullptr;
+        }
+    }
+    //the profiler that sections are timed by, nullptr when profiling is disabled
+    static GpuProfiler* active(){
+        return s_active;
+    }
+    //call after starting to record the first command buffer of a frame, once the frame previously recorded into slot finished on the GPU. Collects its' timestamps and resets the queries
+    void startFrame(CommandBuffer& command_buffer, uint32_t slot){
+        collect(slot);
+        FrameSlot& s = m_slots[slot];
+        s.sections.clear();
+        s.frame = m_frame++;
+        s.pending = true;
+        vkCmdResetQueryPool(command_buffer, m_query_pool, slot * queriesPerSlot(), queriesPerSlot());
+        m_slot = slot;
+        m_recording = true;
+    }
+    //same as above for a frame whose first submission is a reusable command buffer recorded for slot, recorded_sections are the ones endReusable() returned for it. It resets the queries, so nothing is recorded here
+    void startFrame(uint32_t slot, const vector<uint32_t>& recorded_sections){
+        collect(slot);
+        FrameSlot& s = m_slots[slot];
+        s.sections = recorded_sections;
+        s.frame = m_frame++;
+        s.pending = true;
+        m_slot = slot;
+        m_recording = true;
+    }
+    //start timing sections of a reusable command buffer submitted first in frames of slot, until endReusable(). Call after starting to record it
+    void startReusable(CommandBuffer& command_buffer, uint32_t slot){
+        vkCmdResetQueryPool(command_buffer, m_query_pool, slot * queriesPerSlot(), queriesPerSlot());
+        m_reusable_sections.clear();
+        m_reusable_slot = slot;
+        m_recording_reusable = true;
+    }
+    //returns ids of the sections timed by the reusable command buffer, in the order of their queries
+    vector<uint32_t> endReusable(){
+        m_recording_reusable = false;
+        return m_reusable_sections;
+    }
+    //write the timestamp before a section, returns the query to pass to end(). Sections over profiler_max_sections_per_frame in one frame aren't timed
+    uint32_t begin(CommandBuffer& command_buffer, const char* name){
+        if (!m_recording && !m_recording_reusable) return gpu_profiler_no_query;
+        vector<uint32_t>& sections = m_recording_reusable ? m_reusable_sections : m_slots[m_slot].sections;
+        uint32_t slot = m_recording_reusable ? m_reusable_slot : m_slot;
+        if (sections.size() == profiler_max_sections_per_frame) return gpu_profiler_no_query;
+        uint32_t query = slot * queriesPerSlot() + 2 * static_cast<uint32_t>(sections.size());
+        sections.push_back(sectionId(name));
+        vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_query_pool, query);
+        return query;
+    }
+    //write the timestamp after a section
+    void end(CommandBuffer& command_buffer, uint32_t query){
+        if (query != gpu_profiler_no_query) vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, m_query_pool, query + 1);
+    }
+    //collect timestamps of all frames, call once the queue is idle
+    void finish(){
+        for (uint32_t slot = 0; slot < m_slots.size(); slot++) collect(slot);
+        m_recording = false;
+    }
+    //total time of each section over all collected frames in milliseconds, in the order sections were first timed. Benchmarks divide it by the number of steps
+    vector<std::pair<string, double>> sectionTotals() const{
+        vector<std::pair<string, double>> totals;
+        for (const SectionStatistics& s : m_sections) totals.emplace_back(s.name, s.total_ms);
+        return totals;
+    }
+    //number of frames whose timestamps weren't available when they were collected
+    uint32_t getDroppedFrames() const{
+        return m_dropped_frames;
+    }
+    //write the kept frames as complete events of a Chrome trace, it can be opened in chrome://tracing or Perfetto. Returns false if the file couldn't be written
+    bool writeChromeTrace(const string& path) const{
+        std::ofstream file(path, std::ios::trunc);
+        file << std::fixed << std::setprecision(3) << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+        for (size_t i = 0; i < m_trace.size(); i++){
+            const TraceEvent& e = m_trace[i];
+            file << "{\"name\":\"" << m_sections[e.section].name << "\",\"cat\":\"gpu\",\"ph\":\"X\",\"pid\":0,\"tid\":0,\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us
+                << ",\"args\":{\"frame\":" << e.frame << "}}" << (i + 1 < m_trace.size() ? ",\n" : "\n");
+        }
+        file << "]}\n";
+        return static_cast<bool>(file);
+    }
+    //write statistics of each section over its' last samples as CSV, times are in milliseconds. Returns false if the file couldn't be written
+    bool writeCsv(const string& path) const{
+        std::ofstream file(path, std::ios::trunc);
+        file << "section,count,mean_ms,p50_ms,p99_ms,min_ms,max_ms\n" << std::fixed << std::setprecision(6);
+        for (const SectionStatistics& s : m_sections){
+            if (s.samples.empty()) continue;
+            vector<double> sorted = s.samples;
+            std::sort(sorted.begin(), sorted.end());
+            double sum = 0;
+            for (double t : sorted) sum += t;
+            file << s.name << "," << s.count << "," << sum / sorted.size() << "," << percentile(sorted, 0.5) << "," << percentile(sorted, 0.99) << "," << sorted.front() << "," << sorted.back() << "\n";
+        }
+        return static_cast<bool>(file);
+    }
+    //write both the trace and the CSV summary, path_prefix + ".json" and path_prefix + ".csv"
+    bool write(const string& path_prefix) const{
+        bool written = writeChromeTrace(path_prefix + ".json") && writeCsv(path_prefix + ".csv");
+        if (written){
+            std::cout << "Profile written to " << path_prefix << ".json and " << path_prefix << ".csv, " << m_frame << " frames, " << m_dropped_frames << " dropped\n";
+        }else{
+            std::cerr << "Could not write profile " << path_prefix << "\n";
+        }
+        return written;
+    }
+private:
+    static uint32_t queriesPerSlot(){
+        return 2 * profiler_max_sections_per_frame;
+    }
+    static double percentile(const vector<double>& sorted, double p){
+        return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+    }
+    uint32_t sectionId(const char* name){
+        auto it = m_section_ids.find(name);
+        if (it != m_section_ids.end()) return it->second;
+        uint32_t id = static_cast<uint32_t>(m_sections.size());
+        m_section_ids.emplace(name, id);
+        m_sections.push_back(SectionStatistics{name, {}, 0, 0, 0});
+        return id;
+    }
+    //read timestamps of the frame recorded into slot, its' submissions have to be finished. Frames whose results aren't available are dropped
+    void collect(uint32_t slot){
+        FrameSlot& s = m_slots[slot];
+        if (!s.pending) return;
+        s.pending = false;
+        uint32_t query_count = 2 * static_cast<uint32_t>(s.sections.size());
+        if (query_count == 0) return;
+        m_results.resize(query_count);
+        VkResult result = vkGetQueryPoolResults(g_device, m_query_pool, slot * queriesPerSlot(), query_count, query_count * sizeof(uint64_t), m_results.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT);
+        if (result != VK_SUCCESS){
+            m_dropped_frames++;
+            return;
+        }
+        if (!m_has_first_timestamp){
+            m_first_timestamp = m_results[0];
+            m_has_first_timestamp = true;
+        }
+        for (size_t i = 0; i < s.sections.size(); i++){
+            uint64_t start = m_results[2 * i], end = m_results[2 * i + 1];
+            double duration_ms = (end > start ? end - start : 0) * m_timestamp_period * 1e-6;
+            SectionStatistics& statistics = m_sections[s.sections[i]];
+            if (statistics.samples.size() < profiler_statistics_window){
+                statistics.samples.push_back(duration_ms);
+            }else{
+                statistics.samples[statistics.next_sample] = duration_ms;
+                statistics.next_sample = (statistics.next_sample + 1) % profiler_statistics_window;
+            }
+            statistics.count++;
+            statistics.total_ms += duration_ms;
+            double start_us = (start > m_first_timestamp ? start - m_first_timestamp : 0) * m_timestamp_period * 1e-3;
+            m_trace.push_back(TraceEvent{s.sections[i], s.frame, start_us, duration_ms * 1e3});
+        }
+        while (!m_trace.empty() && m_trace.front().frame + profiler_trace_frames <= s.frame) m_trace.pop_front();
+    }
+};
+
+
+
+/**
+ * GpuProfileScope
+ *  - Times the commands recorded into command_buffer during its' lifetime as one section, if a profiler exists. Otherwise it only checks that there isn't one
+ */
+class GpuProfileScope{
+    CommandBuffer& m_command_buffer;
+    uint32_t m_query;
+public:
+    GpuProfileScope(CommandBuffer& command_buffer, const char* name) :
+        m_command_buffer(command_buffer),
+        m_query(GpuProfiler::active() ? GpuProfiler::active()->begin(command_buffer, name) : gpu_profiler_no_query)
+    {}
+    GpuProfileScope(const GpuProfileScope&) = delete;
+    GpuProfileScope& operator=(const GpuProfileScope&) = delete;
+    ~GpuProfileScope(){
+        if (m_query != gpu_profiler_no_query) GpuProfiler::active()->end(m_command_buffer, m_query);
+    }
+};
+
+
+#endif
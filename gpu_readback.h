@@ -0,0 +1,256 @@
+#ifndef GPU_READBACK_H
+#define GPU_READBACK_H
+
+#include <memory>
+#include <cstring>
+#include <stdexcept>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "fluid_flow_sections.h"
+
+
+
+/**
+ * ReadbackRegion
+ *  - Describes where one image or buffer is saved inside the readback buffer
+ *  - Data is saved as 4 byte words, texels are ordered with x changing the fastest, each texel has 'components' words
+ */
+struct ReadbackRegion{
+    string name;
+    //ImageAttachments value for images, BufferAttachments value for buffers
+    uint32_t index;
+    bool is_image;
+    bool is_float;
+    uint32_t components;
+    Size3 size;
+    //offset from the start of the readback buffer, in words
+    uint32_t word_offset;
+
+    uint32_t wordCount() const{
+        return size.volume() * components;
+    }
+};
+
+
+//all images and buffers that are copied when reading simulation state, in the order they are saved in the readback buffer
+inline vector<ReadbackRegion> simulationReadbackRegions(){
+    vector<ReadbackRegion> regions{
+        {"Velocities 1",                VELOCITIES_1,                   true, true,  4, fluid_size, 0},
+        {"Velocities 2",                VELOCITIES_2,                   true, true,  4, fluid_size, 0},
+        {"Cell types",                  CELL_TYPES,                     true, false, 1, fluid_size, 0},
+        {"New cell types",              NEW_CELL_TYPES,                 true, false, 1, fluid_size, 0},
+        {"Pressures 1",                 PRESSURES_1,                    true, true,  1, fluid_size, 0},
+        {"Pressures 2",                 PRESSURES_2,                    true, true,  1, fluid_size, 0},
+        {"Divergences",                 DIVERGENCES,                    true, true,  1, fluid_size, 0},
+        {"Particle densities",          PARTICLE_DENSITIES_IMG,         true, false, 1, fluid_size, 0},
+        {"Detailed particle densities", DETAILED_DENSITIES_IMG,         true, false, 1, surface_render_size, 0},
+        {"Detailed densities inertias", DETAILED_DENSITIES_INERTIA_IMG, true, false, 1, surface_render_size, 0},
+        {"Particle densities float 1",  PARTICLE_DENSITIES_FLOAT_1,     true, true,  1, surface_render_size, 0},
+        {"Particle densities float 2",  PARTICLE_DENSITIES_FLOAT_2,     true, true,  1, surface_render_size, 0},
+        {"Particles storage buffer",    PARTICLES_BUF,                  false, true, 4, Size3{particle_space_size, 1, 1}, 0}
+    };
+    uint32_t offset = 0;
+    for (ReadbackRegion& r : regions){
+        r.word_offset = offset;
+        offset += r.wordCount();
+    }
+    return regions;
+}
+
+//size of the readback buffer required to hold all regions, in bytes
+inline uint32_t simulationReadbackBufferSize(){
+    const ReadbackRegion& last = simulationReadbackRegions().back();
+    return (last.word_offset + last.wordCount()) * sizeof(uint32_t);
+}
+
+
+
+/**
+ * SimulationReadbackData
+ *  - Contents of the readback buffer copied to CPU memory, provides access to individual components of saved images
+ */
+class SimulationReadbackData{
+    vector<ReadbackRegion> m_regions;
+    vector<uint32_t> m_words;
+public:
+    SimulationReadbackData() : m_regions(simulationReadbackRegions()), m_words(simulationReadbackBufferSize() / sizeof(uint32_t))
+    {}
+    uint32_t* data(){
+        return m_words.data();
+    }
+    const ReadbackRegion& region(uint32_t index, bool is_image) const{
+        for (const ReadbackRegion& r : m_regions){
+            if (r.index == index && r.is_image == is_image) return r;
+        }
+        throw std::runtime_error("Region not present in readback data");
+    }
+    const vector<ReadbackRegion>& regions() const{
+        return m_regions;
+    }
+    //return one component of all texels in a region as floats
+    vector<float> floatComponent(const ReadbackRegion& r, uint32_t component) const{
+        vector<float> result(r.size.volume());
+        for (uint32_t i = 0; i < result.size(); i++){
+            std::memcpy(&result[i], &m_words[r.word_offset + i * r.components + component], sizeof(float));
+        }
+        return result;
+    }
+    //return one component of all texels in a region as unsigned integers
+    vector<uint32_t> uintComponent(const ReadbackRegion& r, uint32_t component) const{
+        vector<uint32_t> result(r.size.volume());
+        for (uint32_t i = 0; i < result.size(); i++){
+            result[i] = m_words[r.word_offset + i * r.components + component];
+        }
+        return result;
+    }
+};
+
+
+
+/**
+ * SimulationReadbackSections
+ *  - One compute section per image and one for the particle buffer, each one copies its data into the readback buffer at the right offset
+ *  - Images are sampled using texelFetch, so one shader works for every floating point format and one for every unsigned integer format
+ */
+class SimulationReadbackSections{
+    VkSampler m_sampler;
+    vector<std::unique_ptr<FlowComputePushConstantSection>> m_sections;
+public:
+    SimulationReadbackSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes) :
+        m_sampler(SamplerInfo().setFilters(VK_FILTER_NEAREST, VK_FILTER_NEAREST).setWrapMode(VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE).create())
+    {
+        const FlowStorageBuffer readback_usage{"readback", READBACK_BUF, usage_compute, BufferState{BUFFER_STORAGE_W}};
+        for (const ReadbackRegion& r : simulationReadbackRegions()){
+            if (r.is_image){
+                m_sections.push_back(std::make_unique<FlowComputePushConstantSection>(
+                    fluid_context, r.is_float ? "40_readback_float_image" : "41_readback_uint_image",
+                    FlowPipelineSectionDescriptors{
+                        flow_context,
+                        vector<FlowPipelineSectionDescriptorUsage>{
+                            FlowCombinedImage{"source_image", r.index, usage_compute, ImageState{IMAGE_SAMPLER}, m_sampler},
+                            readback_usage
+                        }
+                    },
+                    divideRoundUp(r.size, workgroup_sizes.fluid)
+                ));
+            }else{
+                m_sections.push_back(std::make_unique<FlowComputePushConstantSection>(
+                    fluid_context, "42_readback_particles",
+                    FlowPipelineSectionDescriptors{
+                        flow_context,
+                        vector<FlowPipelineSectionDescriptorUsage>{
+                            FlowStorageBuffer{"particles", PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_R}},
+                            readback_usage
+                        }
+                    },
+                    workgroup_sizes.particleDispatchSize()
+                ));
+            }
+            m_sections.back()->getPushConstantData().write("word_offset", &r.word_offset, 1);
+            m_sections.back()->getPushConstantData().write("components", &r.components, 1);
+        }
+    }
+    void complete(){
+        for (auto& s : m_sections) s->complete();
+    }
+    //record copying of all data into the readback buffer
+    void run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        for (auto& s : m_sections){
+            s->transition(command_buffer, flow_context);
+            s->execute(command_buffer);
+        }
+    }
+};
+
+
+
+/**
+ * SimulationRestoreSections
+ *  - Inverse of SimulationReadbackSections, one compute section per region copies its data from the readback buffer back into the image or the particle buffer. Used when restoring a checkpoint
+ *  - Images are declared without a format, values are converted into the format of each image when stored
+ *  - After the copies, surface mesh densities are cleared and active particles are compacted again, the same way as during initialization
+ */
+class SimulationRestoreSections{
+    vector<std::unique_ptr<FlowComputePushConstantSection>> m_sections;
+    FlowClearColorSection m_clear_surface_mesh_densities;
+    FlowComputeSection m_reset_active_particles;
+    FlowComputeSection m_compact_particles;
+public:
+    SimulationRestoreSections(DirectoryPipelinesContext& fluid_context, FlowDescriptorContext& flow_context, const WorkgroupSizes& workgroup_sizes) :
+        m_clear_surface_mesh_densities(flow_context, SURFACE_MESH_DENSITIES, ClearValue(-1.f)),
+        m_reset_active_particles(
+            fluid_context, "00a_reset_active_particles",
+            FlowPipelineSectionDescriptors{
+                flow_context,
+                vector<FlowPipelineSectionDescriptorUsage>{
+                    FlowStorageBuffer{"particle_commands", PARTICLE_COMMANDS_BUF, usage_compute, BufferState{BUFFER_STORAGE_W}}
+                }
+            },
+            Size3{1, 1, 1}
+        ),
+        m_compact_particles(
+            fluid_context, "00b_compact_particles",
+            FlowPipelineSectionDescriptors{
+                flow_context,
+                vector<FlowPipelineSectionDescriptorUsage>{
+                    simulation_parameters_buffer_compute_usage,
+                    FlowStorageBuffer{"particles", PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_R}},
+                    FlowStorageBuffer{"active_particles", ACTIVE_PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_W}},
+                    FlowStorageBuffer{"particle_commands", PARTICLE_COMMANDS_BUF, usage_compute, BufferState{BUFFER_STORAGE_RW}}
+                }
+            },
+            workgroup_sizes.particleDispatchSize()
+        )
+    {
+        const FlowStorageBuffer readback_usage{"readback", READBACK_BUF, usage_compute, BufferState{BUFFER_STORAGE_R}};
+        for (const ReadbackRegion& r : simulationReadbackRegions()){
+            if (r.is_image){
+                m_sections.push_back(std::make_unique<FlowComputePushConstantSection>(
+                    fluid_context, r.is_float ? "43_restore_float_image" : "44_restore_uint_image",
+                    FlowPipelineSectionDescriptors{
+                        flow_context,
+                        vector<FlowPipelineSectionDescriptorUsage>{
+                            FlowStorageImage{"target_image", r.index, usage_compute, ImageState{IMAGE_STORAGE_W}},
+                            readback_usage
+                        }
+                    },
+                    divideRoundUp(r.size, workgroup_sizes.fluid)
+                ));
+            }else{
+                m_sections.push_back(std::make_unique<FlowComputePushConstantSection>(
+                    fluid_context, "45_restore_particles",
+                    FlowPipelineSectionDescriptors{
+                        flow_context,
+                        vector<FlowPipelineSectionDescriptorUsage>{
+                            FlowStorageBuffer{"particles", PARTICLES_BUF, usage_compute, BufferState{BUFFER_STORAGE_W}},
+                            readback_usage
+                        }
+                    },
+                    workgroup_sizes.particleDispatchSize()
+                ));
+            }
+            m_sections.back()->getPushConstantData().write("word_offset", &r.word_offset, 1);
+            m_sections.back()->getPushConstantData().write("components", &r.components, 1);
+        }
+    }
+    void complete(){
+        for (auto& s : m_sections) s->complete();
+        m_clear_surface_mesh_densities.complete();
+        m_reset_active_particles.complete();
+        m_compact_particles.complete();
+    }
+    //record copying of all data from the readback buffer, it has to contain data saved by SimulationReadbackSections
+    void run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        for (auto& s : m_sections){
+            s->transition(command_buffer, flow_context);
+            s->execute(command_buffer);
+        }
+        m_clear_surface_mesh_densities.run(command_buffer, flow_context);
+        m_reset_active_particles.run(command_buffer, flow_context);
+        m_compact_particles.run(command_buffer, flow_context);
+        recordIndirectCommandsBarrier(command_buffer);
+    }
+};
+
+
+#endif
@@ -0,0 +1,366 @@
+#ifndef HEADLESS_SIMULATION_H
+#define HEADLESS_SIMULATION_H
+
+#include <chrono>
+#include <algorithm>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <stdexcept>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "fluid_flow_sections.h"
+#include "gpu_readback.h"
+#include "checkpoint.h"
+#include "frame_exporter.h"
+#include "gpu_profiler.h"
+#include "completion_event.h"
+#include "embedded_shaders.h"
+#include "run_settings.h"
+
+
+
+//clock used for measuring times of the headless simulation
+using HeadlessClock = std::chrono::steady_clock;
+
+//how long to wait for a single submission to finish in headless mode - software drivers such as lavapipe can take much longer than a second for one step
+const uint64_t headless_submit_timeout = 60 * SYNC_SECOND;
+
+
+/**
+ * HeadlessTimings
+ *  - Collects times of all simulation steps and prints a summary when the run ends
+ *  - When several substeps are submitted at once, times of the submission are divided between them, minimum, median and maximum are then over submissions
+ */
+class HeadlessTimings{
+    vector<double> m_step_times_ms;
+    vector<double> m_record_times_ms;
+    vector<uint32_t> m_step_counts;
+public:
+    void add(double step_time_ms, double record_time_ms, uint32_t steps = 1){
+        m_step_times_ms.push_back(step_time_ms / steps);
+        m_record_times_ms.push_back(record_time_ms / steps);
+        m_step_counts.push_back(steps);
+    }
+    void print(double init_time_ms, double total_time_ms) const{
+        if (m_step_times_ms.empty()){
+            std::cout << "No simulation steps were run.\n";
+            return;
+        }
+        vector<double> sorted = m_step_times_ms;
+        std::sort(sorted.begin(), sorted.end());
+        double sum = 0, record_sum = 0;
+        size_t n = 0;
+        for (size_t i = 0; i < m_step_times_ms.size(); i++){
+            sum += m_step_times_ms[i] * m_step_counts[i];
+            record_sum += m_record_times_ms[i] * m_step_counts[i];
+            n += m_step_counts[i];
+        }
+
+        std::cout << std::fixed << std::setprecision(3)
+            << "Headless run finished\n"
+            << "  steps:                 " << n << "\n"
+            << "  submissions:           " << m_step_times_ms.size() << "\n"
+            << "  initialization:        " << init_time_ms << " ms\n"
+            << "  total time:            " << total_time_ms << " ms\n"
+            << "  step time (mean):      " << sum / n << " ms\n"
+            << "  step time (min):       " << sorted.front() << " ms\n"
+            << "  step time (median):    " << sorted[sorted.size() / 2] << " ms\n"
+            << "  step time (max):       " << sorted.back() << " ms\n"
+            << "  recording time (mean): " << record_sum / n << " ms\n"
+            << "  throughput:            " << 1000.0 * n / sum << " steps/s\n";
+    }
+};
+
+
+//return time elapsed between two time points in milliseconds
+inline double elapsedMs(HeadlessClock::time_point start, HeadlessClock::time_point end){
+    return std::chrono::duration<double, std::milli>(end - start).count();
+}
+
+
+
+/**
+ * HeadlessDevice
+ *  - Owns a compute capable device with a single queue and one command buffer, no window, swapchain or present queue are created
+ *  - Used by the headless simulation and by benchmarks
+ */
+class HeadlessDevice{
+    VulkanInstance& m_instance;
+    PhysicalDevice m_physical_device;
+    Device& m_device;
+    Queue& m_queue;
+    CommandPool m_command_pool;
+    LocalObjectCreator m_device_local_buffer_creator;
+    CommandBuffer m_command_buffer;
+    SubmitSynchronization m_sync;
+    //set at the end of each submission, tells whether waiting for it timed out
+    CompletionEvent m_completion;
+public:
+    HeadlessDevice(VulkanLibrary& library, const string& app_name) :
+        // * Create vulkan instance - no surface extensions are required *
+        m_instance(library.createInstance(VulkanInstanceCreateInfo().appName(app_name))),
+        // * Choose a physical device and create a logical one with a single compute queue *
+        m_physical_device(PhysicalDevices(m_instance).choose()),
+        m_device(m_physical_device.requestFeatures(simulationDeviceFeatures()).requestQueues({{1, VK_QUEUE_COMPUTE_BIT | VK_QUEUE_TRANSFER_BIT}}).createLogicalDevice(m_instance)),
+        m_queue(m_device.getQueue(0, 0)),
+        m_command_pool(CommandPoolInfo{0, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT}.create()),
+        m_device_local_buffer_creator{m_queue, max_image_or_buffer_size_bytes},
+        m_command_buffer{m_command_pool.allocateBuffer()}
+    {
+        m_sync.setEndFence(Fence());
+    }
+    LocalObjectCreator& getLocalObjectCreator(){
+        return m_device_local_buffer_creator;
+    }
+    Queue& getQueue(){
+        return m_queue;
+    }
+    CommandPool& getCommandPool(){
+        return m_command_pool;
+    }
+    VkPhysicalDeviceProperties getProperties(){
+        return physicalDeviceProperties(m_physical_device);
+    }
+    string getDeviceName(){
+        return getProperties().deviceName;
+    }
+    //start recording the command buffer, it is submitted by submitAndWait()
+    CommandBuffer& startRecord(){
+        m_command_buffer.startRecordPrimary(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        return m_command_buffer;
+    }
+    //end recording, submit the command buffer, wait for it to finish and reset it. Throws if it didn't finish within headless_submit_timeout, its' results mustn't be used then
+    void submitAndWait(){
+        endRecord();
+        m_queue.submit(m_command_buffer, m_sync);
+        wait();
+    }
+    //same as above, the step selected by recorded_step is submitted before the command buffer
+    void submitAndWait(RecordedSimulationStep& recorded_step){
+        endRecord();
+        recorded_step.submit(m_queue, m_command_buffer, m_sync);
+        wait();
+    }
+    void waitIdle(){
+        m_queue.waitFor();
+    }
+private:
+    //the command buffer is the last one submitted, so the event is set once all submitted work finished
+    void endRecord(){
+        m_completion.record(m_command_buffer);
+        m_command_buffer.endRecord();
+    }
+    void wait(){
+        m_sync.waitFor(headless_submit_timeout);
+        if (!m_completion.finished()) throw std::runtime_error("A submission didn't finish within " + std::to_string(headless_submit_timeout / SYNC_SECOND) + " seconds");
+        m_completion.reset();
+        m_command_buffer.resetBuffer(false);
+    }
+};
+
+
+
+/**
+ * HeadlessSimulation
+ *  - Runs the simulation on a headless device, several simulations can be created on one device one after another
+ *  - When readback is enabled, complete simulation state can be copied to the CPU after any step
+ *  - When settings save or restore checkpoints, the simulation can start from a checkpoint instead of the initial particle cube, and save one after any step
+ *  - Pressure solver, particle sorting, binning, sparse bricks, storage precision and surface remeshing are configured by settings, the same way as in the windowed application
+ *  - Starts with the default scene unless another one is given, see SimulationScene
+ */
+class HeadlessSimulation{
+    HeadlessDevice& m_headless;
+    //when creating the simulation started, before the shader context was created
+    HeadlessClock::time_point m_startup_start;
+    SimulationParametersBufferData m_fluid_params_uniform_buffer;
+    DirectoryPipelinesContext m_fluid_context;
+    SimulationDescriptors m_flow_context;
+    SimulationInitializationSections m_init_sections;
+    SimulationStepSections m_step_sections;
+    std::unique_ptr<RecordedSimulationStep> m_recorded_step;
+    std::unique_ptr<SimulationReadbackSections> m_readback_sections;
+    std::unique_ptr<SimulationCheckpoints> m_checkpoints;
+    StoragePrecision m_storage_precision;
+    GpuProfiler* m_profiler = nullptr;
+    //where barriers recorded by initialization and steps are printed, set by dumpSchedule()
+    std::ostream* m_barrier_report = nullptr;
+    double m_startup_ms = 0;
+    SurfaceMeshOverflowReport m_surface_overflow;
+public:
+    HeadlessSimulation(HeadlessDevice& headless, const RunSettings& settings, const WorkgroupSizes& workgroup_sizes, bool enable_readback = false, const SimulationScene& scene = SimulationScene{}) :
+        m_headless(headless),
+        m_startup_start(HeadlessClock::now()),
+        m_fluid_params_uniform_buffer(scene),
+        //create all simulation data and sections, exactly the same way the windowed application does
+        m_fluid_context(shaderDirectory(settings.shaders_from_disk, workgroup_sizes)),
+        m_flow_context{m_fluid_params_uniform_buffer, m_headless.getLocalObjectCreator(), workgroup_sizes, settings.storage_precision, (enable_readback || settings.usesCheckpoints()) ? simulationReadbackBufferSize() : 4},
+        m_init_sections{m_fluid_context, m_flow_context, workgroup_sizes},
+        m_step_sections{m_fluid_context, m_flow_context, workgroup_sizes, m_flow_context.getVelocitiesSampler(), m_flow_context.getParticleCommandsBuffer(), m_flow_context.getBrickCommandsBuffer(), m_flow_context.getSurfaceMeshCommandsBuffer(),
+            settings.pressure_solver, settings.pressure_sweeps_per_dispatch, settings.particle_sort_interval, settings.particle_binning, settings.sparse_bricks, settings.kernel_fusion, settings.incremental_remesh},
+        m_storage_precision(settings.storage_precision)
+    {
+        if (settings.prerecorded_step) m_recorded_step = std::make_unique<RecordedSimulationStep>(m_step_sections, m_flow_context, m_headless.getCommandPool());
+        if (enable_readback) m_readback_sections = std::make_unique<SimulationReadbackSections>(m_fluid_context, m_flow_context, workgroup_sizes);
+        if (settings.usesCheckpoints()) m_checkpoints = std::make_unique<SimulationCheckpoints>(m_fluid_context, m_flow_context, workgroup_sizes);
+
+        m_fluid_context.createDescriptorPool();
+        m_init_sections.complete();
+        m_step_sections.complete();
+        if (m_readback_sections) m_readback_sections->complete();
+        if (m_checkpoints) m_checkpoints->complete();
+        m_startup_ms = elapsedMs(m_startup_start, HeadlessClock::now());
+    }
+    //run all initialization sections and wait for them to finish
+    void initialize(){
+        GraphBarriers barriers = m_init_sections.run(m_headless.startRecord(), m_flow_context);
+        if (m_barrier_report) barriers.print(*m_barrier_report, "initialization");
+        m_headless.submitAndWait();
+    }
+    //start from a checkpoint instead of initializing, returns false if it couldn't be loaded. Checkpoints must be enabled by settings
+    bool restore(const string& path){
+        uint32_t step;
+        if (!SimulationCheckpoints::load(path, m_flow_context, step)) return false;
+        m_checkpoints->recordRestore(m_headless.startRecord(), m_flow_context);
+        m_headless.submitAndWait();
+        m_step_sections.setStep(step);
+        return true;
+    }
+    //save a checkpoint of the state after the last step, returns false if it couldn't be written. Checkpoints must be enabled by settings
+    bool saveCheckpoint(const string& path){
+        m_checkpoints->recordSave(m_headless.startRecord(), m_flow_context);
+        m_headless.submitAndWait();
+        invalidateRecordedStep();
+        return SimulationCheckpoints::save(path, m_flow_context, m_step_sections.getStep(), m_storage_precision);
+    }
+    //run substeps simulation steps in one submission and wait for them to finish, returns how long recording took in milliseconds. With a pre-recorded step, only the first step and steps after readback are recorded
+    double step(uint32_t substeps = 1){
+        auto record_start = HeadlessClock::now();
+        CommandBuffer& command_buffer = m_headless.startRecord();
+        //the previous submission was waited for, so its' timestamps can be collected
+        if (m_recorded_step){
+            m_recorded_step->record(command_buffer, substeps);
+        }else{
+            if (m_profiler) m_profiler->startFrame(command_buffer, 0);
+            m_step_sections.run(command_buffer, m_flow_context, substeps);
+        }
+        //the last substep always computes the surface
+        recordSurfaceStatusCopy(command_buffer, m_flow_context, 0);
+        double record_time = elapsedMs(record_start, HeadlessClock::now());
+        if (m_recorded_step){
+            m_headless.submitAndWait(*m_recorded_step);
+        }else{
+            m_headless.submitAndWait();
+        }
+        m_surface_overflow.check(m_flow_context.readSurfaceStatus(0));
+        return record_time;
+    }
+    //copy all images and the particle buffer to CPU memory, readback must be enabled
+    SimulationReadbackData readback(){
+        SimulationReadbackData data;
+        m_readback_sections->run(m_headless.startRecord(), m_flow_context);
+        m_headless.submitAndWait();
+        invalidateRecordedStep();
+        m_flow_context.readReadbackBuffer(data.data(), simulationReadbackBufferSize());
+        return data;
+    }
+    //time sections of each step, pre-recorded command buffers are recorded again with timestamps, so the same path is timed. The profiler needs one frame slot
+    void setProfiler(GpuProfiler* profiler){
+        m_profiler = profiler;
+        invalidateRecordedStep();
+    }
+    SimulationDescriptors& getDescriptors(){
+        return m_flow_context;
+    }
+    //how long creating the shader context and all sections of this simulation took, see 'Startup time' in simulation_constants.h
+    double getStartupMs() const{
+        return m_startup_ms;
+    }
+    //print schedules of initialization and step section graphs, and barriers they record when they are recorded afterwards
+    void dumpSchedule(std::ostream& out){
+        m_init_sections.getGraph().dump(out);
+        m_step_sections.dumpSchedule(out);
+        m_barrier_report = &out;
+        m_step_sections.setBarrierReport(&out);
+    }
+    //number of submissions after which some bricks had no surface because the mesh buffers were full
+    uint32_t getSurfaceOverflowCount() const{
+        return m_surface_overflow.getOverflowCount();
+    }
+    //number of steps simulated so far, including ones before a restored checkpoint
+    uint32_t getStep() const{
+        return m_step_sections.getStep();
+    }
+    void waitIdle(){
+        m_headless.waitIdle();
+    }
+private:
+    //readback sections transition simulation images, so the pre-recorded step has to be recorded again
+    void invalidateRecordedStep(){
+        if (m_recorded_step) m_recorded_step->invalidate();
+    }
+};
+
+
+
+/**
+ * runHeadless
+ *  - Runs the simulation without a window, swapchain or present queue. Only a compute capable device is created.
+ *  - After initialization, settings.headless_steps simulation steps are run back to back, settings.substeps in each submission, then a timing summary is printed
+ *  - The simulation starts from a checkpoint if one is given, checkpoints are saved every checkpoint_interval steps of the whole simulation and at the end. Saving isn't included in step times
+ *  - When an export file is given, frames are captured after steps and written by the exporter's thread, step times include only the time needed to submit the copies
+ *  - When profiling, each submission is one frame of the profile
+ */
+inline int runHeadless(VulkanLibrary& library, const string& app_name, const RunSettings& settings){
+    auto run_start = HeadlessClock::now();
+    HeadlessDevice headless(library, app_name);
+    HeadlessSimulation simulation(headless, settings, loadWorkgroupSizes(headless.getDeviceName()));
+    std::cout << std::fixed << std::setprecision(3) << "Created shaders and sections in " << simulation.getStartupMs() << " ms\n";
+    if (settings.dump_schedule) simulation.dumpSchedule(std::cout);
+    if (settings.restore_path.empty()){
+        simulation.initialize();
+    }else if (!simulation.restore(settings.restore_path)){
+        return 1;
+    }
+    std::unique_ptr<FrameExporter> exporter;
+    if (!settings.export_path.empty()) exporter = std::make_unique<FrameExporter>(simulation.getDescriptors(), headless.getCommandPool(), settings);
+    std::unique_ptr<GpuProfiler> profiler;
+    if (!settings.profile_path.empty()){
+        profiler = std::make_unique<GpuProfiler>(headless.getProperties().limits.timestampPeriod, 1);
+        simulation.setProfiler(profiler.get());
+    }
+    auto init_end = HeadlessClock::now();
+
+    //run all simulation steps, one submission per substeps steps, each one waits for the previous one to finish
+    HeadlessTimings timings;
+    uint32_t substeps = std::max(settings.substeps, 1u);
+    for (uint32_t step = 0; step < settings.headless_steps; step += substeps){
+        uint32_t submission_steps = std::min(substeps, settings.headless_steps - step);
+        uint32_t steps_before = simulation.getStep();
+        auto step_start = HeadlessClock::now();
+        double record_time = simulation.step(submission_steps);
+        if (exporter) exporter->capture(headless.getQueue(), submission_steps);
+        timings.add(elapsedMs(step_start, HeadlessClock::now()), record_time, submission_steps);
+        //save if an interval-th step was among the substeps
+        bool save = settings.checkpoint_interval != 0 && steps_before / settings.checkpoint_interval != simulation.getStep() / settings.checkpoint_interval;
+        if (save && !simulation.saveCheckpoint(settings.checkpoint_path)) return 1;
+    }
+    simulation.waitIdle();
+
+    timings.print(elapsedMs(run_start, init_end), elapsedMs(run_start, HeadlessClock::now()));
+    if (simulation.getSurfaceOverflowCount() != 0) std::cerr << "Surface mesh buffers were full after " << simulation.getSurfaceOverflowCount() << " submissions\n";
+    if (profiler){
+        profiler->finish();
+        if (!profiler->write(settings.profile_path)) return 1;
+    }
+    if (!settings.checkpoint_path.empty() && !simulation.saveCheckpoint(settings.checkpoint_path)) return 1;
+    if (exporter){
+        bool exported = exporter->finish();
+        exporter->printSummary();
+        if (!exported) return 1;
+    }
+    return 0;
+}
+
+
+#endif
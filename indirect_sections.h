@@ -0,0 +1,155 @@
+#ifndef INDIRECT_SECTIONS_H
+#define INDIRECT_SECTIONS_H
+
+#include <memory>
+#include <initializer_list>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "gpu_profiler.h"
+
+
+
+/**
+ * Indirect sections
+ *  - Flow sections dispatch or draw a size that is known when they are created. These sections use a size computed on the GPU, read from an indirect commands buffer
+ *  - They are created with an empty size - execute() of the wrapped section binds the pipeline, descriptors and push constants and records an empty dispatch / draw,
+ *    the indirect command is recorded right after it and uses the same bound state
+ *  - The commands buffer doesn't have to be a descriptor, flow context doesn't track it as an indirect buffer, use recordIndirectCommandsBarrier() after writing commands into it,
+ *    and recordIndirectCommandsOverwriteBarrier() before writing into commands that were already used
+ *  - Indirect sections have to be run directly, not from a FlowSectionList
+ *  - run() of indirect compute sections is timed by the GPU profiler under the name of the shader directory, when profiling is enabled
+ */
+
+
+//dispatch size of indirect compute sections, the direct dispatch doesn't do any work
+const Size3 indirect_dispatch_size{0, 1, 1};
+
+
+/**
+ * IndirectComputeSection
+ *  - Compute section dispatched using a VkDispatchIndirectCommand at commands_offset in commands_buffer
+ */
+template<typename Section = FlowComputeSection>
+class IndirectComputeSection : public Section{
+    VkBuffer m_commands_buffer;
+    VkDeviceSize m_commands_offset;
+    string m_name;
+public:
+    IndirectComputeSection(VkBuffer commands_buffer, VkDeviceSize commands_offset, DirectoryPipelinesContext& context, const string& shader_dir, FlowPipelineSectionDescriptors descriptors) :
+        Section(context, shader_dir, descriptors, indirect_dispatch_size), m_commands_buffer(commands_buffer), m_commands_offset(commands_offset), m_name(shader_dir)
+    {}
+    void execute(CommandBuffer& command_buffer){
+        Section::execute(command_buffer);
+        vkCmdDispatchIndirect(command_buffer, m_commands_buffer, m_commands_offset);
+    }
+    void run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        GpuProfileScope profile(command_buffer, m_name.c_str());
+        record(command_buffer, flow_context);
+    }
+    //same as run(), without timing
+    void record(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        Section::transition(command_buffer, flow_context);
+        execute(command_buffer);
+    }
+    const string& getName() const{
+        return m_name;
+    }
+};
+
+
+/**
+ * IndirectLoopComputeSection
+ *  - Indirect equivalent of FlowLoopPushConstantSection - the section is run iterations times, push constant is_even_iteration is 1 in even iterations and 0 in odd ones
+ *  - All iterations are timed as one section
+ */
+class IndirectLoopComputeSection : public IndirectComputeSection<FlowComputePushConstantSection>{
+    uint32_t m_iterations;
+public:
+    IndirectLoopComputeSection(uint32_t iterations, VkBuffer commands_buffer, VkDeviceSize commands_offset, DirectoryPipelinesContext& context, const string& shader_dir, FlowPipelineSectionDescriptors descriptors) :
+        IndirectComputeSection<FlowComputePushConstantSection>(commands_buffer, commands_offset, context, shader_dir, descriptors), m_iterations(iterations)
+    {}
+    void run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        GpuProfileScope profile(command_buffer, getName().c_str());
+        for (uint32_t i = 0; i < m_iterations; i++){
+            uint32_t is_even_iteration = (i % 2 == 0) ? 1 : 0;
+            getPushConstantData().write("is_even_iteration", &is_even_iteration, 1);
+            record(command_buffer, flow_context);
+        }
+    }
+};
+
+
+/**
+ * IndirectGraphicsSection
+ *  - Graphics section drawn using a single VkDrawIndirectCommand at commands_offset in commands_buffer
+ */
+template<typename Section = FlowGraphicsPushConstantSection>
+class IndirectGraphicsSection : public Section{
+    VkBuffer m_commands_buffer;
+    VkDeviceSize m_commands_offset;
+public:
+    IndirectGraphicsSection(VkBuffer commands_buffer, VkDeviceSize commands_offset, DirectoryPipelinesContext& context, const string& shader_dir, FlowPipelineSectionDescriptors descriptors,
+        const PipelineInfo& pipeline_info, VkRenderPass render_pass) :
+        Section(context, shader_dir, descriptors, 0, pipeline_info, render_pass), m_commands_buffer(commands_buffer), m_commands_offset(commands_offset)
+    {}
+    void execute(CommandBuffer& command_buffer){
+        Section::execute(command_buffer);
+        vkCmdDrawIndirect(command_buffer, m_commands_buffer, m_commands_offset, 1, 0);
+    }
+};
+
+
+/**
+ * IndirectIndexedGraphicsSection
+ *  - Graphics section drawn using a single VkDrawIndexedIndirectCommand at commands_offset in commands_buffer, with 32 bit indices read from index_buffer
+ *  - The index buffer isn't a descriptor either, use recordIndexBufferBarrier() after writing indices, and recordIndexBufferOverwriteBarrier() before writing indices that were already drawn
+ *    Pre-recorded command buffers don't know whether a draw read a descriptor before them, recordVertexStorageOverwriteBarrier() waits for vertex shaders of previous draws
+ */
+template<typename Section = FlowGraphicsPushConstantSection>
+class IndirectIndexedGraphicsSection : public Section{
+    VkBuffer m_commands_buffer;
+    VkDeviceSize m_commands_offset;
+    VkBuffer m_index_buffer;
+public:
+    IndirectIndexedGraphicsSection(VkBuffer commands_buffer, VkDeviceSize commands_offset, VkBuffer index_buffer, DirectoryPipelinesContext& context, const string& shader_dir, FlowPipelineSectionDescriptors descriptors,
+        const PipelineInfo& pipeline_info, VkRenderPass render_pass) :
+        Section(context, shader_dir, descriptors, 0, pipeline_info, render_pass), m_commands_buffer(commands_buffer), m_commands_offset(commands_offset), m_index_buffer(index_buffer)
+    {}
+    void execute(CommandBuffer& command_buffer){
+        Section::execute(command_buffer);
+        vkCmdBindIndexBuffer(command_buffer, m_index_buffer, 0, VK_INDEX_TYPE_UINT32);
+        vkCmdDrawIndexedIndirect(command_buffer, m_commands_buffer, m_commands_offset, 1, 0);
+    }
+};
+
+
+//make commands written by compute shaders visible to indirect dispatches and draws, and to shaders reading the commands buffer as a storage buffer
+inline void recordIndirectCommandsBarrier(CommandBuffer& command_buffer){
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_SHADER_READ_BIT};
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+        0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+//wait until previously recorded indirect dispatches and draws have read their commands, before a compute shader overwrites them
+inline void recordIndirectCommandsOverwriteBarrier(CommandBuffer& command_buffer){
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+}
+
+//make indices written by compute shaders visible to indexed draws
+inline void recordIndexBufferBarrier(CommandBuffer& command_buffer){
+    VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT, VK_ACCESS_INDEX_READ_BIT};
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+}
+
+//wait until previously recorded indexed draws have read their indices, before a compute shader overwrites them
+inline void recordIndexBufferOverwriteBarrier(CommandBuffer& command_buffer){
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+}
+
+//wait until previously recorded draws have read storage buffers in vertex shaders, before a compute shader overwrites them
+inline void recordVertexStorageOverwriteBarrier(CommandBuffer& command_buffer){
+    vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 0, nullptr, 0, nullptr);
+}
+
+
+#endif
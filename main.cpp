@@ -1,6 +1,8 @@
 #include <iostream>
 #include <vector>
 #include <string>
+#include <chrono>
+#include <iomanip>
 
 #include "just-a-vulkan-library/vulkan_include_all.h"
 
@@ -8,6 +10,21 @@
 #include <glm/ext/matrix_clip_space.hpp>
 #include <glm/gtc/type_ptr.hpp>
 #include "fluid_flow_sections.h"
+#include "headless_simulation.h"
+#include "cpu_verification.h"
+#include "slab_decomposition.h"
+#include "ensemble.h"
+#include "binning_benchmark.h"
+#include "benchmark_suite.h"
+#include "workgroup_autotuner.h"
+#include "precision_report.h"
+#include "frame_exporter.h"
+#include "checkpoint.h"
+#include "frame_pacing.h"
+#include "gpu_profiler.h"
+#include "completion_event.h"
+#include "embedded_shaders.h"
+#include "run_settings.h"
 
 
 
@@ -23,10 +40,36 @@ string app_name = "Vulkan fluid simulation";
 
 
 
-int main(){
+int main(int argc, char* argv[]){
+    //read command line arguments, exit if any are invalid
+    RunSettings settings = parseRunSettings(argc, argv);
+    if (!settings.valid) return 1;
+    //grid and particle buffer sizes are chosen before anything uses them, described in simulation_constants.h, look for 'Simulation sizes'
+    setSimulationSizes(settings.grid_size, settings.surface_resolution, settings.particle_space);
+    //the CPU backend doesn't use vulkan at all
+    if (settings.cpu) return settings.cpu_workers > 1 ? runCpuSlabSimulation(settings) : runCpuSimulation(settings);
+    if (settings.scaling_benchmark_workers != 0) return runCpuScalingBenchmark(settings);
+    //reading an export file doesn't need vulkan either
+    if (!settings.export_info_path.empty()) return runExportInfo(settings.export_info_path);
+
     // * Load vulkan library *
     VulkanLibrary library;
 
+    //when running headless, no window is created, simulation runs for a given number of steps and the application exits
+    if (settings.headless) return runHeadless(library, app_name, settings);
+    //compare results of the GPU simulation with the CPU backend and exit
+    if (settings.verify_cpu) return runCpuVerification(library, app_name, settings);
+    //time both particle binning methods at different particle densities and exit
+    if (settings.benchmark_binning) return runBinningBenchmark(library, app_name, settings);
+    //run all benchmark scenarios, write results and compare them with a baseline, then exit
+    if (settings.benchmark) return runBenchmarkSuite(library, app_name, settings);
+    //run many simulations with different parameters as one, write statistics of each one and exit
+    if (settings.ensemble_members != 0) return runEnsemble(library, app_name, settings);
+    //find the fastest workgroup sizes for this device, save them and exit
+    if (settings.autotune) return runWorkgroupAutotuner(library, app_name, settings);
+    //compare reduced storage precisions with full precision and exit
+    if (settings.precision_report) return runPrecisionReport(library, app_name, settings);
+
     // * Create vulkan instance *
     const vector<string> instance_extensions {VK_KHR_SURFACE_EXTENSION_NAME, VK_KHR_WIN32_SURFACE_EXTENSION_NAME};
     VulkanInstance& instance = library.createInstance(VulkanInstanceCreateInfo().appName(app_name).requestExtensions(instance_extensions));
@@ -36,10 +79,12 @@ int main(){
 
     // * Choose a physical device *
     PhysicalDevice physical_device = PhysicalDevices(instance).choose();
+    //workgroup sizes saved by the autotuner for this device, or default ones
+    WorkgroupSizes workgroup_sizes = loadWorkgroupSizes(physicalDeviceProperties(physical_device).deviceName);
 
     // * Create logical device *
     Device& device = physical_device.requestExtensions({VK_KHR_SWAPCHAIN_EXTENSION_NAME})
-        .requestFeatures(PhysicalDeviceFeatures().enableGeometryShader())
+        .requestFeatures(simulationDeviceFeatures())
         .requestScreenSupportQueues({{2, VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_TRANSFER_BIT}}, window)
         .createLogicalDevice(instance);
     
@@ -55,8 +100,6 @@ int main(){
     CommandPool render_command_pool = CommandPoolInfo{0, VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT}.create();
 
     // * Create local object creator -  used to copy data from RAM to GPU local buffers / images*
-    //the largest buffer that will need to be copied is triangle list for marching cubes method - 256 variants * 15 vertices per variant * 4 bytes per int
-    const uint32_t max_image_or_buffer_size_bytes = 256 * 15 * 4;
     LocalObjectCreator device_local_buffer_creator{queue, max_image_or_buffer_size_bytes};
 
 
@@ -67,16 +110,22 @@ int main(){
     //data for uniform buffer containing all simulation parameters. Buffer layout is described in shaders_fluid/fluids_uniform_buffer_layout.txt
     SimulationParametersBufferData fluid_params_uniform_buffer;
 
-    //Initialize shader context - Load all shaders
-    DirectoryPipelinesContext fluid_context("shaders_fluid");
+    //time taken by creating the shader context and all sections is printed, described in simulation_constants.h, look for 'Startup time'
+    auto startup_start = std::chrono::steady_clock::now();
+
+    //Initialize shader context - shaders embedded in the executable are used unless loading them from disk, with workgroup sizes written into them
+    DirectoryPipelinesContext fluid_context(shaderDirectory(settings.shaders_from_disk, workgroup_sizes));
     
-    SimulationDescriptors flow_context{fluid_params_uniform_buffer, device_local_buffer_creator};
+    //the readback buffer is only needed when saving or restoring checkpoints
+    //each frame in flight draws its' own particle buffers, written by the last step of the frame
+    SimulationDescriptors flow_context{fluid_params_uniform_buffer, device_local_buffer_creator, workgroup_sizes, settings.storage_precision, settings.usesCheckpoints() ? simulationReadbackBufferSize() : 4, frames_in_flight};
     
     //List of sections that will be executed before simulation start
-    SimulationInitializationSections init_sections{fluid_context, flow_context};
+    SimulationInitializationSections init_sections{fluid_context, flow_context, workgroup_sizes};
 
     //All sections that will run each simulation step
-    SimulationStepSections draw_section_list{fluid_context, flow_context, flow_context.getVelocitiesSampler()};
+    SimulationStepSections draw_section_list{fluid_context, flow_context, workgroup_sizes, flow_context.getVelocitiesSampler(), flow_context.getParticleCommandsBuffer(), flow_context.getBrickCommandsBuffer(), flow_context.getSurfaceMeshCommandsBuffer(),
+        settings.pressure_solver, settings.pressure_sweeps_per_dispatch, settings.particle_sort_interval, settings.particle_binning, settings.sparse_bricks, settings.kernel_fusion, settings.incremental_remesh, frames_in_flight};
 
     // * Create a render pass - all graphics shaders must be executed inside one, this render pass uses previously created depth image and images that can be displayed into the app window*
     VkRenderPass render_pass = SimpleRenderPassInfo{swapchain.getFormat(), VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, depth_test_image.getFormat(), VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL}.create();
@@ -92,8 +141,19 @@ int main(){
     //enable depth testing
     render_pipeline_info.getDepthStencilInfo().enableDepthTest().enableDepthWrite();
 
-    //sections used for rendering particles, surface and data(disabled by default)
-    RenderSections render_sections(fluid_context, flow_context, render_pipeline_info, render_pass);
+    //the surface mesh is drawn as a list of triangles
+    PipelineInfo surface_pipeline_info = render_pipeline_info;
+    surface_pipeline_info.getAssemblyInfo().setTopology(VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST);
+
+    //sections used for rendering particles, surface and data(disabled by default), one for every frame in flight
+    vector<std::unique_ptr<RenderSections>> render_sections;
+    for (uint32_t frame = 0; frame < frames_in_flight; frame++){
+        render_sections.push_back(std::make_unique<RenderSections>(fluid_context, flow_context, frame, render_pipeline_info, surface_pipeline_info, render_pass));
+    }
+
+    //sections that copy simulation state into the readback buffer and back, when saving or restoring checkpoints
+    std::unique_ptr<SimulationCheckpoints> checkpoints;
+    if (settings.usesCheckpoints()) checkpoints = std::make_unique<SimulationCheckpoints>(fluid_context, flow_context, workgroup_sizes);
     
 
     //when all sections were created, each one recorded which descriptors it needed to function, now all descriptors can be allocated from a shared descriptor set
@@ -102,17 +162,38 @@ int main(){
     //Complete all sections - this is needed to update all descriptors
     init_sections.complete();   
     draw_section_list.complete();
-    render_sections.complete();
+    for (auto& r : render_sections) r->complete();
+    if (checkpoints) checkpoints->complete();
+    std::cout << std::fixed << std::setprecision(3) << "Created shaders and sections in " << std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startup_start).count() << " ms\n";
+    if (settings.dump_schedule){
+        init_sections.getGraph().dump(std::cout);
+        draw_section_list.dumpSchedule(std::cout);
+        draw_section_list.setBarrierReport(&std::cout);
+    }
 
     //record command buffer responsible for initializing the simulation
     CommandBuffer init_buffer{init_command_pool.allocateBuffer()};
     init_buffer.startRecordPrimary(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-    //record all sections used during initialization into the command buffer
-    init_sections.run(init_buffer, flow_context);
+    if (settings.restore_path.empty()){
+        //record all sections used during initialization into the command buffer
+        GraphBarriers init_barriers = init_sections.run(init_buffer, flow_context);
+        if (settings.dump_schedule) init_barriers.print(std::cout, "initialization");
+    }else{
+        //copy the checkpoint into the readback buffer, then distribute it into simulation images instead of initializing them
+        uint32_t restored_step;
+        if (!SimulationCheckpoints::load(settings.restore_path, flow_context, restored_step)) return 1;
+        checkpoints->recordRestore(init_buffer, flow_context);
+        draw_section_list.setStep(restored_step);
+    }
+    //frames drawn before the first step draw no particles
+    recordRenderFramesClear(init_buffer, flow_context);
     //transition depth image to be used as a depth attachment next frame
     init_buffer.cmdBarrier(VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT, 
         depth_test_image.createMemoryBarrier(ImageState{IMAGE_NEWLY_CREATED}, ImageState{IMAGE_DEPTH_STENCIL_ATTACHMENT})    
     );
+    //set once the initialization and checkpoint copies below finished, waits for them can time out
+    CompletionEvent completion;
+    completion.record(init_buffer);
     init_buffer.endRecord();
     //create a synchronization object to track whether initialization has finished
     SubmitSynchronization init_sync;
@@ -122,6 +203,44 @@ int main(){
     queue.submit(init_buffer, init_sync);
     //wait at most one second for all commands to finish
     init_sync.waitFor(SYNC_SECOND);
+    if (!completion.finished()){
+        std::cerr << "Initialization didn't finish within one second\n";
+        return 1;
+    }
+
+    //submits steps from command buffers recorded once, described in simulation_constants.h, look for 'Pre-recorded steps'
+    //times sections with GPU timestamps, described in simulation_constants.h, look for 'GPU profiler'. Pre-recorded steps write timestamps too, one set of command buffers per frame in flight
+    std::unique_ptr<GpuProfiler> profiler;
+    if (!settings.profile_path.empty()) profiler = std::make_unique<GpuProfiler>(physicalDeviceProperties(physical_device).limits.timestampPeriod, frames_in_flight);
+    std::unique_ptr<RecordedSimulationStep> recorded_step;
+    if (settings.prerecorded_step) recorded_step = std::make_unique<RecordedSimulationStep>(draw_section_list, flow_context, render_command_pool);
+
+    //saves a checkpoint of the state after the last submitted step, waits for the copy to finish. Returns false if the copy timed out or the file couldn't be written
+    CommandBuffer checkpoint_buffer{render_command_pool.allocateBuffer()};
+    auto save_checkpoint = [&](){
+        completion.reset();
+        checkpoint_buffer.startRecordPrimary(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        checkpoints->recordSave(checkpoint_buffer, flow_context);
+        completion.record(checkpoint_buffer);
+        checkpoint_buffer.endRecord();
+        SubmitSynchronization checkpoint_sync;
+        checkpoint_sync.setEndFence(Fence());
+        queue.submit(checkpoint_buffer, checkpoint_sync);
+        checkpoint_sync.waitFor(SYNC_SECOND);
+        //the readback buffer would hold a partial copy, and the command buffer can't be reset while it is executing
+        if (!completion.finished()){
+            std::cerr << "Copying the checkpoint didn't finish within one second, it wasn't saved\n";
+            return false;
+        }
+        checkpoint_buffer.resetBuffer(false);
+        //readback changed states of simulation images, the pre-recorded step has to be recorded again
+        if (recorded_step) recorded_step->invalidate();
+        return SimulationCheckpoints::save(settings.checkpoint_path, flow_context, draw_section_list.getStep(), settings.storage_precision);
+    };
+
+    //streams simulation steps into an export file, copies are submitted after steps and written to the file by a separate thread
+    std::unique_ptr<FrameExporter> exporter;
+    if (!settings.export_path.empty()) exporter = std::make_unique<FrameExporter>(flow_context, render_command_pool, settings);
 
 
     // * Initialize projection matrices and camera * 
@@ -132,25 +251,38 @@ int main(){
     glm::mat4 projection = glm::perspective(glm::radians(45.f), 1.f*window.getWidth() / window.getHeight(), 0.1f, 200.f) * invert_y_mat;
     glm::mat4 MVP;
 
-    //Semaphore is a synchronization object, it will be signalled after one simulation step finishes and rendering can begin, it is watchable by the GPU
-    Semaphore simulation_step_end_semaphore;
-
-    //Watches whether simulation step is finished
-    SubmitSynchronization simulation_step_synchronization;
-    //add semaphore to be signalled when simulation step finishes executing
-    simulation_step_synchronization.addEndSemaphore(simulation_step_end_semaphore);
-
-    //Watches whether rendering is finished
-    SubmitSynchronization render_synchronization;
-    render_synchronization.addStartSemaphore(simulation_step_end_semaphore);
-    //add fence to be signalled when rendering finishes
-    render_synchronization.setEndFence(Fence());
-
-    CommandBuffer render_command_buffer(render_command_pool.allocateBuffer());
-    CommandBuffer simulation_step_buffer(render_command_pool.allocateBuffer());
+    //Semaphore is a synchronization object, it will be signalled after one simulation step finishes and rendering can begin, it is watchable by the GPU. Each frame in flight has its' own
+    vector<Semaphore> simulation_step_end_semaphores(frames_in_flight);
+    //Watch whether simulation steps and rendering of each frame in flight are finished
+    vector<SubmitSynchronization> simulation_step_synchronizations(frames_in_flight);
+    vector<SubmitSynchronization> render_synchronizations(frames_in_flight);
+    vector<CommandBuffer> simulation_step_buffers;
+    vector<CommandBuffer> render_command_buffers;
+    for (uint32_t frame = 0; frame < frames_in_flight; frame++){
+        //add semaphore to be signalled when simulation step finishes executing, rendering of the same frame waits for it
+        simulation_step_synchronizations[frame].addEndSemaphore(simulation_step_end_semaphores[frame]);
+        render_synchronizations[frame].addStartSemaphore(simulation_step_end_semaphores[frame]);
+        //add fence to be signalled when rendering finishes
+        render_synchronizations[frame].setEndFence(Fence());
+        simulation_step_buffers.emplace_back(render_command_pool.allocateBuffer());
+        render_command_buffers.emplace_back(render_command_pool.allocateBuffer());
+    }
+    //whether each frame in flight was submitted at least once, its' fence can be waited for only then
+    vector<bool> frame_submitted(frames_in_flight, false);
+    uint32_t frame_index = 0;
+    //frame in flight whose particle buffers the last step wrote, frames without a step draw these
+    uint32_t drawn_frame = 0;
 
     //whether simulation is paused - during a pause, simulation is static, but camera can still move
     bool paused = false;
+    bool surface_on = true;
+    //reports when the surface mesh doesn't fit into its' buffers, from the status copied by each frame
+    SurfaceMeshOverflowReport surface_overflow;
+    //decides how many steps are simulated each frame and limits the frame rate
+    FramePacer frame_pacer(settings);
+    bool profile_key_down = false;
+    //set when saving a checkpoint failed, the application then ends with an error
+    bool failed = false;
 
     //while user hasn't closed the window
     while (window.running()){
@@ -162,20 +294,59 @@ int main(){
         //if Q or E keys are pressed, pause/resume the simulation
         if (window.keyOn(GLFW_KEY_Q)) paused = true;
         if (window.keyOn(GLFW_KEY_E)) paused = false;
-        if (window.keyOn(GLFW_KEY_R)) render_sections.surface_on = false;
-        if (window.keyOn(GLFW_KEY_F)) render_sections.surface_on = true;
-
-        //if simulation isn't paused
-        if (!paused){
-            simulation_step_buffer.startRecordPrimary(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
-            //record all sections
-            draw_section_list.run(simulation_step_buffer, flow_context);
-            simulation_step_buffer.endRecord();
-        
-            //submit recorded command buffer to the queue
-            queue.submit(simulation_step_buffer, simulation_step_synchronization);
+        if (window.keyOn(GLFW_KEY_R)) surface_on = false;
+        if (window.keyOn(GLFW_KEY_F)) surface_on = true;
+        //if P is pressed, write the profile of frames finished so far
+        bool profile_key = window.keyOn(GLFW_KEY_P);
+        if (profiler && profile_key && !profile_key_down) profiler->write(settings.profile_path);
+        profile_key_down = profile_key;
+        uint32_t substeps = frame_pacer.startFrame(paused);
+
+        //resources of the frame in flight used this time
+        uint32_t frame = frame_index++ % frames_in_flight;
+        CommandBuffer& simulation_step_buffer = simulation_step_buffers[frame];
+        CommandBuffer& render_command_buffer = render_command_buffers[frame];
+        if (substeps != 0) drawn_frame = frame;
+        RenderSections& frame_render_sections = *render_sections[drawn_frame];
+        frame_render_sections.surface_on = surface_on;
+        //wait until the last frame that used the same resources is rendered, then reset its' command buffers. Other frames can still be running on the GPU
+        if (frame_submitted[frame]){
+            render_synchronizations[frame].waitFor(SYNC_SECOND);
+            surface_overflow.check(flow_context.readSurfaceStatus(frame));
+            simulation_step_buffer.resetBuffer(false);
+            render_command_buffer.resetBuffer(false);
         }
-        
+        frame_submitted[frame] = true;
+
+        simulation_step_buffer.startRecordPrimary(VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT);
+        //record all sections of this frame's substeps, or select the pre-recorded ones to be submitted
+        //either way, timestamps of the frame that used the same resources are collected first, it has finished
+        uint32_t steps_before = draw_section_list.getStep();
+        if (recorded_step){
+            recorded_step->record(simulation_step_buffer, substeps, frame);
+        }else{
+            if (profiler) profiler->startFrame(simulation_step_buffer, frame);
+            if (substeps != 0) draw_section_list.run(simulation_step_buffer, flow_context, substeps, frame);
+        }
+        //the last step wrote particles drawn by this frame, the next one writes the ones of another frame and overwrites the surface mesh only after this frame drew it, so it can run while this frame is being rendered
+        recordRenderFrameOutputs(simulation_step_buffer, flow_context, frame);
+        simulation_step_buffer.endRecord();
+        //submit the pre-recorded step if there is one, then the recorded command buffer
+        if (recorded_step){
+            recorded_step->submit(queue, simulation_step_buffer, simulation_step_synchronizations[frame]);
+        }else{
+            queue.submit(simulation_step_buffer, simulation_step_synchronizations[frame]);
+        }
+        if (substeps != 0){
+            //copy the finished step into a staging buffer of the exporter
+            if (exporter) exporter->capture(queue, substeps);
+            //save if an interval-th step was among the substeps
+            if (settings.checkpoint_interval != 0 && steps_before / settings.checkpoint_interval != draw_section_list.getStep() / settings.checkpoint_interval && !save_checkpoint()){
+                failed = true;
+                break;
+            }
+        }
+
 
         //get current window image to render into
         SwapchainImage swapchain_image = swapchain.acquireImage();
@@ -186,33 +357,41 @@ int main(){
         render_command_buffer.cmdBarrier(VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
             swapchain_image.createMemoryBarrier(ImageState{IMAGE_NEWLY_CREATED}, ImageState{IMAGE_COLOR_ATTACHMENT})
         );
+        //all frames share one depth image, wait until the previous frame finished depth testing before clearing it
+        render_command_buffer.cmdBarrier(VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT, VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT,
+            depth_test_image.createMemoryBarrier(ImageState{IMAGE_DEPTH_STENCIL_ATTACHMENT}, ImageState{IMAGE_DEPTH_STENCIL_ATTACHMENT})
+        );
         //transition all images to be ready for rendering. Normally, this is a part of command_buffer.record call, however, transitions are not possible during a render pass
         // -> .record is split into two parts, transition() and execute()
-        render_sections.transition(render_command_buffer, flow_context);
+        frame_render_sections.transition(render_command_buffer, flow_context);
         render_command_buffer.cmdBeginRenderPass(render_pass_settings, render_pass, swapchain_image.getFramebuffer());
 
         //compute model-view-projection matrix
         MVP = projection * camera.view_matrix;
         //render particles, surface and data if enabled
-        render_sections.execute(render_command_buffer, MVP);
+        frame_render_sections.execute(render_command_buffer, MVP);
         render_command_buffer.cmdEndRenderPass();
         render_command_buffer.endRecord();
         
         //wait until window image can be rendered into
         swapchain.prepareToDraw();
-        //execute render command buffer
-        queue.submit(render_command_buffer, render_synchronization);
-        //wait for rendering to finish
-        render_synchronization.waitFor(SYNC_SECOND);
+        //execute render command buffer, it is waited for when its' frame in flight is used again
+        queue.submit(render_command_buffer, render_synchronizations[frame]);
         
         //present rendered image
         swapchain.presentImage(swapchain_image, present_queue);
-
-        //reset recorded command buffers
-        simulation_step_buffer.resetBuffer(false);
-        render_command_buffer.resetBuffer(false);
     }
     //wait for all operations on main queue to finish, then end the app
     queue.waitFor();
-    return 0;
+    if (profiler){
+        profiler->finish();
+        profiler->write(settings.profile_path);
+    }
+    if (!failed && !settings.checkpoint_path.empty() && !save_checkpoint()) failed = true;
+    //write remaining frames and the index of the export file
+    if (exporter){
+        exporter->finish();
+        exporter->printSummary();
+    }
+    return failed ? 1 : 0;
 }
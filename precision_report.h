@@ -0,0 +1,101 @@
+#ifndef PRECISION_REPORT_H
+#define PRECISION_REPORT_H
+
+#include <iostream>
+#include <iomanip>
+
+#include "headless_simulation.h"
+#include "cpu_verification.h"
+#include "run_settings.h"
+
+
+
+//size of one texel of the formats simulation images use, in bytes
+inline uint32_t formatBytes(VkFormat format){
+    switch (format){
+        case VK_FORMAT_R32G32B32A32_SFLOAT: return 16;
+        case VK_FORMAT_R16G16B16A16_SFLOAT: return 8;
+        case VK_FORMAT_R32_SFLOAT:
+        case VK_FORMAT_R32_UINT:            return 4;
+        case VK_FORMAT_R16_SFLOAT:
+        case VK_FORMAT_R16_UINT:            return 2;
+        case VK_FORMAT_R8_UINT:             return 1;
+        default:                            return 0;
+    }
+}
+
+//bytes of all images of one fluid grid cell - 2x velocities, 2x cell types, 2x pressures, divergence, particle densities and 5 pressure solver images. Coarser multigrid levels aren't included
+inline uint32_t fluidCellBytes(const StorageFormats& formats){
+    return 2 * formatBytes(formats.velocities) + 2 * 1 + 3 * 4 + 4 + 5 * 4;
+}
+//bytes of all images of one detailed grid cell - detailed densities, inertia, 2x float densities and surface mesh densities
+inline uint32_t detailedCellBytes(const StorageFormats& formats){
+    return 4 + formatBytes(formats.densities_inertia) + 3 * formatBytes(formats.float_densities);
+}
+
+
+
+/**
+ * runPrecisionReport
+ *  - Runs settings.verify_steps steps with full precision and with each reduced precision from the same initial state, then compares all read back images with the full precision ones
+ *  - Mismatches are counted with the tolerances of CPU verification, max and mean differences show how far reduced precisions drift
+ *  - Also prints how many bytes one cell of each grid takes, which is what reduced precisions save in bandwidth
+ *  - All other settings are taken from the command line, particles aren't sorted, so that they can be compared one by one
+ */
+inline int runPrecisionReport(VulkanLibrary& library, const string& app_name, const RunSettings& settings){
+    HeadlessDevice headless(library, app_name);
+    WorkgroupSizes workgroup_sizes = loadWorkgroupSizes(headless.getDeviceName());
+    const StoragePrecision precisions[3]{StoragePrecision::STORAGE_PRECISION_FULL, StoragePrecision::STORAGE_PRECISION_HALF, StoragePrecision::STORAGE_PRECISION_COMPACT};
+    const char* names[3]{"full", "half", "compact"};
+
+    //run the simulation with the given precision and read back its' state
+    auto run = [&](StoragePrecision precision){
+        RunSettings run_settings = settings;
+        run_settings.storage_precision = precision;
+        run_settings.particle_sort_interval = 0;
+        HeadlessSimulation simulation(headless, run_settings, workgroup_sizes, true);
+        simulation.initialize();
+        for (uint32_t step = 0; step < settings.verify_steps; step++) simulation.step();
+        return simulation.readback();
+    };
+    SimulationReadbackData reference = run(StoragePrecision::STORAGE_PRECISION_FULL);
+
+    //float densities in solid cells are never written, they are skipped the same way as in CPU verification
+    vector<uint32_t> cell_types = reference.uintComponent(reference.region(CELL_TYPES, true), 0);
+    auto not_solid = [&](size_t i){
+        size_t x = i % surface_render_size.x, y = i / surface_render_size.x % surface_render_size.y, z = i / surface_render_size.x / surface_render_size.y;
+        size_t r = surface_render_resolution;
+        return cell_types[(x / r) + (y / r) * fluid_size.x + (z / r) * fluid_size.x * fluid_size.y] != (uint32_t) CellType::CELL_SOLID;
+    };
+
+    std::cout << "Storage precision report after " << settings.verify_steps << " step(s)\n"
+        << std::setw(10) << "precision" << std::setw(18) << "fluid cell bytes" << std::setw(21) << "detailed cell bytes" << "\n";
+    for (uint32_t p = 0; p < 3; p++){
+        StorageFormats formats = storageFormats(precisions[p]);
+        std::cout << std::setw(10) << names[p] << std::setw(18) << fluidCellBytes(formats) << std::setw(21) << detailedCellBytes(formats) << "\n";
+    }
+
+    for (uint32_t p = 1; p < 3; p++){
+        SimulationReadbackData data = run(precisions[p]);
+        std::cout << "\nDifferences of " << names[p] << " precision from full precision:\n";
+        for (const ReadbackRegion& r : simulationReadbackRegions()){
+            const ReadbackRegion& region = data.region(r.index, r.is_image);
+            const ReadbackRegion& reference_region = reference.region(r.index, r.is_image);
+            bool detailed = r.is_image && r.size.volume() == surface_render_size.volume();
+            //the alpha component of velocities isn't used
+            uint32_t components = (r.is_image && r.components == 4) ? 3 : r.components;
+            for (uint32_t c = 0; c < components; c++){
+                string image = components == 1 ? r.name : r.name + " " + "xyzw"[c];
+                if (r.is_float){
+                    compareFloats(names[p], image, data.floatComponent(region, c), reference.floatComponent(reference_region, c), detailed ? std::function<bool(size_t)>(not_solid) : nullptr).print();
+                }else{
+                    compareUints(names[p], image, data.uintComponent(region, c), reference.uintComponent(reference_region, c)).print();
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+
+#endif
@@ -0,0 +1,595 @@
+#ifndef RUN_SETTINGS_H
+#define RUN_SETTINGS_H
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cerrno>
+#include <cctype>
+#include <limits>
+
+#include "simulation_constants.h"
+
+
+using std::string;
+using std::vector;
+
+
+
+/**
+ * RunSettings
+ *  - Describes how the application should run, is filled from command line arguments
+ *  - Arguments:
+ *    - --headless      run the simulation without a window, swapchain or rendering, then print a timing summary and exit
+ *    - --steps N       how many simulation steps to run in headless mode
+ *    - --grid-size N   simulate an N^3 grid, 20 by default
+ *    - --surface-resolution N  number of detailed grid cells along each side of a simulation cell, 5 by default
+ *    - --particle-space N  the most particles the particle buffer can hold, 1000000 by default
+ *    - --cpu           run the simulation on the multithreaded CPU backend instead of the GPU, then print a timing summary and exit
+ *    - --threads N     how many threads the CPU backend uses, 0 means one per hardware core. With --workers, threads of each worker process
+ *    - --workers N     with --cpu, split the grid into N slabs simulated by separate worker processes. Only the CPU backend can be split, the GPU pipeline always simulates the whole grid
+ *    - --scaling-benchmark N  run the CPU backend split into 1 to N slabs, print speedup and parallel efficiency, check that all runs end in the same state, then exit
+ *    - --verify-cpu    run the simulation on both the GPU and the CPU backend and compare outputs of all sections
+ *    - --verify-steps N  how many steps to run before comparing in verification mode
+ *    - --pressure-solver NAME  which method solves for pressure - jacobi, tiled, multigrid or mgpcg (default)
+ *    - --pressure-sweeps N  red-black sweeps per dispatch of the tiled Gauss-Seidel solver
+ *    - --sort-interval N  sort particles by cell every N steps, 0 disables sorting
+ *    - --binning NAME  how particles are counted in each cell - atomic or shared (default)
+ *    - --benchmark-binning  compare both binning methods at different particle densities, then exit
+ *    - --benchmark     run all benchmark scenarios headless, write results as JSON, then exit
+ *    - --benchmark-steps N  how many steps are timed in each benchmark run
+ *    - --benchmark-scenario NAME  only run scenarios with this name
+ *    - --benchmark-grid-sizes N,N,...  grid sizes each scenario runs at, 16,20,32 by default
+ *    - --benchmark-surface-resolutions N,N,...  surface resolutions each scenario runs at, 3,5 by default
+ *    - --benchmark-out FILE  file that benchmark results are written to
+ *    - --benchmark-baseline FILE  compare benchmark results with the ones in FILE, the application returns a non-zero exit code if any run is slower
+ *    - --dense         process all bricks of the fluid and detailed grids each step, instead of only the active ones
+ *    - --kernels NAME  whether sections 02 - 10 run as fused (default) or separate kernels
+ *    - --autotune      time the simulation with different workgroup sizes, save the fastest ones for the device used, then exit
+ *    - --autotune-steps N  how many steps are timed for each candidate when autotuning
+ *    - --precision NAME  storage precision of velocities and surface images - full (default), half or compact
+ *    - --precision-report  run --verify-steps steps with each storage precision, print differences from full precision and bytes per cell, then exit
+ *    - --full-remesh   extract the surface mesh of all active bricks each step, instead of only the ones that changed
+ *    - --record-every-step  record all sections of each step again, instead of submitting pre-recorded command buffers
+ *    - --shaders-from-disk  load compiled shaders from shaders_fluid instead of the ones embedded in the executable, for changing shaders without rebuilding
+ *    - --dump-schedule  print the order in which sections of section graphs run, and how many barriers each variant of recorded steps records
+ *    - --substeps N    simulate N steps per submission, only the last one computes the surface. By default, the windowed application runs as many as needed to keep up with real time
+ *    - --max-substeps N  the most substeps per frame when keeping up with real time
+ *    - --max-fps N     render at most N frames per second, 0 means no limit
+ *    - --profile PREFIX  time each section with GPU timestamps, write a Chrome trace to PREFIX.json and statistics to PREFIX.csv at exit, or when P is pressed in the windowed application
+ *    - --export FILE   stream particles to an export file while the simulation runs, in the windowed application or in headless mode
+ *    - --export-surface  also export the surface mesh
+ *    - --export-every N  export every N-th step
+ *    - --export-encoding NAME  how exported positions are stored - float (default), quantized or delta
+ *    - --export-info FILE  print a summary of an export file, check that its' frames can be decoded, then exit
+ *    - --restore FILE  start from a checkpoint instead of the initial particle cube
+ *    - --checkpoint FILE  save a checkpoint of the simulation state into FILE when the application exits
+ *    - --checkpoint-every N  also save the checkpoint every N steps, requires --checkpoint
+ *    - --ensemble N    run N simulations of --grid-size cells as one, tiled in one grid, for --steps steps, write statistics of each one, then exit. Requires the jacobi or tiled pressure solver
+ *    - --ensemble-sweep NAME FIRST LAST  vary fountain, gravity or diffusion across ensemble members from FIRST to LAST, can be given for several parameters
+ *    - --ensemble-out FILE  file that statistics of ensemble members are written to as CSV
+ */
+struct RunSettings{
+    //whether to run without a window
+    bool headless = false;
+    //number of simulation steps to run in headless mode
+    uint32_t headless_steps = 1000;
+    //width, height and depth of the fluid grid
+    uint32_t grid_size = default_fluid_grid_size;
+    //subdivisions of each simulation cell on the detailed grid
+    uint32_t surface_resolution = default_surface_render_resolution;
+    //size of the particle buffer, in particles
+    uint32_t particle_space = default_particle_space_size;
+    //whether to run the simulation on the CPU backend
+    bool cpu = false;
+    //number of threads used by the CPU backend, 0 means one per hardware core
+    uint32_t cpu_threads = 0;
+    //number of slab worker processes the CPU backend is split into, 1 simulates the whole grid in this process
+    uint32_t cpu_workers = 1;
+    //the most workers the scaling benchmark runs with, 0 means it isn't run
+    uint32_t scaling_benchmark_workers = 0;
+    //whether to compare GPU results with the CPU backend
+    bool verify_cpu = false;
+    //number of simulation steps to run before comparing GPU and CPU results
+    uint32_t verify_steps = 1;
+    //method used for solving pressure on the GPU
+    PressureSolver pressure_solver = default_pressure_solver;
+    //sweeps per dispatch of the tiled Gauss-Seidel pressure solver
+    uint32_t pressure_sweeps_per_dispatch = tiled_pressure_sweeps_per_dispatch;
+    //how often particles are sorted by cell, 0 means never
+    uint32_t particle_sort_interval = default_particle_sort_interval;
+    //method used for counting particles in each cell
+    ParticleBinning particle_binning = default_particle_binning;
+    //whether to run the binning microbenchmark
+    bool benchmark_binning = false;
+    //whether to run the benchmark suite
+    bool benchmark = false;
+    //number of steps timed in each run of the benchmark suite
+    uint32_t benchmark_steps = default_benchmark_steps;
+    //scenario the benchmark suite runs, all of them if empty
+    string benchmark_scenario;
+    //grid sizes and surface resolutions the benchmark suite runs each scenario at, every combination is run
+    vector<uint32_t> benchmark_grid_sizes = default_benchmark_grid_sizes;
+    vector<uint32_t> benchmark_surface_resolutions = default_benchmark_surface_resolutions;
+    //file benchmark results are written to
+    string benchmark_output_path = "benchmark.json";
+    //results to compare with, no comparison if empty
+    string benchmark_baseline_path;
+    //whether fluid and surface sections only go over active bricks
+    bool sparse_bricks = default_sparse_bricks;
+    //whether chains of velocity sections run as fused kernels
+    KernelFusion kernel_fusion = default_kernel_fusion;
+    //whether to run the workgroup size autotuner
+    bool autotune = false;
+    //number of steps timed for each candidate workgroup size
+    uint32_t autotune_steps = default_autotune_steps;
+    //formats of velocities, float densities and densities inertia
+    StoragePrecision storage_precision = default_storage_precision;
+    //whether to compare results of reduced storage precisions with full precision
+    bool precision_report = false;
+    //whether only surface meshes of bricks that changed are extracted each step
+    bool incremental_remesh = default_incremental_remesh;
+    //whether simulation steps are submitted from command buffers recorded once
+    bool prerecorded_step = default_prerecorded_step;
+    //whether shaders are loaded from files even if the executable has embedded ones
+    bool shaders_from_disk = false;
+    //whether to print the schedule of section graphs at startup
+    bool dump_schedule = false;
+    //steps simulated per submission, 0 means as many as needed to keep up with real time in the windowed application, and 1 in headless mode
+    uint32_t substeps = 0;
+    //the most substeps per frame when keeping up with real time
+    uint32_t max_substeps = default_max_substeps_per_frame;
+    //frame rate limit of the windowed application, 0 means no limit
+    uint32_t max_fps = 0;
+    //prefix of profile files, sections aren't timed if empty
+    string profile_path;
+    //file that frames are exported to, no export if empty
+    string export_path;
+    //whether the surface mesh is exported together with particles
+    bool export_surface = false;
+    //export every export_interval-th step
+    uint32_t export_interval = 1;
+    //how exported positions are encoded
+    ExportEncoding export_encoding = default_export_encoding;
+    //export file to print a summary of, nothing is simulated if set
+    string export_info_path;
+    //checkpoint to start the simulation from, the initial particle cube is used if empty
+    string restore_path;
+    //file that checkpoints are saved to, none are saved if empty
+    string checkpoint_path;
+    //save a checkpoint every checkpoint_interval steps, 0 means only when exiting
+    uint32_t checkpoint_interval = 0;
+    //number of ensemble members, 0 means no ensemble is run
+    uint32_t ensemble_members = 0;
+    //parameters that differ between ensemble members
+    vector<EnsembleSweep> ensemble_sweeps;
+    //file that statistics of ensemble members are written to
+    string ensemble_output_path = default_ensemble_output_file;
+    //if parsing arguments failed, this is set to false and the application should exit
+    bool valid = true;
+
+    //whether checkpoints are saved or restored, the readback buffer is needed for both
+    bool usesCheckpoints() const{
+        return !restore_path.empty() || !checkpoint_path.empty();
+    }
+};
+
+
+//parse an unsigned integer, returns false if the text isn't a number or it doesn't fit into 32 bits
+inline bool parseUint(const char* text, uint32_t& value){
+    //strtoul parses an empty string as 0 and wraps negative numbers around, both are rejected here
+    if (!std::isdigit(static_cast<unsigned char>(text[0]))) return false;
+    char* end;
+    errno = 0;
+    unsigned long long parsed = std::strtoull(text, &end, 10);
+    if (*end != '\0' || errno == ERANGE || parsed > std::numeric_limits<uint32_t>::max()) return false;
+    value = (uint32_t) parsed;
+    return true;
+}
+//parse an unsigned integer argument following a flag, returns false if there is none, it isn't a number or it doesn't fit into 32 bits
+inline bool parseUintArgument(int argc, char* argv[], int& i, uint32_t& value){
+    if (i + 1 >= argc || !parseUint(argv[i + 1], value)) return false;
+    i++;
+    return true;
+}
+
+
+//parse a float argument following a flag, returns false if there is none or it isn't a number
+inline bool parseFloatArgument(int argc, char* argv[], int& i, float& value){
+    if (i + 1 >= argc) return false;
+    char* end;
+    float parsed = std::strtof(argv[i + 1], &end);
+    if (end == argv[i + 1] || *end != '\0') return false;
+    value = parsed;
+    i++;
+    return true;
+}
+
+
+//parse a comma separated list of positive integers following a flag, returns false if there is none or any value isn't a positive number
+inline bool parseUintListArgument(int argc, char* argv[], int& i, vector<uint32_t>& values){
+    if (i + 1 >= argc) return false;
+    vector<uint32_t> parsed;
+    string text = argv[i + 1];
+    size_t start = 0;
+    while (true){
+        size_t end = text.find(',', start);
+        uint32_t value;
+        if (!parseUint(text.substr(start, end == string::npos ? string::npos : end - start).c_str(), value) || value == 0) return false;
+        parsed.push_back(value);
+        if (end == string::npos) break;
+        start = end + 1;
+    }
+    values = parsed;
+    i++;
+    return true;
+}
+
+
+//parse the name of a pressure solver following a flag, returns false if there is none or it isn't known
+inline bool parsePressureSolver(int argc, char* argv[], int& i, PressureSolver& solver){
+    if (i + 1 >= argc) return false;
+    string name = argv[i + 1];
+    if (name == "jacobi"){
+        solver = PressureSolver::PRESSURE_SOLVER_JACOBI;
+    }else if (name == "tiled"){
+        solver = PressureSolver::PRESSURE_SOLVER_TILED_GAUSS_SEIDEL;
+    }else if (name == "multigrid"){
+        solver = PressureSolver::PRESSURE_SOLVER_MULTIGRID;
+    }else if (name == "mgpcg"){
+        solver = PressureSolver::PRESSURE_SOLVER_MGPCG;
+    }else{
+        return false;
+    }
+    i++;
+    return true;
+}
+
+
+//parse the name of a particle binning method following a flag, returns false if there is none or it isn't known
+inline bool parseParticleBinning(int argc, char* argv[], int& i, ParticleBinning& binning){
+    if (i + 1 >= argc) return false;
+    string name = argv[i + 1];
+    if (name == "atomic"){
+        binning = ParticleBinning::PARTICLE_BINNING_ATOMIC;
+    }else if (name == "shared"){
+        binning = ParticleBinning::PARTICLE_BINNING_SHARED;
+    }else{
+        return false;
+    }
+    i++;
+    return true;
+}
+
+
+//parse whether kernels are fused following a flag, returns false if there is no name or it isn't known
+inline bool parseKernelFusion(int argc, char* argv[], int& i, KernelFusion& fusion){
+    if (i + 1 >= argc) return false;
+    string name = argv[i + 1];
+    if (name == "separate"){
+        fusion = KernelFusion::KERNELS_SEPARATE;
+    }else if (name == "fused"){
+        fusion = KernelFusion::KERNELS_FUSED;
+    }else{
+        return false;
+    }
+    i++;
+    return true;
+}
+
+
+//parse storage precision following a flag, returns false if there is no name or it isn't known
+inline bool parseStoragePrecision(int argc, char* argv[], int& i, StoragePrecision& precision){
+    if (i + 1 >= argc) return false;
+    string name = argv[i + 1];
+    if (name == "full"){
+        precision = StoragePrecision::STORAGE_PRECISION_FULL;
+    }else if (name == "half"){
+        precision = StoragePrecision::STORAGE_PRECISION_HALF;
+    }else if (name == "compact"){
+        precision = StoragePrecision::STORAGE_PRECISION_COMPACT;
+    }else{
+        return false;
+    }
+    i++;
+    return true;
+}
+
+
+//parse the encoding of exported frames following a flag, returns false if there is no name or it isn't known
+inline bool parseExportEncoding(int argc, char* argv[], int& i, ExportEncoding& encoding){
+    if (i + 1 >= argc) return false;
+    string name = argv[i + 1];
+    if (name == "float"){
+        encoding = ExportEncoding::EXPORT_FLOAT;
+    }else if (name == "quantized"){
+        encoding = ExportEncoding::EXPORT_QUANTIZED;
+    }else if (name == "delta"){
+        encoding = ExportEncoding::EXPORT_DELTA;
+    }else{
+        return false;
+    }
+    i++;
+    return true;
+}
+
+
+//parse the name of an ensemble parameter and its' first and last value following a flag, returns false if any is missing or the name isn't known
+inline bool parseEnsembleSweep(int argc, char* argv[], int& i, EnsembleSweep& sweep){
+    if (i + 1 >= argc) return false;
+    string name = argv[i + 1];
+    if (name == "fountain"){
+        sweep.parameter = EnsembleParameter::ENSEMBLE_FOUNTAIN;
+    }else if (name == "gravity"){
+        sweep.parameter = EnsembleParameter::ENSEMBLE_GRAVITY;
+    }else if (name == "diffusion"){
+        sweep.parameter = EnsembleParameter::ENSEMBLE_DIFFUSION;
+    }else{
+        return false;
+    }
+    i++;
+    return parseFloatArgument(argc, argv, i, sweep.first) && parseFloatArgument(argc, argv, i, sweep.last);
+}
+
+
+//parse a file path following a flag, returns false if there is none
+inline bool parsePathArgument(int argc, char* argv[], int& i, string& path){
+    if (i + 1 >= argc) return false;
+    path = argv[i + 1];
+    i++;
+    return true;
+}
+
+
+inline RunSettings parseRunSettings(int argc, char* argv[]){
+    RunSettings settings;
+    for (int i = 1; i < argc; i++){
+        string arg = argv[i];
+        if (arg == "--headless"){
+            settings.headless = true;
+        }else if (arg == "--steps"){
+            if (!parseUintArgument(argc, argv, i, settings.headless_steps)){
+                std::cerr << "Expected a number of steps after --steps\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--grid-size"){
+            if (!parseUintArgument(argc, argv, i, settings.grid_size)){
+                std::cerr << "Expected a number of cells after --grid-size\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--surface-resolution"){
+            if (!parseUintArgument(argc, argv, i, settings.surface_resolution)){
+                std::cerr << "Expected a number of subdivisions after --surface-resolution\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--particle-space"){
+            if (!parseUintArgument(argc, argv, i, settings.particle_space)){
+                std::cerr << "Expected a number of particles after --particle-space\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--cpu"){
+            settings.cpu = true;
+        }else if (arg == "--threads"){
+            if (!parseUintArgument(argc, argv, i, settings.cpu_threads)){
+                std::cerr << "Expected a number of threads after --threads\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--workers"){
+            if (!parseUintArgument(argc, argv, i, settings.cpu_workers) || settings.cpu_workers == 0){
+                std::cerr << "Expected a positive number of workers after --workers\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--scaling-benchmark"){
+            if (!parseUintArgument(argc, argv, i, settings.scaling_benchmark_workers) || settings.scaling_benchmark_workers == 0){
+                std::cerr << "Expected a positive number of workers after --scaling-benchmark\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--verify-cpu"){
+            settings.verify_cpu = true;
+        }else if (arg == "--verify-steps"){
+            if (!parseUintArgument(argc, argv, i, settings.verify_steps)){
+                std::cerr << "Expected a number of steps after --verify-steps\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--pressure-solver"){
+            if (!parsePressureSolver(argc, argv, i, settings.pressure_solver)){
+                std::cerr << "Expected jacobi, tiled, multigrid or mgpcg after --pressure-solver\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--pressure-sweeps"){
+            if (!parseUintArgument(argc, argv, i, settings.pressure_sweeps_per_dispatch) || settings.pressure_sweeps_per_dispatch == 0){
+                std::cerr << "Expected a positive number of sweeps after --pressure-sweeps\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--sort-interval"){
+            if (!parseUintArgument(argc, argv, i, settings.particle_sort_interval)){
+                std::cerr << "Expected a number of steps after --sort-interval\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--binning"){
+            if (!parseParticleBinning(argc, argv, i, settings.particle_binning)){
+                std::cerr << "Expected atomic or shared after --binning\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--benchmark-binning"){
+            settings.benchmark_binning = true;
+        }else if (arg == "--benchmark"){
+            settings.benchmark = true;
+        }else if (arg == "--benchmark-steps"){
+            if (!parseUintArgument(argc, argv, i, settings.benchmark_steps) || settings.benchmark_steps == 0){
+                std::cerr << "Expected a positive number of steps after --benchmark-steps\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--benchmark-scenario"){
+            if (!parsePathArgument(argc, argv, i, settings.benchmark_scenario)){
+                std::cerr << "Expected a scenario name after --benchmark-scenario\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--benchmark-grid-sizes"){
+            if (!parseUintListArgument(argc, argv, i, settings.benchmark_grid_sizes)){
+                std::cerr << "Expected comma separated grid sizes after --benchmark-grid-sizes\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--benchmark-surface-resolutions"){
+            if (!parseUintListArgument(argc, argv, i, settings.benchmark_surface_resolutions)){
+                std::cerr << "Expected comma separated surface resolutions after --benchmark-surface-resolutions\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--benchmark-out"){
+            if (!parsePathArgument(argc, argv, i, settings.benchmark_output_path)){
+                std::cerr << "Expected a file name after --benchmark-out\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--benchmark-baseline"){
+            if (!parsePathArgument(argc, argv, i, settings.benchmark_baseline_path)){
+                std::cerr << "Expected a file name after --benchmark-baseline\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--dense"){
+            settings.sparse_bricks = false;
+        }else if (arg == "--full-remesh"){
+            settings.incremental_remesh = false;
+        }else if (arg == "--record-every-step"){
+            settings.prerecorded_step = false;
+        }else if (arg == "--shaders-from-disk"){
+            settings.shaders_from_disk = true;
+        }else if (arg == "--dump-schedule"){
+            settings.dump_schedule = true;
+        }else if (arg == "--substeps"){
+            if (!parseUintArgument(argc, argv, i, settings.substeps) || settings.substeps == 0){
+                std::cerr << "Expected a positive number of substeps after --substeps\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--max-substeps"){
+            if (!parseUintArgument(argc, argv, i, settings.max_substeps) || settings.max_substeps == 0){
+                std::cerr << "Expected a positive number of substeps after --max-substeps\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--profile"){
+            if (!parsePathArgument(argc, argv, i, settings.profile_path)){
+                std::cerr << "Expected a file name prefix after --profile\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--max-fps"){
+            if (!parseUintArgument(argc, argv, i, settings.max_fps)){
+                std::cerr << "Expected a number of frames after --max-fps\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--kernels"){
+            if (!parseKernelFusion(argc, argv, i, settings.kernel_fusion)){
+                std::cerr << "Expected separate or fused after --kernels\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--autotune"){
+            settings.autotune = true;
+        }else if (arg == "--autotune-steps"){
+            if (!parseUintArgument(argc, argv, i, settings.autotune_steps) || settings.autotune_steps == 0){
+                std::cerr << "Expected a positive number of steps after --autotune-steps\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--precision"){
+            if (!parseStoragePrecision(argc, argv, i, settings.storage_precision)){
+                std::cerr << "Expected full, half or compact after --precision\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--precision-report"){
+            settings.precision_report = true;
+        }else if (arg == "--export"){
+            if (!parsePathArgument(argc, argv, i, settings.export_path)){
+                std::cerr << "Expected a file name after --export\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--export-surface"){
+            settings.export_surface = true;
+        }else if (arg == "--export-every"){
+            if (!parseUintArgument(argc, argv, i, settings.export_interval) || settings.export_interval == 0){
+                std::cerr << "Expected a positive number of steps after --export-every\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--export-encoding"){
+            if (!parseExportEncoding(argc, argv, i, settings.export_encoding)){
+                std::cerr << "Expected float, quantized or delta after --export-encoding\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--export-info"){
+            if (!parsePathArgument(argc, argv, i, settings.export_info_path)){
+                std::cerr << "Expected a file name after --export-info\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--restore"){
+            if (!parsePathArgument(argc, argv, i, settings.restore_path)){
+                std::cerr << "Expected a file name after --restore\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--checkpoint"){
+            if (!parsePathArgument(argc, argv, i, settings.checkpoint_path)){
+                std::cerr << "Expected a file name after --checkpoint\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--checkpoint-every"){
+            if (!parseUintArgument(argc, argv, i, settings.checkpoint_interval) || settings.checkpoint_interval == 0){
+                std::cerr << "Expected a positive number of steps after --checkpoint-every\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--ensemble"){
+            if (!parseUintArgument(argc, argv, i, settings.ensemble_members) || settings.ensemble_members == 0){
+                std::cerr << "Expected a positive number of members after --ensemble\n";
+                settings.valid = false;
+            }
+        }else if (arg == "--ensemble-sweep"){
+            EnsembleSweep sweep;
+            if (!parseEnsembleSweep(argc, argv, i, sweep)){
+                std::cerr << "Expected fountain, gravity or diffusion and two numbers after --ensemble-sweep\n";
+                settings.valid = false;
+            }
+            settings.ensemble_sweeps.push_back(sweep);
+        }else if (arg == "--ensemble-out"){
+            if (!parsePathArgument(argc, argv, i, settings.ensemble_output_path)){
+                std::cerr << "Expected a file name after --ensemble-out\n";
+                settings.valid = false;
+            }
+        }else{
+            std::cerr << "Unknown argument '" << arg << "'\n";
+            settings.valid = false;
+        }
+    }
+    string size_error;
+    if (!simulationSizesValid(settings.grid_size, settings.surface_resolution, settings.particle_space, size_error)){
+        std::cerr << "Invalid simulation sizes - " << size_error << "\n";
+        settings.valid = false;
+    }
+    if (settings.benchmark){
+        for (uint32_t grid_size : settings.benchmark_grid_sizes){
+            for (uint32_t resolution : settings.benchmark_surface_resolutions){
+                if (simulationSizesValid(grid_size, resolution, settings.particle_space, size_error)) continue;
+                std::cerr << "Invalid benchmark sizes, grid " << grid_size << " and surface resolution " << resolution << " - " << size_error << "\n";
+                settings.valid = false;
+            }
+        }
+    }
+    if (settings.ensemble_members != 0){
+        if (!simulationSizesValid(settings.grid_size, settings.surface_resolution, settings.particle_space, size_error, settings.ensemble_members)){
+            std::cerr << "Invalid ensemble sizes - " << size_error << "\n";
+            settings.valid = false;
+        }
+        //see 'Ensembles' in simulation_constants.h
+        bool solver_per_member = settings.pressure_solver == PressureSolver::PRESSURE_SOLVER_JACOBI || settings.pressure_solver == PressureSolver::PRESSURE_SOLVER_TILED_GAUSS_SEIDEL;
+        if (!solver_per_member || settings.cpu || settings.usesCheckpoints()){
+            std::cerr << "--ensemble requires --pressure-solver jacobi or tiled, and can't be combined with --cpu or checkpoints\n";
+            settings.valid = false;
+        }
+    }
+    if (settings.cpu_workers > 1 && !settings.cpu){
+        std::cerr << "--workers requires --cpu, the GPU pipeline isn't split into slabs\n";
+        settings.valid = false;
+    }
+    if (settings.checkpoint_interval != 0 && settings.checkpoint_path.empty()){
+        std::cerr << "--checkpoint-every requires --checkpoint\n";
+        settings.valid = false;
+    }
+    return settings;
+}
+
+
+#endif
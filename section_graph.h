@@ -0,0 +1,498 @@
+#ifndef SECTION_GRAPH_H
+#define SECTION_GRAPH_H
+
+#include <vector>
+#include <string>
+#include <map>
+#include <functional>
+#include <algorithm>
+#include <iostream>
+#include <type_traits>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "indirect_sections.h"
+
+
+using std::vector;
+using std::string;
+
+
+
+//values ImageState and BufferState of the library are created from
+using ImageStateValue = std::remove_cv_t<decltype(IMAGE_STORAGE_R)>;
+using BufferStateValue = std::remove_cv_t<decltype(BUFFER_STORAGE_R)>;
+
+
+/**
+ * SectionAccess
+ *  - One image or buffer a section uses, the state it needs it in and whether it writes into it. Derived from a descriptor usage of the section, or from the image a clear section writes into
+ */
+struct SectionAccess{
+    bool image;
+    uint32_t index;
+    //state of the image or buffer, images change layout between states, buffers only access masks
+    uint32_t state;
+    bool write;
+};
+
+
+/**
+ * SectionUsage
+ *  - A descriptor usage of a section, together with the access the graph schedules the section by. Both are created by the same call below, so the images and buffers of a section are only listed once
+ *  - Converts to the usage of the library, so shared usages can be placed in usage lists of sections outside of graphs as well
+ */
+struct SectionUsage{
+    FlowPipelineSectionDescriptorUsage usage;
+    SectionAccess access;
+
+    operator const FlowPipelineSectionDescriptorUsage&() const{
+        return usage;
+    }
+};
+
+using SectionUsages = vector<SectionUsage>;
+
+//storage image used by a compute shader
+inline SectionUsage storageImage(const string& name, uint32_t image, ImageStateValue state){
+    return SectionUsage{FlowStorageImage{name, image, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, ImageState{state}}, SectionAccess{true, image, (uint32_t) state, state != IMAGE_STORAGE_R}};
+}
+//image sampled by a compute shader through sampler
+inline SectionUsage sampledImage(const string& name, uint32_t image, VkSampler sampler){
+    return SectionUsage{FlowCombinedImage{name, image, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, ImageState{IMAGE_SAMPLER}, sampler}, SectionAccess{true, image, (uint32_t) IMAGE_SAMPLER, false}};
+}
+//uniform buffer used by a compute shader, shaders can't write it
+inline SectionUsage uniformBuffer(const string& name, uint32_t buffer){
+    return SectionUsage{FlowUniformBuffer{name, buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, BufferState{BUFFER_UNIFORM}}, SectionAccess{false, buffer, (uint32_t) BUFFER_UNIFORM, false}};
+}
+//storage buffer used by a compute shader
+inline SectionUsage storageBuffer(const string& name, uint32_t buffer, BufferStateValue state){
+    return SectionUsage{FlowStorageBuffer{name, buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, BufferState{state}}, SectionAccess{false, buffer, (uint32_t) state, state != BUFFER_STORAGE_R}};
+}
+
+//accesses of sections that aren't created from SectionUsages, used by FlowSectionGraph::addOpaque()
+inline SectionAccess imageAccess(uint32_t image, ImageStateValue state){
+    return SectionAccess{true, image, (uint32_t) state, state != IMAGE_STORAGE_R && state != IMAGE_SAMPLER};
+}
+inline SectionAccess bufferAccess(uint32_t buffer, BufferStateValue state){
+    return SectionAccess{false, buffer, (uint32_t) state, state != BUFFER_STORAGE_R && state != BUFFER_UNIFORM};
+}
+//add accesses to the ones of an opaque node, an image or buffer used more than once is listed once, as written if any use writes it and in the state of its' last use
+inline void appendAccesses(vector<SectionAccess>& accesses, const vector<SectionAccess>& added){
+    for (const SectionAccess& access : added){
+        auto it = std::find_if(accesses.begin(), accesses.end(), [&access](const SectionAccess& a){ return a.image == access.image && a.index == access.index; });
+        if (it == accesses.end()){
+            accesses.push_back(access);
+            continue;
+        }
+        it->state = access.state;
+        it->write = it->write || access.write;
+    }
+}
+
+
+//descriptor usages of the library and accesses of usages
+inline vector<FlowPipelineSectionDescriptorUsage> descriptorUsages(const SectionUsages& usages){
+    vector<FlowPipelineSectionDescriptorUsage> descriptor_usages;
+    for (const SectionUsage& u : usages) descriptor_usages.push_back(u.usage);
+    return descriptor_usages;
+}
+inline vector<SectionAccess> sectionAccesses(const SectionUsages& usages){
+    vector<SectionAccess> accesses;
+    for (const SectionUsage& u : usages) accesses.push_back(u.access);
+    return accesses;
+}
+//descriptors of a section that isn't a node itself, e.g. one of a loop or of a brick map. Its' accesses are appended to accesses, for the opaque node that runs it
+inline FlowPipelineSectionDescriptors trackedDescriptors(FlowDescriptorContext& flow_context, const SectionUsages& usages, vector<SectionAccess>& accesses){
+    appendAccesses(accesses, sectionAccesses(usages));
+    return FlowPipelineSectionDescriptors{flow_context, descriptorUsages(usages)};
+}
+
+
+/**
+ * GraphComputeSection
+ *  - A compute section created from SectionUsages, which keeps accesses derived from them for FlowSectionGraph::add(). Section is FlowComputeSection or FlowComputePushConstantSection
+ *  - Can be dispatched indirectly instead, with a command read from a buffer the same way as IndirectComputeSection does, e.g. over active bricks
+ */
+template<typename Section>
+class GraphComputeSection : public Section{
+    vector<SectionAccess> m_accesses;
+    VkBuffer m_commands_buffer = VK_NULL_HANDLE;
+    VkDeviceSize m_commands_offset = 0;
+public:
+    GraphComputeSection(DirectoryPipelinesContext& fluid_context, const string& shader_dir, FlowDescriptorContext& flow_context, const SectionUsages& usages, Size3 dispatch_size) :
+        Section(fluid_context, shader_dir, FlowPipelineSectionDescriptors{flow_context, descriptorUsages(usages)}, dispatch_size),
+        m_accesses(sectionAccesses(usages))
+    {}
+    //dispatched using a VkDispatchIndirectCommand at commands_offset in commands_buffer, which isn't tracked by the flow context, see 'Indirect sections' in indirect_sections.h
+    GraphComputeSection(VkBuffer commands_buffer, VkDeviceSize commands_offset, DirectoryPipelinesContext& fluid_context, const string& shader_dir, FlowDescriptorContext& flow_context, const SectionUsages& usages) :
+        GraphComputeSection(fluid_context, shader_dir, flow_context, usages, indirect_dispatch_size)
+    {
+        m_commands_buffer = commands_buffer;
+        m_commands_offset = commands_offset;
+    }
+    void execute(CommandBuffer& command_buffer){
+        Section::execute(command_buffer);
+        if (m_commands_buffer != VK_NULL_HANDLE) vkCmdDispatchIndirect(command_buffer, m_commands_buffer, m_commands_offset);
+    }
+    const vector<SectionAccess>& getAccesses() const{
+        return m_accesses;
+    }
+};
+
+
+/**
+ * GraphClearSection
+ *  - Clear section that writes the image it clears as its' only access
+ */
+class GraphClearSection : public FlowClearColorSection{
+    vector<SectionAccess> m_accesses;
+public:
+    GraphClearSection(FlowDescriptorContext& flow_context, uint32_t image, ClearValue value) :
+        FlowClearColorSection(flow_context, image, value),
+        m_accesses{SectionAccess{true, image, (uint32_t) IMAGE_TRANSFER_DST, true}}
+    {}
+    const vector<SectionAccess>& getAccesses() const{
+        return m_accesses;
+    }
+};
+
+
+
+/**
+ * GraphBarriers
+ *  - Barriers recorded by graphs during one GraphRecording, returned by GraphRecording::end()
+ */
+struct GraphBarriers{
+    //levels and sections recorded, opaque nodes count as one section
+    uint32_t levels = 0;
+    uint32_t sections = 0;
+    //pipeline barriers recorded by the recording itself - one merged memory barrier per level that needs one, and the barriers at the start and at the end of the recording
+    uint32_t barriers = 0;
+    //sections transitioned by the flow context because an image changed layout or wasn't used before in the recording, each records at most one barrier of its' own
+    uint32_t flow_transitions = 0;
+    //barriers the same sections record when the flow context transitions each of them in the order they were added, one before each section that needs a transition
+    uint32_t sequential_barriers = 0;
+
+    void print(std::ostream& out, const string& name) const{
+        out << name << " - " << sections << " sections in " << levels << " levels, " << barriers << " merged barriers and " << flow_transitions << " sections transitioned by the flow context ("
+            << sequential_barriers << " barriers when recorded in order). Barriers recorded inside opaque nodes aren't counted, apart from the ones of graphs they run\n";
+    }
+};
+
+
+
+/**
+ * GraphRecording
+ *  - Records FlowSectionGraphs into one command buffer, and tracks what their sections did to each image and buffer, so that each level of a graph needs at most one barrier.
+ *    Graphs run one after another in the same recording, e.g. all substeps of one submission, or a solver iteration run many times, share what is known about images and buffers
+ *  - The barrier of a level is one global memory barrier from earlier compute and transfer writes to compute, transfer and indirect command reads, recorded by the graph itself.
+ *    It is needed when a section of the level uses something written before, or writes something read before, since the last barrier
+ *  - The flow context still transitions a section when one of its' images changes layout - storage states share the general layout, transfer and sampler states have their own -
+ *    or when the section uses an image first in the recording, since only the flow context knows its' layout then. Other sections aren't transitioned by the flow context
+ *  - The flow context doesn't see the states of sections it didn't transition, its' states of images and buffers are behind. It still knows the layout of each image, the recording
+ *    starts with a barrier after all commands recorded or submitted before, and end() records one before all commands after it, so these states don't miss any dependency
+ */
+class GraphRecording{
+    struct TrackedState{
+        bool image;
+        uint32_t index;
+        //layout of an image, as the state all states with the same layout are tracked as, valid if layout_known is true
+        bool layout_known;
+        uint32_t layout;
+        //accesses since the last barrier
+        bool written;
+        bool read;
+    };
+    //replays states the way the flow context tracks them, for counting barriers of sections recorded in order
+    struct SequentialState{
+        bool image;
+        uint32_t index;
+        uint32_t state;
+        bool written;
+        bool read;
+    };
+    CommandBuffer& m_command_buffer;
+    FlowDescriptorContext& m_flow_context;
+    vector<TrackedState> m_states;
+    vector<SequentialState> m_sequential_states;
+    GraphBarriers m_barriers;
+    //whether anything was written since the last barrier
+    bool m_written = false;
+    bool m_ended = false;
+public:
+    GraphRecording(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context) :
+        m_command_buffer(command_buffer),
+        m_flow_context(flow_context)
+    {
+        //commands before the recording include draws reading buffers that are written by the recording, e.g. particles of a frame in flight
+        VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_UNIFORM_READ_BIT | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT};
+        vkCmdPipelineBarrier(command_buffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+            0, 1, &barrier, 0, nullptr, 0, nullptr);
+        m_barriers.barriers++;
+    }
+    GraphRecording(const GraphRecording&) = delete;
+    GraphRecording& operator=(const GraphRecording&) = delete;
+    ~GraphRecording(){
+        end();
+    }
+    //record the barrier before commands recorded after the graphs, if anything was written since the last one. Returns barriers recorded by the whole recording, nothing can be recorded into it afterwards
+    const GraphBarriers& end(){
+        if (m_ended) return m_barriers;
+        m_ended = true;
+        if (!m_written) return m_barriers;
+        VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT};
+        vkCmdPipelineBarrier(m_command_buffer, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        m_barriers.barriers++;
+        return m_barriers;
+    }
+    CommandBuffer& getCommandBuffer(){
+        return m_command_buffer;
+    }
+    FlowDescriptorContext& getFlowContext(){
+        return m_flow_context;
+    }
+    const GraphBarriers& getBarriers() const{
+        return m_barriers;
+    }
+private:
+    friend class FlowSectionGraph;
+
+    TrackedState& state(const SectionAccess& access){
+        auto it = std::find_if(m_states.begin(), m_states.end(), [&access](const TrackedState& s){ return s.image == access.image && s.index == access.index; });
+        if (it != m_states.end()) return *it;
+        m_states.push_back(TrackedState{access.image, access.index, false, 0, false, false});
+        return m_states.back();
+    }
+    //all storage states of an image use the general layout
+    static uint32_t layout(uint32_t state){
+        bool storage = state == (uint32_t) IMAGE_STORAGE_R || state == (uint32_t) IMAGE_STORAGE_W || state == (uint32_t) IMAGE_STORAGE_RW;
+        return storage ? (uint32_t) IMAGE_STORAGE_RW : state;
+    }
+    //whether the accesses depend on accesses since the last barrier
+    bool needsBarrier(const vector<SectionAccess>& accesses){
+        for (const SectionAccess& access : accesses){
+            const TrackedState& s = state(access);
+            if (s.written || (access.write && s.read)) return true;
+        }
+        return false;
+    }
+    //whether the flow context has to transition a section with the accesses, because of the layout of one of its' images
+    bool needsTransition(const vector<SectionAccess>& accesses){
+        for (const SectionAccess& access : accesses){
+            if (!access.image) continue;
+            const TrackedState& s = state(access);
+            if (!s.layout_known || s.layout != layout(access.state)) return true;
+        }
+        return false;
+    }
+    void recordLevelBarrier(){
+        VkMemoryBarrier barrier{VK_STRUCTURE_TYPE_MEMORY_BARRIER, nullptr, VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_WRITE_BIT,
+            VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_INDIRECT_COMMAND_READ_BIT};
+        //indirect dispatches read their commands at the draw indirect stage, before their commands are overwritten
+        vkCmdPipelineBarrier(m_command_buffer, VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &barrier, 0, nullptr, 0, nullptr);
+        for (TrackedState& s : m_states){
+            s.written = false;
+            s.read = false;
+        }
+        m_written = false;
+        m_barriers.barriers++;
+    }
+    //update states after a section with the accesses was recorded. Opaque nodes transition their images themselves, so their layouts aren't known afterwards
+    void recorded(const vector<SectionAccess>& accesses, bool opaque){
+        for (const SectionAccess& access : accesses){
+            TrackedState& s = state(access);
+            if (access.image){
+                s.layout_known = !opaque;
+                s.layout = layout(access.state);
+            }
+            if (access.write){
+                s.written = true;
+                m_written = true;
+            }else{
+                s.read = true;
+            }
+        }
+    }
+    //count the barrier the flow context would record before a section with the accesses, if sections were recorded in order. An access needs a transition when the image changes state, after a write,
+    //or when writing after reads. The first access of each image or buffer always needs one, since it was last used outside of the recording
+    void countSequential(const vector<SectionAccess>& accesses){
+        bool needed_any = false;
+        for (const SectionAccess& access : accesses){
+            auto it = std::find_if(m_sequential_states.begin(), m_sequential_states.end(), [&access](const SequentialState& s){ return s.image == access.image && s.index == access.index; });
+            bool needed = it == m_sequential_states.end() || (access.image && it->state != access.state) || it->written || (access.write && it->read);
+            if (it == m_sequential_states.end()) it = m_sequential_states.insert(m_sequential_states.end(), SequentialState{access.image, access.index, access.state, false, false});
+            if (needed){
+                needed_any = true;
+                it->written = false;
+                it->read = false;
+            }
+            it->state = access.state;
+            if (access.write){
+                it->written = true;
+            }else{
+                it->read = true;
+            }
+        }
+        m_barriers.sequential_barriers += needed_any;
+    }
+};
+
+
+
+/**
+ * FlowSectionGraph
+ *  - Runs sections in the order of a dependency graph built from their accesses, in place of recording them one after another
+ *  - Each section is placed one level after the last enabled section added before it that it conflicts with - both use the same image or buffer and one of them writes it, or they need an image in different states
+ *  - Sections of one level don't conflict. The level starts with at most one barrier recorded by the GraphRecording, then the flow context transitions sections whose images change layout,
+ *    then all sections are executed. Nothing waits between dispatches of one level, so independent sections overlap on the GPU
+ *  - Sections are GraphComputeSections or GraphClearSections, which know their accesses. A section can be added more than once, e.g. with different push constants, prepare() of a node is called right before the section is executed
+ *  - Opaque nodes record commands of their own, e.g. loops, brick maps or nested graphs, and list everything they use as accesses. They run after the other sections of their level, so barriers they record don't stop
+ *    sections of the level from overlapping. Nested graphs are run in the same recording
+ *  - Disabled nodes are left out of the schedule, levels are computed once for each set of enabled nodes
+ */
+class FlowSectionGraph{
+    struct Node{
+        string name;
+        vector<SectionAccess> accesses;
+        std::function<void()> prepare;
+        std::function<void(CommandBuffer&, FlowDescriptorContext&)> transition;
+        std::function<void(CommandBuffer&)> execute;
+        //set for opaque nodes, which record everything themselves
+        std::function<void(GraphRecording&)> run;
+        bool enabled;
+    };
+    string m_name;
+    //whether each section is timed by the GPU profiler under its' name, opaque nodes time themselves
+    bool m_time_sections;
+    vector<Node> m_nodes;
+    //indices of nodes of each level, in the order they were added, for each set of enabled nodes
+    std::map<vector<bool>, vector<vector<uint32_t>>> m_schedules;
+public:
+    FlowSectionGraph(const string& name = "", bool time_sections = false) : m_name(name), m_time_sections(time_sections) {}
+    //add a section after all sections added so far, it has to outlive the graph. Returns the index of its' node
+    template<typename Section>
+    uint32_t add(const string& name, Section& section, std::function<void()> prepare = nullptr){
+        return addNode(Node{name, section.getAccesses(), prepare,
+            [&section](CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+                section.transition(command_buffer, flow_context);
+            },
+            [&section](CommandBuffer& command_buffer){
+                section.execute(command_buffer);
+            },
+            nullptr, true});
+    }
+    //add a node that records its' commands by run(), accesses have to include everything they use, with the state each image is in at the end
+    uint32_t addOpaque(const string& name, const vector<SectionAccess>& accesses, std::function<void(GraphRecording&)> run){
+        return addNode(Node{name, accesses, nullptr, nullptr, nullptr, run, true});
+    }
+    void setEnabled(uint32_t node, bool enabled){
+        m_nodes[node].enabled = enabled;
+    }
+    //record enabled nodes level by level into the recording
+    void run(GraphRecording& recording){
+        CommandBuffer& command_buffer = recording.getCommandBuffer();
+        const vector<vector<uint32_t>>& levels = schedule();
+        for (const Node& node : m_nodes){
+            if (node.enabled) recording.countSequential(node.accesses);
+        }
+        for (const vector<uint32_t>& level : levels){
+            bool barrier = false;
+            for (uint32_t i : level) barrier = barrier || recording.needsBarrier(m_nodes[i].accesses);
+            if (barrier) recording.recordLevelBarrier();
+            for (uint32_t i : level){
+                Node& node = m_nodes[i];
+                if (node.run) continue;
+                if (recording.needsTransition(node.accesses)){
+                    node.transition(command_buffer, recording.getFlowContext());
+                    recording.m_barriers.flow_transitions++;
+                }
+                recording.recorded(node.accesses, false);
+            }
+            for (uint32_t i : level){
+                Node& node = m_nodes[i];
+                if (node.run) continue;
+                if (node.prepare) node.prepare();
+                if (m_time_sections){
+                    GpuProfileScope profile(command_buffer, node.name.c_str());
+                    node.execute(command_buffer);
+                }else{
+                    node.execute(command_buffer);
+                }
+            }
+            for (uint32_t i : level){
+                Node& node = m_nodes[i];
+                if (!node.run) continue;
+                node.run(recording);
+                recording.recorded(node.accesses, true);
+            }
+            recording.m_barriers.sections += static_cast<uint32_t>(level.size());
+        }
+        recording.m_barriers.levels += static_cast<uint32_t>(levels.size());
+    }
+    //record the graph alone, with barriers before and after it
+    GraphBarriers run(CommandBuffer& command_buffer, FlowDescriptorContext& flow_context){
+        GraphRecording recording(command_buffer, flow_context);
+        run(recording);
+        return recording.end();
+    }
+    //everything nodes of the graph use, for an opaque node that runs it
+    vector<SectionAccess> getAccesses() const{
+        vector<SectionAccess> accesses;
+        for (const Node& node : m_nodes) appendAccesses(accesses, node.accesses);
+        return accesses;
+    }
+    //number of enabled nodes, and the number of levels they are in
+    uint32_t sectionCount() const{
+        return static_cast<uint32_t>(std::count_if(m_nodes.begin(), m_nodes.end(), [](const Node& n){ return n.enabled; }));
+    }
+    uint32_t levelCount(){
+        return static_cast<uint32_t>(schedule().size());
+    }
+    //print enabled nodes of each level, opaque nodes are marked by *
+    void dump(std::ostream& out){
+        const vector<vector<uint32_t>>& levels = schedule();
+        out << m_name << " - " << sectionCount() << " sections in " << levels.size() << " levels\n";
+        for (size_t l = 0; l < levels.size(); l++){
+            out << "  " << l << ":";
+            for (uint32_t i : levels[l]) out << " " << m_nodes[i].name << (m_nodes[i].run ? "*" : "");
+            out << "\n";
+        }
+    }
+private:
+    uint32_t addNode(Node node){
+        m_nodes.push_back(std::move(node));
+        m_schedules.clear();
+        return static_cast<uint32_t>(m_nodes.size() - 1);
+    }
+    const vector<vector<uint32_t>>& schedule(){
+        vector<bool> enabled(m_nodes.size());
+        for (size_t i = 0; i < m_nodes.size(); i++) enabled[i] = m_nodes[i].enabled;
+        auto it = m_schedules.find(enabled);
+        if (it != m_schedules.end()) return it->second;
+        vector<vector<uint32_t>> levels;
+        vector<uint32_t> node_levels(m_nodes.size(), 0);
+        for (uint32_t i = 0; i < m_nodes.size(); i++){
+            if (!enabled[i]) continue;
+            for (uint32_t j = 0; j < i; j++){
+                if (enabled[j] && conflict(m_nodes[i], m_nodes[j])) node_levels[i] = std::max(node_levels[i], node_levels[j] + 1);
+            }
+            if (node_levels[i] == levels.size()) levels.emplace_back();
+            levels[node_levels[i]].push_back(i);
+        }
+        return m_schedules.emplace(enabled, std::move(levels)).first->second;
+    }
+    static bool conflict(const Node& a, const Node& b){
+        for (const SectionAccess& x : a.accesses){
+            for (const SectionAccess& y : b.accesses){
+                if (x.image != y.image || x.index != y.index) continue;
+                if (x.write || y.write || (x.image && x.state != y.state)) return true;
+            }
+        }
+        return false;
+    }
+};
+
+
+#endif
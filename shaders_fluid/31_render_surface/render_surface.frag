@@ -21,6 +21,6 @@ layout(set = 0, binding = 0) uniform simulation_params_buffer{
 void main(){
     //normalize light direction
     vec3 L_dir = normalize(light_dir);
-    //perform simple shading - color is ambient_color + diffuse_color * k, where k is a constant that decreases with increasing angle between normal and light direction
-    o_color = ambient_color + max(0, dot(-L_dir, normal)) * diffuse_color;
+    //perform simple shading - color is ambient_color + diffuse_color * k, where k is a constant that decreases with increasing angle between normal and light direction. Normals are interpolated between vertices, so they have to be normalized again
+    o_color = ambient_color + max(0, dot(-L_dir, normalize(normal))) * diffuse_color;
 }
\ No newline at end of file
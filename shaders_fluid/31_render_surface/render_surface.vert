@@ -2,23 +2,28 @@
 
 /**
  * render_surface.vert
- *  - Vertex shader used for rendering fluid surface. Converts vertex ID to cell position in the grid.
+ *  - Vertex shader used for rendering fluid surface. Reads the vertex given by the index buffer from the surface mesh written by 21_surface_generate_mesh
  */
 
 
-layout(location = 0) out ivec3 out_pos;
+layout(location = 0) out vec3 normal;
 
 
-layout(set = 0, binding = 0) uniform simulation_params_buffer{
-    layout(offset = 224) uvec3 fluid_surface_render_size;
+struct SurfaceVertex{
+    vec4 position;          //w is 1
+    vec4 normal;            //w isn't used
+};
+layout(set = 0, binding = 1, std430) buffer restrict readonly surface_vertices{
+    SurfaceVertex vertices[];
 };
 
+layout (push_constant) uniform render_surface_push{
+    mat4 MVP;
+};
 
-ivec3 getPos(int vertex_i){
-    return ivec3(vertex_i % fluid_surface_render_size.x, vertex_i % (fluid_surface_render_size.x * fluid_surface_render_size.y) / fluid_surface_render_size.x, vertex_i / fluid_surface_render_size.x / fluid_surface_render_size.y);
-}
 
 void main(){
-    //compute cell position from gl_VertexIndex
-    out_pos = getPos(gl_VertexIndex);
-}
\ No newline at end of file
+    SurfaceVertex v = vertices[gl_VertexIndex];
+    gl_Position = MVP * v.position;
+    normal = v.normal.xyz;
+}
@@ -0,0 +1,41 @@
+import pathlib
+import colorama
+import sys
+
+colorama.init()
+
+#writes all compiled shaders into embedded_shader_data.h, which is included by embedded_shaders.h and compiled into the executable
+root_dir = pathlib.Path(".")
+output_file = root_dir / "embedded_shader_data.h"
+
+spirv_files = sorted(s for shader_dir in root_dir.iterdir() if shader_dir.is_dir() for s in shader_dir.iterdir() if s.suffix == ".spv")
+if not spirv_files:
+    print (colorama.Style.BRIGHT, colorama.Fore.RED, "No compiled shaders found, run build_shaders.py first", colorama.Style.RESET_ALL, sep="")
+    sys.exit(1)
+
+lines = ["//generated by shaders_fluid/embed_shaders.py from compiled shaders, don't edit", ""]
+for i, spirv in enumerate(spirv_files):
+    code = spirv.read_bytes()
+    if len(code) % 4:
+        print (colorama.Style.BRIGHT, colorama.Fore.RED, spirv, " isn't a SPIR-V file", colorama.Style.RESET_ALL, sep="")
+        sys.exit(1)
+    words = [int.from_bytes(code[w:w + 4], "little") for w in range(0, len(code), 4)]
+    lines.append("constexpr uint32_t embedded_shader_code_" + str(i) + "[]{")
+    for w in range(0, len(words), 8):
+        lines.append("    " + ", ".join("0x%08x" % word for word in words[w:w + 8]) + ",")
+    lines.append("};")
+
+lines.append("")
+lines.append("constexpr EmbeddedShaderFile embedded_shader_files[]{")
+for i, spirv in enumerate(spirv_files):
+    lines.append("    {\"" + spirv.as_posix() + "\", embedded_shader_code_" + str(i) + ", sizeof(embedded_shader_code_" + str(i) + ") / sizeof(uint32_t)},")
+lines.append("};")
+lines.append("")
+
+content = "\n".join(lines)
+#only write the file when shaders changed, so that the application isn't rebuilt needlessly
+if not output_file.exists() or output_file.read_text() != content:
+    output_file.write_text(content)
+    print (colorama.Style.BRIGHT, colorama.Fore.GREEN, "Embedded ", len(spirv_files), " shaders into ", output_file, colorama.Style.RESET_ALL, sep="")
+else:
+    print (colorama.Style.BRIGHT, colorama.Fore.GREEN, "Embedded shaders up to date, nothing to be done.", colorama.Style.RESET_ALL)
@@ -1,43 +1,170 @@
 #ifndef SIMULATION_CONSTANTS_H
 #define SIMULATION_CONSTANTS_H
 
+#include <algorithm>
+
 #include "just-a-vulkan-library/vulkan_include_all.h"
 
+/**
+ * Simulation sizes
+ *  - Grid size, surface resolution and the number of particles the particle buffer can hold are chosen at startup, with --grid-size, --surface-resolution and --particle-space
+ *  - Variables below that depend on them are set by setSimulationSizes(), they must not change while any sections or images using them exist
+ *  - Shaders read all sizes from the uniform buffer or push constants, and skip invocations past the end of each grid or buffer, so no size has to be a multiple of workgroup sizes
+ *  - Bounds keep default workgroup sizes valid - at most 65535 bricks of 5x5x5 cells in each grid (see 'Sparse bricks'), so both the fluid grid and the detailed grid are at most 200 cells wide.
+ *    The smallest grid still has two multigrid levels and room for the fountain
+ */
+constexpr uint32_t default_fluid_grid_size = 20;
+constexpr uint32_t min_fluid_grid_size = 8;
+constexpr uint32_t max_fluid_grid_size = 200;
+constexpr uint32_t default_surface_render_resolution = 5;
+//the most cells of the detailed grid in each dimension, grid size times surface resolution
+constexpr uint32_t max_surface_render_grid_size = 200;
+constexpr uint32_t default_particle_space_size = 1000000;
+//position, sorted position and one copy per frame in flight take 16 bytes per particle each
+constexpr uint32_t max_particle_space_size = 1u << 24;
+
 //dimensions of fluid simulation grid
-constexpr uint32_t fluid_width = 20, fluid_height = 20, fluid_depth = 20;
+inline uint32_t fluid_width = default_fluid_grid_size, fluid_height = default_fluid_grid_size, fluid_depth = default_fluid_grid_size;
 
 
 
 /**
  * Parameters for dispatching compute shaders:
- *  - Local group dispatch size is specified in shaders, larger volume is slightly better for performance
- *  - However, when setting fluid width / height / depth, respective local group sizes must be divisors of size in each dimension (local group size (5, 5, 5) works with fluid size (20, 20, 20), but not with (21, 20, 20) (x dimension invalid))
- *  - Global dispatch size, or dispatch size in code for short, represents number of local work groups in each dimensions - for aforementioned local group size (5, 5, 5) and fluid size (20, 20, 20), dispatch size would be (20 / 5, 20 / 5, 20 / 5) = (4, 4, 4)
+ *  - Local group size (workgroup size) isn't written in shaders, it is a specialization constant, whose default value is written into the SPIR-V code at startup. Sizes are chosen at startup, see WorkgroupSizes below
+ *  - Global dispatch size, or dispatch size in code for short, represents number of local work groups in each dimensions - for local group size (5, 5, 5) and fluid size (20, 20, 20), dispatch size would be (20 / 5, 20 / 5, 20 / 5) = (4, 4, 4)
+ *  - Grid size doesn't have to be divisible by the local group size, dispatch size is rounded up and invocations past the end of the grid do nothing
 */
-const Size3 fluid_size{fluid_width, fluid_height, fluid_depth};
-//local group size (must match value written in shaders)
-const Size3 fluid_local_group_size{5, 5, 5};
-//global dispatch size for fluid shaders
-const Size3 fluid_dispatch_size = fluid_size / fluid_local_group_size;
+inline Size3 fluid_size{fluid_width, fluid_height, fluid_depth};
+
+//number of workgroups of the given size needed to cover the given size
+inline Size3 divideRoundUp(const Size3& size, const Size3& local_size){
+    return Size3{(size.x + local_size.x - 1) / local_size.x, (size.y + local_size.y - 1) / local_size.y, (size.z + local_size.z - 1) / local_size.z};
+}
+
 
+//largest workgroup every device the simulation runs on supports, also limited by the shared hash table of binned particle sections (2048 slots)
+constexpr uint32_t max_workgroup_invocations = 1024;
 
-//max amount of particles to be simulated
-//!! When modifying this variable, for the simulation to work correctly, a constant in the shaders has to be changed as well
-//!! Change 'const int PARTICLE_BUFFER_SIZE = 1000000;' to match the number specified here
-//!! shaders affected - init_particles.comp, update_densities.comp, particles.comp, update_detailed_densities.comp, render.vert
-//also, for this change to have any effect, change particle_init_cube_resolution variable below (otherwise, the same amount of particles will be spawned)
-constexpr uint32_t particle_space_size = 1000000;
-//local group size for particle shaders - particle computes are 1D - size is always (particle_local_group_size, 1, 1)
-constexpr uint32_t particle_local_group_size = 1000;
-//global dispatch size for particle shaders
-const Size3 particle_dispatch_size = Size3{particle_space_size / particle_local_group_size, 1, 1};
+//max amount of particles to be simulated. Shaders use the length of the particle buffer, nothing has to be changed in them
+//the default particle cube shrinks to fit into smaller particle buffers, see setSimulationSizes()
+inline uint32_t particle_space_size = default_particle_space_size;
+
+/**
+ * Active particles
+ *  - Only a part of the particle buffer is used by the scene, after initialization, indices of all active particles are compacted into a dense list
+ *  - Particle sections are dispatched indirectly, and particles are drawn indirectly, so that only active particles are processed
+ *  - The particle commands buffer holds the indirect dispatch command at offset 0, and the indirect draw command at offset 16. Vertex count of the draw command is the number of active particles
+ */
+constexpr uint32_t particle_dispatch_command_offset = 0;
+constexpr uint32_t particle_draw_command_offset = 16;
+constexpr uint32_t particle_commands_size = 32;
+
+/**
+ * Particle sorting
+ *  - Every particle_sort_interval steps, active particles are sorted by the Morton code of the cell they are in, at the start of the step. 0 disables sorting
+ *  - Neighbouring invocations of particle shaders then work with particles in neighbouring cells, which makes atomics and velocity sampling more cache friendly
+ *  - Sorting is a counting sort with the cell as the key - count particles in each cell, compute cell starts with a prefix sum, scatter particles to their places
+ *  - Start and count of particles in each cell are kept in buffers indexed by the Morton code of the cell, they are valid until 14_particles moves particles
+ */
+constexpr uint32_t default_particle_sort_interval = 0;
+//number of bits needed for each cell coordinate in the Morton code
+inline uint32_t computeMortonBits(){
+    uint32_t max_size = fluid_width > fluid_height ? fluid_width : fluid_height;
+    if (fluid_depth > max_size) max_size = fluid_depth;
+    uint32_t bits = 0;
+    while ((1u << bits) < max_size) bits++;
+    return bits;
+}
+inline uint32_t particle_sort_morton_bits = computeMortonBits();
+//number of Morton codes, each one has its' own cell start and count
+inline uint32_t particle_sort_cell_count = 1u << (3 * particle_sort_morton_bits);
+//local group size of sorting shaders that go over all cells
+constexpr uint32_t particle_sort_local_group_size = 1024;
+inline Size3 particle_sort_cells_dispatch_size{(particle_sort_cell_count + particle_sort_local_group_size - 1) / particle_sort_local_group_size, 1, 1};
 
-//detailed resolution is used for rendering water surface - resolution defines number of subdivisions on each side of simulation cube
-constexpr uint32_t surface_render_resolution = 5;
-const Size3 surface_render_size{fluid_size * surface_render_resolution};
-const Size3 surface_render_local_group_size{5, 5, 5};
-//global dispatch size for 
-const Size3 surface_render_dispatch_size = surface_render_size / surface_render_local_group_size;
+/**
+ * Particle binning
+ *  - 01_update_densities and 15_update_detailed_densities count particles in each cell of a grid. Two methods are available:
+ *    - Atomic - one image atomic per particle, particles in the same cell serialize on one texel
+ *    - Shared - each workgroup counts its' particles in a small hash table in shared memory, then adds the count of each distinct cell to the image once.
+ *      The fewer distinct cells a workgroup touches, the fewer global atomics are needed, this works best when particles are sorted
+ */
+enum class ParticleBinning{
+    PARTICLE_BINNING_ATOMIC, PARTICLE_BINNING_SHARED
+};
+constexpr ParticleBinning default_particle_binning = ParticleBinning::PARTICLE_BINNING_SHARED;
+
+/**
+ * Kernel fusion
+ *  - Sections 02 - 10 are short passes over the same few images, at small grid sizes their dispatches and barriers cost more than the work itself. Fused variants merge chains of them:
+ *    - 02b_update_cell_types_fused replaces 02_update_water and 03_update_air
+ *    - 07b_advect_forces_fused replaces 06_update_cell_types, 07_advect and 08_forces
+ *    - 09b_diffuse_solids_fused replaces 09_diffuse and 10_solids
+ *  - 04 and 05 stay separate, 05 writes velocities 1, which 04 reads around each cell. Fused sections never read values written by other invocations of the same pass
+ *  - Both variants write the same images, separate sections are kept as the reference for A/B comparisons
+ */
+enum class KernelFusion{
+    KERNELS_SEPARATE, KERNELS_FUSED
+};
+constexpr KernelFusion default_kernel_fusion = KernelFusion::KERNELS_FUSED;
+
+/**
+ * Storage precision
+ *  - Chooses formats of the images that are read the most per step - velocities, float densities and densities inertia
+ *    - Full - RGBA32F velocities, R32F float densities, R32U inertia
+ *    - Half - RGBA16F velocities, R16F float densities, R16U inertia
+ *    - Compact - same as half, inertia is R8U, it never exceeds simulation_densities_max_inertia
+ *  - Shaders declare these images without a format, so the same SPIR-V is used for all modes
+ *  - Pressures, divergences and solver images stay 32 bit - the solver accumulates small differences, and particle densities are counted with 32 bit atomics
+ *  - Velocities have an unused alpha component in all modes, RGB formats aren't supported for storage images
+ */
+enum class StoragePrecision{
+    STORAGE_PRECISION_FULL, STORAGE_PRECISION_HALF, STORAGE_PRECISION_COMPACT
+};
+constexpr StoragePrecision default_storage_precision = StoragePrecision::STORAGE_PRECISION_FULL;
+//formats of images whose precision can be chosen
+struct StorageFormats{
+    VkFormat velocities;
+    VkFormat float_densities;
+    VkFormat densities_inertia;
+};
+inline StorageFormats storageFormats(StoragePrecision precision){
+    switch (precision){
+        case StoragePrecision::STORAGE_PRECISION_HALF:
+            return {VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_R16_SFLOAT, VK_FORMAT_R16_UINT};
+        case StoragePrecision::STORAGE_PRECISION_COMPACT:
+            return {VK_FORMAT_R16G16B16A16_SFLOAT, VK_FORMAT_R16_SFLOAT, VK_FORMAT_R8_UINT};
+        default:
+            return {VK_FORMAT_R32G32B32A32_SFLOAT, VK_FORMAT_R32_SFLOAT, VK_FORMAT_R32_UINT};
+    }
+}
+
+//detailed resolution is used for rendering water surface - resolution defines number of subdivisions on each side of simulation cube, see 'Simulation sizes'
+inline uint32_t surface_render_resolution = default_surface_render_resolution;
+inline Size3 surface_render_size{fluid_size * surface_render_resolution};
+
+/**
+ * Sparse bricks
+ *  - Both the fluid grid and the detailed grid are split into bricks, one brick is the area processed by one workgroup of a grid section - 5x5x5 cells with default workgroup sizes
+ *  - Each step, a brick map is built for each grid - bricks that contain particles, or water / air cells (fluid grid) or non-zero inertia (detailed grid) from the previous step, are occupied.
+ *    Occupied bricks and all their neighbours are active, fluid and surface sections are dispatched indirectly over active bricks only
+ *  - Cells of inactive bricks keep values written the last time their brick was active, which are the same as the ones a full dispatch would write there
+ *    - This holds because sections only read cells next to the one they write, and surface densities are diffused over fewer cells than a brick is wide
+ *  - The first step processes all bricks, so that every cell, including solid cells at the border of the domain, is written at least once. With sparse bricks disabled, all bricks are always active
+ *  - Multigrid and MGPCG go over active bricks on the finest level. Restriction, coarser multigrid levels and clears of whole images stay dense, coarser levels have 8 times fewer cells each and no brick lists
+ *  - Brick coordinates are packed into one uint with 10 bits per dimension, and bricks are dispatched along x only - up to 65535 active bricks, the minimum every device supports
+ */
+constexpr bool default_sparse_bricks = true;
+//number of bricks in each dimension is the same as the dispatch size of dense sections of the grid, see WorkgroupSizes
+//local group size of 01d_build_brick_list, which goes over all bricks of a grid
+constexpr uint32_t brick_list_local_group_size = 64;
+inline Size3 brickListDispatchSize(const Size3& brick_grid_size){
+    return Size3{(brick_grid_size.volume() + brick_list_local_group_size - 1) / brick_list_local_group_size, 1, 1};
+}
+//indirect dispatch commands of fluid and surface sections, and the size of the buffer holding both of them
+constexpr uint32_t fluid_brick_command_offset = 0;
+constexpr uint32_t surface_brick_command_offset = 16;
+constexpr uint32_t brick_commands_size = 32;
 
 
 /**
@@ -45,9 +172,10 @@ const Size3 surface_render_dispatch_size = surface_render_size / surface_render_
  *  - These are passed to shaders using an uniform buffer, they modify behaviour of different shaders
  */
 //Particles are initialized as a cube, starting at given offset with given dimensions. Resolution specifies particle count for each size.
-const Size3 particle_init_cube_resolution{100, 100, 100};
-const glm::vec3 particle_init_cube_offset{5, 2, 1.5};
-const glm::vec3 particle_init_cube_size{10, 10, 2};
+//offset and size are relative to the grid, these values are for the default 20^3 grid, setSimulationSizes() scales them
+inline Size3 particle_init_cube_resolution{100, 100, 100};
+inline glm::vec3 particle_init_cube_offset{5, 2, 1.5};
+inline glm::vec3 particle_init_cube_size{10, 10, 2};
 
 //particle w coordinate will be set to this constant when particle is active, can be any number except 0
 constexpr float active_particle_w = 1;
@@ -70,9 +198,57 @@ constexpr float simulation_diffusion_coefficient = 0.01;
 
 
 
-//how many iterations are used when solving for pressure
+//how many iterations are used when solving for pressure with the Jacobi method
 constexpr uint32_t divergence_solve_iterations = 200;
 
+
+/**
+ * Pressure solver
+ *  - Pressure equations can be solved by one of four methods:
+ *    - Jacobi - the original solver, runs divergence_solve_iterations iterations each step. It is kept as a reference, the CPU backend implements it as well
+ *    - Multigrid - repeats geometric multigrid V-cycles until the residual drops below tolerance
+ *    - MGPCG - conjugate gradient, preconditioned by one multigrid V-cycle per iteration. Converges in the fewest iterations
+ *    - Tiled Gauss-Seidel - a relaxation solver like Jacobi, but each dispatch loads a tile into shared memory and runs several red-black sweeps on it, which needs far fewer dispatches and barriers
+ *  - All solvers start from pressures computed during the previous step (warm start)
+ *  - Multigrid levels halve the grid in each dimension, as long as the grid is even in all dimensions and the coarser level is at least multigrid_min_level_size cells wide. A 20^3 grid has levels 20^3, 10^3 and 5^3
+ *  - Residual is summed on the GPU, once it is small enough, all remaining iterations recorded for the step do nothing
+ */
+enum class PressureSolver{
+    PRESSURE_SOLVER_JACOBI, PRESSURE_SOLVER_MULTIGRID, PRESSURE_SOLVER_MGPCG, PRESSURE_SOLVER_TILED_GAUSS_SEIDEL
+};
+constexpr PressureSolver default_pressure_solver = PressureSolver::PRESSURE_SOLVER_MGPCG;
+//solve stops when |residual| <= tolerance * |right hand side|
+constexpr float pressure_solve_tolerance = 1e-4;
+//max multigrid or conjugate gradient iterations per step
+constexpr uint32_t pressure_solve_max_iterations = 20;
+//red-black Gauss-Seidel sweeps done before and after moving to a coarser multigrid level
+constexpr uint32_t multigrid_smoothing_sweeps = 2;
+//sweeps done on the coarsest level, they approximate an exact solve there
+constexpr uint32_t multigrid_coarse_sweeps = 16;
+//tiled Gauss-Seidel - red-black sweeps done in shared memory during one dispatch. More sweeps mean less dispatches are needed, but tile borders are only updated once per dispatch
+constexpr uint32_t tiled_pressure_sweeps_per_dispatch = 8;
+//tiled Gauss-Seidel - dispatches per step, must be odd so that the last one writes into pressures 2. 25 dispatches with 8 sweeps converge about as far as 200 Jacobi iterations on the default scene
+constexpr uint32_t tiled_pressure_dispatches = 25;
+//upper bound on the number of multigrid levels
+constexpr uint32_t multigrid_max_levels = 8;
+//coarsest level can't be smaller than this in any dimension
+constexpr uint32_t multigrid_min_level_size = 4;
+
+//number of multigrid levels, including the full resolution one
+inline uint32_t computeMultigridLevelCount(){
+    uint32_t levels = 1, w = fluid_width, h = fluid_height, d = fluid_depth;
+    while (levels < multigrid_max_levels && w % 2 == 0 && h % 2 == 0 && d % 2 == 0 && w / 2 >= multigrid_min_level_size && h / 2 >= multigrid_min_level_size && d / 2 >= multigrid_min_level_size){
+        w /= 2; h /= 2; d /= 2;
+        levels++;
+    }
+    return levels;
+}
+inline uint32_t multigrid_level_count = computeMultigridLevelCount();
+//grid size on the given multigrid level, level 0 is the full resolution grid
+inline Size3 multigridLevelSize(uint32_t level){
+    return Size3{fluid_width >> level, fluid_height >> level, fluid_depth >> level};
+}
+
 //particle color used when rendering
 const glm::vec3 particle_render_color{1, 0, 0};
 //particle size - this number is divided by distance from camera, particles further away will appear smaller
@@ -81,8 +257,8 @@ constexpr float particle_render_size = 10;
 constexpr float particle_render_max_size = 20;
 
 
-//position of the fountain spewing fluid upwards
-constexpr glm::uvec3 fountain_position{fluid_width / 2, fluid_height - 2, fluid_depth / 2};
+//position of the fountain spewing fluid upwards, relative to the origin of each ensemble member
+inline glm::uvec3 fountain_position{fluid_width / 2, fluid_height - 2, fluid_depth / 2};
 
 constexpr float fountain_force = -3000;
 //velocity at the border of solid cells will be at least this, pointing away from the solid cell, into the fluid
@@ -102,7 +278,8 @@ constexpr float solid_repel_velocity = 0.01;
  *    - then, if floating point values on the 3D grid are interpreted as a 4D function, then the set of all points in which the function would be equal to 0 represents the fluid surface
  *  - This representation is still prone to have holes in the fluid when there are no particles present at the given time - to fix this, a blur operation is applied multiple times to the resulting function, again, in attempt to reduce smoothness errors
  *    - Blurring is done as diffusion described above
- *  - The surface is then rendered from the floating point representation using the marching cubes method described here https://developer.nvidia.com/gpugems/gpugems3/part-i-geometry/chapter-1-generating-complex-procedural-terrains-using-gpu
+ *  - The surface is then extracted from the floating point representation using the marching cubes method described here https://developer.nvidia.com/gpugems/gpugems3/part-i-geometry/chapter-1-generating-complex-procedural-terrains-using-gpu
+ *    - This is done by compute shaders at the end of each step, the result is an indexed triangle mesh that is drawn with one indirect draw, see 'Surface mesh'
  *    - Shading is really simple - light has two components, ambient and diffuse that are added together
  *      - Ambient is the same base color for all fragments
  *      - Diffuse is scaled down based on the angle between light direction and surface normal
@@ -110,6 +287,7 @@ constexpr float solid_repel_velocity = 0.01;
 
 //max inertia in one field
 constexpr int simulation_densities_max_inertia = 100;
+static_assert(simulation_densities_max_inertia <= 255, "Compact storage precision keeps inertia in 8 bits");
 //how much inertia is increased during a frame when there are any particles present
 constexpr int simulation_inertia_increase_filled = 4;
 //how many neighbours must be filled for inertia to increase
@@ -132,31 +310,342 @@ const glm::vec3 render_surface_ambient_color{0, 0, 0.3};
 const glm::vec3 render_light_direction{1, -3, 1};
 const glm::vec3 render_surface_diffuse_color{0, 0.8, 0.7};
 
+//the largest buffer that will need to be copied by local object creator is triangle list for marching cubes method - 256 variants * 15 vertices per variant * 4 bytes per int
+constexpr uint32_t max_image_or_buffer_size_bytes = 256 * 15 * 4;
+
 //render background color (black)
 const ClearValue background_color{0.0f, 0.0f, 0.0f};
 
+/**
+ * Surface mesh
+ *  - Written by 19 - 21 over active bricks of the detailed grid. Each brick mesh is stored contiguously, vertices on faces between bricks are duplicated
+ *  - Meshes are kept between steps, only bricks whose densities changed, and their neighbours, are extracted again. Calm or settled water costs one comparison per cell
+ *    - A brick changed if any cell moved to the other side of the surface, or its' density differs by more than surface_remesh_threshold from the last time the brick changed
+ *    - Each brick owns a range of the mesh buffers with some space to grow, and moves to a new one at the end of the used part when its' mesh doesn't fit.
+ *      Unused indices are degenerate triangles. When the buffers are full, meshes of all active bricks are extracted again in the next step and packed from the start
+ *    - With incremental remeshing disabled, meshes of all active bricks are extracted every step
+ *  - Vertices buffer - position (xyz, w = 1) and normal (xyz, w unused), 8 floats per vertex. Positions are in the same space as particles. Vertices not referenced by any index aren't valid
+ *  - Indices buffer - 32 bit indices, 3 per triangle, indexing the vertices buffer from its' start
+ *  - Commands buffer - VkDrawIndexedIndirectCommand of the whole mesh, followed by the number of used vertices, the dispatch command of 21, and the state of the mesh - step counter, rebuild flag, used vertices and indices
+ *    Ends with the mesh status - bricks left without a surface because even a rebuild didn't fit, and the vertices and indices all bricks would need. It is copied to the CPU, which reports when the buffers are too small
+ */
+constexpr uint32_t surface_mesh_max_vertices = 1u << 20;
+constexpr uint32_t surface_mesh_max_indices = 3u << 21;
+constexpr uint32_t surface_mesh_vertex_size = 8 * sizeof(float);
+constexpr uint32_t surface_mesh_draw_command_offset = 0;
+constexpr uint32_t surface_mesh_vertex_count_offset = 20;
+constexpr uint32_t surface_mesh_remesh_command_offset = 32;
+constexpr uint32_t surface_mesh_status_offset = 64;
+constexpr uint32_t surface_mesh_status_size = 16;
+constexpr uint32_t surface_mesh_commands_size = surface_mesh_status_offset + surface_mesh_status_size;
+//size of one brick mesh record - allocated ranges, counts, when the brick last changed and the range it used before moving
+constexpr uint32_t surface_brick_mesh_size = 12 * sizeof(uint32_t);
+//brick ranges are allocated in multiples of these
+constexpr uint32_t surface_mesh_vertex_granularity = 32;
+constexpr uint32_t surface_mesh_index_granularity = 96;
+//smallest change of float density that makes a brick extract its' mesh again
+constexpr float surface_remesh_threshold = 0.02f;
+constexpr bool default_incremental_remesh = true;
+
+/**
+ * Frame export
+ *  - After every export_interval-th step, particles and optionally the surface mesh are copied into one of export_ring_size host visible staging buffers, by a separate submission after the step
+ *  - A writer thread waits for the fence of each copy, encodes the frame and appends it to the export file, the simulation only waits when all staging buffers are still being written
+ *  - The surface is copied up to export_surface_max_vertices vertices and export_surface_max_indices indices, larger meshes are saved truncated
+ *  - Encodings and the file layout are described in frame_export_file.h
+ */
+enum class ExportEncoding{
+    EXPORT_FLOAT, EXPORT_QUANTIZED, EXPORT_DELTA
+};
+constexpr ExportEncoding default_export_encoding = ExportEncoding::EXPORT_FLOAT;
+constexpr uint32_t export_ring_size = 3;
+constexpr uint32_t export_keyframe_interval = 30;
+constexpr uint32_t export_surface_max_vertices = 1u << 18;
+constexpr uint32_t export_surface_max_indices = 3u << 19;
+
+/**
+ * Frames in flight
+ *  - The windowed application keeps up to frames_in_flight frames on the GPU at once. Each one has its' own command buffers, semaphore and fence, the CPU only waits for the frame that used the same slot before
+ *  - Nothing is copied for rendering. The last substep of a frame writes positions of active particles and their draw command into buffers of the frame (see RenderFrameBuffer), so the next step writes the ones of another frame while this one is drawn
+ *  - The surface mesh is kept between steps, frames draw it from the simulation buffers. Steps and frames are submitted to one queue in order, and 20 and 21 wait for draws submitted before them, so only they wait for the previous frame
+ *  - Frames without a step, while the simulation is paused, draw particles of the frame that ran the last step. Before overwriting particles of a frame, the step waits for draws submitted before it
+ */
+constexpr uint32_t frames_in_flight = 2;
+
+/**
+ * Pre-recorded steps
+ *  - The simulation step doesn't change between steps, except for the first one and steps that sort particles, so it is recorded into reusable command buffers once and only submitted afterwards
+ *  - All substeps of a submission are recorded into one reusable buffer, one for each number of substeps and each choice of substeps that sort particles, recorded the first time it is needed. A frame is then at most two submissions, however many substeps it has
+ *  - The first step, and the first one after readback or checkpoint sections transitioned simulation images, are recorded as before, the reusable buffers are recorded again when they are used next
+ *  - Batches are recorded for each frame in flight, since the last substep writes particles drawn by its' frame. Per frame, only barriers before rendering and the render pass are recorded
+ */
+constexpr bool default_prerecorded_step = true;
+
+/**
+ * Substeps
+ *  - Each step simulates simulation_time_step seconds. Several steps can be recorded into one submission as substeps, only the last one computes densities of the detailed grid and extracts the surface mesh (15 - 21)
+ *    It counts particles where they are at the start of that substep, so the surface runs next to the fluid sections and lags one step behind particles, see 'Section graphs' in README.md
+ *  - Densities inertia is updated once per submission, so the surface reacts to particles a bit slower with more substeps
+ *  - The windowed application runs as many substeps per frame as needed to keep simulated time equal to real time, at most max_substeps_per_frame. Time that doesn't fit is dropped, the simulation then runs slower than real time
+ *  - A fixed number of substeps per submission can be set instead, which is also used in headless mode
+ */
+constexpr uint32_t default_max_substeps_per_frame = 8;
+
+/**
+ * GPU profiler
+ *  - With --profile, timestamps are written before and after each section of the simulation step and of rendering. Loops like the Jacobi solver, and each iteration of the multigrid and MGPCG solvers, are timed as one section
+ *  - Timestamps of a frame are collected when its' frame in flight is reused, after waiting for its' fence, so collecting never waits for the GPU
+ *  - Statistics of each section are computed over its' last profiler_statistics_window samples, the trace keeps the last profiler_trace_frames frames
+ *  - Pre-recorded steps are timed as well, so profiles measure the path that runs without the profiler. Their command buffers are recorded once per frame in flight, each writes the queries of its' frame slot and resets them first
+ */
+constexpr uint32_t profiler_max_sections_per_frame = 1024;
+constexpr uint32_t profiler_statistics_window = 1000;
+constexpr uint32_t profiler_trace_frames = 200;
+
+/**
+ * Benchmark suite
+ *  - With --benchmark, each scenario of benchmark_suite.h is run headless at several particle counts, the same number of steps each time, and results are written as JSON
+ *  - Steps are first timed without the profiler, with pre-recorded command buffers if enabled, then benchmark_profiled_steps more are run with the profiler to get the time of each stage
+ *  - Scenarios run at each of several grid sizes and surface resolutions, which are set by setSimulationSizes() before each run (see 'Simulation sizes'). Particle space is the one chosen at startup
+ *    Combinations outside the bounds of simulation sizes are rejected when parsing arguments, saved workgroup sizes that don't fit a grid are replaced by default ones for its' runs
+ *  - Startup is timed once, at the sizes chosen at startup
+ *  - Results are compared with a baseline by the name of each run, a run is a regression if its' steps per second dropped by more than benchmark_regression_threshold
+ */
+constexpr uint32_t default_benchmark_steps = 200;
+const vector<uint32_t> default_benchmark_grid_sizes{16, 20, 32};
+const vector<uint32_t> default_benchmark_surface_resolutions{3, 5};
+constexpr uint32_t benchmark_warmup_steps = 10;
+constexpr uint32_t benchmark_profiled_steps = 50;
+constexpr double benchmark_regression_threshold = 0.1;
+
+
+/**
+ * Startup time
+ *  - The library loads shaders and creates pipelines of sections one after another, while the shader context and sections are created. It has no way to give it a VkPipelineCache,
+ *    or to create pipelines on several threads, so startup relies on the pipeline cache of the driver, which many drivers keep on disk between launches
+ *  - Only sections of variants selected by settings are created, so other variants don't add pipelines
+ *  - A pipeline cache saved by the application, validated by device UUID and shader hash, and pipelines created on a thread pool are not implemented, they need both hooks in the library first
+ *  - Time taken by creating the shader context and all sections is printed at startup. The benchmark suite measures the first and a repeated creation of the default simulation
+ */
+
+
+/**
+ * CPU slab decomposition
+ *  - With --cpu --workers N, the CPU backend splits the grid along z into N slabs of nearly equal depth, each one simulated by a separate worker process, see slab_decomposition.h
+ *  - A slab stores slab_ghost_layers layers of each neighbour (slab_detailed_ghost_layers of the detailed grid) next to the ones it owns. Sections only write owned layers,
+ *    ghost layers are exchanged through a SlabTransport after sections that change what the following ones read from neighbours - including after each pressure iteration
+ *  - Two fluid ghost layers cover advection of velocities up to 1.5 cells per step across the slab border, one layer is enough for the neighbours read by all other sections
+ *  - Each slab only keeps particles inside its' owned layers, particles are sent to the neighbour after they move into it
+ *  - Every slab has to own at least slab_ghost_layers layers, so at most fluid_depth / slab_ghost_layers workers can be used
+ *  - Only the CPU backend is decomposed. The GPU pipeline (windowed and headless) always simulates the whole grid on one device, splitting it is out of scope
+ */
+constexpr uint32_t slab_ghost_layers = 2;
+constexpr uint32_t slab_detailed_ghost_layers = 1;
+
 //fluid surface is rendered at the border between neighboring cells (each computation will use current cell and the one after that) - for this reason, the total number of cells in each dimension is surface_render_dimension - 1
-const Size3 fluid_surface_render_size{surface_render_size.x - 1, surface_render_size.y - 1, surface_render_size.z - 1};
+inline Size3 fluid_surface_render_size{surface_render_size.x - 1, surface_render_size.y - 1, surface_render_size.z - 1};
+
+
+/**
+ * Ensembles
+ *  - With --ensemble N, N independent simulations of the same size - members - run as one simulation on one headless device, see ensemble.h. Every section is dispatched once for all members
+ *  - Members are tiled in an atlas - the fluid grid holds ensemble_member_tiles members in each dimension, each one followed by one padding cell in every axis. fluid_size, and every size derived from it,
+ *    is the size of the atlas, the fountain position and the default particle cube are relative to the origin of a member. Without an ensemble, the only member is the whole grid, without padding
+ *  - Padding is cleared at initialization and skipped by sections that would change it (06 copies the cleared cell types, divergences of padding are never read), so reading it gives the same values
+ *    as reading past the end of the grid of a single simulation.
+ *    Borders of the domain, the fountain and linear samples of velocities are the ones of the member of each cell, and particles are kept inside the member they started in
+ *  - Gravity, the diffusion coefficient and fountain force of each member are in an array of the uniform buffer, shaders index it by the member of the cell. --ensemble-sweep NAME FIRST LAST
+ *    varies one of them linearly from FIRST in the first member to LAST in the last one, all members start with the same particle cube
+ *  - The Jacobi and tiled pressure solvers only read neighbours of water cells, which never lie in padding, multigrid and MGPCG coarsen and reduce over the whole atlas, so ensembles require one of the first two.
+ *    The CPU backend has no ensembles. The surface is extracted over the whole atlas, so surfaces of neighbouring members can touch, it isn't used by statistics
+ *  - One member is first run alone at the member size, throughput of the ensemble is reported relative to it. Statistics of each member after the last step are written as CSV into --ensemble-out
+ */
+constexpr uint32_t max_ensemble_members = 1000;
+const string default_ensemble_output_file = "ensemble.csv";
+//number of members, size of each one, distance between origins of neighbouring members, and number of members in each dimension of the atlas
+inline uint32_t ensemble_member_count = 1;
+inline Size3 ensemble_member_size = fluid_size;
+inline Size3 ensemble_member_stride = fluid_size;
+inline Size3 ensemble_member_tiles{1, 1, 1};
+
+//number of members in each dimension of an atlas that holds the given number of members, as close to a cube as possible
+inline Size3 ensembleTiles(uint32_t members){
+    uint32_t x = 1, y = 1;
+    while (x * x * x < members) x++;
+    while (x * y * y < members) y++;
+    return Size3{x, y, (members + x * y - 1) / (x * y)};
+}
+//size of the atlas holding the given number of members of the given size, the grid size itself for a single simulation
+inline Size3 ensembleAtlasSize(uint32_t grid_size, uint32_t members){
+    if (members <= 1) return Size3{grid_size, grid_size, grid_size};
+    Size3 tiles = ensembleTiles(members);
+    return Size3{tiles.x * (grid_size + 1), tiles.y * (grid_size + 1), tiles.z * (grid_size + 1)};
+}
+
+
+//whether sizes are within bounds described in 'Simulation sizes' and 'Ensembles', returns the reason they aren't in 'error'. Grid size is the size of one member
+inline bool simulationSizesValid(uint32_t grid_size, uint32_t resolution, uint32_t particle_space, string& error, uint32_t members = 1){
+    Size3 atlas = ensembleAtlasSize(grid_size, members);
+    uint32_t atlas_width = std::max(atlas.x, std::max(atlas.y, atlas.z));
+    if (grid_size < min_fluid_grid_size || grid_size > max_fluid_grid_size){
+        error = "grid size must be between " + std::to_string(min_fluid_grid_size) + " and " + std::to_string(max_fluid_grid_size);
+    }else if (members == 0 || members > max_ensemble_members){
+        error = "an ensemble must have between 1 and " + std::to_string(max_ensemble_members) + " members";
+    }else if (atlas_width > max_fluid_grid_size){
+        error = "all ensemble members take " + std::to_string(atlas_width) + " cells in one dimension, at most " + std::to_string(max_fluid_grid_size) + " are allowed";
+    }else if (resolution == 0 || atlas_width * resolution > max_surface_render_grid_size){
+        error = "surface resolution must be at least 1, and grid size (of all ensemble members) times surface resolution at most " + std::to_string(max_surface_render_grid_size);
+    }else if (particle_space < members || particle_space > max_particle_space_size){
+        error = "particle space must be between the number of ensemble members and " + std::to_string(max_particle_space_size);
+    }else{
+        return true;
+    }
+    return false;
+}
+
+//set the grid size of a member, surface resolution, particle buffer size and number of ensemble members, and everything that depends on them. Sizes must be valid, see simulationSizesValid()
+inline void setSimulationSizes(uint32_t grid_size, uint32_t resolution, uint32_t particle_space, uint32_t members = 1){
+    ensemble_member_count = members;
+    ensemble_member_size = Size3{grid_size, grid_size, grid_size};
+    ensemble_member_stride = members == 1 ? ensemble_member_size : Size3{grid_size + 1, grid_size + 1, grid_size + 1};
+    ensemble_member_tiles = ensembleTiles(members);
+    fluid_size = ensembleAtlasSize(grid_size, members);
+    fluid_width = fluid_size.x;
+    fluid_height = fluid_size.y;
+    fluid_depth = fluid_size.z;
+    particle_space_size = particle_space;
+    particle_sort_morton_bits = computeMortonBits();
+    particle_sort_cell_count = 1u << (3 * particle_sort_morton_bits);
+    particle_sort_cells_dispatch_size = Size3{(particle_sort_cell_count + particle_sort_local_group_size - 1) / particle_sort_local_group_size, 1, 1};
+    surface_render_resolution = resolution;
+    surface_render_size = fluid_size * surface_render_resolution;
+    fluid_surface_render_size = Size3{surface_render_size.x - 1, surface_render_size.y - 1, surface_render_size.z - 1};
+    multigrid_level_count = computeMultigridLevelCount();
+    fountain_position = glm::uvec3{grid_size / 2, grid_size - 2, grid_size / 2};
+
+    //the default cube keeps its' place relative to the grid of a member, and has as many particles in each dimension as fit into the particle buffer next to cubes of other members, at most 100
+    uint32_t cube_resolution = 1;
+    while (cube_resolution < 100 && (cube_resolution + 1) * (cube_resolution + 1) * (cube_resolution + 1) <= particle_space / members) cube_resolution++;
+    particle_init_cube_resolution = Size3{cube_resolution, cube_resolution, cube_resolution};
+    glm::vec3 domain(grid_size, grid_size, grid_size);
+    particle_init_cube_offset = glm::vec3{0.25f, 0.1f, 0.075f} * domain;
+    particle_init_cube_size = glm::vec3{0.5f, 0.5f, 0.1f} * domain;
+}
 
 
 
+/**
+ * WorkgroupSizes
+ *  - Local group sizes of sections that go over the fluid grid, the detailed grid and particles. They are chosen at startup, either saved by the autotuner for the device used, or defaults below
+ *  - All sections of one grid use the same size, because one workgroup processes one brick (see 'Sparse bricks'). Size (5, 5, 5) has 125 invocations, which doesn't fit 32 or 64 wide hardware well, the autotuner tries other shapes
+ *  - Sizes are default values of specialization constants 0, 1 and 2 (x, y, z) of shaders, particle shaders only use constant 0. They are written into the code the shader context is created with, see shaderDirectory()
+ */
+struct WorkgroupSizes{
+    Size3 fluid{5, 5, 5};
+    Size3 surface{5, 5, 5};
+    uint32_t particle = 1000;
+
+    //dispatch sizes of sections that go over the whole grid, also the number of bricks of each grid
+    Size3 fluidDispatchSize() const{
+        return divideRoundUp(fluid_size, fluid);
+    }
+    Size3 surfaceDispatchSize() const{
+        return divideRoundUp(surface_render_size, surface);
+    }
+    Size3 multigridDispatchSize(uint32_t level) const{
+        return divideRoundUp(multigridLevelSize(level), fluid);
+    }
+    //dispatch size of particle sections that go over the whole particle buffer
+    Size3 particleDispatchSize() const{
+        return Size3{(particle_space_size + particle - 1) / particle, 1, 1};
+    }
+    //whether the sizes can be used, returns the reason they can't in 'error'
+    bool valid(string& error) const{
+        if (fluid.volume() == 0 || surface.volume() == 0 || particle == 0){
+            error = "workgroup sizes can't be zero";
+        }else if (fluid.volume() > max_workgroup_invocations || surface.volume() > max_workgroup_invocations || particle > max_workgroup_invocations){
+            error = "workgroups can have at most " + std::to_string(max_workgroup_invocations) + " invocations";
+        }else if (surface.x <= float_density_diffuse_steps || surface.y <= float_density_diffuse_steps || surface.z <= float_density_diffuse_steps){
+            //diffusion moves densities by one cell per step, with sparse bricks they can't move further than one brick
+            error = "surface workgroups must be wider than float_density_diffuse_steps in each dimension";
+        }else if (!bricksFit(fluidDispatchSize()) || !bricksFit(surfaceDispatchSize())){
+            error = "too many bricks, at most 1024 in each dimension and 65535 in total";
+        }else{
+            return true;
+        }
+        return false;
+    }
+private:
+    //brick coordinates are packed into 10 bits per dimension, and active bricks are dispatched along x only
+    static bool bricksFit(const Size3& brick_grid_size){
+        return brick_grid_size.x <= 1024 && brick_grid_size.y <= 1024 && brick_grid_size.z <= 1024 && brick_grid_size.volume() <= 65535;
+    }
+};
+
+//how many simulation steps are timed for each candidate when autotuning workgroup sizes
+constexpr uint32_t default_autotune_steps = 50;
+
+
 //each cell type is represented by a different integer value, this enum lists them all
 enum class CellType{
     CELL_INACTIVE, CELL_AIR, CELL_WATER, CELL_SOLID
 };
 
 
+//parameters that differ between ensemble members, see 'Ensembles'
+enum class EnsembleParameter{
+    ENSEMBLE_FOUNTAIN, ENSEMBLE_GRAVITY, ENSEMBLE_DIFFUSION
+};
+//parameter varied across ensemble members, from its' first value in the first member to the last value in the last one
+struct EnsembleSweep{
+    EnsembleParameter parameter;
+    float first, last;
+};
+//parameters of one ensemble member, written into member_parameters of the uniform buffer
+struct EnsembleMemberParameters{
+    float gravity = simulation_gravity;
+    float diffusion_coefficient = simulation_diffusion_coefficient;
+    float fountain_strength = fountain_force;
+};
+
+
+/**
+ * SimulationScene
+ *  - What the simulation starts with - the initial particle cube, and how strong the fountain is. All other parameters are the same in every scene
+ *  - The windowed application, headless mode and the CPU backend use the default scene, benchmarks create their own. Resolution volume must not exceed particle_space_size
+ *  - Ensembles give parameters of each member, there must be ensemble_member_count of them. Each member starts with the same particle cube, and resolution volume times the number of members
+ *    must not exceed particle_space_size. Without them, the only member uses the default gravity and diffusion coefficient, and fountain_strength
+ */
+struct SimulationScene{
+    Size3 spawn_cube_resolution = particle_init_cube_resolution;
+    glm::vec3 spawn_cube_offset = particle_init_cube_offset;
+    glm::vec3 spawn_cube_size = particle_init_cube_size;
+    //0 disables the fountain
+    float fountain_strength = fountain_force;
+    vector<EnsembleMemberParameters> members;
+};
+
+
+//offset of the array of ensemble member parameters in the uniform buffer, in bytes
+constexpr uint32_t ensemble_member_parameters_offset = 320;
+
 /**
  * SimulationParametersBufferData
  *  - Holds all simulation parameters in a buffer. Buffer layout is described in shaders_fluid/fluids_uniform_buffer_layout.txt
+ *  - The scene can be changed, benchmarks use this to create scenes with different particle densities and layouts
+ *  - The ensemble layout and parameters of each member follow all other parameters, the buffer always has room for max_ensemble_members members, see 'Ensembles'
  */
 class SimulationParametersBufferData : public UniformBufferRawDataSTD140{
 public:
-    SimulationParametersBufferData() : UniformBufferRawDataSTD140(264) {
+    //default scene with the particle cube moved and resized
+    SimulationParametersBufferData(glm::vec3 spawn_cube_offset, glm::vec3 spawn_cube_size) :
+        SimulationParametersBufferData(SimulationScene{particle_init_cube_resolution, spawn_cube_offset, spawn_cube_size, fountain_force})
+    {}
+    SimulationParametersBufferData(const SimulationScene& scene = SimulationScene{}) : UniformBufferRawDataSTD140(ensemble_member_parameters_offset + max_ensemble_members * 16) {
         writeIVec3((int32_t*) &fluid_size).write(fluid_size.volume())
         .write((uint32_t) CellType::CELL_INACTIVE).write((uint32_t) CellType::CELL_AIR).write((uint32_t) CellType::CELL_WATER).write((uint32_t) CellType::CELL_SOLID)
         .write(simulation_time_step).write(simulation_air_pressure).write(simulation_cell_width).write(simulation_fluid_density)
-        .write(glm::uvec2(particle_dispatch_size.x * particle_local_group_size, particle_dispatch_size.y)).write(particle_init_cube_resolution).write(particle_init_cube_resolution.volume()).write(particle_init_cube_offset).write(particle_init_cube_size)
+        .write(glm::uvec2(particle_space_size, 1)).write(scene.spawn_cube_resolution).write(scene.spawn_cube_resolution.volume()).write(scene.spawn_cube_offset).write(scene.spawn_cube_size)
         .write(simulation_gravity)
         .write(simulation_diffusion_coefficient)
         .write(surface_render_resolution).write(surface_render_size.volume())
@@ -167,9 +656,16 @@ public:
         .write(render_light_direction).write(render_surface_ambient_color).write(render_surface_diffuse_color)
         .write(fluid_surface_render_size)
         .write(active_particle_w)
-        .write(fountain_position).write(fountain_force)
+        .write(fountain_position).write(scene.fountain_strength)
         .write(solid_repel_velocity)
-        .write(particle_render_max_size);
+        .write(particle_render_max_size)
+        .write(ensemble_member_size).write(ensemble_member_count).write(ensemble_member_stride).write(ensemble_member_tiles);
+        //one vec4 per member - gravity, diffusion coefficient, fountain force and one unused value
+        vector<EnsembleMemberParameters> members = scene.members;
+        if (members.empty()) members.push_back(EnsembleMemberParameters{simulation_gravity, simulation_diffusion_coefficient, scene.fountain_strength});
+        for (const EnsembleMemberParameters& member : members){
+            write(glm::vec4(member.gravity, member.diffusion_coefficient, member.fountain_strength, 0));
+        }
     }
 };
 
@@ -0,0 +1,279 @@
+#ifndef SLAB_DECOMPOSITION_H
+#define SLAB_DECOMPOSITION_H
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <exception>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+#endif
+
+#include "cpu_simulation.h"
+#include "slab_transport.h"
+#include "run_settings.h"
+
+
+using std::vector;
+
+using SlabClock = std::chrono::steady_clock;
+
+
+
+/**
+ * SlabWorkerReport
+ *  - Written into shared memory by each worker process once it finished all steps
+ */
+struct SlabWorkerReport{
+    double init_ms;
+    double steps_ms;
+    uint64_t sent_bytes;
+    uint64_t particles;
+};
+
+
+/**
+ * SlabRun
+ *  - Result of simulating the grid split into slabs, see 'CPU slab decomposition' in simulation_constants.h
+ *  - State of owned layers of all slabs is gathered after the last step, so that runs with different numbers of workers can be compared
+ */
+struct SlabRun{
+    uint32_t workers = 0;
+    uint32_t threads = 0;
+    uint32_t steps = 0;
+    //of the slowest worker, steps start at the same time in all of them
+    double init_ms = 0;
+    double step_ms = 0;
+    //sent by all workers to their neighbours each step, ghost layers and particles
+    double sent_bytes_per_step = 0;
+    uint64_t particles = 0;
+    vector<uint8_t> cell_types;
+    CpuVelocityGrid velocities;
+    vector<float> pressures;
+};
+
+
+//threads of each worker - the given number, or hardware cores split between workers if it is 0
+inline uint32_t slabWorkerThreads(uint32_t threads, uint32_t workers){
+    return threads != 0 ? threads : std::max(1u, std::thread::hardware_concurrency() / workers);
+}
+
+//gathered state is stored as cell types, then three velocity components, then pressures, each one an array of the whole grid
+inline size_t slabGatherOffset(uint32_t array){
+    size_t volume = (size_t) fluid_width * fluid_height * fluid_depth;
+    return array == 0 ? 0 : (volume + 3) / 4 * 4 + (array - 1) * volume * sizeof(float);
+}
+
+
+#ifndef _WIN32
+
+//body of a worker process - simulate the slab of transport.rank(), then write the report and owned layers of the slab into shared memory
+inline void runSlabWorker(SharedMemorySlabTransport& transport, uint32_t threads, uint32_t steps, SlabWorkerReport& report, uint8_t* gathered){
+    auto start = SlabClock::now();
+    WorkStealingThreadPool pool(threads);
+    CpuSimulation simulation(pool, transport);
+    simulation.initialize();
+    report.init_ms = std::chrono::duration<double, std::milli>(SlabClock::now() - start).count();
+
+    transport.barrier();
+    auto steps_start = SlabClock::now();
+    for (uint32_t step = 0; step < steps; step++){
+        simulation.step();
+    }
+    report.steps_ms = std::chrono::duration<double, std::milli>(SlabClock::now() - steps_start).count();
+    report.sent_bytes = transport.sentBytes();
+    report.particles = simulation.particles.size();
+
+    const CpuGridIndexer& fluid = simulation.fluidGrid();
+    size_t layer = fluid.index(0, 0, 1);
+    size_t first = fluid.index(0, 0, fluid.owned_begin), bytes = layer * (fluid.owned_end - fluid.owned_begin);
+    size_t global_first = layer * fluid.globalZ(fluid.owned_begin);
+    std::memcpy(gathered + slabGatherOffset(0) + global_first, simulation.cell_types.data() + first, bytes);
+    for (uint32_t c = 0; c < 3; c++){
+        std::memcpy(gathered + slabGatherOffset(1 + c) + global_first * sizeof(float), simulation.velocities_1.c[c].data() + first, bytes * sizeof(float));
+    }
+    std::memcpy(gathered + slabGatherOffset(4) + global_first * sizeof(float), simulation.pressures_2.data() + first, bytes * sizeof(float));
+}
+
+//wait until all workers exit, if one of them fails, the others are killed, since they would wait for it forever. Returns whether all of them succeeded
+inline bool waitForSlabWorkers(vector<pid_t> pids){
+    bool succeeded = true;
+    while (!pids.empty()){
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) return false;
+        auto it = std::find(pids.begin(), pids.end(), pid);
+        if (it == pids.end()) continue;
+        pids.erase(it);
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            if (succeeded) std::cerr << "A slab worker process failed, stopping the others\n";
+            succeeded = false;
+            for (pid_t other : pids) kill(other, SIGKILL);
+        }
+    }
+    return succeeded;
+}
+
+#endif
+
+
+/**
+ * runCpuSlabs
+ *  - Simulate steps steps on the CPU backend with the grid split into workers slabs, each one simulated by a worker process forked from this one using threads threads,
+ *    connected by a SharedMemorySlabTransport. Returns false if a worker failed, or if processes can't be forked on this system
+ *  - Only the CPU backend is split, there is no GPU counterpart - the GPU pipeline always simulates the whole grid
+ */
+inline bool runCpuSlabs(uint32_t workers, uint32_t threads, uint32_t steps, SlabRun& run){
+    if (workers == 0 || workers > maxCpuSlabs()){
+        std::cerr << "The grid can be split into 1 to " << maxCpuSlabs() << " slabs, not " << workers << "\n";
+        return false;
+    }
+#ifdef _WIN32
+    std::cerr << "Slab workers need fork() and process-shared barriers, they are only supported on POSIX systems\n";
+    return false;
+#else
+    //mailboxes have to fit the largest message - velocities of ghost layers, detailed ghost layers, or all particles moving into one neighbour
+    size_t capacity = std::max({(size_t) fluid_width * fluid_height * slab_ghost_layers * 3 * sizeof(float),
+                                (size_t) surface_render_size.x * surface_render_size.y * slab_detailed_ghost_layers * sizeof(float),
+                                (size_t) particle_space_size * 4 * sizeof(float)});
+    SharedMemorySlabTransport transport(workers, capacity);
+    SharedMemory reports(sizeof(SlabWorkerReport) * workers);
+    SharedMemory gathered(slabGatherOffset(5));
+    SlabWorkerReport* report = reinterpret_cast<SlabWorkerReport*>(reports.data());
+
+    //buffered output would be written again by each child
+    std::cout.flush();
+    std::cerr.flush();
+    vector<pid_t> pids;
+    for (uint32_t rank = 0; rank < workers; rank++){
+        pid_t pid = fork();
+        if (pid == 0){
+            transport.setRank(rank);
+            int code = 0;
+            try{
+                runSlabWorker(transport, threads, steps, report[rank], gathered.data());
+            }catch (const std::exception& e){
+                std::cerr << "Slab worker " << rank << " failed: " << e.what() << "\n";
+                code = 1;
+            }
+            std::cout.flush();
+            std::cerr.flush();
+            _exit(code);
+        }
+        if (pid < 0){
+            std::cerr << "Could not start slab worker " << rank << "\n";
+            for (pid_t other : pids) kill(other, SIGKILL);
+            waitForSlabWorkers(pids);
+            return false;
+        }
+        pids.push_back(pid);
+    }
+    if (!waitForSlabWorkers(pids)) return false;
+
+    run.workers = workers;
+    run.threads = threads;
+    run.steps = steps;
+    run.init_ms = run.step_ms = run.sent_bytes_per_step = 0;
+    run.particles = 0;
+    for (uint32_t rank = 0; rank < workers; rank++){
+        run.init_ms = std::max(run.init_ms, report[rank].init_ms);
+        run.step_ms = std::max(run.step_ms, steps ? report[rank].steps_ms / steps : 0.0);
+        run.sent_bytes_per_step += steps ? (double) report[rank].sent_bytes / steps : 0.0;
+        run.particles += report[rank].particles;
+    }
+    size_t volume = (size_t) fluid_width * fluid_height * fluid_depth;
+    const float* floats = reinterpret_cast<const float*>(gathered.data() + slabGatherOffset(1));
+    run.cell_types.assign(gathered.data(), gathered.data() + volume);
+    for (uint32_t c = 0; c < 3; c++) run.velocities.c[c].assign(floats + c * volume, floats + (c + 1) * volume);
+    run.pressures.assign(floats + 3 * volume, floats + 4 * volume);
+    return true;
+#endif
+}
+
+
+/**
+ * runCpuSlabSimulation
+ *  - --cpu --workers N, runs settings.headless_steps steps with the grid split into slabs and prints a timing summary
+ */
+inline int runCpuSlabSimulation(const RunSettings& settings){
+    uint32_t threads = slabWorkerThreads(settings.cpu_threads, settings.cpu_workers);
+    std::cout << "Running on the CPU backend split into " << settings.cpu_workers << " slabs, one worker process each using " << threads << " threads\n";
+    SlabRun run;
+    if (!runCpuSlabs(settings.cpu_workers, threads, settings.headless_steps, run)) return 1;
+
+    std::cout << std::fixed << std::setprecision(3)
+        << "Slab run finished\n"
+        << "  steps:                 " << run.steps << "\n"
+        << "  initialization:        " << run.init_ms << " ms\n"
+        << "  step time (mean):      " << run.step_ms << " ms\n"
+        << "  throughput:            " << (run.step_ms > 0 ? 1000.0 / run.step_ms : 0.0) << " steps/s\n"
+        << "  sent per step:         " << run.sent_bytes_per_step / 1024 << " KiB\n"
+        << "  particles:             " << run.particles << "\n";
+    return 0;
+}
+
+
+//largest difference between gathered states of two runs, cell types count as the number of cells that differ
+struct SlabRunDifference{
+    size_t cell_types = 0;
+    double velocities = 0;
+    double pressures = 0;
+};
+
+inline SlabRunDifference compareSlabRuns(const SlabRun& a, const SlabRun& b){
+    SlabRunDifference difference;
+    for (size_t i = 0; i < a.cell_types.size(); i++){
+        difference.cell_types += a.cell_types[i] != b.cell_types[i];
+        for (uint32_t c = 0; c < 3; c++) difference.velocities = std::max(difference.velocities, (double) std::abs(a.velocities.c[c][i] - b.velocities.c[c][i]));
+        difference.pressures = std::max(difference.pressures, (double) std::abs(a.pressures[i] - b.pressures[i]));
+    }
+    return difference;
+}
+
+
+/**
+ * runCpuScalingBenchmark
+ *  - --scaling-benchmark N, runs settings.benchmark_steps steps with 1 to N workers, each using --threads threads (1 by default, so that only the number of processes changes)
+ *  - Prints speedup and parallel efficiency - speedup divided by the number of workers - relative to one worker, and how much each run differs from it.
+ *    Sections compute each owned cell from the same values as with one slab, so all runs should end in the same state, the application returns a non-zero exit code if they don't
+ */
+inline int runCpuScalingBenchmark(const RunSettings& settings){
+    uint32_t max_workers = std::min(settings.scaling_benchmark_workers, maxCpuSlabs());
+    if (max_workers < settings.scaling_benchmark_workers){
+        std::cout << "The grid can be split into at most " << max_workers << " slabs, benchmarking up to " << max_workers << " workers\n";
+    }
+    uint32_t threads = std::max(1u, settings.cpu_threads);
+    std::cout << "CPU backend scaling benchmark, " << settings.benchmark_steps << " steps, " << threads << " threads per worker\n";
+    std::cout << std::setw(8) << "workers" << std::setw(14) << "step ms" << std::setw(12) << "steps/s" << std::setw(10) << "speedup" << std::setw(12) << "efficiency"
+        << std::setw(16) << "sent/step KiB" << std::setw(12) << "particles" << std::setw(14) << "cell types" << std::setw(14) << "velocity" << std::setw(14) << "pressure" << "\n";
+
+    SlabRun single;
+    bool consistent = true;
+    for (uint32_t workers = 1; workers <= max_workers; workers++){
+        SlabRun run;
+        if (!runCpuSlabs(workers, threads, settings.benchmark_steps, run)) return 1;
+        if (workers == 1) single = run;
+        double speedup = run.step_ms > 0 ? single.step_ms / run.step_ms : 0;
+        SlabRunDifference difference = compareSlabRuns(single, run);
+        bool same = difference.cell_types == 0 && difference.velocities == 0 && difference.pressures == 0 && run.particles == single.particles;
+        consistent = consistent && same;
+        std::cout << std::fixed << std::setprecision(3) << std::setw(8) << workers << std::setw(14) << run.step_ms << std::setw(12) << (run.step_ms > 0 ? 1000.0 / run.step_ms : 0.0)
+            << std::setw(10) << speedup << std::setw(12) << speedup / workers << std::setw(16) << run.sent_bytes_per_step / 1024 << std::setw(12) << run.particles
+            << std::setw(14) << difference.cell_types << std::scientific << std::setw(14) << difference.velocities << std::setw(14) << difference.pressures << std::defaultfloat
+            << (same ? "" : "   MISMATCH") << "\n";
+    }
+    if (!consistent) std::cout << "Runs with more workers ended in a different state than with one worker\n";
+    return consistent ? 0 : 1;
+}
+
+
+#endif
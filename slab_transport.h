@@ -0,0 +1,174 @@
+#ifndef SLAB_TRANSPORT_H
+#define SLAB_TRANSPORT_H
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
+
+using std::vector;
+
+
+
+/**
+ * SlabTransport
+ *  - Connects a slab of a decomposed grid with the slabs below and above it, see 'CPU slab decomposition' in simulation_constants.h
+ *  - Slabs are numbered by rank in order of z, the first and the last slab have only one neighbour
+ *  - Implementations decide how messages travel, the CPU backend only calls exchange() and barrier(). The GPU pipeline isn't decomposed and doesn't use it
+ */
+class SlabTransport{
+protected:
+    uint64_t m_sent_bytes = 0;
+public:
+    virtual ~SlabTransport() = default;
+
+    //index of this slab
+    virtual uint32_t rank() const = 0;
+    //number of slabs
+    virtual uint32_t size() const = 0;
+    //send a message to both neighbours and receive theirs, returns once both are received. Messages to neighbours that don't exist are dropped,
+    //and messages from them are empty. Every slab has to call exchange the same number of times, in the same order
+    virtual void exchange(const vector<uint8_t>& to_lower, const vector<uint8_t>& to_upper, vector<uint8_t>& from_lower, vector<uint8_t>& from_upper) = 0;
+    //return once all slabs called it
+    virtual void barrier() = 0;
+
+    bool hasLower() const{
+        return rank() > 0;
+    }
+    bool hasUpper() const{
+        return rank() + 1 < size();
+    }
+    //bytes sent to neighbours so far
+    uint64_t sentBytes() const{
+        return m_sent_bytes;
+    }
+};
+
+
+
+#ifndef _WIN32
+
+/**
+ * SharedMemory
+ *  - Anonymous memory mapping that is shared with child processes forked after it was created
+ */
+class SharedMemory{
+    uint8_t* m_data = nullptr;
+    size_t m_size = 0;
+public:
+    explicit SharedMemory(size_t size) : m_size(size){
+        void* data = mmap(nullptr, m_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED) throw std::runtime_error("Could not map shared memory");
+        m_data = static_cast<uint8_t*>(data);
+    }
+    ~SharedMemory(){
+        munmap(m_data, m_size);
+    }
+    SharedMemory(const SharedMemory&) = delete;
+    SharedMemory& operator=(const SharedMemory&) = delete;
+
+    uint8_t* data() const{
+        return m_data;
+    }
+    size_t size() const{
+        return m_size;
+    }
+};
+
+
+/**
+ * SharedMemorySlabTransport
+ *  - Transport between worker processes on one host, created by the parent process before it forks the workers, each of which then calls setRank()
+ *  - Each slab has two mailboxes in shared memory, one for each neighbour. exchange() writes both, waits on a process-shared barrier, reads the mailboxes
+ *    neighbours wrote for this slab and waits again, so that mailboxes aren't overwritten before they are read
+ *  - Mailboxes have a fixed capacity, a larger message is an error
+ */
+class SharedMemorySlabTransport : public SlabTransport{
+    struct Mailbox{
+        uint64_t bytes;
+        //followed by capacity bytes of the message
+    };
+    uint32_t m_size;
+    uint32_t m_rank = 0;
+    size_t m_capacity;
+    SharedMemory m_memory;
+    //whether this process created the barrier, only the parent destroys it
+    bool m_owner = true;
+public:
+    SharedMemorySlabTransport(uint32_t slab_count, size_t mailbox_capacity) :
+        m_size(slab_count), m_capacity(mailbox_capacity), m_memory(mailboxOffset(slab_count * 2, mailbox_capacity))
+    {
+        pthread_barrierattr_t attributes;
+        pthread_barrierattr_init(&attributes);
+        pthread_barrierattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED);
+        pthread_barrier_init(getBarrier(), &attributes, slab_count);
+        pthread_barrierattr_destroy(&attributes);
+    }
+    ~SharedMemorySlabTransport(){
+        if (m_owner) pthread_barrier_destroy(getBarrier());
+    }
+    SharedMemorySlabTransport(const SharedMemorySlabTransport&) = delete;
+    SharedMemorySlabTransport& operator=(const SharedMemorySlabTransport&) = delete;
+
+    //called by a worker process after it was forked
+    void setRank(uint32_t rank){
+        m_rank = rank;
+        m_owner = false;
+    }
+    uint32_t rank() const override{
+        return m_rank;
+    }
+    uint32_t size() const override{
+        return m_size;
+    }
+    void exchange(const vector<uint8_t>& to_lower, const vector<uint8_t>& to_upper, vector<uint8_t>& from_lower, vector<uint8_t>& from_upper) override{
+        if (hasLower()) write(mailbox(m_rank, 0), to_lower);
+        if (hasUpper()) write(mailbox(m_rank, 1), to_upper);
+        barrier();
+        read(hasLower() ? mailbox(m_rank - 1, 1) : nullptr, from_lower);
+        read(hasUpper() ? mailbox(m_rank + 1, 0) : nullptr, from_upper);
+        barrier();
+    }
+    void barrier() override{
+        pthread_barrier_wait(getBarrier());
+    }
+
+private:
+    //the barrier is at the start of the mapping, followed by mailboxes, two for each slab - to the lower and to the upper neighbour
+    static size_t mailboxOffset(size_t index, size_t capacity){
+        size_t header = (sizeof(pthread_barrier_t) + 63) / 64 * 64;
+        size_t stride = (sizeof(Mailbox) + capacity + 63) / 64 * 64;
+        return header + index * stride;
+    }
+    pthread_barrier_t* getBarrier() const{
+        return reinterpret_cast<pthread_barrier_t*>(m_memory.data());
+    }
+    Mailbox* mailbox(uint32_t rank, uint32_t direction) const{
+        return reinterpret_cast<Mailbox*>(m_memory.data() + mailboxOffset(rank * 2 + direction, m_capacity));
+    }
+    void write(Mailbox* box, const vector<uint8_t>& message){
+        if (message.size() > m_capacity) throw std::runtime_error("Slab message is larger than the mailbox");
+        box->bytes = message.size();
+        if (!message.empty()) std::memcpy(box + 1, message.data(), message.size());
+        m_sent_bytes += message.size();
+    }
+    static void read(const Mailbox* box, vector<uint8_t>& message){
+        if (!box){
+            message.clear();
+            return;
+        }
+        const uint8_t* data = reinterpret_cast<const uint8_t*>(box + 1);
+        message.assign(data, data + box->bytes);
+    }
+};
+
+#endif
+
+
+#endif
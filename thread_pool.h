@@ -0,0 +1,155 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <algorithm>
+
+
+using std::vector;
+
+
+
+/**
+ * WorkStealingThreadPool
+ *  - A pool of worker threads used by the CPU simulation backend
+ *  - parallelFor splits a range into chunks (usually z-slabs of a grid) and distributes them evenly between per-thread queues
+ *    - Each thread takes chunks from the back of its own queue, when it runs out, it steals from the front of queues of other threads
+ *    - The thread calling parallelFor takes part in the work as well, and returns once all chunks are finished
+ *  - Only one parallelFor can be running at a time, the pool is meant to be driven from a single thread
+ */
+class WorkStealingThreadPool{
+    //range of indices processed by one task
+    struct TaskRange{
+        uint32_t begin, end;
+    };
+    struct TaskQueue{
+        std::mutex mutex;
+        std::deque<TaskRange> tasks;
+    };
+    //one queue per thread, queue 0 belongs to the thread calling parallelFor
+    vector<std::unique_ptr<TaskQueue>> m_queues;
+    vector<std::thread> m_threads;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake_condition;
+    std::condition_variable m_done_condition;
+    //function that is currently being run, called with a range of indices
+    const std::function<void(uint32_t, uint32_t)>* m_job = nullptr;
+    //increased each time new work is submitted, used to wake up workers
+    uint64_t m_job_generation = 0;
+    std::atomic<uint32_t> m_remaining_tasks{0};
+    bool m_stop = false;
+public:
+    //thread_count includes the thread calling parallelFor, 0 means one thread per hardware core
+    explicit WorkStealingThreadPool(uint32_t thread_count = 0){
+        if (thread_count == 0) thread_count = std::max(1u, std::thread::hardware_concurrency());
+        for (uint32_t i = 0; i < thread_count; i++) m_queues.push_back(std::make_unique<TaskQueue>());
+        for (uint32_t i = 1; i < thread_count; i++) m_threads.emplace_back(&WorkStealingThreadPool::workerLoop, this, i);
+    }
+    ~WorkStealingThreadPool(){
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake_condition.notify_all();
+        for (std::thread& t : m_threads) t.join();
+    }
+    WorkStealingThreadPool(const WorkStealingThreadPool&) = delete;
+    WorkStealingThreadPool& operator=(const WorkStealingThreadPool&) = delete;
+
+    uint32_t threadCount() const{
+        return (uint32_t) m_queues.size();
+    }
+    //call f(chunk_begin, chunk_end) for chunks of at most grain indices covering [begin, end), return when all chunks are done
+    void parallelFor(uint32_t begin, uint32_t end, uint32_t grain, const std::function<void(uint32_t, uint32_t)>& f){
+        if (begin >= end) return;
+        grain = std::max(grain, 1u);
+        uint32_t task_count = (end - begin + grain - 1) / grain;
+        //when there is a single task or a single thread, don't bother with the queues
+        if (task_count == 1 || threadCount() == 1){
+            for (uint32_t i = begin; i < end; i += grain) f(i, std::min(end, i + grain));
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_job = &f;
+            m_remaining_tasks = task_count;
+            //distribute contiguous blocks of tasks to each queue, neighbouring slabs are then processed by the same thread
+            uint32_t tasks_per_queue = (task_count + threadCount() - 1) / threadCount();
+            for (uint32_t t = 0; t < task_count; t++){
+                TaskQueue& queue = *m_queues[t / tasks_per_queue];
+                std::lock_guard<std::mutex> queue_lock(queue.mutex);
+                queue.tasks.push_back(TaskRange{begin + t * grain, std::min(end, begin + (t + 1) * grain)});
+            }
+            m_job_generation++;
+        }
+        m_wake_condition.notify_all();
+        runTasks(0);
+        //wait until tasks stolen by other threads are done as well
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_done_condition.wait(lock, [this]{ return m_remaining_tasks == 0; });
+        m_job = nullptr;
+    }
+    //call f(i) for each index, processing z-slabs of a grid with given depth in parallel
+    void forEachSlab(uint32_t depth, const std::function<void(uint32_t, uint32_t)>& f){
+        //a few slabs per thread allow stealing to balance uneven work
+        uint32_t grain = std::max(1u, depth / (4 * threadCount()));
+        parallelFor(0, depth, grain, f);
+    }
+private:
+    //take a task from the back of own queue, or steal one from the front of another queue
+    bool popTask(uint32_t worker, TaskRange& task){
+        {
+            TaskQueue& own = *m_queues[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()){
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (uint32_t i = 1; i < threadCount(); i++){
+            TaskQueue& victim = *m_queues[(worker + i) % threadCount()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()){
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+    void runTasks(uint32_t worker){
+        TaskRange task;
+        while (popTask(worker, task)){
+            (*m_job)(task.begin, task.end);
+            //last finished task wakes up the thread waiting in parallelFor
+            if (--m_remaining_tasks == 0){
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_done_condition.notify_all();
+            }
+        }
+    }
+    void workerLoop(uint32_t worker){
+        uint64_t seen_generation = 0;
+        while (true){
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake_condition.wait(lock, [&]{ return m_stop || m_job_generation != seen_generation; });
+                if (m_stop) return;
+                seen_generation = m_job_generation;
+            }
+            runTasks(worker);
+        }
+    }
+};
+
+
+#endif
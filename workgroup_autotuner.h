@@ -0,0 +1,102 @@
+#ifndef WORKGROUP_AUTOTUNER_H
+#define WORKGROUP_AUTOTUNER_H
+
+#include <iostream>
+#include <iomanip>
+#include <functional>
+
+#include "headless_simulation.h"
+#include "workgroup_sizes.h"
+
+
+
+//candidate sizes of each group. Fluid ones are powers of two except the default, surface ones have to be wider than float_density_diffuse_steps
+const vector<Size3> autotune_fluid_candidates{{5, 5, 5}, {4, 4, 4}, {8, 4, 4}, {8, 8, 2}, {8, 8, 4}};
+const vector<Size3> autotune_surface_candidates{{5, 5, 5}, {8, 5, 5}, {8, 8, 5}, {16, 5, 5}};
+const vector<uint32_t> autotune_particle_candidates{64, 128, 256, 512, 1000, 1024};
+//steps run before timing each candidate - the first step processes all bricks, and particles need a few steps to spread out
+constexpr uint32_t autotune_warmup_steps = 10;
+
+
+
+//whether the device supports the given sizes
+inline bool workgroupSizesFitDevice(const WorkgroupSizes& sizes, const VkPhysicalDeviceLimits& limits){
+    auto fits = [&limits](const Size3& s){
+        return s.x <= limits.maxComputeWorkGroupSize[0] && s.y <= limits.maxComputeWorkGroupSize[1] && s.z <= limits.maxComputeWorkGroupSize[2] && s.volume() <= limits.maxComputeWorkGroupInvocations;
+    };
+    return fits(sizes.fluid) && fits(sizes.surface) && fits(Size3{sizes.particle, 1, 1});
+}
+
+
+//create a simulation with the given sizes, run warmup steps, then return the median time of settings.autotune_steps steps in milliseconds
+inline double timeWorkgroupSizes(HeadlessDevice& headless, const RunSettings& settings, const WorkgroupSizes& sizes){
+    HeadlessSimulation simulation(headless, settings, sizes);
+    simulation.initialize();
+    for (uint32_t step = 0; step < autotune_warmup_steps; step++) simulation.step();
+
+    vector<double> times;
+    for (uint32_t step = 0; step < settings.autotune_steps; step++){
+        auto start = HeadlessClock::now();
+        simulation.step();
+        times.push_back(elapsedMs(start, HeadlessClock::now()));
+    }
+    simulation.waitIdle();
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+
+/**
+ * runWorkgroupAutotuner
+ *  - Finds the fastest workgroup sizes for the device used and saves them to workgroup_sizes_file, where all modes of the application look for them at startup
+ *  - Groups are tuned one after another - fluid, surface, then particle sizes. While one group is tuned, the others keep the fastest sizes found so far
+ *  - Each candidate runs the whole simulation headless, with the solver and other settings given on the command line, so the result is tuned for them
+ */
+inline int runWorkgroupAutotuner(VulkanLibrary& library, const string& app_name, const RunSettings& settings){
+    HeadlessDevice headless(library, app_name);
+    string device_name = headless.getDeviceName();
+    VkPhysicalDeviceLimits limits = headless.getProperties().limits;
+    WorkgroupSizes best = loadWorkgroupSizes(device_name);
+
+    std::cout << "Workgroup size autotuner - " << device_name << ", median step time of " << settings.autotune_steps << " steps\n"
+        << std::setw(10) << "group" << std::setw(14) << "size" << std::setw(12) << "step ms" << "\n";
+
+    //time all candidates of one group, keep the fastest one in 'best'
+    auto tune = [&](const string& group, uint32_t count, const std::function<void(WorkgroupSizes&, uint32_t)>& set_candidate, const std::function<string(const WorkgroupSizes&)>& describe){
+        WorkgroupSizes group_best = best;
+        double best_time = -1;
+        for (uint32_t c = 0; c < count; c++){
+            WorkgroupSizes candidate = best;
+            set_candidate(candidate, c);
+            string error;
+            if (!candidate.valid(error) || !workgroupSizesFitDevice(candidate, limits)) continue;
+
+            double time = timeWorkgroupSizes(headless, settings, candidate);
+            std::cout << std::fixed << std::setprecision(3) << std::setw(10) << group << std::setw(14) << describe(candidate) << std::setw(12) << time << "\n";
+            if (best_time < 0 || time < best_time){
+                best_time = time;
+                group_best = candidate;
+            }
+        }
+        best = group_best;
+    };
+    auto describe3 = [](const Size3& s){
+        return std::to_string(s.x) + "x" + std::to_string(s.y) + "x" + std::to_string(s.z);
+    };
+    tune("fluid", (uint32_t) autotune_fluid_candidates.size(),
+        [](WorkgroupSizes& s, uint32_t c){ s.fluid = autotune_fluid_candidates[c]; },
+        [&](const WorkgroupSizes& s){ return describe3(s.fluid); });
+    tune("surface", (uint32_t) autotune_surface_candidates.size(),
+        [](WorkgroupSizes& s, uint32_t c){ s.surface = autotune_surface_candidates[c]; },
+        [&](const WorkgroupSizes& s){ return describe3(s.surface); });
+    tune("particle", (uint32_t) autotune_particle_candidates.size(),
+        [](WorkgroupSizes& s, uint32_t c){ s.particle = autotune_particle_candidates[c]; },
+        [](const WorkgroupSizes& s){ return std::to_string(s.particle); });
+
+    saveWorkgroupSizes(device_name, best);
+    std::cout << "Saved to " << workgroup_sizes_file << " - fluid " << describe3(best.fluid) << ", surface " << describe3(best.surface) << ", particle " << best.particle << "\n";
+    return 0;
+}
+
+
+#endif
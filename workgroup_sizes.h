@@ -0,0 +1,134 @@
+#ifndef WORKGROUP_SIZES_H
+#define WORKGROUP_SIZES_H
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+
+#include "just-a-vulkan-library/vulkan_include_all.h"
+#include "simulation_constants.h"
+
+
+
+//file with the best workgroup sizes found by the autotuner, one line per device. It is read from and written to the working directory
+const string workgroup_sizes_file = "workgroup_sizes.txt";
+
+//shaders using each group of workgroup sizes, all other shaders have fixed local sizes
+const vector<string> fluid_workgroup_shaders{
+    "01c_mark_fluid_bricks", "02_update_water", "02b_update_cell_types_fused", "03_update_air", "04_compute_extrapolated_velocities", "05_set_extrapolated_velocities", "06_update_cell_types", "07_advect", "07b_advect_forces_fused", "08_forces", "09_diffuse", "09b_diffuse_solids_fused",
+    "10_solids", "11_compute_divergence", "12_solve_pressure", "12a_pressure_init", "12b_pressure_residual", "12d_multigrid_coarsen", "12e_multigrid_smooth", "12f_multigrid_restrict",
+    "12g_multigrid_prolongate", "12h_multigrid_correct", "12i_pcg_apply_operator", "12j_pcg_dot", "12k_pcg_update_solution", "12l_pcg_update_search", "12m_solve_pressure_tiled",
+    "13_fix_divergence", "40_readback_float_image", "41_readback_uint_image", "43_restore_float_image", "44_restore_uint_image"
+};
+const vector<string> surface_workgroup_shaders{
+    "15c_mark_surface_bricks", "16_compute_detailed_densities_inertia", "17_compute_float_densities", "18_diffuse_float_densities", "19_surface_mark_changed_bricks", "19b_surface_count_bricks", "21_surface_generate_mesh"
+};
+const vector<string> particle_workgroup_shaders{
+    "00_init_particles", "00b_compact_particles", "00d_sort_count_particles", "00f_sort_scatter_particles", "00g_sort_copy_particles", "01_update_densities", "01b_update_densities_binned",
+    "14_particles", "14b_particles_render_output", "15_update_detailed_densities", "15b_update_detailed_densities_binned", "42_readback_particles", "45_restore_particles"
+};
+
+
+//SPIR-V words read when writing workgroup sizes into shaders
+constexpr uint32_t spirv_header_words = 5;
+constexpr uint32_t spirv_op_spec_constant = 50;
+constexpr uint32_t spirv_op_decorate = 71;
+constexpr uint32_t spirv_decoration_spec_id = 1;
+
+//write chosen workgroup sizes into the SPIR-V code of a shader, as default values of its' specialization constants. The library creates pipelines without specialization info,
+//so the default values are used. Shaders that don't use chosen sizes are left as they are, shader is the name of the shader directory
+inline void specializeWorkgroupSizes(const string& shader, vector<uint32_t>& code, const WorkgroupSizes& sizes){
+    auto uses = [&shader](const vector<string>& shaders){
+        return std::find(shaders.begin(), shaders.end(), shader) != shaders.end();
+    };
+    vector<uint32_t> values;
+    if (uses(fluid_workgroup_shaders)){
+        values = {sizes.fluid.x, sizes.fluid.y, sizes.fluid.z};
+    }else if (uses(surface_workgroup_shaders)){
+        values = {sizes.surface.x, sizes.surface.y, sizes.surface.z};
+    }else if (uses(particle_workgroup_shaders)){
+        values = {sizes.particle};
+    }else{
+        return;
+    }
+
+    //result id of the constant with each SpecId, decorations come before constants in a SPIR-V module
+    vector<uint32_t> ids(values.size(), 0);
+    uint32_t written = 0;
+    for (size_t i = spirv_header_words; i < code.size();){
+        uint32_t opcode = code[i] & 0xffff;
+        uint32_t words = code[i] >> 16;
+        if (words == 0 || i + words > code.size()) break;
+        if (opcode == spirv_op_decorate && words == 4 && code[i + 2] == spirv_decoration_spec_id && code[i + 3] < values.size()) ids[code[i + 3]] = code[i + 1];
+        if (opcode == spirv_op_spec_constant && words == 4){
+            for (size_t c = 0; c < values.size(); c++){
+                if (ids[c] != code[i + 2]) continue;
+                code[i + 3] = values[c];
+                written++;
+            }
+        }
+        i += words;
+    }
+    if (written != values.size()) throw std::runtime_error("Shader " + shader + " doesn't declare its' workgroup size as specialization constants");
+}
+
+
+//device name is used as the key in the workgroup sizes file, limits decide which sizes the autotuner can try
+inline VkPhysicalDeviceProperties physicalDeviceProperties(PhysicalDevice& physical_device){
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    return properties;
+}
+
+
+/**
+ * Workgroup sizes file
+ *  - Each line contains fluid x y z, surface x y z, particle size, and the device name, which can contain spaces, so it is last
+ *  - Lines of other devices are kept when the file is saved
+ */
+//read one line of the file, returns false if it isn't valid
+inline bool parseWorkgroupSizesLine(const string& line, WorkgroupSizes& sizes, string& device_name){
+    std::istringstream s(line);
+    s >> sizes.fluid.x >> sizes.fluid.y >> sizes.fluid.z >> sizes.surface.x >> sizes.surface.y >> sizes.surface.z >> sizes.particle >> std::ws;
+    return s && std::getline(s, device_name);
+}
+
+//read sizes saved for the given device, default sizes are returned if there are none or the saved ones aren't valid
+inline WorkgroupSizes loadWorkgroupSizes(const string& device_name){
+    std::ifstream file(workgroup_sizes_file);
+    string line;
+    while (std::getline(file, line)){
+        WorkgroupSizes sizes;
+        string name;
+        if (!parseWorkgroupSizesLine(line, sizes, name) || name != device_name) continue;
+        string error;
+        if (sizes.valid(error)) return sizes;
+        std::cout << "Ignoring saved workgroup sizes of " << device_name << " - " << error << "\n";
+    }
+    return WorkgroupSizes{};
+}
+
+//replace the line of the given device in the workgroup sizes file, or add one
+inline void saveWorkgroupSizes(const string& device_name, const WorkgroupSizes& sizes){
+    vector<string> lines;
+    {
+        std::ifstream file(workgroup_sizes_file);
+        string line;
+        while (std::getline(file, line)){
+            WorkgroupSizes saved;
+            string name;
+            if (!parseWorkgroupSizesLine(line, saved, name) || name != device_name) lines.push_back(line);
+        }
+    }
+    std::ostringstream s;
+    s << sizes.fluid.x << " " << sizes.fluid.y << " " << sizes.fluid.z << " " << sizes.surface.x << " " << sizes.surface.y << " " << sizes.surface.z << " " << sizes.particle << " " << device_name;
+    lines.push_back(s.str());
+
+    std::ofstream file(workgroup_sizes_file);
+    for (const string& line : lines) file << line << "\n";
+}
+
+
+#endif